@@ -0,0 +1,494 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// Measures indexing, linear decoding, random access, planar export and audio extraction for every file in a corpus and
+// writes one JSON object per line so runs with different releases or FFmpeg builds can be compared with --compare
+
+#include "videosource.h"
+#include "audiosource.h"
+#include "tracklist.h"
+#include "version.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/log.h>
+}
+
+struct BenchOptions {
+    std::vector<std::string> Files;
+    std::map<std::string, std::string> LAVFOpts;
+    int Threads = 0;
+    int IndexThreads = 0;
+    int ExportThreads = 1;
+    int64_t LinearFrames = 1000; // 0 decodes the whole track
+    int Seeks = 100;
+    int64_t AudioSamples = 0; // 0 extracts the whole track
+    double ExportSeconds = 1;
+    std::string OutputFile;
+    std::string CompareFile;
+    double Tolerance = 10; // In percent
+};
+
+struct BenchResult {
+    std::string File;
+    std::string Codec;
+    std::string Test;
+    double Value = 0;
+    std::string Unit;
+    bool HigherIsBetter = true;
+};
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double SecondsSince(BenchClock::time_point Start) {
+    return std::chrono::duration<double>(BenchClock::now() - Start).count();
+}
+
+static std::string EscapeJSON(const std::string &Str) {
+    std::string Result;
+    for (char C : Str) {
+        if (C == '"' || C == '\\') {
+            Result += '\\';
+            Result += C;
+        } else if (static_cast<unsigned char>(C) < 0x20) {
+            char Tmp[8];
+            snprintf(Tmp, sizeof(Tmp), "\\u%04x", static_cast<unsigned char>(C));
+            Result += Tmp;
+        } else {
+            Result += C;
+        }
+    }
+    return Result;
+}
+
+static std::string FormatResult(const BenchResult &R) {
+    char Value[64];
+    snprintf(Value, sizeof(Value), "%.6g", R.Value);
+    return "{\"file\":\"" + EscapeJSON(R.File) + "\",\"codec\":\"" + EscapeJSON(R.Codec) + "\",\"test\":\"" + EscapeJSON(R.Test) + "\",\"value\":" + Value +
+        ",\"unit\":\"" + EscapeJSON(R.Unit) + "\",\"higher_is_better\":" + (R.HigherIsBetter ? "true" : "false") + "}";
+}
+
+// Only understands the flat objects written by FormatResult(), everything else such as the environment line is skipped
+static bool ParseResult(const std::string &Line, BenchResult &R) {
+    size_t Pos = 0;
+
+    auto Expect = [&](char C) {
+        while (Pos < Line.size() && (Line[Pos] == ' ' || Line[Pos] == '\t' || Line[Pos] == '\r'))
+            Pos++;
+        if (Pos < Line.size() && Line[Pos] == C) {
+            Pos++;
+            return true;
+        }
+        return false;
+    };
+
+    auto ParseString = [&](std::string &Out) {
+        if (!Expect('"'))
+            return false;
+        Out.clear();
+        while (Pos < Line.size() && Line[Pos] != '"') {
+            char C = Line[Pos++];
+            if (C == '\\' && Pos < Line.size()) {
+                C = Line[Pos++];
+                if (C == 'u') {
+                    if (Pos + 4 > Line.size())
+                        return false;
+                    C = static_cast<char>(std::strtol(Line.substr(Pos, 4).c_str(), nullptr, 16));
+                    Pos += 4;
+                }
+            }
+            Out += C;
+        }
+        return Expect('"');
+    };
+
+    if (!Expect('{'))
+        return false;
+
+    R = {};
+    bool HasValue = false;
+    do {
+        std::string Key;
+        if (!ParseString(Key) || !Expect(':'))
+            return false;
+        if (Pos < Line.size() && Line[Pos] == '"') {
+            std::string Str;
+            if (!ParseString(Str))
+                return false;
+            if (Key == "file")
+                R.File = Str;
+            else if (Key == "codec")
+                R.Codec = Str;
+            else if (Key == "test")
+                R.Test = Str;
+            else if (Key == "unit")
+                R.Unit = Str;
+        } else {
+            size_t End = Line.find_first_of(",}", Pos);
+            if (End == std::string::npos)
+                return false;
+            std::string Token = Line.substr(Pos, End - Pos);
+            Pos = End;
+            if (Key == "value") {
+                R.Value = std::strtod(Token.c_str(), nullptr);
+                HasValue = true;
+            } else if (Key == "higher_is_better") {
+                R.HigherIsBetter = (Token.find("true") != std::string::npos);
+            }
+        }
+    } while (Expect(','));
+
+    return Expect('}') && HasValue;
+}
+
+class Benchmark {
+private:
+    const BenchOptions &Options;
+    std::vector<BenchResult> &Results;
+    std::string File;
+    std::filesystem::path Path;
+    std::unique_ptr<BestTrackList> TrackList;
+
+    void AddResult(const std::string &Codec, const std::string &Test, double Value, const char *Unit, bool HigherIsBetter = true);
+    [[nodiscard]] bool HasTrackType(int MediaType) const;
+    [[nodiscard]] std::string GetCodec(int Track) const;
+public:
+    Benchmark(const BenchOptions &Options, const std::string &File, std::vector<BenchResult> &Results);
+    void RunVideo();
+    void RunAudio();
+};
+
+Benchmark::Benchmark(const BenchOptions &Options, const std::string &File, std::vector<BenchResult> &Results) : Options(Options), Results(Results), File(File) {
+    Path = CreateProbablyUTF8Path(File.c_str());
+    TrackList.reset(new BestTrackList(Path, &Options.LAVFOpts));
+}
+
+void Benchmark::AddResult(const std::string &Codec, const std::string &Test, double Value, const char *Unit, bool HigherIsBetter) {
+    // Anything that finished too quickly to be timed is left out rather than reported as infinitely fast
+    if (!std::isfinite(Value))
+        return;
+    BenchResult R;
+    R.File = File;
+    R.Codec = Codec;
+    R.Test = Test;
+    R.Value = Value;
+    R.Unit = Unit;
+    R.HigherIsBetter = HigherIsBetter;
+    Results.push_back(R);
+    std::cerr << File << ": " << Test << " " << Value << " " << Unit << std::endl;
+}
+
+bool Benchmark::HasTrackType(int MediaType) const {
+    for (int i = 0; i < TrackList->GetNumTracks(); i++)
+        if (TrackList->GetTrackInfo(i).MediaType == MediaType)
+            return true;
+    return false;
+}
+
+std::string Benchmark::GetCodec(int Track) const {
+    return TrackList->GetTrackInfo(Track).CodecString;
+}
+
+void Benchmark::RunVideo() {
+    if (!HasTrackType(AVMEDIA_TYPE_VIDEO))
+        return;
+
+    // The index is never written or read so indexing is always measured
+    auto Start = BenchClock::now();
+    std::unique_ptr<BestVideoSource> V(new BestVideoSource(Path, "", 0, -1, 0, Options.Threads, bcmDisable, "", &Options.LAVFOpts, nullptr, Options.IndexThreads));
+    double IndexTime = SecondsSince(Start);
+
+    const BSVideoProperties &VP = V->GetVideoProperties();
+    std::string Codec = GetCodec(V->GetTrack());
+    AddResult(Codec, "video_index", VP.NumFrames / IndexTime, "fps");
+
+    int64_t LinearFrames = (Options.LinearFrames > 0) ? std::min(Options.LinearFrames, VP.NumFrames) : VP.NumFrames;
+    Start = BenchClock::now();
+    for (int64_t N = 0; N < LinearFrames; N++) {
+        std::unique_ptr<BestVideoFrame> F(V->GetFrame(N));
+        if (!F)
+            throw BestSourceException("No frame returned for frame " + std::to_string(N));
+    }
+    AddResult(Codec, "video_linear", LinearFrames / SecondsSince(Start), "fps");
+
+    // Empty the cache so the random frames are never already decoded by the linear pass, 1GB is the default size
+    V->SetMaxCacheSize(0);
+    V->SetMaxCacheSize(1024 * 1024 * 1024);
+
+    if (Options.Seeks > 0 && VP.NumFrames > 1) {
+        BSSourceStatistics Before = V->GetStatistics();
+        std::mt19937_64 Generator(0); // Fixed so every run requests the same frames
+        std::uniform_int_distribution<int64_t> Distribution(0, VP.NumFrames - 1);
+        std::vector<double> Latency;
+        for (int i = 0; i < Options.Seeks; i++) {
+            int64_t N = Distribution(Generator);
+            auto SeekStart = BenchClock::now();
+            std::unique_ptr<BestVideoFrame> F(V->GetFrame(N));
+            if (!F)
+                throw BestSourceException("No frame returned for frame " + std::to_string(N));
+            Latency.push_back(SecondsSince(SeekStart) * 1000);
+        }
+        BSSourceStatistics After = V->GetStatistics();
+
+        std::sort(Latency.begin(), Latency.end());
+        AddResult(Codec, "video_seek_median", Latency[Latency.size() / 2], "ms", false);
+        AddResult(Codec, "video_seek_p95", Latency[std::min(Latency.size() - 1, Latency.size() * 95 / 100)], "ms", false);
+        AddResult(Codec, "video_seek_retries", static_cast<double>(After.SeekRetries - Before.SeekRetries), "count", false);
+        AddResult(Codec, "video_linear_fallback", V->GetLinearDecodingState() ? 1 : 0, "bool", false);
+    }
+
+    if (Options.ExportSeconds > 0) {
+        std::unique_ptr<BestVideoFrame> F(V->GetFrame(VP.NumFrames / 2));
+        if (!F)
+            throw BestSourceException("No frame returned for frame " + std::to_string(VP.NumFrames / 2));
+
+        int BytesPerSample = (F->VF.Bits + 7) / 8;
+        int NumPlanes = (F->VF.ColorFamily == 1) ? 1 : 3;
+        // Planes in the order ExportAsPlanar() takes them with alpha last
+        std::vector<std::vector<uint8_t>> Buffers;
+        uint8_t *Dsts[4] = {};
+        ptrdiff_t Stride[4] = {};
+        for (int Plane = 0; Plane < NumPlanes + (F->VF.Alpha ? 1 : 0); Plane++) {
+            bool Chroma = (Plane == 1 || Plane == 2) && F->VF.ColorFamily == 3;
+            int PlaneWidth = Chroma ? (F->SSModWidth >> F->VF.SubSamplingW) : F->SSModWidth;
+            int PlaneHeight = Chroma ? (F->SSModHeight >> F->VF.SubSamplingH) : F->SSModHeight;
+            Stride[Plane] = (static_cast<ptrdiff_t>(PlaneWidth) * BytesPerSample + 63) & ~static_cast<ptrdiff_t>(63);
+            Buffers.emplace_back(Stride[Plane] * PlaneHeight);
+            Dsts[Plane] = Buffers.back().data();
+        }
+        uint8_t *AlphaDst = F->VF.Alpha ? Dsts[NumPlanes] : nullptr;
+        ptrdiff_t AlphaStride = F->VF.Alpha ? Stride[NumPlanes] : 0;
+
+        int64_t Exported = 0;
+        Start = BenchClock::now();
+        do {
+            if (!F->ExportAsPlanar(Dsts, Stride, AlphaDst, AlphaStride, Options.ExportThreads))
+                throw BestSourceException("Can't export frame as planar");
+            Exported++;
+        } while (SecondsSince(Start) < Options.ExportSeconds);
+        AddResult(Codec, "video_export", Exported / SecondsSince(Start), "fps");
+    }
+}
+
+void Benchmark::RunAudio() {
+    if (!HasTrackType(AVMEDIA_TYPE_AUDIO))
+        return;
+
+    auto Start = BenchClock::now();
+    std::unique_ptr<BestAudioSource> A(new BestAudioSource(Path, -1, -2, Options.Threads, bcmDisable, "", &Options.LAVFOpts, 0));
+    double IndexTime = SecondsSince(Start);
+
+    const BSAudioProperties &AP = A->GetAudioProperties();
+    std::string Codec = GetCodec(A->GetTrack());
+    AddResult(Codec, "audio_index", AP.NumSamples / IndexTime, "samples/s");
+
+    static constexpr int64_t ChunkSize = 65536;
+    int64_t Samples = (Options.AudioSamples > 0) ? std::min(Options.AudioSamples, AP.NumSamples) : AP.NumSamples;
+    std::vector<std::vector<uint8_t>> Buffers(AP.Channels, std::vector<uint8_t>(ChunkSize * AP.AF.BytesPerSample));
+    std::vector<uint8_t *> Dsts;
+    for (auto &Iter : Buffers)
+        Dsts.push_back(Iter.data());
+
+    Start = BenchClock::now();
+    for (int64_t Pos = 0; Pos < Samples; Pos += ChunkSize)
+        A->GetPlanarAudio(Dsts.data(), Pos, std::min(ChunkSize, Samples - Pos));
+    AddResult(Codec, "audio_planar", Samples / SecondsSince(Start), "samples/s");
+}
+
+static bool CompareResults(const std::vector<BenchResult> &Results, const std::string &Filename, double Tolerance) {
+    std::ifstream Baseline(CreateProbablyUTF8Path(Filename.c_str()));
+    if (!Baseline)
+        throw BestSourceException("Can't open " + Filename);
+
+    std::map<std::pair<std::string, std::string>, BenchResult> Previous;
+    std::string Line;
+    while (std::getline(Baseline, Line)) {
+        BenchResult R;
+        if (ParseResult(Line, R))
+            Previous[std::make_pair(R.File, R.Test)] = R;
+    }
+
+    bool Regressed = false;
+    for (const auto &Iter : Results) {
+        auto Old = Previous.find(std::make_pair(Iter.File, Iter.Test));
+        if (Old == Previous.end() || Old->second.Value == 0)
+            continue;
+        double Change = (Iter.Value - Old->second.Value) / Old->second.Value * 100;
+        if (!Iter.HigherIsBetter)
+            Change = -Change;
+        if (Change < -Tolerance) {
+            std::cerr << "Regression: " << Iter.File << ": " << Iter.Test << " " << Old->second.Value << " -> " << Iter.Value << " " << Iter.Unit << std::endl;
+            Regressed = true;
+        }
+    }
+    return !Regressed;
+}
+
+static void PrintUsage() {
+    std::cerr << "Usage: bsbench [options] [files...]\n"
+        "  --corpus <file>         Read the files to benchmark from a list with one path per line, # starts a comment\n"
+        "  --output <file>         Write the results to a file instead of stdout\n"
+        "  --compare <file>        Compare with the results of a previous run and fail if anything got slower\n"
+        "  --tolerance <percent>   How much slower a result may get before it counts as a regression, default 10\n"
+        "  --threads <n>           Decoder threads, default 0 which means automatic\n"
+        "  --indexthreads <n>      Video indexing threads, default 0 which means automatic\n"
+        "  --exportthreads <n>     Threads used by ExportAsPlanar(), default 1\n"
+        "  --frames <n>            Frames to decode in order, default 1000 and 0 means all\n"
+        "  --seeks <n>             Random frames to request, default 100\n"
+        "  --samples <n>           Audio samples to extract, default 0 which means all\n"
+        "  --exportseconds <s>     How long to repeat the planar export, default 1\n"
+        "  --lavf <key=value>      Pass an option to the demuxer, can be given several times\n";
+}
+
+static bool ParseArguments(int argc, char **argv, BenchOptions &Options) {
+    for (int i = 1; i < argc; i++) {
+        std::string Arg = argv[i];
+        if (Arg.size() < 2 || Arg.compare(0, 2, "--") != 0) {
+            Options.Files.push_back(Arg);
+            continue;
+        }
+
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << Arg << std::endl;
+            return false;
+        }
+        std::string Value = argv[++i];
+
+        try {
+            if (Arg == "--corpus") {
+                std::ifstream Corpus(CreateProbablyUTF8Path(Value.c_str()));
+                if (!Corpus) {
+                    std::cerr << "Can't open " << Value << std::endl;
+                    return false;
+                }
+                std::string Line;
+                while (std::getline(Corpus, Line)) {
+                    while (!Line.empty() && (Line.back() == '\r' || Line.back() == ' '))
+                        Line.pop_back();
+                    if (!Line.empty() && Line[0] != '#')
+                        Options.Files.push_back(Line);
+                }
+            } else if (Arg == "--output") {
+                Options.OutputFile = Value;
+            } else if (Arg == "--compare") {
+                Options.CompareFile = Value;
+            } else if (Arg == "--tolerance") {
+                Options.Tolerance = std::stod(Value);
+            } else if (Arg == "--threads") {
+                Options.Threads = std::stoi(Value);
+            } else if (Arg == "--indexthreads") {
+                Options.IndexThreads = std::stoi(Value);
+            } else if (Arg == "--exportthreads") {
+                Options.ExportThreads = std::max(std::stoi(Value), 1);
+            } else if (Arg == "--frames") {
+                Options.LinearFrames = std::stoll(Value);
+            } else if (Arg == "--seeks") {
+                Options.Seeks = std::stoi(Value);
+            } else if (Arg == "--samples") {
+                Options.AudioSamples = std::stoll(Value);
+            } else if (Arg == "--exportseconds") {
+                Options.ExportSeconds = std::stod(Value);
+            } else if (Arg == "--lavf") {
+                size_t Separator = Value.find('=');
+                if (Separator == std::string::npos) {
+                    std::cerr << "Demuxer options have to be key=value" << std::endl;
+                    return false;
+                }
+                Options.LAVFOpts[Value.substr(0, Separator)] = Value.substr(Separator + 1);
+            } else {
+                std::cerr << "Unknown option " << Arg << std::endl;
+                return false;
+            }
+        } catch (std::logic_error &) {
+            std::cerr << "Invalid value for " << Arg << ": " << Value << std::endl;
+            return false;
+        }
+    }
+
+    return !Options.Files.empty();
+}
+
+static std::string FormatLibraryVersion(unsigned Version) {
+    return std::to_string(Version >> 16) + "." + std::to_string((Version >> 8) & 0xFF) + "." + std::to_string(Version & 0xFF);
+}
+
+int main(int argc, char **argv) {
+    BenchOptions Options;
+    if (!ParseArguments(argc, argv, Options)) {
+        PrintUsage();
+        return 2;
+    }
+
+    SetFFmpegLogLevel(AV_LOG_ERROR);
+
+    std::vector<BenchResult> Results;
+    bool Failed = false;
+    for (const auto &Iter : Options.Files) {
+        try {
+            Benchmark B(Options, Iter, Results);
+            B.RunVideo();
+            B.RunAudio();
+        } catch (BestSourceException &e) {
+            std::cerr << Iter << ": " << e.what() << std::endl;
+            Failed = true;
+        }
+    }
+
+    std::ofstream OutputFile;
+    if (!Options.OutputFile.empty()) {
+        OutputFile.open(CreateProbablyUTF8Path(Options.OutputFile.c_str()));
+        if (!OutputFile) {
+            std::cerr << "Can't open " << Options.OutputFile << std::endl;
+            return 2;
+        }
+    }
+    std::ostream &Output = OutputFile.is_open() ? OutputFile : std::cout;
+
+    // The environment is written first so results from different builds can be told apart
+    Output << "{\"test\":\"environment\",\"bestsource\":\"" << BEST_SOURCE_VERSION_MAJOR << "." << BEST_SOURCE_VERSION_MINOR << "\",\"ffmpeg\":\"" << EscapeJSON(av_version_info()) <<
+        "\",\"libavcodec\":\"" << FormatLibraryVersion(avcodec_version()) << "\",\"libavformat\":\"" << FormatLibraryVersion(avformat_version()) << "\",\"libavutil\":\"" << FormatLibraryVersion(avutil_version()) << "\"}\n";
+    for (const auto &Iter : Results)
+        Output << FormatResult(Iter) << "\n";
+    Output.flush();
+
+    try {
+        if (!Options.CompareFile.empty() && !CompareResults(Results, Options.CompareFile, Options.Tolerance))
+            return 1;
+    } catch (BestSourceException &e) {
+        std::cerr << e.what() << std::endl;
+        return 2;
+    }
+
+    return Failed ? 2 : 0;
+}
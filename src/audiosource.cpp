@@ -19,10 +19,14 @@
 //  THE SOFTWARE.
 
 #include "audiosource.h"
+#include "trackindexer.h"
+#include "streamprobe.h"
 #include "videosource.h"
+#include "blockcache.h"
 #include "version.h"
 #include <algorithm>
 #include <thread>
+#include <chrono>
 #include <cassert>
 #include <iterator>
 
@@ -36,6 +40,8 @@ extern "C" {
 }
 
 bool LWAudioDecoder::ReadPacket() {
+    if (PacketSource)
+        return PacketSource->Pop(Packet);
     while (av_read_frame(FormatContext, Packet) >= 0) {
         if (Packet->stream_index == TrackNumber)
             return true;
@@ -70,13 +76,24 @@ bool LWAudioDecoder::DecodeNextFrame(bool SkipOutput) {
     return false;
 }
 
-void LWAudioDecoder::OpenFile(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale) {
+void LWAudioDecoder::OpenFile(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale, BSBlockCache *BlockCache) {
     TrackNumber = Track;
 
     AVDictionary *Dict = nullptr;
     for (const auto &Iter : LAVFOpts)
         av_dict_set(&Dict, Iter.first.c_str(), Iter.second.c_str(), 0);
 
+    if (BlockCache) {
+        FormatContext = avformat_alloc_context();
+        CustomIO = BlockCache->CreateIOContext();
+        if (!FormatContext || !CustomIO) {
+            av_dict_free(&Dict);
+            throw BestSourceException("Couldn't allocate IO context");
+        }
+        FormatContext->pb = CustomIO;
+        FormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
     if (avformat_open_input(&FormatContext, SourceFile.u8string().c_str(), nullptr, &Dict) != 0) {
         av_dict_free(&Dict);
         throw BestSourceException("Couldn't open '" + SourceFile.u8string() + "'");
@@ -84,7 +101,7 @@ void LWAudioDecoder::OpenFile(const std::filesystem::path &SourceFile, int Track
 
     av_dict_free(&Dict);
 
-    if (avformat_find_stream_info(FormatContext, nullptr) < 0) {
+    if (FindStreamInfo(FormatContext, SourceFile, LAVFOpts) < 0) {
         avformat_close_input(&FormatContext);
         FormatContext = nullptr;
         throw BestSourceException("Couldn't find stream information");
@@ -132,7 +149,8 @@ void LWAudioDecoder::OpenFile(const std::filesystem::path &SourceFile, int Track
         int HardwareConcurrency = std::thread::hardware_concurrency();
         Threads = std::min(HardwareConcurrency, 16);
     }
-    CodecContext->thread_count = Threads;
+    ReservedThreads = AcquireDecoderThreads(Threads);
+    CodecContext->thread_count = ReservedThreads;
 
     if (DrcScale < 0)
         throw BestSourceException("Invalid drc_scale value");
@@ -145,10 +163,10 @@ void LWAudioDecoder::OpenFile(const std::filesystem::path &SourceFile, int Track
         throw BestSourceException("Could not open audio codec");
 }
 
-LWAudioDecoder::LWAudioDecoder(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale) {
+LWAudioDecoder::LWAudioDecoder(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale, BSBlockCache *BlockCache) {
     try {
         Packet = av_packet_alloc();
-        OpenFile(SourceFile, Track, Threads, LAVFOpts, DrcScale);
+        OpenFile(SourceFile, Track, Threads, LAVFOpts, DrcScale, BlockCache);
     } catch (...) {
         Free();
         throw;
@@ -160,6 +178,9 @@ void LWAudioDecoder::Free() {
     av_frame_free(&DecodeFrame);
     avcodec_free_context(&CodecContext);
     avformat_close_input(&FormatContext);
+    BSBlockCache::FreeIOContext(&CustomIO);
+    ReleaseDecoderThreads(ReservedThreads);
+    ReservedThreads = 0;
 }
 
 LWAudioDecoder::~LWAudioDecoder() {
@@ -171,9 +192,19 @@ int64_t LWAudioDecoder::GetSourceSize() const {
 }
 
 int64_t LWAudioDecoder::GetSourcePostion() const {
+    if (PacketSource)
+        return PacketSource->GetPosition();
     return avio_tell(FormatContext->pb);
 }
 
+int64_t LWAudioDecoder::TakeBytesRead() {
+    if (PacketSource || !FormatContext->pb)
+        return 0;
+    int64_t Result = FormatContext->pb->bytes_read - ReportedBytesRead;
+    ReportedBytesRead = FormatContext->pb->bytes_read;
+    return Result;
+}
+
 int LWAudioDecoder::GetTrack() const {
     return TrackNumber;
 }
@@ -244,6 +275,10 @@ bool LWAudioDecoder::Seek(int64_t PTS) {
     return DecodeSuccess;
 }
 
+void LWAudioDecoder::SetPacketSource(BSPacketQueue *Packets) {
+    PacketSource = Packets;
+}
+
 bool LWAudioDecoder::HasSeeked() const {
     return Seeked;
 }
@@ -315,12 +350,15 @@ BestAudioSource::Cache::Cache(const AudioTrackIndex &TrackIndex) : TrackIndex(Tr
 void BestAudioSource::Cache::ApplyMaxSize() {
     while (Size > MaxSize) {
         Size -= Data.back().Size;
+        Index.erase(Data.back().FrameNumber);
         Data.pop_back();
+        Evictions++;
     }
 }
 
 void BestAudioSource::Cache::Clear() {
     Data.clear();
+    Index.clear();
     Size = 0;
 }
 
@@ -333,32 +371,38 @@ void BestAudioSource::Cache::CacheFrame(int64_t FrameNumber, AVFrame *Frame) {
     assert(Frame);
     assert(FrameNumber >= 0);
     // Don't cache the same frame twice, get rid of the oldest copy instead
-    for (auto Iter = Data.begin(); Iter != Data.end(); ++Iter) {
-        if (Iter->FrameNumber == FrameNumber) {
-            Size -= Iter->Size;
-            Data.erase(Iter);
-            break;
-        }
+    auto Iter = Index.find(FrameNumber);
+    if (Iter != Index.end()) {
+        Size -= Iter->second->Size;
+        Data.erase(Iter->second);
+        Index.erase(Iter);
     }
 
     Data.emplace_front(FrameNumber, Frame);
+    Index[FrameNumber] = Data.begin();
     Size += Data.front().Size;
     ApplyMaxSize();
 }
 
 BestAudioFrame *BestAudioSource::Cache::GetFrame(int64_t N) {
-    for (auto Iter = Data.begin(); Iter != Data.end(); ++Iter) {
-        if (Iter->FrameNumber == N) {
-            AVFrame *F = Iter->Frame;
-            Data.splice(Data.begin(), Data, Iter);
-            return new BestAudioFrame(F, TrackIndex.Frames[N].BitsPerSample);
-        }
+    auto Iter = Index.find(N);
+    if (Iter == Index.end()) {
+        Misses++;
+        return nullptr;
     }
-    return nullptr;
+
+    Hits++;
+    AVFrame *F = Iter->second->Frame;
+    Data.splice(Data.begin(), Data, Iter->second);
+    return new BestAudioFrame(F, TrackIndex.Frames[N].BitsPerSample);
+}
+
+BSCacheStatistics BestAudioSource::Cache::GetStatistics() const {
+    return { Hits, Misses, Evictions, Size, Data.size() };
 }
 
-BestAudioSource::BestAudioSource(const std::filesystem::path &SourceFile, int Track, int AjustDelay, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, double DrcScale, const ProgressFunction &Progress)
-    : Source(SourceFile), AudioTrack(Track), DrcScale(DrcScale), Threads(Threads), FrameCache(TrackIndex) {
+BestAudioSource::BestAudioSource(const std::filesystem::path &SourceFile, int Track, int AjustDelay, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, double DrcScale, const ProgressFunction &Progress, int MaxDecoders, size_t IOCacheSize, BSPacketQueue *IndexPackets)
+    : Source(SourceFile), AudioTrack(Track), DrcScale(DrcScale), Threads(Threads), DecoderLastUse(std::max(MaxDecoders, 1)), Decoders(std::max(MaxDecoders, 1)), FrameCache(TrackIndex), IndexPackets(IndexPackets) {
     // Only make file path absolute if it exists to pass through special protocol paths
     std::error_code ec;
     if (std::filesystem::exists(SourceFile, ec))
@@ -370,13 +414,40 @@ BestAudioSource::BestAudioSource(const std::filesystem::path &SourceFile, int Tr
     if (CacheMode < 0 || CacheMode > 4)
         throw BestSourceException("CacheMode must be between 0 and 4");
 
-    std::unique_ptr<LWAudioDecoder> Decoder(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale));
+    if (MaxDecoders < 1)
+        throw BestSourceException("MaxDecoders must be 1 or greater");
+
+    if (IOCacheSize > 0 && BSBlockCache::IsSupported(Source))
+        BlockCache = std::make_shared<BSBlockCache>(Source, LAVFOptions, IOCacheSize);
+
+    std::filesystem::path ProbeFile;
+    if (CacheMode != bcmDisable) {
+        ProbeFile = GetStreamProbePath(IsAbsolutePathCacheMode(CacheMode), CachePath, Source);
+        LoadStreamProbe(ProbeFile, Source, LAVFOptions);
+    }
+
+    std::unique_ptr<LWAudioDecoder> Decoder(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale, BlockCache.get()));
 
     Decoder->GetAudioProperties(AP);
     AudioTrack = Decoder->GetTrack();
     FileSize = Decoder->GetSourceSize();
 
-    if (CacheMode == bcmDisable || !ReadAudioTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath)) {
+    int64_t IndexedFileSize = -1;
+    bool IndexLoaded = (CacheMode != bcmDisable && ReadAudioTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath, IndexedFileSize));
+
+    // The audio index is delta coded so it's simply written again after being extended
+    if (IndexLoaded && IndexedFileSize != FileSize) {
+        IndexLoaded = ExtendTrackIndex(Progress);
+        if (!IndexLoaded) {
+            BSDebugPrint("The existing index doesn't match the grown file, indexing the whole track");
+            TrackIndex.Frames.clear();
+        } else if (ShouldWriteIndex(CacheMode, TrackIndex.Frames.size())) {
+            if (!WriteAudioTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath))
+                throw BestSourceException("Failed to write index to '" + CachePath.u8string() + "' for track #" + std::to_string(AudioTrack));
+        }
+    }
+
+    if (!IndexLoaded) {
         if (!IndexTrack(Progress))
             throw BestSourceException("Indexing of '" + Source.u8string() + "' track #" + std::to_string(AudioTrack) + " failed");
 
@@ -386,6 +457,17 @@ BestAudioSource::BestAudioSource(const std::filesystem::path &SourceFile, int Tr
         }
     }
 
+    if (CacheMode != bcmDisable && (IndexLoaded || ShouldWriteIndex(CacheMode, TrackIndex.Frames.size()))) {
+        StoreStreamProbe(ProbeFile, Source, LAVFOptions);
+        SeekHistoryFile = GetCacheFilePath(IsAbsolutePathCacheMode(CacheMode), CachePath, Source, AudioTrack);
+        BSSeekHistory History;
+        if (ReadSeekHistory(SeekHistoryFile, false, FileSize, TrackIndex.Frames.size(), History)) {
+            BSDebugPrint("Loaded seek history with " + std::to_string(History.BadSeekLocations.size()) + " bad seek locations" + (History.LinearMode ? " and linear mode" : ""));
+            BadSeekLocations = std::move(History.BadSeekLocations);
+            LinearMode = History.LinearMode;
+        }
+    }
+
     InitializeFormatSets();
     SelectFormatSet(-1);
 
@@ -406,12 +488,27 @@ void BestAudioSource::SetMaxCacheSize(size_t Bytes) {
     FrameCache.SetMaxSize(Bytes);
 }
 
+BSCacheStatistics BestAudioSource::GetCacheStatistics() const {
+    return FrameCache.GetStatistics();
+}
+
+BSSourceStatistics BestAudioSource::GetStatistics() const {
+    BSSourceStatistics Result = Stats;
+    Result.Cache = FrameCache.GetStatistics();
+    return Result;
+}
+
+void BestAudioSource::SetTraceCallback(const TraceFunction &Callback) {
+    TraceCallback = Callback;
+}
+
 void BestAudioSource::SetSeekPreRoll(int64_t Frames) {
     PreRoll = std::max<int64_t>(Frames, 0);
 }
 
 bool BestAudioSource::IndexTrack(const ProgressFunction &Progress) {
-    std::unique_ptr<LWAudioDecoder> Decoder(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale));
+    std::unique_ptr<LWAudioDecoder> Decoder(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale, BlockCache.get()));
+    Decoder->SetPacketSource(IndexPackets);
 
     int64_t FileSize = Progress ? Decoder->GetSourceSize() : -1;
 
@@ -449,6 +546,87 @@ bool BestAudioSource::IndexTrack(const ProgressFunction &Progress) {
     return !TrackIndex.Frames.empty();
 }
 
+// Audio frames can be decoded independently so the last few are decoded again in case they were incomplete when the
+// index was created and the first frames have to match the old index exactly
+
+bool BestAudioSource::ExtendTrackIndex(const ProgressFunction &Progress) {
+    static constexpr size_t ReindexFrames = 10;
+    static constexpr size_t MaxSearchFrames = 1000;
+
+    if (TrackIndex.Frames.size() < 2)
+        return false;
+
+    int64_t LastFrame = TrackIndex.Frames.size() - 1;
+    int64_t ResumeFrame = std::max<int64_t>(LastFrame - ReindexFrames, 0);
+    while (ResumeFrame >= 0 && TrackIndex.Frames[ResumeFrame].PTS == AV_NOPTS_VALUE)
+        ResumeFrame--;
+
+    if (ResumeFrame < 0)
+        return false;
+
+    std::unique_ptr<LWAudioDecoder> Decoder(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale, BlockCache.get()));
+    if (!Decoder->Seek(TrackIndex.Frames[ResumeFrame].PTS))
+        return false;
+
+    std::vector<FrameInfo> NewFrames;
+    int64_t NumSamples = TrackIndex.Frames[ResumeFrame].Start;
+    size_t SearchedFrames = 0;
+
+    while (true) {
+        int BitsPerSample;
+        AVFrame *F = Decoder->GetNextFrame(&BitsPerSample);
+        if (!F)
+            break;
+
+        uint64_t ChannelLayout;
+        if (F->ch_layout.order == AV_CHANNEL_ORDER_NATIVE) {
+            ChannelLayout = F->ch_layout.u.mask;
+        } else if (F->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC) {
+            AVChannelLayout ch = {};
+            av_channel_layout_default(&ch, F->ch_layout.nb_channels);
+            ChannelLayout = ch.u.mask;
+        } else {
+            av_frame_free(&F);
+            throw BestSourceException("Ambisonics and custom channel orders not supported");
+        }
+
+        FrameInfo FI = { F->pts, NumSamples, F->nb_samples, F->format, BitsPerSample, F->sample_rate, F->ch_layout.nb_channels, ChannelLayout, GetHash(F) };
+        av_frame_free(&F);
+
+        int64_t N = ResumeFrame + NewFrames.size();
+        if (NewFrames.empty() && (FI.PTS != TrackIndex.Frames[N].PTS || FI.Hash != TrackIndex.Frames[N].Hash)) {
+            if (++SearchedFrames >= MaxSearchFrames)
+                return false;
+            continue;
+        }
+
+        if (N < LastFrame && (FI.PTS != TrackIndex.Frames[N].PTS || FI.Length != TrackIndex.Frames[N].Length || FI.Hash != TrackIndex.Frames[N].Hash)) {
+            BSDebugPrint("Frame doesn't match the existing index when extending it", N);
+            return false;
+        }
+
+        NumSamples += FI.Length;
+        NewFrames.push_back(FI);
+
+        if (Progress) {
+            if (!Progress(AudioTrack, Decoder->GetSourcePostion(), FileSize))
+                throw BestSourceException("Indexing canceled by user");
+        }
+    }
+
+    if (Progress)
+        Progress(AudioTrack, INT64_MAX, INT64_MAX);
+
+    if (ResumeFrame + NewFrames.size() < TrackIndex.Frames.size())
+        return false;
+
+    BSDebugPrint("Extended index with " + std::to_string(ResumeFrame + NewFrames.size() - TrackIndex.Frames.size()) + " new frames", ResumeFrame);
+
+    TrackIndex.Frames.resize(ResumeFrame);
+    TrackIndex.Frames.insert(TrackIndex.Frames.end(), NewFrames.begin(), NewFrames.end());
+    return true;
+}
+
 void BestAudioSource::InitializeFormatSets() {
     std::map<std::tuple<int, int, int, int, uint64_t>, std::tuple<int64_t, int64_t, int64_t>> SeenSets;
     for (const auto &Iter : TrackIndex.Frames) {
@@ -492,32 +670,43 @@ void BestAudioSource::InitializeFormatSets() {
 }
 
 double BestAudioSource::GetRelativeStartTime(int Track) const {
-    if (Track < 0) {
-        try {
-            std::unique_ptr<LWVideoDecoder> Dec(new LWVideoDecoder(Source, "", 0, Track, 0, 0, LAVFOptions));
-            BSVideoProperties VP;
-            Dec->GetVideoProperties(VP);
-            return AP.StartTime - VP.StartTime;
-        } catch (BestSourceException &) {
-        }
+    // The start time of an audio track is already known if the file has been probed, otherwise the first frame of the other track
+    // is decoded since that's what the start time of the sources is based on
+    double StartTime;
+    if (GetProbedStartTime(Source, LAVFOptions, Track, StartTime))
+        return AP.StartTime - StartTime;
+
+    auto FirstFrameTime = [](AVFrame *F, const BSRational &TimeBase, double &StartTime) {
+        bool Valid = F && F->pts != AV_NOPTS_VALUE && TimeBase.Den > 0;
+        if (Valid)
+            StartTime = (static_cast<double>(TimeBase.Num) * F->pts) / TimeBase.Den;
+        av_frame_free(&F);
+        return Valid;
+    };
+
+    try {
+        std::unique_ptr<LWVideoDecoder> Dec(new LWVideoDecoder(Source, "", 0, Track, 0, 0, LAVFOptions));
+        LWVideoProperties VP;
+        Dec->GetVideoProperties(VP);
+        if (FirstFrameTime(Dec->GetNextFrame(), VP.TimeBase, StartTime))
+            return AP.StartTime - StartTime;
+    } catch (BestSourceException &) {
+    }
+
+    // There's no video track to be relative to
+    if (Track < 0)
         return 0;
-    } else {
-        try {
-            std::unique_ptr<LWVideoDecoder> Dec(new LWVideoDecoder(Source, "", 0, Track, 0, 0, LAVFOptions));
-            BSVideoProperties VP;
-            Dec->GetVideoProperties(VP);
-            return AP.StartTime - VP.StartTime;
-        } catch (BestSourceException &) {
-            try {
-                std::unique_ptr<LWAudioDecoder> Dec(new LWAudioDecoder(Source, Track, Threads, LAVFOptions, 0));
-                BSAudioProperties AP2;
-                Dec->GetAudioProperties(AP2);
-                return AP.StartTime - AP2.StartTime;
-            } catch (BestSourceException &) {
-                throw BestSourceException("Can't get delay relative to track");
-            }
-        }
+
+    try {
+        std::unique_ptr<LWAudioDecoder> Dec(new LWAudioDecoder(Source, Track, Threads, LAVFOptions, 0));
+        LWAudioProperties AP2;
+        Dec->GetAudioProperties(AP2);
+        if (FirstFrameTime(Dec->GetNextFrame(), AP2.TimeBase, StartTime))
+            return AP.StartTime - StartTime;
+    } catch (BestSourceException &) {
     }
+
+    throw BestSourceException("Can't get delay relative to track");
 }
 
 const BSAudioProperties &BestAudioSource::GetAudioProperties() const {
@@ -577,10 +766,24 @@ BestAudioFrame *BestAudioSource::GetFrame(int64_t N, bool Linear) {
         }
     }
 
+    auto Start = std::chrono::steady_clock::now();
+    CurrentRequest = {};
+    CurrentRequest.Track = AudioTrack;
+    CurrentRequest.Frame = N;
+
     std::unique_ptr<BestAudioFrame> F(FrameCache.GetFrame(N));
+    CurrentRequest.CacheHit = !!F;
     if (!F)
         F.reset(Linear ? GetFrameLinearInternal(N) : GetFrameInternal(N));
 
+    for (auto &Iter : Decoders)
+        if (Iter)
+            CurrentRequest.BytesRead += Iter->TakeBytesRead();
+    CurrentRequest.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    Stats.AddRequest(CurrentRequest);
+    if (TraceCallback)
+        TraceCallback(CurrentRequest);
+
     return F.release();
 }
 
@@ -589,12 +792,35 @@ void BestAudioSource::SetLinearMode() {
     if (!LinearMode) {
         BSDebugPrint("Linear mode is now forced");
         LinearMode = true;
+        CurrentRequest.LinearFallback = true;
         FrameCache.Clear();
-        for (size_t i = 0; i < MaxVideoSources; i++)
-            Decoders[i].reset();
+        for (size_t i = 0; i < Decoders.size(); i++)
+            if (Decoders[i])
+                CloseDecoder(Decoders[i]);
+        StoreSeekHistory();
     }
 }
 
+void BestAudioSource::CloseDecoder(std::unique_ptr<LWAudioDecoder> &Decoder) {
+    CurrentRequest.BytesRead += Decoder->TakeBytesRead();
+    Decoder.reset();
+}
+
+void BestAudioSource::AddBadSeekLocation(int64_t N) {
+    if (BadSeekLocations.insert(N).second)
+        StoreSeekHistory();
+}
+
+void BestAudioSource::StoreSeekHistory() {
+    if (SeekHistoryFile.empty())
+        return;
+    BSSeekHistory History;
+    History.BadSeekLocations = BadSeekLocations;
+    History.LinearMode = LinearMode;
+    if (!WriteSeekHistory(SeekHistoryFile, false, FileSize, TrackIndex.Frames.size(), History))
+        BSDebugPrint("Failed to store the seek history");
+}
+
 int64_t BestAudioSource::GetSeekFrame(int64_t N) {
     for (int64_t i = N - PreRoll; i >= 100; i--) {
         if (TrackIndex.Frames[i].PTS != AV_NOPTS_VALUE && !BadSeekLocations.count(i))
@@ -645,6 +871,7 @@ namespace {
 }
 
 BestAudioFrame *BestAudioSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std::unique_ptr<LWAudioDecoder> &Decoder, size_t Depth) {
+    CurrentRequest.Seeks++;
     if (!Decoder->Seek(TrackIndex.Frames[SeekFrame].PTS)) {
         BSDebugPrint("Unseekable file", N);
         SetLinearMode();
@@ -652,19 +879,20 @@ BestAudioFrame *BestAudioSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
     }
 
     Decoder->SkipFrames(PreRoll / 2);
+    CurrentRequest.DecodedFrames += PreRoll / 2;
 
     FrameHolder MatchFrames;
 
     while (true) {
         AVFrame *F = Decoder->GetNextFrame();
         if (!F && MatchFrames.empty()) {
-            BadSeekLocations.insert(SeekFrame);
+            AddBadSeekLocation(SeekFrame);
             BSDebugPrint("No frame could be decoded after seeking, added as bad seek location", N, SeekFrame);
             if (Depth < RetrySeekAttempts) {
                 int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                 BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
                 if (SeekFrameNext < 100) { // #2 again
-                    Decoder.reset();
+                    CloseDecoder(Decoder);
                     return GetFrameLinearInternal(N);
                 } else {
                     return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
@@ -680,6 +908,7 @@ BestAudioFrame *BestAudioSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
 
         if (F) {
             MatchFrames.push_back(F);
+            CurrentRequest.DecodedFrames++;
 
             for (size_t i = 0; i <= TrackIndex.Frames.size() - MatchFrames.size(); i++) {
                 bool HashMatch = true;
@@ -717,13 +946,13 @@ BestAudioFrame *BestAudioSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
 
         if (!SuitableCandidate || UndeterminableLocation) {
             BSDebugPrint("No destination frame number could be determined after seeking, added as bad seek location", N, SeekFrame);
-            BadSeekLocations.insert(SeekFrame);
+            AddBadSeekLocation(SeekFrame);
             MatchFrames.clear();
             if (Depth < RetrySeekAttempts) {
                 int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                 BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
                 if (SeekFrameNext < 100) { // #2 again
-                    Decoder.reset();
+                    CloseDecoder(Decoder);
                     return GetFrameLinearInternal(N);
                 } else {
                     return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
@@ -788,7 +1017,7 @@ BestAudioFrame *BestAudioSource::GetFrameInternal(int64_t N) {
         return GetFrameLinearInternal(N);
 
     // # 1 A suitable linear decoder exists and seeking is out of the question
-    for (int i = 0; i < MaxVideoSources; i++) {
+    for (int i = 0; i < static_cast<int>(Decoders.size()); i++) {
         if (Decoders[i] && Decoders[i]->GetFrameNumber() <= N && Decoders[i]->GetFrameNumber() >= SeekFrame)
             return GetFrameLinearInternal(N);
     }
@@ -798,7 +1027,7 @@ BestAudioFrame *BestAudioSource::GetFrameInternal(int64_t N) {
     // Grab/create a new decoder to use for seeking, the position is irrelevant
     int EmptySlot = -1;
     int LeastRecentlyUsed = 0;
-    for (int i = 0; i < MaxVideoSources; i++) {
+    for (int i = 0; i < static_cast<int>(Decoders.size()); i++) {
         if (!Decoders[i])
             EmptySlot = i;
         if (Decoders[i] && DecoderLastUse[i] < DecoderLastUse[LeastRecentlyUsed])
@@ -807,12 +1036,15 @@ BestAudioFrame *BestAudioSource::GetFrameInternal(int64_t N) {
 
     int Index = (EmptySlot >= 0) ? EmptySlot : LeastRecentlyUsed;
     if (!Decoders[Index])
-        Decoders[Index].reset(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale));
+        Decoders[Index].reset(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale, BlockCache.get()));
 
     DecoderLastUse[Index] = DecoderSequenceNum++;
 
     // #3 Actual seeking dance of death starts here
-    return SeekAndDecode(N, SeekFrame, Decoders[Index]);
+    auto Start = std::chrono::steady_clock::now();
+    BestAudioFrame *Frame = SeekAndDecode(N, SeekFrame, Decoders[Index]);
+    CurrentRequest.SeekSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    return Frame;
 }
 
 BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekFrame, size_t Depth, bool ForceUnseeked) {
@@ -820,7 +1052,7 @@ BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
     int Index = -1;
     int EmptySlot = -1;
     int LeastRecentlyUsed = 0;
-    for (int i = 0; i < MaxVideoSources; i++) {
+    for (int i = 0; i < static_cast<int>(Decoders.size()); i++) {
         if (Decoders[i] && (!ForceUnseeked || !Decoders[i]->HasSeeked()) && Decoders[i]->GetFrameNumber() <= N && (Index < 0 || Decoders[Index]->GetFrameNumber() < Decoders[i]->GetFrameNumber()))
             Index = i;
         if (!Decoders[i])
@@ -832,7 +1064,9 @@ BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
     // If an empty slot exists simply spawn a new decoder there or reuse the least recently used decoder slot if no free ones exist
     if (Index < 0) {
         Index = (EmptySlot >= 0) ? EmptySlot : LeastRecentlyUsed;
-        Decoders[Index].reset(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale));
+        if (Decoders[Index])
+            CloseDecoder(Decoders[Index]);
+        Decoders[Index].reset(new LWAudioDecoder(Source, AudioTrack, Threads, LAVFOptions, DrcScale, BlockCache.get()));
     }
 
     std::unique_ptr<LWAudioDecoder> &Decoder = Decoders[Index];
@@ -844,6 +1078,7 @@ BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
         int64_t FrameNumber = Decoder->GetFrameNumber();
         if (FrameNumber >= N - PreRoll) {
             AVFrame *Frame = Decoder->GetNextFrame();
+            CurrentRequest.DecodedFrames++;
 
             // This is the most central sanity check. It primarily exists to catch the case
             // when a decoder has successfully seeked and had its location identified but
@@ -855,12 +1090,12 @@ BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
                 if (Decoder->HasSeeked()) {
                     BSDebugPrint("Decoded frame does not match hash in GetFrameLinearInternal() or no frame produced at all, added as bad seek location", N, FrameNumber);
                     assert(SeekFrame >= 0);
-                    BadSeekLocations.insert(SeekFrame);
+                    AddBadSeekLocation(SeekFrame);
                     if (Depth < RetrySeekAttempts) {
                         int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                         BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
                         if (SeekFrameNext < 100) { // #2 again
-                            Decoder.reset();
+                            CloseDecoder(Decoder);
                             return GetFrameLinearInternal(N);
                         } else {
                             return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
@@ -882,44 +1117,57 @@ BestAudioFrame *BestAudioSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
             FrameCache.CacheFrame(FrameNumber, Frame);
         } else if (FrameNumber < N) {
             Decoder->SkipFrames(N - PreRoll - FrameNumber);
+            CurrentRequest.DecodedFrames += N - PreRoll - FrameNumber;
         }
 
         if (!Decoder->HasMoreFrames())
-            Decoder.reset();
+            CloseDecoder(Decoder);
     }
 
     return RetFrame;
 }
 
+// Audio is almost always requested in consecutive chunks so the frame the previous range ended in and the one
+// following it are checked before falling back to a binary search of the frame start positions
+
+int64_t BestAudioSource::GetFrameBySample(int64_t Sample) const {
+    const auto &Frames = TrackIndex.Frames;
+    int64_t NumFrames = static_cast<int64_t>(Frames.size());
+
+    int64_t Hint = LastRangeHint;
+    for (int64_t i = Hint; i >= 0 && i <= Hint + 1 && i < NumFrames; i++) {
+        if (Sample >= Frames[i].Start && Sample < Frames[i].Start + Frames[i].Length)
+            return i;
+    }
+
+    auto Iter = std::upper_bound(Frames.begin(), Frames.end(), Sample, [](int64_t Value, const FrameInfo &Frame) { return Value < Frame.Start; });
+    if (Iter == Frames.begin())
+        return -1;
+    --Iter;
+    if (Sample >= Iter->Start + Iter->Length)
+        return -1;
+    return std::distance(Frames.begin(), Iter);
+}
+
 BestAudioSource::FrameRange BestAudioSource::GetFrameRangeBySamples(int64_t Start, int64_t Count) const {
     FrameRange Result = { -1, -1, -1 };
     if (Count <= 0 || Start >= AP.NumSamples)
         return Result;
-    if (Start < 0) {
+    if (Start < 0)
         Result.First = 0;
-    } else {
-        for (size_t i = 0; i < TrackIndex.Frames.size(); i++) {
-            if (Start >= TrackIndex.Frames[i].Start && Start < TrackIndex.Frames[i].Start + TrackIndex.Frames[i].Length) {
-                Result.First = i;
-                break;
-            }
-        }
-    }
+    else
+        Result.First = GetFrameBySample(Start);
 
     int64_t EndPos = Start + Count;
-    if (EndPos >= AP.NumSamples) {
+    if (EndPos >= AP.NumSamples)
         Result.Last = AP.NumFrames - 1;
-    } else {
-        for (size_t i = 0; i < TrackIndex.Frames.size(); i++) {
-            if (EndPos - 1 >= TrackIndex.Frames[i].Start && EndPos - 1 < TrackIndex.Frames[i].Start + TrackIndex.Frames[i].Length) {
-                Result.Last = i;
-                break;
-            }
-        }
-    }
+    else
+        Result.Last = GetFrameBySample(EndPos - 1);
 
     assert(Result.First >= 0 && Result.Last >= 0);
 
+    LastRangeHint = Result.Last;
+
     Result.FirstSamplePos = TrackIndex.Frames[Result.First].Start;
 
     return Result;
@@ -955,11 +1203,10 @@ static void PackChannels(const uint8_t **Src, uint8_t *&Dst, size_t Length, size
     }
 }
 
-bool BestAudioSource::FillInFramePacked(const BestAudioFrame *Frame, int64_t FrameStartSample, uint8_t *&Data, int64_t &Start, int64_t &Count) {
-    const AVFrame *F = Frame->GetAVFrame();
+bool BestAudioSource::FillInFramePacked(const AVFrame *F, int64_t FrameStartSample, uint8_t *&Data, int64_t &Start, int64_t &Count) {
     bool IsPlanar = av_sample_fmt_is_planar(static_cast<AVSampleFormat>(F->format));
-    if ((Start >= FrameStartSample) && (Start < FrameStartSample + Frame->NumSamples)) {
-        int64_t Length = std::min(Count, Frame->NumSamples - Start + FrameStartSample);
+    if ((Start >= FrameStartSample) && (Start < FrameStartSample + F->nb_samples)) {
+        int64_t Length = std::min<int64_t>(Count, F->nb_samples - Start + FrameStartSample);
         if (Length == 0)
             return false;
 
@@ -1018,11 +1265,10 @@ static void UnpackChannels(const uint8_t *Src, uint8_t *Dst[], size_t Length, si
     }
 }
 
-bool BestAudioSource::FillInFramePlanar(const BestAudioFrame *Frame, int64_t FrameStartSample, uint8_t *Data[], int64_t &Start, int64_t &Count) {
-    const AVFrame *F = Frame->GetAVFrame();
+bool BestAudioSource::FillInFramePlanar(const AVFrame *F, int64_t FrameStartSample, uint8_t *Data[], int64_t &Start, int64_t &Count) {
     bool IsPlanar = av_sample_fmt_is_planar(static_cast<AVSampleFormat>(F->format));
-    if ((Start >= FrameStartSample) && (Start < FrameStartSample + Frame->NumSamples)) {
-        int64_t Length = std::min(Count, Frame->NumSamples - Start + FrameStartSample);
+    if ((Start >= FrameStartSample) && (Start < FrameStartSample + F->nb_samples)) {
+        int64_t Length = std::min<int64_t>(Count, F->nb_samples - Start + FrameStartSample);
         if (Length == 0)
             return false;
 
@@ -1064,7 +1310,7 @@ void BestAudioSource::GetPackedAudio(uint8_t *Data, int64_t Start, int64_t Count
         std::unique_ptr<BestAudioFrame> F(GetFrame(i));
         if (!F)
             throw BestSourceException("Audio decoding error, failed to get frame " + std::to_string(i));
-        FillInFramePacked(F.get(), Range.FirstSamplePos, Data, Start, Count);
+        FillInFramePacked(F->GetAVFrame(), Range.FirstSamplePos, Data, Start, Count);
         Range.FirstSamplePos += F->NumSamples;
     }
 
@@ -1099,7 +1345,7 @@ void BestAudioSource::GetPlanarAudio(uint8_t *const *const Data, int64_t Start,
         std::unique_ptr<BestAudioFrame> F(GetFrame(i));
         if (!F)
             throw BestSourceException("Audio decoding error, failed to get frame " + std::to_string(i));
-        FillInFramePlanar(F.get(), Range.FirstSamplePos, DataV.data(), Start, Count);
+        FillInFramePlanar(F->GetAVFrame(), Range.FirstSamplePos, DataV.data(), Start, Count);
         Range.FirstSamplePos += F->NumSamples;
     }
 
@@ -1112,6 +1358,105 @@ void BestAudioSource::GetPlanarAudio(uint8_t *const *const Data, int64_t Start,
         throw BestSourceException("Code error, failed to provide all samples");
 }
 
+BestAudioSource::StreamReader::StreamReader(BestAudioSource &Source, int64_t Start) : Source(Source), Position(Start) {
+    const BSAudioProperties &AP = Source.AP;
+    if (AP.Format == 0 || AP.BitsPerSample == 0 || AP.Channels == 0 || AP.ChannelLayout == 0 || AP.SampleRate == 0)
+        throw BestSourceException("StreamReader can only be used when variable format is disabled");
+}
+
+BestAudioSource::StreamReader::~StreamReader() {
+    av_frame_free(&Frame);
+}
+
+int64_t BestAudioSource::StreamReader::GetPosition() const {
+    return Position;
+}
+
+void BestAudioSource::StreamReader::SetPosition(int64_t Start) {
+    Position = Start;
+}
+
+void BestAudioSource::StreamReader::DecodeFrameContaining(int64_t Sample) {
+    if (Frame && Sample >= FrameStart && Sample < FrameStart + Frame->nb_samples)
+        return;
+
+    int64_t N = Source.GetFrameBySample(Sample);
+    if (N < 0)
+        throw BestSourceException("Audio decoding error, no frame contains sample " + std::to_string(Sample));
+
+    av_frame_free(&Frame);
+
+    // Continue with the furthest decoder of the pool before N unless seeking is expected to be cheaper, the same rule as in GetFrameInternal()
+    int64_t SeekFrame = Source.GetSeekFrame(N);
+    int Index = -1;
+    for (int i = 0; i < static_cast<int>(Source.Decoders.size()); i++) {
+        const auto &Decoder = Source.Decoders[i];
+        if (Decoder && Decoder->GetFrameNumber() <= N && (Source.LinearMode || Decoder->GetFrameNumber() >= SeekFrame) && (Index < 0 || Source.Decoders[Index]->GetFrameNumber() < Decoder->GetFrameNumber()))
+            Index = i;
+    }
+
+    if (Index >= 0) {
+        std::unique_ptr<LWAudioDecoder> &Decoder = Source.Decoders[Index];
+        Source.DecoderLastUse[Index] = Source.DecoderSequenceNum++;
+        Decoder->SkipFrames(N - Decoder->GetFrameNumber());
+        Frame = Decoder->GetNextFrame();
+        if (!Decoder->HasMoreFrames())
+            Source.CloseDecoder(Decoder);
+
+        // Decoders that have seeked can still return frames out of order so the hash is checked just like when decoding through the cache
+        if (Frame && Frame->nb_samples > 0 && Source.TrackIndex.Frames[N].Hash == GetHash(Frame)) {
+            FrameStart = Source.TrackIndex.Frames[N].Start;
+            return;
+        }
+
+        BSDebugPrint("Decoded frame does not match hash in StreamReader, retrying the normal way", N);
+        av_frame_free(&Frame);
+        if (Decoder)
+            Source.CloseDecoder(Decoder);
+    }
+
+    // Seeks through the verified path or decodes linearly as appropriate, the decoder is then positioned right after N for the next call
+    std::unique_ptr<BestAudioFrame> F(Source.GetFrame(N));
+    if (F)
+        Frame = av_frame_clone(F->GetAVFrame());
+    if (!Frame || Frame->nb_samples <= 0)
+        throw BestSourceException("Audio decoding error, failed to get frame " + std::to_string(N));
+    FrameStart = Source.TrackIndex.Frames[N].Start;
+}
+
+void BestAudioSource::StreamReader::GetPackedAudio(uint8_t *Data, int64_t Count) {
+    int64_t Start = Position - Source.SampleDelay;
+    Position += Count;
+
+    Source.ZeroFillStartPacked(Data, Start, Count);
+    Source.ZeroFillEndPacked(Data, Start, Count);
+
+    while (Count > 0) {
+        DecodeFrameContaining(Start);
+        if (!Source.FillInFramePacked(Frame, FrameStart, Data, Start, Count))
+            throw BestSourceException("Code error, failed to provide all samples");
+    }
+}
+
+void BestAudioSource::StreamReader::GetPlanarAudio(uint8_t *const *const Data, int64_t Count) {
+    int64_t Start = Position - Source.SampleDelay;
+    Position += Count;
+
+    std::vector<uint8_t *> DataV;
+    DataV.reserve(Source.AP.Channels);
+    for (int i = 0; i < Source.AP.Channels; i++)
+        DataV.push_back(Data[i]);
+
+    Source.ZeroFillStartPlanar(DataV.data(), Start, Count);
+    Source.ZeroFillEndPlanar(DataV.data(), Start, Count);
+
+    while (Count > 0) {
+        DecodeFrameContaining(Start);
+        if (!Source.FillInFramePlanar(Frame, FrameStart, DataV.data(), Start, Count))
+            throw BestSourceException("Code error, failed to provide all samples");
+    }
+}
+
 ////////////////////////////////////////
 // Index read/write
 
@@ -1210,13 +1555,14 @@ bool BestAudioSource::WriteAudioTrackIndex(bool AbsolutePath, const std::filesys
     return true;
 }
 
-bool BestAudioSource::ReadAudioTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath) {
+bool BestAudioSource::ReadAudioTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, int64_t &IndexedFileSize) {
     file_ptr_t F = OpenCacheFile(AbsolutePath, CachePath, Source, AudioTrack, false);
     if (!F)
         return false;
     if (!ReadBSHeader(F, false))
         return false;
-    if (!ReadCompareInt64(F, FileSize))
+    IndexedFileSize = ReadInt64(F);
+    if (IndexedFileSize != FileSize && (IndexedFileSize < 0 || FileSize < 0 || IndexedFileSize > FileSize))
         return false;
     if (!ReadCompareInt(F, AudioTrack))
         return false;
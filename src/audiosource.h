@@ -24,18 +24,23 @@
 #include "bsshared.h"
 #include <cstdint>
 #include <list>
+#include <unordered_map>
 #include <string>
 #include <map>
 #include <set>
 #include <vector>
 #include <array>
 #include <memory>
+#include <atomic>
 
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVBufferRef;
 struct AVFrame;
 struct AVPacket;
+struct AVIOContext;
+class BSPacketQueue;
+class BSBlockCache;
 
 struct BSAudioFormat {
     bool Float;
@@ -76,16 +81,21 @@ private:
     bool DecodeSuccess = true;
     AVPacket *Packet = nullptr;
     bool Seeked = false;
+    int ReservedThreads = 0; // Drawn from the decoder thread budget
+    BSPacketQueue *PacketSource = nullptr;
+    AVIOContext *CustomIO = nullptr; // Reads through the block cache of the source when set
+    int64_t ReportedBytesRead = 0;
 
-    void OpenFile(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale);
+    void OpenFile(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale, BSBlockCache *BlockCache);
     bool ReadPacket();
     bool DecodeNextFrame(bool SkipOutput = false);
     void Free();
 public:
-    LWAudioDecoder(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale); // Positive track numbers are absolute. Negative track numbers mean nth audio track to simplify things.
+    LWAudioDecoder(const std::filesystem::path &SourceFile, int Track, int Threads, const std::map<std::string, std::string> &LAVFOpts, double DrcScale, BSBlockCache *BlockCache = nullptr); // Positive track numbers are absolute. Negative track numbers mean nth audio track to simplify things.
     ~LWAudioDecoder();
     [[nodiscard]] int64_t GetSourceSize() const;
     [[nodiscard]] int64_t GetSourcePostion() const;
+    [[nodiscard]] int64_t TakeBytesRead(); // The number of bytes read from the file since the last call
     [[nodiscard]] int GetTrack() const; // Useful when opening nth video track to get the actual number
     [[nodiscard]] int64_t GetFrameNumber() const; // The frame you will get when calling GetNextFrame()
     [[nodiscard]] int64_t GetSamplePos() const; // The frame you will get when calling GetNextFrame()
@@ -95,6 +105,7 @@ public:
     bool SkipFrames(int64_t Count);
     [[nodiscard]] bool HasMoreFrames() const;
     [[nodiscard]] bool Seek(int64_t PTS); // Note that the current frame number isn't updated and if seeking fails the decoder is in an undefined state
+    void SetPacketSource(BSPacketQueue *Packets); // Takes the packets from a shared demuxer instead of reading the file, only for decoding the whole track in order
     [[nodiscard]] bool HasSeeked() const;
 };
 
@@ -146,7 +157,7 @@ private:
     };
 
     bool WriteAudioTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath);
-    bool ReadAudioTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath);
+    bool ReadAudioTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, int64_t &IndexedFileSize); // Also accepts indexes of a smaller file size so they can be extended
 
     class Cache {
     private:
@@ -162,7 +173,11 @@ private:
         const AudioTrackIndex &TrackIndex;
         size_t Size = 0;
         size_t MaxSize = 1024 * 1024 * 1024;
+        uint64_t Hits = 0;
+        uint64_t Misses = 0;
+        uint64_t Evictions = 0;
         std::list<CacheBlock> Data;
+        std::unordered_map<int64_t, std::list<CacheBlock>::iterator> Index;
         void ApplyMaxSize();
     public:
         Cache(const AudioTrackIndex &TrackIndex);
@@ -170,6 +185,7 @@ private:
         void SetMaxSize(size_t Bytes);
         void CacheFrame(int64_t FrameNumber, AVFrame *Frame); // Takes ownership of Frame
         [[nodiscard]] BestAudioFrame *GetFrame(int64_t N);
+        [[nodiscard]] BSCacheStatistics GetStatistics() const;
     };
 
     AudioTrackIndex TrackIndex;
@@ -178,8 +194,8 @@ private:
     std::vector<FormatSet> FormatSets;
     FormatSet DefaultFormatSet;
 
-    static constexpr int MaxVideoSources = 4;
     std::map<std::string, std::string> LAVFOptions;
+    std::shared_ptr<BSBlockCache> BlockCache; // Shared by all decoders of the source, declared before them so it outlives them
     double DrcScale;
     BSAudioProperties AP = {};
     std::filesystem::path Source;
@@ -188,26 +204,37 @@ private:
     int Threads;
     bool LinearMode = false;
     uint64_t DecoderSequenceNum = 0;
-    uint64_t DecoderLastUse[MaxVideoSources] = {};
-    std::unique_ptr<LWAudioDecoder> Decoders[MaxVideoSources];
+    std::vector<uint64_t> DecoderLastUse;
+    std::vector<std::unique_ptr<LWAudioDecoder>> Decoders;
     int64_t PreRoll = 40;
     int64_t SampleDelay = 0;
+    mutable std::atomic<int64_t> LastRangeHint{ 0 }; // The last frame of the previous sample range lookup
     int64_t FileSize = -1;
     static constexpr size_t RetrySeekAttempts = 10;
     std::set<int64_t> BadSeekLocations;
+    std::filesystem::path SeekHistoryFile; // The index file the seek history is stored next to, empty if it isn't stored
+    void AddBadSeekLocation(int64_t N);
+    void StoreSeekHistory();
     void SetLinearMode();
+    BSSourceStatistics Stats = {};
+    BSRequestTrace CurrentRequest = {};
+    TraceFunction TraceCallback;
+    void CloseDecoder(std::unique_ptr<LWAudioDecoder> &Decoder); // Counts what the decoder read for the current request before closing it
     [[nodiscard]] int64_t GetSeekFrame(int64_t N);
     [[nodiscard]] BestAudioFrame *SeekAndDecode(int64_t N, int64_t SeekFrame, std::unique_ptr<LWAudioDecoder> &Decoder, size_t Depth = 0);
     [[nodiscard]] BestAudioFrame *GetFrameInternal(int64_t N);
     [[nodiscard]] BestAudioFrame *GetFrameLinearInternal(int64_t N, int64_t SeekFrame = -1, size_t Depth = 0, bool ForceUnseeked = false);
+    BSPacketQueue *IndexPackets = nullptr; // Only set during construction
     [[nodiscard]] bool IndexTrack(const ProgressFunction &Progress = nullptr);
+    [[nodiscard]] bool ExtendTrackIndex(const ProgressFunction &Progress); // Decodes the end of the file again and appends any new frames to the loaded index
     void InitializeFormatSets();
+    [[nodiscard]] int64_t GetFrameBySample(int64_t Sample) const; // Returns the frame containing Sample or -1
     void ZeroFillStartPacked(uint8_t *&Data, int64_t &Start, int64_t &Count);
     void ZeroFillEndPacked(uint8_t *Data, int64_t Start, int64_t &Count);
-    bool FillInFramePacked(const BestAudioFrame *Frame, int64_t FrameStartSample, uint8_t *&Data, int64_t &Start, int64_t &Count);
+    bool FillInFramePacked(const AVFrame *F, int64_t FrameStartSample, uint8_t *&Data, int64_t &Start, int64_t &Count);
     void ZeroFillStartPlanar(uint8_t *Data[], int64_t &Start, int64_t &Count);
     void ZeroFillEndPlanar(uint8_t *Data[], int64_t Start, int64_t &Count);
-    bool FillInFramePlanar(const BestAudioFrame *Frame, int64_t FrameStartSample, uint8_t *Data[], int64_t &Start, int64_t &Count);
+    bool FillInFramePlanar(const AVFrame *F, int64_t FrameStartSample, uint8_t *Data[], int64_t &Start, int64_t &Count);
 public:
     struct FrameRange {
         int64_t First;
@@ -215,9 +242,32 @@ public:
         int64_t FirstSamplePos;
     };
 
-    BestAudioSource(const std::filesystem::path &SourceFile, int Track, int AjustDelay, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, double DrcScale, const ProgressFunction &Progress = nullptr);
+    /* Decodes the track in order straight into the supplied buffers without going through the cache, the rest of the last decoded frame
+       is kept for the next call. Much faster than GetPackedAudio() and GetPlanarAudio() for reading long ranges in order. Continues with
+       the decoder of the source closest before the requested position when it's cheaper than seeking, otherwise the frame is requested the
+       normal way which seeks and leaves a decoder to continue with. Only works with variable format disabled and must not outlive the source. */
+    class StreamReader {
+    private:
+        BestAudioSource &Source;
+        AVFrame *Frame = nullptr;
+        int64_t FrameStart = 0; // The first sample of Frame
+        int64_t Position;
+        void DecodeFrameContaining(int64_t Sample);
+    public:
+        StreamReader(BestAudioSource &Source, int64_t Start = 0);
+        ~StreamReader();
+        [[nodiscard]] int64_t GetPosition() const; // The first sample of the next read
+        void SetPosition(int64_t Start);
+        void GetPackedAudio(uint8_t *Data, int64_t Count);
+        void GetPlanarAudio(uint8_t *const *const Data, int64_t Count);
+    };
+
+    BestAudioSource(const std::filesystem::path &SourceFile, int Track, int AjustDelay, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, double DrcScale, const ProgressFunction &Progress = nullptr, int MaxDecoders = 4, size_t IOCacheSize = 0, BSPacketQueue *IndexPackets = nullptr); // New arguments are only ever added at the end so existing callers keep working. IOCacheSize is the size in bytes of a block cache all decoders read the file through, 0 reads the file directly. IndexPackets makes indexing read from a shared demuxer, see IndexTracksTogether()
     [[nodiscard]] int GetTrack() const; // Useful when opening nth video track to get the actual number
     void SetMaxCacheSize(size_t Bytes); /* default max size is 1GB */
+    [[nodiscard]] BSCacheStatistics GetCacheStatistics() const;
+    [[nodiscard]] BSSourceStatistics GetStatistics() const; /* Counters and histograms for all frame requests so far, StreamReader isn't included */
+    void SetTraceCallback(const TraceFunction &Callback); /* Called with a summary of every frame request once it's done, nullptr disables it */
     void SetSeekPreRoll(int64_t Frames); /* the number of frames to cache before the position being fast forwarded to */
     double GetRelativeStartTime(int Track) const;
     [[nodiscard]] const BSAudioProperties &GetAudioProperties() const;
@@ -23,6 +23,8 @@
 #include "bsshared.h"
 #include "version.h"
 #include "synthshared.h"
+#include "tracklist.h"
+#include "trackindexer.h"
 #include "../AviSynthPlus/avs_core/include/avisynth.h"
 #include <VSHelper4.h>
 #include <vector>
@@ -66,16 +68,17 @@ static void BSInit() {
 
 class AvisynthVideoSource : public IClip {
     VideoInfo VI = {};
-    std::unique_ptr<BestVideoSource> V;
+    std::shared_ptr<BestVideoSource> V;
     int64_t FPSNum;
     int64_t FPSDen;
     bool RFF;
+    int ExportThreads;
 public:
     AvisynthVideoSource(const char *Source, int Track, int ViewID,
         int AFPSNum, int AFPSDen, bool RFF, int Threads, int SeekPreRoll, bool EnableDrefs, bool UseAbsolutePath,
         int CacheMode, const char *CachePath, int CacheSize, const char *HWDevice, int ExtraHWFrames,
-        const char *Timecodes, int StartNumber, int VariableFormat, IScriptEnvironment *Env)
-        : FPSNum(AFPSNum), FPSDen(AFPSDen), RFF(RFF) {
+        const char *Timecodes, int StartNumber, int VariableFormat, int IndexThreads, bool FastIndex, int Prefetch, int MaxDecoders, int DecoderPolicy, int IdleTimeout, int ExportThreads, bool SparseHash, bool Shared, int IOCacheSize, bool CachePlanar, IScriptEnvironment *Env)
+        : FPSNum(AFPSNum), FPSDen(AFPSDen), RFF(RFF), ExportThreads(std::max(ExportThreads, 1)) {
 
         try {
             if (VariableFormat < 0)
@@ -95,9 +98,30 @@ public:
             if (StartNumber >= 0)
                 Opts["start_number"] = std::to_string(StartNumber);
 
-            V.reset(new BestVideoSource(CreateProbablyUTF8Path(Source), HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath, &Opts));
-
-            V->SelectFormatSet(VariableFormat);
+            // Everything the source is configured with has to be part of the key when it's shared
+            auto Create = [&]() {
+                std::unique_ptr<BestVideoSource> Tmp(new BestVideoSource(CreateProbablyUTF8Path(Source), HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath, &Opts, nullptr, IndexThreads, FastIndex, SparseHash, MaxDecoders, static_cast<size_t>(std::max(IOCacheSize, 0)) * 1024 * 1024));
+                Tmp->SetDecoderPolicy(static_cast<BestDecoderPolicy>(DecoderPolicy));
+                Tmp->SetIdleDecoderTimeout(IdleTimeout);
+                Tmp->SelectFormatSet(VariableFormat);
+                Tmp->SetSeekPreRoll(SeekPreRoll);
+                if (CacheSize >= 0)
+                    Tmp->SetMaxCacheSize(CacheSize * 1024 * 1024);
+                Tmp->SetCachePlanar(CachePlanar);
+                Tmp->SetPrefetch(Prefetch);
+                return Tmp.release();
+            };
+
+            if (Shared) {
+                std::string OptsKey;
+                for (const auto &Iter : Opts)
+                    OptsKey += Iter.first + "=" + Iter.second + ";";
+                V = GetSharedVideoSource(GetSharedSourceKey({ Source, std::to_string(Track), std::to_string(ViewID), HWDevice ? HWDevice : "", std::to_string(ExtraHWFrames), std::to_string(Threads),
+                    std::to_string(FastIndex), std::to_string(SparseHash), std::to_string(MaxDecoders), std::to_string(IOCacheSize), std::to_string(CacheMode), CachePath, OptsKey,
+                    std::to_string(VariableFormat), std::to_string(SeekPreRoll), std::to_string(DecoderPolicy), std::to_string(IdleTimeout), std::to_string(CacheSize), std::to_string(CachePlanar) }), Create);
+            } else {
+                V.reset(Create());
+            }
 
             const BSVideoProperties &VP = V->GetVideoProperties();
 
@@ -173,11 +197,6 @@ public:
                 VI.num_frames = vsh::int64ToIntS(VP.NumRFFFrames);
             }
 
-            V->SetSeekPreRoll(SeekPreRoll);
-
-            if (CacheSize >= 0)
-                V->SetMaxCacheSize(CacheSize * 1024 * 1024);
-
             if (Timecodes)
                 V->WriteTimecodes(CreateProbablyUTF8Path(Timecodes));
 
@@ -247,7 +266,7 @@ public:
                 assert(false);
             }
 
-            if (!Src->ExportAsPlanar(DstPtrs, DstStride, DestHasAlpha ? Dst->GetWritePtr(PLANAR_A) : nullptr, DestHasAlpha ? Dst->GetPitch(PLANAR_A) : 0)) {
+            if (!Src->ExportAsPlanar(DstPtrs, DstStride, DestHasAlpha ? Dst->GetWritePtr(PLANAR_A) : nullptr, DestHasAlpha ? Dst->GetPitch(PLANAR_A) : 0, ExportThreads)) {
                 throw BestSourceException("Cannot export to planar format for frame " + std::to_string(n));
             }
 
@@ -291,16 +310,42 @@ static AVSValue __cdecl CreateBSVideoSource(AVSValue Args, void *UserData, IScri
     int StartNumber = Args[15].AsInt(-1);
     int VariableFormat = Args[16].AsInt(0);
     int ViewID = Args[17].AsInt(0);
-
-    return new AvisynthVideoSource(Source, Track, ViewID, FPSNum, FPSDen, RFF, Threads, SeekPreroll, EnableDrefs, UseAbsolutePath, CacheMode, CachePath, CacheSize, HWDevice, ExtraHWFrames, Timecodes, StartNumber, VariableFormat, Env);
+    int IndexThreads = Args[18].AsInt(1);
+    bool FastIndex = Args[19].AsBool(false);
+    int Prefetch = Args[20].AsInt(0);
+    int MaxDecoders = Args[21].AsInt(4);
+    int DecoderPolicy = Args[22].AsInt(bdpLeastRecentlyUsed);
+    int IdleTimeout = Args[23].AsInt(0);
+    int ExportThreads = Args[24].AsInt(1);
+    bool SparseHash = Args[25].AsBool(false);
+    bool Shared = Args[26].AsBool(false);
+    int IOCacheSize = Args[27].AsInt(0);
+    bool CachePlanar = Args[28].AsBool(false);
+
+    return new AvisynthVideoSource(Source, Track, ViewID, FPSNum, FPSDen, RFF, Threads, SeekPreroll, EnableDrefs, UseAbsolutePath, CacheMode, CachePath, CacheSize, HWDevice, ExtraHWFrames, Timecodes, StartNumber, VariableFormat, IndexThreads, FastIndex, Prefetch, MaxDecoders, DecoderPolicy, IdleTimeout, ExportThreads, SparseHash, Shared, IOCacheSize, CachePlanar, Env);
 }
 
 class AvisynthAudioSource : public IClip {
     VideoInfo VI = {};
     std::unique_ptr<BestAudioSource> A;
+    std::unique_ptr<BestAudioSource::StreamReader> Reader; // Only created once audio is requested in order
+    int64_t NextSample = -1;
+
+    void GetPackedAudio(uint8_t *Buf, int64_t Start, int64_t Count) {
+        if (Start == NextSample) {
+            if (!Reader)
+                Reader.reset(new BestAudioSource::StreamReader(*A, Start));
+            Reader->SetPosition(Start);
+        }
+        if (Reader && Reader->GetPosition() == Start)
+            Reader->GetPackedAudio(Buf, Count);
+        else
+            A->GetPackedAudio(Buf, Start, Count);
+        NextSample = Start + Count;
+    }
 public:
     AvisynthAudioSource(const char *Source, int Track,
-        int AdjustDelay, int Threads, bool EnableDrefs, bool UseAbsolutePath, double DrcScale, int CacheMode, const char *CachePath, int CacheSize, IScriptEnvironment *Env) {
+        int AdjustDelay, int Threads, bool EnableDrefs, bool UseAbsolutePath, double DrcScale, int CacheMode, const char *CachePath, int CacheSize, int MaxDecoders, int IOCacheSize, IScriptEnvironment *Env) {
 
         std::map<std::string, std::string> Opts;
         if (EnableDrefs)
@@ -309,7 +354,7 @@ public:
             Opts["use_absolute_path"] = "1";
 
         try {
-            A.reset(new BestAudioSource(CreateProbablyUTF8Path(Source), Track, AdjustDelay, Threads, CacheMode, CachePath ? CachePath : "", &Opts, DrcScale));
+            A.reset(new BestAudioSource(CreateProbablyUTF8Path(Source), Track, AdjustDelay, Threads, CacheMode, CachePath ? CachePath : "", &Opts, DrcScale, nullptr, MaxDecoders, static_cast<size_t>(std::max(IOCacheSize, 0)) * 1024 * 1024));
 
             A->SelectFormatSet(0);
 
@@ -360,7 +405,7 @@ public:
                 // Avisynth has no way to signal the number of significant bits and instead requires 24bit packed stuff
                 std::unique_ptr<uint8_t[]> Tmp(new uint8_t[Count * VI.nchannels * 4]);
                 uint8_t *Dst = reinterpret_cast<uint8_t *>(Buf);
-                A->GetPackedAudio(reinterpret_cast<uint8_t *>(Tmp.get()), Start, Count);
+                GetPackedAudio(reinterpret_cast<uint8_t *>(Tmp.get()), Start, Count);
                 for (int64_t i = 0; i < Count * VI.nchannels; i++) {
 #ifdef BS_LITTLE_ENDIAN
                     memcpy(Dst, Tmp.get() + i * 4 + 1, 3);
@@ -370,7 +415,7 @@ public:
                     Dst += 3;
                 }
             } else {
-                A->GetPackedAudio(reinterpret_cast<uint8_t *>(Buf), Start, Count);
+                GetPackedAudio(reinterpret_cast<uint8_t *>(Buf), Start, Count);
             }
         } catch (BestSourceException &e) {
             Env->ThrowError("BestAudioSource: %s", e.what());
@@ -399,8 +444,10 @@ static AVSValue __cdecl CreateBSAudioSource(AVSValue Args, void *UserData, IScri
     int CacheMode = Args[7].AsInt(1);
     const char *CachePath = Args[8].AsString("");
     int CacheSize = Args[9].AsInt(-1);
+    int MaxDecoders = Args[10].AsInt(4);
+    int IOCacheSize = Args[11].AsInt(0);
 
-    return new AvisynthAudioSource(Source, Track, AdjustDelay, Threads, EnableDrefs, UseAbsolutePath, DrcScale, CacheMode, CachePath, CacheSize, Env);
+    return new AvisynthAudioSource(Source, Track, AdjustDelay, Threads, EnableDrefs, UseAbsolutePath, DrcScale, CacheMode, CachePath, CacheSize, MaxDecoders, IOCacheSize, Env);
 }
 
 // Now some fun magic to parse things from Avisynth arg strings at compile time
@@ -435,9 +482,9 @@ static constexpr auto PopulateArgNames() {
     return Result;
 }
 
-static constexpr char BSVideoSourceAvsArgs[] = "[source]s[track]i[fpsnum]i[fpsden]i[rff]b[threads]i[seekpreroll]i[enable_drefs]b[use_absolute_path]b[cachemode]i[cachepath]s[cachesize]i[hwdevice]s[extrahwframes]i[timecodes]s[start_number]i[variableformat]i[viewid]i";
-static constexpr char BSAudioSourceAvsArgs[] = "[source]s[track]i[adjustdelay]i[threads]i[enable_drefs]b[use_absolute_path]b[drc_scale]f[cachemode]i[cachepath]s[cachesize]i";
-static constexpr char BSSourceAvsArgs[] = "[source]s[atrack]i[vtrack]i[fpsnum]i[fpsden]i[rff]b[threads]i[seekpreroll]i[enable_drefs]b[use_absolute_path]b[cachemode]i[cachepath]s[acachesize]i[vcachesize]i[hwdevice]s[extrahwframes]i[timecodes]s[start_number]i[variableformat]i[adjustdelay]i[drc_scale]f[viewid]i";
+static constexpr char BSVideoSourceAvsArgs[] = "[source]s[track]i[fpsnum]i[fpsden]i[rff]b[threads]i[seekpreroll]i[enable_drefs]b[use_absolute_path]b[cachemode]i[cachepath]s[cachesize]i[hwdevice]s[extrahwframes]i[timecodes]s[start_number]i[variableformat]i[viewid]i[indexthreads]i[fastindex]b[prefetch]i[decoders]i[decoderpolicy]i[idletimeout]i[exportthreads]i[sparsehash]b[shared]b[iocachesize]i[cacheplanar]b";
+static constexpr char BSAudioSourceAvsArgs[] = "[source]s[track]i[adjustdelay]i[threads]i[enable_drefs]b[use_absolute_path]b[drc_scale]f[cachemode]i[cachepath]s[cachesize]i[decoders]i[iocachesize]i";
+static constexpr char BSSourceAvsArgs[] = "[source]s[atrack]i[vtrack]i[fpsnum]i[fpsden]i[rff]b[threads]i[seekpreroll]i[enable_drefs]b[use_absolute_path]b[cachemode]i[cachepath]s[acachesize]i[vcachesize]i[hwdevice]s[extrahwframes]i[timecodes]s[start_number]i[variableformat]i[adjustdelay]i[drc_scale]f[viewid]i[indexthreads]i[fastindex]b[prefetch]i[decoders]i[decoderpolicy]i[idletimeout]i[exportthreads]i[sparsehash]b[shared]b[iocachesize]i[cacheplanar]b";
 
 static constexpr std::array BSVArgNames = PopulateArgNames<BSVideoSourceAvsArgs>();
 static constexpr std::array BSAArgNames = PopulateArgNames<BSAudioSourceAvsArgs>();
@@ -471,10 +518,100 @@ static constexpr auto GetAudioArgMapping() {
     return Result;
 }
 
+static constexpr int GetBSArgPos(std::string_view Name) {
+    for (size_t i = 0; i < BSArgNames.size(); i++)
+        if (BSArgNames[i] == Name)
+            return static_cast<int>(i);
+    return -1;
+}
+
+// Resolves a relative track number the same way the decoders do, returns -1 if there's no such track
+static int GetAbsoluteTrack(const BestTrackList &TrackList, int Track, const char *MediaType) {
+    if (Track >= 0)
+        return (Track < TrackList.GetNumTracks() && TrackList.GetTrackInfo(Track).MediaTypeString == MediaType) ? Track : -1;
+    for (int i = 0; i < TrackList.GetNumTracks(); i++)
+        if (TrackList.GetTrackInfo(i).MediaTypeString == MediaType && ++Track == 0)
+            return i;
+    return -1;
+}
+
+// Indexes the video and audio track from a single pass over the file when neither has an index on disk yet so the sources created
+// afterwards only have to load them. It's only an optimization, anything that goes wrong is reported when the sources are created instead.
+static void IndexBSSourceTracks(const AVSValue &Args) {
+    static constexpr int SourcePos = GetBSArgPos("source");
+    static constexpr int VTrackPos = GetBSArgPos("vtrack");
+    static constexpr int ATrackPos = GetBSArgPos("atrack");
+    static constexpr int ThreadsPos = GetBSArgPos("threads");
+    static constexpr int EnableDrefsPos = GetBSArgPos("enable_drefs");
+    static constexpr int UseAbsolutePathPos = GetBSArgPos("use_absolute_path");
+    static constexpr int CacheModePos = GetBSArgPos("cachemode");
+    static constexpr int CachePathPos = GetBSArgPos("cachepath");
+    static constexpr int StartNumberPos = GetBSArgPos("start_number");
+    static constexpr int AdjustDelayPos = GetBSArgPos("adjustdelay");
+    static constexpr int DrcScalePos = GetBSArgPos("drc_scale");
+    static constexpr int ViewIDPos = GetBSArgPos("viewid");
+    static constexpr int FastIndexPos = GetBSArgPos("fastindex");
+    static constexpr int SparseHashPos = GetBSArgPos("sparsehash");
+    static constexpr int HWDevicePos = GetBSArgPos("hwdevice");
+    static constexpr int ExtraHWFramesPos = GetBSArgPos("extrahwframes");
+
+    int CacheMode = Args[CacheModePos].AsInt(1);
+    // Nothing is written to disk to load later, fast indexing never writes an index and image sequences have no audio
+    if (!Args[SourcePos].Defined() || CacheMode == bcmDisable || Args[FastIndexPos].AsBool(false) || Args[StartNumberPos].Defined())
+        return;
+
+    try {
+        std::filesystem::path Source = CreateProbablyUTF8Path(Args[SourcePos].AsString());
+        std::error_code ec;
+        if (std::filesystem::exists(Source, ec))
+            Source = std::filesystem::absolute(Source);
+
+        std::map<std::string, std::string> Opts;
+        if (Args[EnableDrefsPos].AsBool(false))
+            Opts["enable_drefs"] = "1";
+        if (Args[UseAbsolutePathPos].AsBool(false))
+            Opts["use_absolute_path"] = "1";
+
+        int VideoTrack;
+        int AudioTrack;
+        {
+            BestTrackList TrackList(Source, &Opts);
+            VideoTrack = GetAbsoluteTrack(TrackList, Args[VTrackPos].AsInt(-1), "video");
+            AudioTrack = GetAbsoluteTrack(TrackList, Args[ATrackPos].AsInt(-1), "audio");
+        }
+
+        if (VideoTrack < 0 || AudioTrack < 0)
+            return;
+
+        std::filesystem::path CachePath = CreateProbablyUTF8Path(Args[CachePathPos].AsString(""));
+        bool AbsolutePath = IsAbsolutePathCacheMode(CacheMode);
+        if (std::filesystem::exists(GetCacheFilePath(AbsolutePath, CachePath, Source, VideoTrack), ec) || std::filesystem::exists(GetCacheFilePath(AbsolutePath, CachePath, Source, AudioTrack), ec))
+            return;
+
+        int Threads = Args[ThreadsPos].AsInt(-1);
+        int ViewID = Args[ViewIDPos].AsInt(0);
+        bool SparseHash = Args[SparseHashPos].AsBool(false);
+        int AdjustDelay = Args[AdjustDelayPos].AsInt(-1);
+        double DrcScale = Args[DrcScalePos].AsFloat(0);
+        // The index records the hardware decoding settings so they have to match what BSVideoSource is created with for it to be used
+        std::string HWDevice = Args[HWDevicePos].AsString("");
+        int ExtraHWFrames = Args[ExtraHWFramesPos].AsInt(9);
+
+        IndexTracksTogether(Source, Opts, {
+            { VideoTrack, [&](BSPacketQueue *Packets) { BestVideoSource(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, CacheMode, CachePath, &Opts, nullptr, 1, false, SparseHash, 1, 0, Packets); } },
+            { AudioTrack, [&](BSPacketQueue *Packets) { BestAudioSource(Source, AudioTrack, AdjustDelay, std::max(Threads, 0), CacheMode, CachePath, &Opts, DrcScale, nullptr, 1, 0, Packets); } } });
+    } catch (...) {
+        BSDebugPrint("Indexing the tracks together failed, they will be indexed separately");
+    }
+}
+
 static AVSValue __cdecl CreateBSSource(AVSValue Args, void *UserData, IScriptEnvironment *Env) {
     static constexpr std::array VideoArgMapping = GetVideoArgMapping();
     static constexpr std::array AudioArgMapping = GetAudioArgMapping();
 
+    BSInit();
+    IndexBSSourceTracks(Args);
+
     std::array<AVSValue, VideoArgMapping.size()> BSVArgs;
     for (size_t i = 0; i < VideoArgMapping.size(); i++)
         BSVArgs[i] = Args[VideoArgMapping[i]];
@@ -505,6 +642,18 @@ static AVSValue __cdecl BSSetDebugOutput(AVSValue Args, void *UserData, IScriptE
     return AVSValue();
 }
 
+static AVSValue __cdecl BSSetThreadBudget(AVSValue Args, void *UserData, IScriptEnvironment *Env) {
+    BSInit();
+    SetDecoderThreadBudget(Args[0].AsInt(0));
+    return AVSValue();
+}
+
+static AVSValue __cdecl BSSetCacheBudget(AVSValue Args, void *UserData, IScriptEnvironment *Env) {
+    BSInit();
+    SetFrameCacheBudget(static_cast<size_t>(std::max(Args[0].AsInt(0), 0)) * 1024 * 1024);
+    return AVSValue();
+}
+
 static AVSValue __cdecl BSSetFFmpegLogLevel(AVSValue Args, void *UserData, IScriptEnvironment *Env) {
     BSInit();
     return SetFFmpegLogLevel(Args[0].AsInt(32));
@@ -519,6 +668,8 @@ extern "C" AVS_EXPORT const char *__stdcall AvisynthPluginInit3(IScriptEnvironme
     Env->AddFunction("BSAudioSource", BSAudioSourceAvsArgs, CreateBSAudioSource, nullptr);
     Env->AddFunction("BSSource", BSSourceAvsArgs, CreateBSSource, nullptr);
     Env->AddFunction("BSSetDebugOutput", "[enable]b", BSSetDebugOutput, nullptr);
+    Env->AddFunction("BSSetThreadBudget", "[threads]i", BSSetThreadBudget, nullptr);
+    Env->AddFunction("BSSetCacheBudget", "[size]i", BSSetCacheBudget, nullptr);
     Env->AddFunction("BSSetFFmpegLogLevel", "[level]i", BSSetFFmpegLogLevel, nullptr);
 
     return "Best Source 2";
@@ -0,0 +1,306 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "blockcache.h"
+#include <algorithm>
+#include <cstring>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+#include <libavutil/mem.h>
+}
+
+static constexpr int IOBufferSize = 32 * 1024;
+
+int BSBlockCache::ReadCallback(void *Opaque, uint8_t *Buf, int BufSize) {
+    Reader *R = static_cast<Reader *>(Opaque);
+    return R->Cache->Read(*R, Buf, BufSize);
+}
+
+int64_t BSBlockCache::SeekCallback(void *Opaque, int64_t Offset, int Whence) {
+    Reader *R = static_cast<Reader *>(Opaque);
+    int64_t Size = R->Cache->GetSize();
+    int64_t NewPosition;
+
+    switch (Whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return Size;
+    case SEEK_SET:
+        NewPosition = Offset;
+        break;
+    case SEEK_CUR:
+        NewPosition = R->Position + Offset;
+        break;
+    case SEEK_END:
+        if (Size < 0)
+            return AVERROR(EINVAL);
+        NewPosition = Size + Offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (NewPosition < 0)
+        return AVERROR(EINVAL);
+    R->Position = NewPosition;
+    return NewPosition;
+}
+
+bool BSBlockCache::IsSupported(const std::filesystem::path &SourceFile) {
+    // Demuxers flagged with AVFMT_NOFILE are picked by name alone before anything is opened, the same check avformat_open_input() does
+    std::string Filename = SourceFile.u8string();
+    AVProbeData ProbeData = {};
+    ProbeData.filename = Filename.c_str();
+    return !av_probe_input_format(&ProbeData, 0);
+}
+
+AVIOContext *BSBlockCache::OpenIO(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts) {
+    AVDictionary *Dict = nullptr;
+    for (const auto &Iter : LAVFOpts)
+        av_dict_set(&Dict, Iter.first.c_str(), Iter.second.c_str(), 0);
+
+    AVIOContext *Result = nullptr;
+    if (avio_open2(&Result, SourceFile.u8string().c_str(), AVIO_FLAG_READ, nullptr, &Dict) < 0)
+        Result = nullptr;
+    av_dict_free(&Dict);
+    return Result;
+}
+
+BSBlockCache::BlockData BSBlockCache::FetchBlock(AVIOContext *IO, int64_t Index) {
+    if (avio_seek(IO, Index * BlockSize, SEEK_SET) < 0)
+        return nullptr;
+
+    auto Data = std::make_shared<std::vector<uint8_t>>(BlockSize);
+    int Filled = 0;
+    while (Filled < BlockSize) {
+        int Result = avio_read(IO, Data->data() + Filled, BlockSize - Filled);
+        if (Result == AVERROR_EOF || Result == 0)
+            break;
+        // A partial block can't be told apart from the end of the file later so errors aren't cached
+        if (Result < 0)
+            return nullptr;
+        Filled += Result;
+    }
+
+    Data->resize(Filled);
+    return Data;
+}
+
+void BSBlockCache::InsertBlock(int64_t Index, const BlockData &Data) {
+    int64_t End = Index * BlockSize + static_cast<int64_t>(Data->size());
+    if (Size >= 0 && End > Size)
+        Size = End;
+    if (Data->empty())
+        return;
+
+    RecentlyUsed.push_front(Index);
+    Blocks[Index] = std::make_pair(Data, RecentlyUsed.begin());
+    while (Blocks.size() > MaxBlocks) {
+        Blocks.erase(RecentlyUsed.back());
+        RecentlyUsed.pop_back();
+    }
+}
+
+BSBlockCache::BlockData BSBlockCache::GetBlock(Reader &R, int64_t Index, bool Refresh) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (true) {
+        auto Iter = Blocks.find(Index);
+        if (Iter != Blocks.end() && Refresh && Iter->second.first->size() < static_cast<size_t>(BlockSize)) {
+            RecentlyUsed.erase(Iter->second.second);
+            Blocks.erase(Iter);
+            Iter = Blocks.end();
+        }
+        if (Iter != Blocks.end()) {
+            RecentlyUsed.splice(RecentlyUsed.begin(), RecentlyUsed, Iter->second.second);
+            return Iter->second.first;
+        }
+        // Wait for the block instead of requesting it twice when it's already on its way
+        if (!Pending.count(Index))
+            break;
+        Condition.wait(Lock);
+    }
+
+    Pending.insert(Index);
+    if (!R.IO && !IdleIO.empty()) {
+        R.IO = IdleIO.back();
+        IdleIO.pop_back();
+    }
+    Lock.unlock();
+
+    // Only this reader uses its connection so nothing else has to wait while the block is fetched
+    if (!R.IO)
+        R.IO = OpenIO(Source, LAVFOptions);
+    BlockData Data;
+    if (R.IO)
+        Data = FetchBlock(R.IO, Index);
+
+    Lock.lock();
+    Pending.erase(Index);
+    if (Data)
+        InsertBlock(Index, Data);
+    Condition.notify_all();
+    return Data;
+}
+
+void BSBlockCache::RequestReadAhead(const Reader &R, int64_t Index) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ReadAheadQueue.erase(std::remove_if(ReadAheadQueue.begin(), ReadAheadQueue.end(), [&R](const std::pair<const Reader *, int64_t> &Item) { return Item.first == &R; }), ReadAheadQueue.end());
+    for (int64_t i = Index; i < Index + ReadAheadBlocks; i++) {
+        if (Size >= 0 && i * BlockSize >= Size)
+            break;
+        if (!Blocks.count(i) && !Pending.count(i))
+            ReadAheadQueue.emplace_back(&R, i);
+    }
+
+    if (!ReadAheadQueue.empty()) {
+        if (!ReadAheadThread.joinable())
+            ReadAheadThread = std::thread(&BSBlockCache::ReadAheadLoop, this);
+        Condition.notify_all();
+    }
+}
+
+void BSBlockCache::ReleaseReader(Reader &R) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    ReadAheadQueue.erase(std::remove_if(ReadAheadQueue.begin(), ReadAheadQueue.end(), [&R](const std::pair<const Reader *, int64_t> &Item) { return Item.first == &R; }), ReadAheadQueue.end());
+    if (R.IO)
+        IdleIO.push_back(R.IO);
+    R.IO = nullptr;
+}
+
+void BSBlockCache::ReadAheadLoop() {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    while (true) {
+        Condition.wait(Lock, [this] { return Exit || !ReadAheadQueue.empty(); });
+        if (Exit)
+            return;
+
+        const Reader *Owner = ReadAheadQueue.front().first;
+        int64_t Index = ReadAheadQueue.front().second;
+        ReadAheadQueue.pop_front();
+        if (Blocks.count(Index) || Pending.count(Index))
+            continue;
+
+        Pending.insert(Index);
+        Lock.unlock();
+
+        if (!ReadAheadIO)
+            ReadAheadIO = OpenIO(Source, LAVFOptions);
+        BlockData Data;
+        if (ReadAheadIO)
+            Data = FetchBlock(ReadAheadIO, Index);
+
+        Lock.lock();
+        Pending.erase(Index);
+        if (Data) {
+            InsertBlock(Index, Data);
+        } else {
+            // The rest of what this reader asked for most likely fails too, what other readers asked for is still fetched
+            ReadAheadQueue.erase(std::remove_if(ReadAheadQueue.begin(), ReadAheadQueue.end(), [Owner](const std::pair<const Reader *, int64_t> &Item) { return Item.first == Owner; }), ReadAheadQueue.end());
+        }
+        Condition.notify_all();
+    }
+}
+
+BSBlockCache::BSBlockCache(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, size_t MaxSize) : Source(SourceFile), LAVFOptions(LAVFOpts) {
+    MaxBlocks = std::max<size_t>(MaxSize / BlockSize, 2 * ReadAheadBlocks);
+
+    AVIOContext *IO = OpenIO(Source, LAVFOptions);
+    if (!IO)
+        throw BestSourceException("Couldn't open '" + Source.u8string() + "'");
+
+    Size = avio_size(IO);
+    Seekable = !!(IO->seekable & AVIO_SEEKABLE_NORMAL);
+    // The first decoder to miss a block gets this connection
+    IdleIO.push_back(IO);
+}
+
+BSBlockCache::~BSBlockCache() {
+    {
+        std::lock_guard<std::mutex> Lock(Mutex);
+        Exit = true;
+        Condition.notify_all();
+    }
+    if (ReadAheadThread.joinable())
+        ReadAheadThread.join();
+    for (auto &Iter : IdleIO)
+        avio_closep(&Iter);
+    avio_closep(&ReadAheadIO);
+}
+
+int64_t BSBlockCache::GetSize() const {
+    return Size;
+}
+
+int BSBlockCache::Read(Reader &R, uint8_t *Buf, int BufSize) {
+    int64_t Index = R.Position / BlockSize;
+    bool Sequential = (Index == R.LastBlock + 1);
+    BlockData Data = GetBlock(R, Index);
+    if (!Data)
+        return AVERROR(EIO);
+
+    // The file may have been appended to since the last block was read so look again before reporting the end
+    size_t Offset = static_cast<size_t>(R.Position - Index * BlockSize);
+    if (Offset >= Data->size() && Data->size() < static_cast<size_t>(BlockSize)) {
+        Data = GetBlock(R, Index, true);
+        if (!Data)
+            return AVERROR(EIO);
+    }
+    if (Offset >= Data->size())
+        return AVERROR_EOF;
+
+    if (Sequential && Seekable)
+        RequestReadAhead(R, Index + 1);
+
+    int Count = static_cast<int>(std::min<size_t>(BufSize, Data->size() - Offset));
+    memcpy(Buf, Data->data() + Offset, Count);
+    R.Position += Count;
+    R.LastBlock = Index;
+    return Count;
+}
+
+AVIOContext *BSBlockCache::CreateIOContext() {
+    uint8_t *Buffer = static_cast<uint8_t *>(av_malloc(IOBufferSize));
+    if (!Buffer)
+        return nullptr;
+
+    Reader *R = new Reader();
+    R->Cache = this;
+    AVIOContext *Context = avio_alloc_context(Buffer, IOBufferSize, 0, R, ReadCallback, nullptr, SeekCallback);
+    if (!Context) {
+        av_free(Buffer);
+        delete R;
+        return nullptr;
+    }
+
+    Context->seekable = Seekable ? AVIO_SEEKABLE_NORMAL : 0;
+    return Context;
+}
+
+void BSBlockCache::FreeIOContext(AVIOContext **Context) {
+    if (!*Context)
+        return;
+    Reader *R = static_cast<Reader *>((*Context)->opaque);
+    R->Cache->ReleaseReader(*R);
+    delete R;
+    av_freep(&(*Context)->buffer);
+    avio_context_free(Context);
+}
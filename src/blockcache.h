@@ -0,0 +1,96 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "bsshared.h"
+#include <cstdint>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <deque>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <thread>
+#include <filesystem>
+
+struct AVIOContext;
+
+/* Keeps recently read blocks of the source file in memory for all decoders of one source. Seeking then mostly lands in blocks one of the
+   decoders has already read which avoids a new range request every time with network protocols. Every decoder fetches the blocks it misses
+   over a connection of its own so they don't wait for each other. When a decoder reads on into the next block the following blocks are
+   fetched ahead on a separate thread with another connection. */
+class BSBlockCache {
+private:
+    typedef std::shared_ptr<const std::vector<uint8_t>> BlockData;
+
+    struct Reader {
+        BSBlockCache *Cache;
+        int64_t Position = 0;
+        int64_t LastBlock = -1;
+        AVIOContext *IO = nullptr; // Opened the first time a block isn't cached
+    };
+
+    std::mutex Mutex;
+    std::condition_variable Condition;
+    std::map<int64_t, std::pair<BlockData, std::list<int64_t>::iterator>> Blocks;
+    std::list<int64_t> RecentlyUsed; // Most recently used block first
+    std::set<int64_t> Pending; // Blocks currently being fetched
+    std::deque<std::pair<const Reader *, int64_t>> ReadAheadQueue; // A new request only replaces the blocks queued for the same reader
+    std::vector<AVIOContext *> IdleIO; // Connections of freed readers to reuse
+    size_t MaxBlocks;
+    bool Exit = false;
+
+    std::filesystem::path Source;
+    std::map<std::string, std::string> LAVFOptions;
+    AVIOContext *ReadAheadIO = nullptr; // Only used by the read ahead thread
+    std::atomic<int64_t> Size{ -1 }; // Grows when blocks past the size seen at construction turn up
+    bool Seekable = false;
+    std::thread ReadAheadThread;
+
+    static AVIOContext *OpenIO(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts);
+    static BlockData FetchBlock(AVIOContext *IO, int64_t Index);
+    static int ReadCallback(void *Opaque, uint8_t *Buf, int BufSize);
+    static int64_t SeekCallback(void *Opaque, int64_t Offset, int Whence);
+    void InsertBlock(int64_t Index, const BlockData &Data); // Mutex has to be held, empty blocks past the end aren't kept
+    BlockData GetBlock(Reader &R, int64_t Index, bool Refresh = false); // Refresh fetches a cached partial block again in case the file has grown
+    void RequestReadAhead(const Reader &R, int64_t Index);
+    void ReleaseReader(Reader &R);
+    void ReadAheadLoop();
+    [[nodiscard]] int Read(Reader &R, uint8_t *Buf, int BufSize); // Returns the number of bytes read or an AVERROR, never reads past the end of a block
+public:
+    static constexpr int BlockSize = 512 * 1024;
+    static constexpr int ReadAheadBlocks = 8;
+
+    [[nodiscard]] static bool IsSupported(const std::filesystem::path &SourceFile); // False for inputs such as image sequences that the demuxer opens itself, they can't be read through the cache
+    BSBlockCache(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, size_t MaxSize);
+    ~BSBlockCache();
+    [[nodiscard]] int64_t GetSize() const; // Negative if unknown
+    [[nodiscard]] AVIOContext *CreateIOContext(); // Every decoder needs one of its own, it has to be freed with FreeIOContext() after closing the format context using it
+    static void FreeIOContext(AVIOContext **Context);
+};
+
+#endif
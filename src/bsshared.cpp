@@ -23,6 +23,9 @@
 #include "version.h"
 #include <string>
 #include <atomic>
+#include <mutex>
+#include <algorithm>
+#include <random>
 #include <cassert>
 
 extern "C" {
@@ -35,6 +38,11 @@ extern "C" {
 
 #ifdef _WIN32
 #include <ShlObj.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #endif
 
 BSRational::BSRational(const AVRational &r) {
@@ -46,6 +54,28 @@ double BSRational::ToDouble() const {
     return Num / (double)Den;
 }
 
+void BSHistogram::Add(double Value) {
+    size_t Bucket = 0;
+    for (double Limit = 1; Bucket < NumBuckets - 1 && Value >= Limit; Limit *= 2)
+        Bucket++;
+    Buckets[Bucket]++;
+}
+
+void BSSourceStatistics::AddRequest(const BSRequestTrace &Trace) {
+    Requests++;
+    BytesRead += Trace.BytesRead;
+    if (Trace.CacheHit)
+        return;
+    Seeks += Trace.Seeks;
+    SeekRetries += std::max(Trace.Seeks - 1, 0);
+    LinearFallbacks += Trace.LinearFallback;
+    DecodedFrames += Trace.DecodedFrames;
+    DecodedFramesPerRequest.Add(static_cast<double>(Trace.DecodedFrames));
+    RequestMilliseconds.Add(Trace.Seconds * 1000);
+    if (Trace.Seeks > 0)
+        SeekMilliseconds.Add(Trace.SeekSeconds * 1000);
+}
+
 std::filesystem::path CreateProbablyUTF8Path(const char *Filename) {
     assert(Filename);
     try {
@@ -60,6 +90,63 @@ int SetFFmpegLogLevel(int Level) {
     return av_log_get_level();
 }
 
+static std::mutex DecoderThreadMutex;
+static int DecoderThreadBudget = 0;
+static int DecoderThreadsInUse = 0;
+
+void SetDecoderThreadBudget(int Threads) {
+    std::lock_guard<std::mutex> Lock(DecoderThreadMutex);
+    DecoderThreadBudget = std::max(Threads, 0);
+}
+
+int GetDecoderThreadsInUse() {
+    std::lock_guard<std::mutex> Lock(DecoderThreadMutex);
+    return DecoderThreadsInUse;
+}
+
+int AcquireDecoderThreads(int Wanted) {
+    std::lock_guard<std::mutex> Lock(DecoderThreadMutex);
+    int Threads = std::max(Wanted, 1);
+    if (DecoderThreadBudget > 0)
+        Threads = std::min(Threads, std::max(DecoderThreadBudget - DecoderThreadsInUse, 1));
+    DecoderThreadsInUse += Threads;
+    return Threads;
+}
+
+void ReleaseDecoderThreads(int Threads) {
+    std::lock_guard<std::mutex> Lock(DecoderThreadMutex);
+    DecoderThreadsInUse -= Threads;
+    assert(DecoderThreadsInUse >= 0);
+}
+
+static std::atomic<size_t> FrameCacheBudget(0);
+static std::atomic<size_t> FrameCacheMemoryUsed(0);
+
+void SetFrameCacheBudget(size_t Bytes) {
+    FrameCacheBudget = Bytes;
+}
+
+size_t GetFrameCacheBudget() {
+    return FrameCacheBudget;
+}
+
+size_t GetFrameCacheMemoryUsed() {
+    return FrameCacheMemoryUsed;
+}
+
+void AddFrameCacheMemory(size_t Bytes) {
+    FrameCacheMemoryUsed += Bytes;
+}
+
+void RemoveFrameCacheMemory(size_t Bytes) {
+    FrameCacheMemoryUsed -= Bytes;
+}
+
+bool IsFrameCacheOverBudget() {
+    size_t Budget = FrameCacheBudget;
+    return Budget > 0 && FrameCacheMemoryUsed > Budget;
+}
+
 static std::atomic_bool PrintDebugInfo(false);
 
 void SetBSDebugOutput(bool DebugOutput) {
@@ -129,7 +216,80 @@ file_ptr_t OpenNormalFile(const std::filesystem::path &Filename, bool Write) {
     return F;
 }
 
-file_ptr_t OpenCacheFile(bool AbsolutePath, const std::filesystem::path &CachePath, const std::filesystem::path &Source, int Track, bool Write) {
+BSMappedFile::~BSMappedFile() {
+#ifdef _WIN32
+    UnmapViewOfFile(Data);
+#else
+    munmap(const_cast<uint8_t *>(Data), Size);
+#endif
+}
+
+std::unique_ptr<BSMappedFile> BSMappedFile::Open(const std::filesystem::path &Filename) {
+    std::unique_ptr<BSMappedFile> Result(new BSMappedFile());
+#ifdef _WIN32
+    HANDLE File = CreateFileW(Filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (File == INVALID_HANDLE_VALUE)
+        return nullptr;
+    LARGE_INTEGER FileSize;
+    if (!GetFileSizeEx(File, &FileSize) || FileSize.QuadPart <= 0 || static_cast<uint64_t>(FileSize.QuadPart) > SIZE_MAX) {
+        CloseHandle(File);
+        return nullptr;
+    }
+    // The view keeps both the mapping object and the file open
+    HANDLE Mapping = CreateFileMappingW(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(File);
+    if (!Mapping)
+        return nullptr;
+    void *Ptr = MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(Mapping);
+    if (!Ptr)
+        return nullptr;
+    Result->Size = static_cast<size_t>(FileSize.QuadPart);
+#else
+    int File = open(Filename.c_str(), O_RDONLY);
+    if (File < 0)
+        return nullptr;
+    struct stat FileInfo;
+    if (fstat(File, &FileInfo) || FileInfo.st_size <= 0) {
+        close(File);
+        return nullptr;
+    }
+    void *Ptr = mmap(nullptr, static_cast<size_t>(FileInfo.st_size), PROT_READ, MAP_SHARED, File, 0);
+    close(File);
+    if (Ptr == MAP_FAILED)
+        return nullptr;
+    Result->Size = static_cast<size_t>(FileInfo.st_size);
+#endif
+    Result->Data = reinterpret_cast<const uint8_t *>(Ptr);
+    return Result;
+}
+
+const uint8_t *BSMappedFile::GetData() const {
+    return Data;
+}
+
+size_t BSMappedFile::GetSize() const {
+    return Size;
+}
+
+file_ptr_t OpenUpdateFile(const std::filesystem::path &Filename) {
+#ifdef _WIN32
+    file_ptr_t F(_wfopen(Filename.c_str(), L"r+b"));
+#else
+    file_ptr_t F(fopen(Filename.c_str(), "r+b"));
+#endif
+    return F;
+}
+
+bool SeekFile(file_ptr_t &F, int64_t Offset) {
+#ifdef _WIN32
+    return !_fseeki64(F.get(), Offset, SEEK_SET);
+#else
+    return !fseeko(F.get(), static_cast<off_t>(Offset), SEEK_SET);
+#endif
+}
+
+std::filesystem::path GetCacheFilePath(bool AbsolutePath, const std::filesystem::path &CachePath, const std::filesystem::path &Source, int Track) {
     std::filesystem::path CacheFile;
 
     if (AbsolutePath)
@@ -138,6 +298,25 @@ file_ptr_t OpenCacheFile(bool AbsolutePath, const std::filesystem::path &CachePa
         CacheFile = MangleCachePath(CachePath.empty() ? GetDefaultCacheSubTreePath() : CachePath, Source);
 
     CacheFile += "." + std::to_string(Track) + ".bsindex";
+    return CacheFile;
+}
+
+std::filesystem::path GetTempFilePath(const std::filesystem::path &Filename) {
+    // The process id keeps processes on the same machine apart, the random part other machines sharing the cache path
+    static std::atomic<uint64_t> Counter(0);
+    static const uint32_t Random = std::random_device()();
+#ifdef _WIN32
+    uint64_t ProcessId = GetCurrentProcessId();
+#else
+    uint64_t ProcessId = getpid();
+#endif
+    std::filesystem::path TempFile = Filename;
+    TempFile += "." + std::to_string(ProcessId) + "." + std::to_string(Random) + "." + std::to_string(Counter++) + ".tmp";
+    return TempFile;
+}
+
+file_ptr_t OpenCacheFile(bool AbsolutePath, const std::filesystem::path &CachePath, const std::filesystem::path &Source, int Track, bool Write) {
+    std::filesystem::path CacheFile = GetCacheFilePath(AbsolutePath, CachePath, Source, Track);
     std::error_code ec;
     std::filesystem::create_directories(CacheFile.parent_path(), ec);
     return OpenNormalFile(CacheFile, Write);
@@ -243,4 +422,75 @@ bool ReadBSHeader(file_ptr_t &F, bool Video) {
         ReadCompareInt(F, avutil_version()) &&
         ReadCompareInt(F, avformat_version()) &&
         ReadCompareInt(F, avcodec_version());
-}
\ No newline at end of file
+}
+
+static constexpr int SeekHistoryFormatVersion = 1;
+static std::mutex SeekHistoryMutex;
+
+std::filesystem::path GetSeekHistoryPath(const std::filesystem::path &IndexFile) {
+    std::filesystem::path HistoryFile = IndexFile;
+    HistoryFile += ".seeks";
+    return HistoryFile;
+}
+
+bool ReadSeekHistory(const std::filesystem::path &IndexFile, bool Video, int64_t FileSize, int64_t NumFrames, BSSeekHistory &History) {
+    file_ptr_t F = OpenNormalFile(GetSeekHistoryPath(IndexFile), false);
+    if (!F)
+        return false;
+    if (!ReadBSHeader(F, Video) || !ReadCompareInt(F, SeekHistoryFormatVersion) || !ReadCompareInt64(F, FileSize) || !ReadCompareInt64(F, NumFrames))
+        return false;
+
+    BSSeekHistory Tmp;
+    Tmp.LinearMode = !!ReadInt(F);
+    int64_t Count = ReadInt64(F);
+    if (Count < 0 || Count > NumFrames)
+        return false;
+    for (int64_t i = 0; i < Count; i++) {
+        int64_t N = ReadInt64(F);
+        if (N < 0 || N >= NumFrames)
+            return false;
+        Tmp.BadSeekLocations.insert(N);
+    }
+
+    History = std::move(Tmp);
+    return true;
+}
+
+bool WriteSeekHistory(const std::filesystem::path &IndexFile, bool Video, int64_t FileSize, int64_t NumFrames, const BSSeekHistory &History) {
+    // Other instances may have learned something about the same file in the meantime so merge with the existing history
+    std::lock_guard<std::mutex> Lock(SeekHistoryMutex);
+    BSSeekHistory Merged;
+    ReadSeekHistory(IndexFile, Video, FileSize, NumFrames, Merged);
+    Merged.LinearMode = Merged.LinearMode || History.LinearMode;
+    Merged.BadSeekLocations.insert(History.BadSeekLocations.begin(), History.BadSeekLocations.end());
+
+    std::filesystem::path HistoryFile = GetSeekHistoryPath(IndexFile);
+    std::filesystem::path TempFile = GetTempFilePath(HistoryFile);
+    std::error_code ec;
+
+    {
+        file_ptr_t F = OpenNormalFile(TempFile, true);
+        if (!F)
+            return false;
+        WriteBSHeader(F, Video);
+        WriteInt(F, SeekHistoryFormatVersion);
+        WriteInt64(F, FileSize);
+        WriteInt64(F, NumFrames);
+        WriteInt(F, Merged.LinearMode);
+        WriteInt64(F, static_cast<int64_t>(Merged.BadSeekLocations.size()));
+        for (int64_t N : Merged.BadSeekLocations)
+            WriteInt64(F, N);
+        if (fflush(F.get())) {
+            F.reset();
+            std::filesystem::remove(TempFile, ec);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(TempFile, HistoryFile, ec);
+    if (ec) {
+        std::filesystem::remove(TempFile, ec);
+        return false;
+    }
+    return true;
+}
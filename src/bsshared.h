@@ -23,10 +23,13 @@
 
 #include <memory>
 #include <cstdio>
+#include <cstdint>
 #include <string>
 #include <stdexcept>
 #include <functional>
 #include <filesystem>
+#include <set>
+#include <array>
 
 constexpr size_t HashSize = 8;
 
@@ -55,6 +58,56 @@ enum BestCacheMode {
     bcmAlwaysAbsolutePath,
 };
 
+enum BestDecoderPolicy {
+    bdpLeastRecentlyUsed = 0, /* Replace the least recently used decoder when seeking */
+    bdpShortestDistance, /* Continue from the decoder with the shortest forward distance when it's cheaper than seeking and replace decoders made redundant by the seek */
+};
+
+struct BSCacheStatistics {
+    uint64_t Hits;
+    uint64_t Misses;
+    uint64_t Evictions; /* Frames dropped to stay below the max size */
+    size_t Size; /* Current size in bytes */
+    size_t Frames; /* Number of frames currently held */
+};
+
+/* Bucket 0 counts values below 1, bucket i values from 2^(i-1) up to 2^i and the last bucket everything larger */
+struct BSHistogram {
+    static constexpr size_t NumBuckets = 16;
+    std::array<uint64_t, NumBuckets> Buckets = {};
+    void Add(double Value);
+};
+
+/* Describes what a single frame request did, passed to the trace callback once it's done */
+struct BSRequestTrace {
+    int Track;
+    int64_t Frame; /* The frame number in the track */
+    bool CacheHit; /* No decoding was needed */
+    bool LinearFallback; /* The request gave up on seeking and forced linear mode */
+    int Seeks; /* Seek attempts, everything after the first one is a retry */
+    int64_t DecodedFrames; /* Including the ones skipped without being output by the decoder */
+    int64_t BytesRead; /* From the file by the decoders used */
+    double SeekSeconds; /* Time spent from the first seek attempt until the frame was found */
+    double Seconds; /* Total time for the request */
+};
+
+typedef std::function<void(const BSRequestTrace &Trace)> TraceFunction;
+
+struct BSSourceStatistics {
+    BSCacheStatistics Cache;
+    uint64_t Requests;
+    uint64_t Seeks;
+    uint64_t SeekRetries;
+    uint64_t LinearFallbacks;
+    uint64_t DecodedFrames;
+    int64_t BytesRead;
+    /* Requests that were cache hits are only included in the totals and not the histograms */
+    BSHistogram DecodedFramesPerRequest;
+    BSHistogram RequestMilliseconds;
+    BSHistogram SeekMilliseconds; /* Only requests that seeked */
+    void AddRequest(const BSRequestTrace &Trace);
+};
+
 struct AVRational;
 
 struct BSRational {
@@ -69,13 +122,50 @@ std::filesystem::path CreateProbablyUTF8Path(const char *Filename);
 
 int SetFFmpegLogLevel(int Level);
 
+/* All decoders in the process draw their threads from a shared budget to avoid oversubscription when many sources are open.
+   Decoders opened while the budget is exhausted get a single thread. The thread count of a decoder is fixed when it's opened
+   so closing idle decoders is the only way to return their threads to the budget. 0 means no limit which is the default. */
+void SetDecoderThreadBudget(int Threads);
+[[nodiscard]] int GetDecoderThreadsInUse();
+[[nodiscard]] int AcquireDecoderThreads(int Wanted); /* Returns the number of threads the decoder may use, always at least 1 */
+void ReleaseDecoderThreads(int Threads);
+
+/* All video frame caches in the process together stay below the budget in addition to their own max size. When a frame is inserted while
+   the total is over budget the least recently used frames of all caches are evicted until it's about 3% below the budget, no matter which
+   source they belong to. 0 means no limit which is the default. */
+void SetFrameCacheBudget(size_t Bytes);
+[[nodiscard]] size_t GetFrameCacheBudget();
+[[nodiscard]] size_t GetFrameCacheMemoryUsed();
+void AddFrameCacheMemory(size_t Bytes);
+void RemoveFrameCacheMemory(size_t Bytes);
+[[nodiscard]] bool IsFrameCacheOverBudget();
+
 void SetBSDebugOutput(bool DebugOutput);
 void BSDebugPrint(const std::string_view Message, int64_t RequestedN = -1, int64_t CurrentN = -1);
 
 bool ShouldWriteIndex(int CacheMode, size_t Frames);
 bool IsAbsolutePathCacheMode(int CacheMode);
 
+/* Read-only mapping of a whole file */
+class BSMappedFile {
+private:
+    const uint8_t *Data = nullptr;
+    size_t Size = 0;
+    BSMappedFile() = default;
+public:
+    BSMappedFile(const BSMappedFile &) = delete;
+    BSMappedFile &operator=(const BSMappedFile &) = delete;
+    ~BSMappedFile();
+    [[nodiscard]] static std::unique_ptr<BSMappedFile> Open(const std::filesystem::path &Filename); /* Returns nullptr if the file can't be mapped or is empty */
+    [[nodiscard]] const uint8_t *GetData() const;
+    [[nodiscard]] size_t GetSize() const;
+};
+
 file_ptr_t OpenNormalFile(const std::filesystem::path &Filename, bool Write);
+file_ptr_t OpenUpdateFile(const std::filesystem::path &Filename); /* Opens an existing file for both reading and writing without truncating it */
+bool SeekFile(file_ptr_t &F, int64_t Offset); /* Offset is from the start of the file */
+std::filesystem::path GetCacheFilePath(bool AbsolutePath, const std::filesystem::path &CacheBasePath, const std::filesystem::path &Source, int Track);
+std::filesystem::path GetTempFilePath(const std::filesystem::path &Filename); /* A name next to Filename that no other thread or process writing the same file uses, for writing it and then renaming it into place */
 file_ptr_t OpenCacheFile(bool AbsolutePath, const std::filesystem::path &CacheBasePath, const std::filesystem::path &Source, int Track, bool Write);
 void WriteByte(file_ptr_t &F, uint8_t Value);
 void WriteInt(file_ptr_t &F, int Value);
@@ -94,4 +184,14 @@ bool ReadCompareDouble(file_ptr_t &F, double Value);
 bool ReadCompareString(file_ptr_t &F, const std::string &Value);
 bool ReadBSHeader(file_ptr_t &F, bool Video);
 
+/* Seeking problems discovered while decoding, stored next to the index so later instances don't have to rediscover them.
+   Only valid for the exact same file size and number of frames, writing merges with what other instances have stored. */
+struct BSSeekHistory {
+    std::set<int64_t> BadSeekLocations;
+    bool LinearMode = false;
+};
+
+bool ReadSeekHistory(const std::filesystem::path &IndexFile, bool Video, int64_t FileSize, int64_t NumFrames, BSSeekHistory &History);
+bool WriteSeekHistory(const std::filesystem::path &IndexFile, bool Video, int64_t FileSize, int64_t NumFrames, const BSSeekHistory &History);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,212 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "exportkernels.h"
+#include <cstring>
+
+#if defined(BS_EXPORT_KERNELS_X86) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Palettes are stored as native endian 32 bit BGRA values which means the byte order in memory is BGRA on all supported platforms
+
+static void DepaletteRowC(const uint8_t *Src, const uint8_t *Palette, uint8_t *DstR, uint8_t *DstG, uint8_t *DstB, uint8_t *DstA, int Width) {
+    for (int x = 0; x < Width; x++) {
+        uint8_t V = Src[x];
+        DstR[x] = Palette[V * 4 + 2];
+        DstG[x] = Palette[V * 4 + 1];
+        DstB[x] = Palette[V * 4 + 0];
+        if (DstA)
+            DstA[x] = Palette[V * 4 + 3];
+    }
+}
+
+static void DeinterleaveRow8C(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int) {
+    for (int x = 0; x < Width; x++) {
+        DstU[x] = Src[2 * x];
+        DstV[x] = Src[2 * x + 1];
+    }
+}
+
+static uint16_t ReadLE16(const uint8_t *Src) {
+    return static_cast<uint16_t>(Src[0] | (Src[1] << 8));
+}
+
+static void DeinterleaveRow16C(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift) {
+    uint16_t *U = reinterpret_cast<uint16_t *>(DstU);
+    uint16_t *V = reinterpret_cast<uint16_t *>(DstV);
+    for (int x = 0; x < Width; x++) {
+        U[x] = ReadLE16(Src + 4 * x) >> Shift;
+        V[x] = ReadLE16(Src + 4 * x + 2) >> Shift;
+    }
+}
+
+static void ShiftRow16C(const uint8_t *Src, uint8_t *Dst, int Width, int Shift) {
+    uint16_t *D = reinterpret_cast<uint16_t *>(Dst);
+    for (int x = 0; x < Width; x++)
+        D[x] = ReadLE16(Src + 2 * x) >> Shift;
+}
+
+static void UnpackRGBRowC(const uint8_t *Src, uint8_t *Dst0, uint8_t *Dst1, uint8_t *Dst2, uint8_t *Dst3, const int *Offsets, int Step, int Width) {
+    for (int x = 0; x < Width; x++) {
+        const uint8_t *P = Src + x * Step;
+        Dst0[x] = P[Offsets[0]];
+        Dst1[x] = P[Offsets[1]];
+        Dst2[x] = P[Offsets[2]];
+        if (Dst3)
+            Dst3[x] = P[Offsets[3]];
+    }
+}
+
+static void UnpackYUV422RowC(const uint8_t *Src, uint8_t *DstY, uint8_t *DstU, uint8_t *DstV, const int *Offsets, int Width) {
+    for (int x = 0; x < Width; x++) {
+        const uint8_t *P = Src + 4 * x;
+        DstY[2 * x] = P[Offsets[0]];
+        DstY[2 * x + 1] = P[Offsets[0] + 2];
+        DstU[x] = P[Offsets[1]];
+        DstV[x] = P[Offsets[2]];
+    }
+}
+
+#if defined(__ARM_NEON) && defined(__ARM_LITTLE_ENDIAN)
+
+// NEON is always available on aarch64 so there's no runtime detection involved
+
+static void DepaletteRowNEON(const uint8_t *Src, const uint8_t *Palette, uint8_t *DstR, uint8_t *DstG, uint8_t *DstB, uint8_t *DstA, int Width) {
+    int x = 0;
+    uint32_t Pixels[16];
+    for (; x + 16 <= Width; x += 16) {
+        for (int i = 0; i < 16; i++)
+            memcpy(&Pixels[i], Palette + Src[x + i] * 4, sizeof(uint32_t));
+        uint8x16x4_t BGRA = vld4q_u8(reinterpret_cast<const uint8_t *>(Pixels));
+        vst1q_u8(DstB + x, BGRA.val[0]);
+        vst1q_u8(DstG + x, BGRA.val[1]);
+        vst1q_u8(DstR + x, BGRA.val[2]);
+        if (DstA)
+            vst1q_u8(DstA + x, BGRA.val[3]);
+    }
+    DepaletteRowC(Src + x, Palette, DstR + x, DstG + x, DstB + x, DstA ? DstA + x : nullptr, Width - x);
+}
+
+static void DeinterleaveRow8NEON(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift) {
+    int x = 0;
+    for (; x + 16 <= Width; x += 16) {
+        uint8x16x2_t UV = vld2q_u8(Src + 2 * x);
+        vst1q_u8(DstU + x, UV.val[0]);
+        vst1q_u8(DstV + x, UV.val[1]);
+    }
+    DeinterleaveRow8C(Src + 2 * x, DstU + x, DstV + x, Width - x, Shift);
+}
+
+static void DeinterleaveRow16NEON(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift) {
+    int x = 0;
+    const int16x8_t ShiftV = vdupq_n_s16(static_cast<int16_t>(-Shift));
+    for (; x + 8 <= Width; x += 8) {
+        uint16x8x2_t UV = vld2q_u16(reinterpret_cast<const uint16_t *>(Src + 4 * x));
+        vst1q_u16(reinterpret_cast<uint16_t *>(DstU) + x, vshlq_u16(UV.val[0], ShiftV));
+        vst1q_u16(reinterpret_cast<uint16_t *>(DstV) + x, vshlq_u16(UV.val[1], ShiftV));
+    }
+    DeinterleaveRow16C(Src + 4 * x, DstU + 2 * x, DstV + 2 * x, Width - x, Shift);
+}
+
+static void ShiftRow16NEON(const uint8_t *Src, uint8_t *Dst, int Width, int Shift) {
+    int x = 0;
+    const int16x8_t ShiftV = vdupq_n_s16(static_cast<int16_t>(-Shift));
+    for (; x + 8 <= Width; x += 8)
+        vst1q_u16(reinterpret_cast<uint16_t *>(Dst) + x, vshlq_u16(vld1q_u16(reinterpret_cast<const uint16_t *>(Src) + x), ShiftV));
+    ShiftRow16C(Src + 2 * x, Dst + 2 * x, Width - x, Shift);
+}
+
+static void UnpackRGBRowNEON(const uint8_t *Src, uint8_t *Dst0, uint8_t *Dst1, uint8_t *Dst2, uint8_t *Dst3, const int *Offsets, int Step, int Width) {
+    int x = 0;
+    if (Step == 3) {
+        for (; x + 16 <= Width; x += 16) {
+            uint8x16x3_t P = vld3q_u8(Src + 3 * x);
+            vst1q_u8(Dst0 + x, P.val[Offsets[0]]);
+            vst1q_u8(Dst1 + x, P.val[Offsets[1]]);
+            vst1q_u8(Dst2 + x, P.val[Offsets[2]]);
+        }
+    } else {
+        for (; x + 16 <= Width; x += 16) {
+            uint8x16x4_t P = vld4q_u8(Src + 4 * x);
+            vst1q_u8(Dst0 + x, P.val[Offsets[0]]);
+            vst1q_u8(Dst1 + x, P.val[Offsets[1]]);
+            vst1q_u8(Dst2 + x, P.val[Offsets[2]]);
+            if (Dst3)
+                vst1q_u8(Dst3 + x, P.val[Offsets[3]]);
+        }
+    }
+    UnpackRGBRowC(Src + Step * x, Dst0 + x, Dst1 + x, Dst2 + x, Dst3 ? Dst3 + x : nullptr, Offsets, Step, Width - x);
+}
+
+static void UnpackYUV422RowNEON(const uint8_t *Src, uint8_t *DstY, uint8_t *DstU, uint8_t *DstV, const int *Offsets, int Width) {
+    int x = 0;
+    for (; x + 16 <= Width; x += 16) {
+        uint8x16x4_t P = vld4q_u8(Src + 4 * x);
+        uint8x16x2_t Y = { { P.val[Offsets[0]], P.val[Offsets[0] + 2] } };
+        vst2q_u8(DstY + 2 * x, Y);
+        vst1q_u8(DstU + x, P.val[Offsets[1]]);
+        vst1q_u8(DstV + x, P.val[Offsets[2]]);
+    }
+    UnpackYUV422RowC(Src + 4 * x, DstY + 2 * x, DstU + x, DstV + x, Offsets, Width - x);
+}
+
+#endif
+
+#ifdef BS_EXPORT_KERNELS_X86
+
+static bool HasAVX2() {
+#ifdef _MSC_VER
+    int Regs[4];
+    __cpuid(Regs, 0);
+    if (Regs[0] < 7)
+        return false;
+    __cpuid(Regs, 1);
+    // Both the instructions and OS support for saving the ymm registers are needed
+    if (!(Regs[2] & (1 << 27)) || !(Regs[2] & (1 << 28)) || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(Regs, 7, 0);
+    return !!(Regs[1] & (1 << 5));
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+#endif
+
+static BSExportKernels SelectExportKernels() {
+    BSExportKernels Result = { DepaletteRowC, DeinterleaveRow8C, DeinterleaveRow16C, ShiftRow16C, UnpackRGBRowC, UnpackYUV422RowC };
+#if defined(BS_EXPORT_KERNELS_X86)
+    if (HasAVX2())
+        Result = { DepaletteRowAVX2, DeinterleaveRow8AVX2, DeinterleaveRow16AVX2, ShiftRow16AVX2, UnpackRGBRowAVX2, UnpackYUV422RowAVX2 };
+#elif defined(__ARM_NEON) && defined(__ARM_LITTLE_ENDIAN)
+    Result = { DepaletteRowNEON, DeinterleaveRow8NEON, DeinterleaveRow16NEON, ShiftRow16NEON, UnpackRGBRowNEON, UnpackYUV422RowNEON };
+#endif
+    return Result;
+}
+
+const BSExportKernels &GetExportKernels() {
+    static const BSExportKernels Kernels = SelectExportKernels();
+    return Kernels;
+}
@@ -0,0 +1,55 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef EXPORTKERNELS_H
+#define EXPORTKERNELS_H
+
+#include <cstdint>
+
+// Row kernels used when exporting frames, the fastest implementation supported by the CPU is selected at runtime
+
+typedef void (*DepaletteRowFunc)(const uint8_t *Src, const uint8_t *Palette, uint8_t *DstR, uint8_t *DstG, uint8_t *DstB, uint8_t *DstA, int Width); // DstA may be null
+typedef void (*DeinterleaveRowFunc)(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift); // Width is in sample pairs
+typedef void (*ShiftRowFunc)(const uint8_t *Src, uint8_t *Dst, int Width, int Shift);
+typedef void (*UnpackRGBRowFunc)(const uint8_t *Src, uint8_t *Dst0, uint8_t *Dst1, uint8_t *Dst2, uint8_t *Dst3, const int *Offsets, int Step, int Width); // Step is 3 or 4 bytes per pixel and Offsets the byte of each destination's component within a pixel, Dst3 may be null
+typedef void (*UnpackYUV422RowFunc)(const uint8_t *Src, uint8_t *DstY, uint8_t *DstU, uint8_t *DstV, const int *Offsets, int Width); // Width is in pixel pairs of 4 bytes, Offsets are the bytes of the first Y, U and V in a pair and the second Y follows 2 bytes after the first
+
+struct BSExportKernels {
+    DepaletteRowFunc DepaletteRow;
+    DeinterleaveRowFunc DeinterleaveRow8; // Shift is ignored
+    DeinterleaveRowFunc DeinterleaveRow16; // Little endian 16 bit samples are shifted right by Shift
+    ShiftRowFunc ShiftRow16;
+    UnpackRGBRowFunc UnpackRGBRow; // Packed 8 bit RGB such as RGB24 and BGRA
+    UnpackYUV422RowFunc UnpackYUV422Row; // Packed 8 bit 4:2:2 such as YUY2 and UYVY
+};
+
+const BSExportKernels &GetExportKernels();
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BS_EXPORT_KERNELS_X86
+void DepaletteRowAVX2(const uint8_t *Src, const uint8_t *Palette, uint8_t *DstR, uint8_t *DstG, uint8_t *DstB, uint8_t *DstA, int Width);
+void DeinterleaveRow8AVX2(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift);
+void DeinterleaveRow16AVX2(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift);
+void ShiftRow16AVX2(const uint8_t *Src, uint8_t *Dst, int Width, int Shift);
+void UnpackRGBRowAVX2(const uint8_t *Src, uint8_t *Dst0, uint8_t *Dst1, uint8_t *Dst2, uint8_t *Dst3, const int *Offsets, int Step, int Width);
+void UnpackYUV422RowAVX2(const uint8_t *Src, uint8_t *DstY, uint8_t *DstU, uint8_t *DstV, const int *Offsets, int Width);
+#endif
+
+#endif
@@ -0,0 +1,179 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+// Needs to be compiled with AVX2 enabled and may only be called after checking for CPU support
+
+#include "exportkernels.h"
+#include <immintrin.h>
+
+void DepaletteRowAVX2(const uint8_t *Src, const uint8_t *Palette, uint8_t *DstR, uint8_t *DstG, uint8_t *DstB, uint8_t *DstA, int Width) {
+    // Groups the bytes of 4 BGRA pixels by component in each lane and then pairs up the same component from both lanes
+    const __m256i Shuffle = _mm256_setr_epi8(0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15, 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i Permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int x = 0;
+    for (; x + 8 <= Width; x += 8) {
+        __m256i Index = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(Src + x)));
+        __m256i BGRA = _mm256_i32gather_epi32(reinterpret_cast<const int *>(Palette), Index, 4);
+        __m256i Planar = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(BGRA, Shuffle), Permute);
+        __m128i BG = _mm256_castsi256_si128(Planar);
+        __m128i RA = _mm256_extracti128_si256(Planar, 1);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(DstB + x), BG);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(DstG + x), _mm_unpackhi_epi64(BG, BG));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(DstR + x), RA);
+        if (DstA)
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(DstA + x), _mm_unpackhi_epi64(RA, RA));
+    }
+
+    for (; x < Width; x++) {
+        uint8_t V = Src[x];
+        DstR[x] = Palette[V * 4 + 2];
+        DstG[x] = Palette[V * 4 + 1];
+        DstB[x] = Palette[V * 4 + 0];
+        if (DstA)
+            DstA[x] = Palette[V * 4 + 3];
+    }
+}
+
+// Splits two registers of interleaved samples into one register of each where Shuffle separates the samples within each 128 bit lane
+static inline void Deinterleave(__m256i A, __m256i B, __m256i Shuffle, __m256i &U, __m256i &V) {
+    A = _mm256_shuffle_epi8(A, Shuffle);
+    B = _mm256_shuffle_epi8(B, Shuffle);
+    U = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(A, B), _MM_SHUFFLE(3, 1, 2, 0));
+    V = _mm256_permute4x64_epi64(_mm256_unpackhi_epi64(A, B), _MM_SHUFFLE(3, 1, 2, 0));
+}
+
+void DeinterleaveRow8AVX2(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int) {
+    const __m256i Shuffle = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15, 0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+
+    int x = 0;
+    for (; x + 32 <= Width; x += 32) {
+        __m256i U, V;
+        Deinterleave(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(Src + 2 * x)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(Src + 2 * x + 32)), Shuffle, U, V);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(DstU + x), U);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(DstV + x), V);
+    }
+
+    for (; x < Width; x++) {
+        DstU[x] = Src[2 * x];
+        DstV[x] = Src[2 * x + 1];
+    }
+}
+
+void DeinterleaveRow16AVX2(const uint8_t *Src, uint8_t *DstU, uint8_t *DstV, int Width, int Shift) {
+    const __m256i Shuffle = _mm256_setr_epi8(0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15, 0, 1, 4, 5, 8, 9, 12, 13, 2, 3, 6, 7, 10, 11, 14, 15);
+    const __m128i ShiftV = _mm_cvtsi32_si128(Shift);
+    const uint16_t *S = reinterpret_cast<const uint16_t *>(Src);
+    uint16_t *U16 = reinterpret_cast<uint16_t *>(DstU);
+    uint16_t *V16 = reinterpret_cast<uint16_t *>(DstV);
+
+    int x = 0;
+    for (; x + 16 <= Width; x += 16) {
+        __m256i U, V;
+        Deinterleave(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(S + 2 * x)), _mm256_loadu_si256(reinterpret_cast<const __m256i *>(S + 2 * x + 16)), Shuffle, U, V);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(U16 + x), _mm256_srl_epi16(U, ShiftV));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(V16 + x), _mm256_srl_epi16(V, ShiftV));
+    }
+
+    for (; x < Width; x++) {
+        U16[x] = S[2 * x] >> Shift;
+        V16[x] = S[2 * x + 1] >> Shift;
+    }
+}
+
+void ShiftRow16AVX2(const uint8_t *Src, uint8_t *Dst, int Width, int Shift) {
+    const __m128i ShiftV = _mm_cvtsi32_si128(Shift);
+    const uint16_t *S = reinterpret_cast<const uint16_t *>(Src);
+    uint16_t *D = reinterpret_cast<uint16_t *>(Dst);
+
+    int x = 0;
+    for (; x + 16 <= Width; x += 16)
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(D + x), _mm256_srl_epi16(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(S + x)), ShiftV));
+
+    for (; x < Width; x++)
+        D[x] = S[x] >> Shift;
+}
+
+void UnpackRGBRowAVX2(const uint8_t *Src, uint8_t *Dst0, uint8_t *Dst1, uint8_t *Dst2, uint8_t *Dst3, const int *Offsets, int Step, int Width) {
+    // Each lane holds 4 pixels whose components are grouped the same way as in DepaletteRowAVX2()
+    alignas(32) int8_t ShuffleBytes[32];
+    for (int Lane = 0; Lane < 2; Lane++)
+        for (int c = 0; c < 4; c++)
+            for (int i = 0; i < 4; i++)
+                ShuffleBytes[Lane * 16 + c * 4 + i] = (c < 3 || Dst3) ? static_cast<int8_t>(i * Step + Offsets[c]) : -1;
+    const __m256i Shuffle = _mm256_load_si256(reinterpret_cast<const __m256i *>(ShuffleBytes));
+    const __m256i Permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int x = 0;
+    // The second lane reads a full 16 bytes starting at the fifth pixel
+    for (; Step * (x + 4) + 16 <= Step * Width; x += 8) {
+        __m128i Lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Src + Step * x));
+        __m128i Hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(Src + Step * (x + 4)));
+        __m256i Planar = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(_mm256_inserti128_si256(_mm256_castsi128_si256(Lo), Hi, 1), Shuffle), Permute);
+        __m128i C01 = _mm256_castsi256_si128(Planar);
+        __m128i C23 = _mm256_extracti128_si256(Planar, 1);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(Dst0 + x), C01);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(Dst1 + x), _mm_unpackhi_epi64(C01, C01));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(Dst2 + x), C23);
+        if (Dst3)
+            _mm_storel_epi64(reinterpret_cast<__m128i *>(Dst3 + x), _mm_unpackhi_epi64(C23, C23));
+    }
+
+    for (; x < Width; x++) {
+        const uint8_t *P = Src + x * Step;
+        Dst0[x] = P[Offsets[0]];
+        Dst1[x] = P[Offsets[1]];
+        Dst2[x] = P[Offsets[2]];
+        if (Dst3)
+            Dst3[x] = P[Offsets[3]];
+    }
+}
+
+void UnpackYUV422RowAVX2(const uint8_t *Src, uint8_t *DstY, uint8_t *DstU, uint8_t *DstV, const int *Offsets, int Width) {
+    // Each lane holds 4 pairs that are shuffled into 8 Y followed by 4 U and 4 V
+    alignas(32) int8_t ShuffleBytes[32];
+    for (int Lane = 0; Lane < 2; Lane++) {
+        for (int i = 0; i < 4; i++) {
+            ShuffleBytes[Lane * 16 + 2 * i] = static_cast<int8_t>(4 * i + Offsets[0]);
+            ShuffleBytes[Lane * 16 + 2 * i + 1] = static_cast<int8_t>(4 * i + Offsets[0] + 2);
+            ShuffleBytes[Lane * 16 + 8 + i] = static_cast<int8_t>(4 * i + Offsets[1]);
+            ShuffleBytes[Lane * 16 + 12 + i] = static_cast<int8_t>(4 * i + Offsets[2]);
+        }
+    }
+    const __m256i Shuffle = _mm256_load_si256(reinterpret_cast<const __m256i *>(ShuffleBytes));
+
+    int x = 0;
+    for (; x + 8 <= Width; x += 8) {
+        __m256i P = _mm256_shuffle_epi8(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(Src + 4 * x)), Shuffle);
+        P = _mm256_permute4x64_epi64(P, _MM_SHUFFLE(3, 1, 2, 0));
+        __m128i UV = _mm_shuffle_epi32(_mm256_extracti128_si256(P, 1), _MM_SHUFFLE(3, 1, 2, 0));
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(DstY + 2 * x), _mm256_castsi256_si128(P));
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(DstU + x), UV);
+        _mm_storel_epi64(reinterpret_cast<__m128i *>(DstV + x), _mm_unpackhi_epi64(UV, UV));
+    }
+
+    for (; x < Width; x++) {
+        const uint8_t *P = Src + 4 * x;
+        DstY[2 * x] = P[Offsets[0]];
+        DstY[2 * x + 1] = P[Offsets[0] + 2];
+        DstU[x] = P[Offsets[1]];
+        DstV[x] = P[Offsets[2]];
+    }
+}
@@ -0,0 +1,174 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "framepool.h"
+#include <algorithm>
+#include <climits>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+#include <libavutil/mem.h>
+}
+
+static constexpr int StrideAlign = 64; // Enough for AVX-512, the largest alignment any FFmpeg build asks for
+static constexpr int BufferPadding = 16 + StrideAlign - 1; // Same padding as the default allocator
+
+BSFramePool::~BSFramePool() {
+    // Buffers still referenced by frames stay valid, the pools are freed once the last one is returned
+    for (auto &Iter : Pools)
+        av_buffer_pool_uninit(&Iter.second.Pool);
+}
+
+AVBufferRef *BSFramePool::GetBuffer(size_t Size) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto Iter = Pools.find(Size);
+    if (Iter == Pools.end()) {
+        if (Pools.size() >= MaxSizes) {
+            auto Oldest = std::min_element(Pools.begin(), Pools.end(), [](const std::pair<const size_t, SizePool> &A, const std::pair<const size_t, SizePool> &B) { return A.second.LastUse < B.second.LastUse; });
+            av_buffer_pool_uninit(&Oldest->second.Pool);
+            Pools.erase(Oldest);
+        }
+
+        AVBufferPool *Pool = av_buffer_pool_init(Size, av_buffer_allocz);
+        if (!Pool)
+            return nullptr;
+        Iter = Pools.insert({ Size, { Pool, 0 } }).first;
+    }
+
+    Iter->second.LastUse = UseCounter++;
+    return av_buffer_pool_get(Iter->second.Pool);
+}
+
+bool BSFramePool::AllocateFrame(AVFrame *Frame, int Format, int Width, int Height, const int *LinesizeAlign) {
+    AVPixelFormat PixFmt = static_cast<AVPixelFormat>(Format);
+    const AVPixFmtDescriptor *Desc = av_pix_fmt_desc_get(PixFmt);
+    if (!Desc || (Desc->flags & (AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_PAL)) || Width <= 0 || Height <= 0)
+        return false;
+
+    // Widen until every plane is aligned instead of aligning the linesizes one by one, decoders may depend on the ratios between them
+    int Linesize[4];
+    int Unaligned;
+    int W = Width;
+    do {
+        if (av_image_fill_linesizes(Linesize, PixFmt, W) < 0)
+            return false;
+        W += W & ~(W - 1);
+
+        Unaligned = 0;
+        for (int i = 0; i < 4; i++)
+            Unaligned |= Linesize[i] % LinesizeAlign[i];
+    } while (Unaligned);
+
+    ptrdiff_t PlaneLinesize[4];
+    for (int i = 0; i < 4; i++)
+        PlaneLinesize[i] = Linesize[i];
+
+    size_t PlaneSize[4];
+    if (av_image_fill_plane_sizes(PlaneSize, PixFmt, Height, PlaneLinesize) < 0)
+        return false;
+
+    for (int i = 0; i < 4 && PlaneSize[i]; i++) {
+        if (PlaneSize[i] > INT_MAX - BufferPadding)
+            return false;
+        Frame->buf[i] = GetBuffer(PlaneSize[i] + BufferPadding);
+        if (!Frame->buf[i]) {
+            for (int j = 0; j < i; j++)
+                av_buffer_unref(&Frame->buf[j]);
+            return false;
+        }
+        Frame->data[i] = Frame->buf[i]->data;
+        Frame->linesize[i] = Linesize[i];
+    }
+
+    Frame->format = Format;
+    Frame->width = Width;
+    Frame->height = Height;
+    return true;
+}
+
+int BSFramePool::GetBuffer2(AVCodecContext *Context, AVFrame *Frame, int Flags) {
+    BSFramePool *Pool = static_cast<BSFramePool *>(Context->opaque);
+    if (!Pool || !(Context->codec->capabilities & AV_CODEC_CAP_DR1) || Context->hw_frames_ctx)
+        return avcodec_default_get_buffer2(Context, Frame, Flags);
+
+    int Width = Frame->width;
+    int Height = Frame->height;
+    int LinesizeAlign[AV_NUM_DATA_POINTERS];
+    avcodec_align_dimensions2(Context, &Width, &Height, LinesizeAlign);
+    for (int i = 0; i < 4; i++)
+        LinesizeAlign[i] = std::max(LinesizeAlign[i], 1);
+
+    // The frame keeps the dimensions the decoder asked for, only the buffers are made larger
+    int FrameWidth = Frame->width;
+    int FrameHeight = Frame->height;
+    if (!Pool->AllocateFrame(Frame, Frame->format, Width, Height, LinesizeAlign))
+        return avcodec_default_get_buffer2(Context, Frame, Flags);
+    Frame->width = FrameWidth;
+    Frame->height = FrameHeight;
+
+    for (int i = 4; i < AV_NUM_DATA_POINTERS; i++) {
+        Frame->data[i] = nullptr;
+        Frame->linesize[i] = 0;
+    }
+    Frame->extended_data = Frame->data;
+    return 0;
+}
+
+bool BSFramePool::AllocateFrame(AVFrame *Frame, int Format, int Width, int Height) {
+    const int LinesizeAlign[4] = { StrideAlign, StrideAlign, StrideAlign, StrideAlign };
+    if (!AllocateFrame(Frame, Format, Width, Height, LinesizeAlign))
+        return false;
+    Frame->extended_data = Frame->data;
+    return true;
+}
+
+void BSFramePool::Attach(AVCodecContext *Context) {
+    Context->opaque = this;
+    Context->get_buffer2 = GetBuffer2;
+}
+
+int BSFramePool::TransferData(BSFramePool *Pool, AVFrame *Dst, const AVFrame *Src) {
+    if (Pool && Src->hw_frames_ctx) {
+        // Mirrors what av_hwframe_transfer_data() does when it allocates the destination itself
+        AVPixelFormat *Formats = nullptr;
+        if (av_hwframe_transfer_get_formats(Src->hw_frames_ctx, AV_HWFRAME_TRANSFER_DIRECTION_FROM, &Formats, 0) >= 0) {
+            const AVHWFramesContext *FramesContext = reinterpret_cast<const AVHWFramesContext *>(Src->hw_frames_ctx->data);
+            bool Allocated = Pool->AllocateFrame(Dst, Formats[0], FramesContext->width, FramesContext->height);
+            av_freep(&Formats);
+
+            if (Allocated) {
+                int Ret = av_hwframe_transfer_data(Dst, Src, 0);
+                if (Ret >= 0) {
+                    Dst->width = Src->width;
+                    Dst->height = Src->height;
+                    return Ret;
+                }
+                av_frame_unref(Dst);
+            }
+        }
+    }
+
+    return av_hwframe_transfer_data(Dst, Src, 0);
+}
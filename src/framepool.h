@@ -0,0 +1,64 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <cstdint>
+#include <cstddef>
+#include <map>
+#include <mutex>
+
+struct AVBufferPool;
+struct AVBufferRef;
+struct AVCodecContext;
+struct AVFrame;
+
+/* Frame buffers shared by all decoders of one source. Every decoder normally has pools of its own which are thrown away together with the
+   decoder while the frames still referencing them are freed whenever they leave the cache. Here released buffers are kept for the next
+   frame of the same size no matter which decoder asks so large frames don't have to be mapped and faulted in again after every seek. */
+class BSFramePool {
+private:
+    struct SizePool {
+        AVBufferPool *Pool;
+        uint64_t LastUse;
+    };
+
+    std::mutex Mutex;
+    std::map<size_t, SizePool> Pools;
+    uint64_t UseCounter = 0;
+
+    [[nodiscard]] AVBufferRef *GetBuffer(size_t Size);
+    [[nodiscard]] bool AllocateFrame(AVFrame *Frame, int Format, int Width, int Height, const int *LinesizeAlign); // Only sets the format, dimensions and plane pointers
+    static int GetBuffer2(AVCodecContext *Context, AVFrame *Frame, int Flags);
+public:
+    static constexpr size_t MaxSizes = 16; // Pools of the least recently used sizes are released after this, only matters for streams that change resolution a lot
+
+    BSFramePool() = default;
+    BSFramePool(const BSFramePool &) = delete;
+    BSFramePool &operator=(const BSFramePool &) = delete;
+    ~BSFramePool();
+    void Attach(AVCodecContext *Context); // Has to be called before the codec is opened, software decoding without direct rendering support uses the default allocator
+    [[nodiscard]] bool AllocateFrame(AVFrame *Frame, int Format, int Width, int Height); // Gives an empty frame buffers from the pool, returns false if the format isn't supported
+    static int TransferData(BSFramePool *Pool, AVFrame *Dst, const AVFrame *Src); // Same as av_hwframe_transfer_data() but Dst gets buffers from the pool, Pool may be nullptr
+};
+
+#endif
@@ -0,0 +1,449 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#include "streamprobe.h"
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <cstring>
+#include <chrono>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+}
+
+static constexpr int StreamProbeFormatVersion = 2;
+
+struct StreamProbe {
+    struct StreamInfo {
+        AVRational TimeBase;
+        int64_t StartTime;
+        int64_t Duration;
+        int64_t NumFrames;
+        int Disposition;
+        AVRational SAR;
+        AVRational AvgFrameRate;
+        AVRational RFrameRate;
+        AVCodecParameters *CodecPar = nullptr;
+    };
+
+    int64_t FileSize = -1;
+    int64_t ModificationTime = -1;
+    std::string FormatName;
+    int64_t StartTime = AV_NOPTS_VALUE;
+    int64_t Duration = AV_NOPTS_VALUE;
+    int64_t BitRate = 0;
+    std::vector<StreamInfo> Streams;
+    std::filesystem::path StoredPath; // The probe file this has been read from or written to
+
+    StreamProbe() = default;
+    StreamProbe(const StreamProbe &) = delete;
+    StreamProbe &operator=(const StreamProbe &) = delete;
+    ~StreamProbe();
+};
+
+StreamProbe::~StreamProbe() {
+    for (auto &Iter : Streams)
+        avcodec_parameters_free(&Iter.CodecPar);
+}
+
+static std::mutex ProbeMutex;
+static std::map<std::string, std::shared_ptr<StreamProbe>> Probes;
+
+static std::string GetProbeKey(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts) {
+    std::string Key = SourceFile.u8string();
+    for (const auto &Iter : LAVFOpts) {
+        Key += '\0';
+        Key += Iter.first;
+        Key += '\0';
+        Key += Iter.second;
+    }
+    return Key;
+}
+
+// The size alone doesn't tell a file apart from one rewritten with different content, -1 for network sources and such that have no time
+static int64_t GetModificationTime(const std::filesystem::path &SourceFile) {
+    std::error_code ec;
+    auto Time = std::filesystem::last_write_time(SourceFile, ec);
+    if (ec)
+        return -1;
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(Time.time_since_epoch()).count();
+}
+
+static std::shared_ptr<StreamProbe> GetProbe(const std::string &Key) {
+    std::lock_guard<std::mutex> Lock(ProbeMutex);
+    auto Iter = Probes.find(Key);
+    if (Iter == Probes.end())
+        return nullptr;
+    return Iter->second;
+}
+
+static bool ProbeMatches(const StreamProbe &Probe, const AVFormatContext *FormatContext, int64_t FileSize, int64_t ModificationTime) {
+    if (Probe.FileSize != FileSize || Probe.ModificationTime != ModificationTime || Probe.FormatName != FormatContext->iformat->name || Probe.Streams.size() != FormatContext->nb_streams)
+        return false;
+
+    for (unsigned i = 0; i < FormatContext->nb_streams; i++) {
+        const AVStream *Stream = FormatContext->streams[i];
+        const StreamProbe::StreamInfo &Info = Probe.Streams[i];
+        if (Stream->codecpar->codec_type != Info.CodecPar->codec_type || Stream->codecpar->codec_id != Info.CodecPar->codec_id || av_cmp_q(Stream->time_base, Info.TimeBase))
+            return false;
+    }
+
+    return true;
+}
+
+static std::shared_ptr<StreamProbe> CreateProbe(const AVFormatContext *FormatContext, int64_t FileSize, int64_t ModificationTime) {
+    auto Probe = std::make_shared<StreamProbe>();
+    Probe->FileSize = FileSize;
+    Probe->ModificationTime = ModificationTime;
+    Probe->FormatName = FormatContext->iformat->name;
+    Probe->StartTime = FormatContext->start_time;
+    Probe->Duration = FormatContext->duration;
+    Probe->BitRate = FormatContext->bit_rate;
+
+    for (unsigned i = 0; i < FormatContext->nb_streams; i++) {
+        const AVStream *Stream = FormatContext->streams[i];
+        StreamProbe::StreamInfo Info = { Stream->time_base, Stream->start_time, Stream->duration, Stream->nb_frames, Stream->disposition, Stream->sample_aspect_ratio, Stream->avg_frame_rate, Stream->r_frame_rate };
+        Probe->Streams.push_back(Info);
+        Probe->Streams.back().CodecPar = avcodec_parameters_alloc();
+        if (!Probe->Streams.back().CodecPar || avcodec_parameters_copy(Probe->Streams.back().CodecPar, Stream->codecpar) < 0)
+            return nullptr;
+    }
+
+    return Probe;
+}
+
+int FindStreamInfo(AVFormatContext *FormatContext, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts) {
+    std::string Key = GetProbeKey(SourceFile, LAVFOpts);
+    int64_t FileSize = FormatContext->pb ? avio_size(FormatContext->pb) : -1;
+
+    // Without a known size there's no way to tell if it's still the same file
+    if (FileSize <= 0)
+        return avformat_find_stream_info(FormatContext, nullptr);
+
+    int64_t ModificationTime = GetModificationTime(SourceFile);
+    std::shared_ptr<StreamProbe> Probe = GetProbe(Key);
+    if (Probe && !(FormatContext->ctx_flags & AVFMTCTX_NOHEADER) && ProbeMatches(*Probe, FormatContext, FileSize, ModificationTime)) {
+        bool Success = true;
+        for (unsigned i = 0; i < FormatContext->nb_streams; i++) {
+            AVStream *Stream = FormatContext->streams[i];
+            const StreamProbe::StreamInfo &Info = Probe->Streams[i];
+            Success = Success && (avcodec_parameters_copy(Stream->codecpar, Info.CodecPar) >= 0);
+            Stream->start_time = Info.StartTime;
+            Stream->duration = Info.Duration;
+            Stream->nb_frames = Info.NumFrames;
+            Stream->disposition = Info.Disposition;
+            Stream->sample_aspect_ratio = Info.SAR;
+            Stream->avg_frame_rate = Info.AvgFrameRate;
+            Stream->r_frame_rate = Info.RFrameRate;
+        }
+        FormatContext->start_time = Probe->StartTime;
+        FormatContext->duration = Probe->Duration;
+        FormatContext->bit_rate = Probe->BitRate;
+        if (Success)
+            return 0;
+        BSDebugPrint("Failed to apply the remembered stream information, probing again");
+    }
+
+    int Result = avformat_find_stream_info(FormatContext, nullptr);
+    if (Result >= 0) {
+        Probe = CreateProbe(FormatContext, FileSize, ModificationTime);
+        if (Probe) {
+            std::lock_guard<std::mutex> Lock(ProbeMutex);
+            Probes[Key] = std::move(Probe);
+        }
+    }
+    return Result;
+}
+
+std::filesystem::path GetStreamProbePath(bool AbsolutePath, const std::filesystem::path &CachePath, const std::filesystem::path &Source) {
+    // The probe covers all tracks so it simply replaces the ".<track>.bsindex" suffix of the index file names
+    std::filesystem::path ProbeFile = GetCacheFilePath(AbsolutePath, CachePath, Source, 0);
+    ProbeFile.replace_extension();
+    ProbeFile.replace_extension(".bsprobe");
+    return ProbeFile;
+}
+
+static void WriteRational(file_ptr_t &F, const AVRational &Value) {
+    WriteInt(F, Value.num);
+    WriteInt(F, Value.den);
+}
+
+static AVRational ReadRational(file_ptr_t &F) {
+    AVRational Value;
+    Value.num = ReadInt(F);
+    Value.den = ReadInt(F);
+    return Value;
+}
+
+// Custom channel orders can't be stored, everything else in the codec parameters is plain values
+static bool CanWriteCodecParameters(const AVCodecParameters *Par) {
+    return Par->ch_layout.order != AV_CHANNEL_ORDER_CUSTOM;
+}
+
+static void WriteCodecParameters(file_ptr_t &F, const AVCodecParameters *Par) {
+    WriteInt(F, Par->codec_type);
+    WriteInt(F, Par->codec_id);
+    WriteInt(F, static_cast<int>(Par->codec_tag));
+    WriteString(F, std::string(reinterpret_cast<const char *>(Par->extradata), Par->extradata ? Par->extradata_size : 0));
+    WriteInt(F, Par->format);
+    WriteInt64(F, Par->bit_rate);
+    WriteInt(F, Par->bits_per_coded_sample);
+    WriteInt(F, Par->bits_per_raw_sample);
+    WriteInt(F, Par->profile);
+    WriteInt(F, Par->level);
+    WriteInt(F, Par->width);
+    WriteInt(F, Par->height);
+    WriteRational(F, Par->sample_aspect_ratio);
+    WriteRational(F, Par->framerate);
+    WriteInt(F, Par->field_order);
+    WriteInt(F, Par->color_range);
+    WriteInt(F, Par->color_primaries);
+    WriteInt(F, Par->color_trc);
+    WriteInt(F, Par->color_space);
+    WriteInt(F, Par->chroma_location);
+    WriteInt(F, Par->video_delay);
+    WriteInt(F, Par->ch_layout.order);
+    WriteInt(F, Par->ch_layout.nb_channels);
+    WriteInt64(F, Par->ch_layout.order == AV_CHANNEL_ORDER_UNSPEC ? 0 : static_cast<int64_t>(Par->ch_layout.u.mask));
+    WriteInt(F, Par->sample_rate);
+    WriteInt(F, Par->block_align);
+    WriteInt(F, Par->frame_size);
+    WriteInt(F, Par->initial_padding);
+    WriteInt(F, Par->trailing_padding);
+    WriteInt(F, Par->seek_preroll);
+    WriteInt(F, Par->nb_coded_side_data);
+    for (int i = 0; i < Par->nb_coded_side_data; i++) {
+        WriteInt(F, Par->coded_side_data[i].type);
+        WriteString(F, std::string(reinterpret_cast<const char *>(Par->coded_side_data[i].data), Par->coded_side_data[i].size));
+    }
+}
+
+static bool ReadCodecParameters(file_ptr_t &F, AVCodecParameters *Par) {
+    Par->codec_type = static_cast<AVMediaType>(ReadInt(F));
+    Par->codec_id = static_cast<AVCodecID>(ReadInt(F));
+    Par->codec_tag = static_cast<uint32_t>(ReadInt(F));
+    std::string Extradata = ReadString(F);
+    if (!Extradata.empty()) {
+        Par->extradata = static_cast<uint8_t *>(av_mallocz(Extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        if (!Par->extradata)
+            return false;
+        memcpy(Par->extradata, Extradata.data(), Extradata.size());
+        Par->extradata_size = static_cast<int>(Extradata.size());
+    }
+    Par->format = ReadInt(F);
+    Par->bit_rate = ReadInt64(F);
+    Par->bits_per_coded_sample = ReadInt(F);
+    Par->bits_per_raw_sample = ReadInt(F);
+    Par->profile = ReadInt(F);
+    Par->level = ReadInt(F);
+    Par->width = ReadInt(F);
+    Par->height = ReadInt(F);
+    Par->sample_aspect_ratio = ReadRational(F);
+    Par->framerate = ReadRational(F);
+    Par->field_order = static_cast<AVFieldOrder>(ReadInt(F));
+    Par->color_range = static_cast<AVColorRange>(ReadInt(F));
+    Par->color_primaries = static_cast<AVColorPrimaries>(ReadInt(F));
+    Par->color_trc = static_cast<AVColorTransferCharacteristic>(ReadInt(F));
+    Par->color_space = static_cast<AVColorSpace>(ReadInt(F));
+    Par->chroma_location = static_cast<AVChromaLocation>(ReadInt(F));
+    Par->video_delay = ReadInt(F);
+    AVChannelOrder Order = static_cast<AVChannelOrder>(ReadInt(F));
+    int Channels = ReadInt(F);
+    uint64_t Mask = static_cast<uint64_t>(ReadInt64(F));
+    if (Order == AV_CHANNEL_ORDER_CUSTOM || Channels < 0)
+        return false;
+    av_channel_layout_uninit(&Par->ch_layout);
+    Par->ch_layout.order = Order;
+    Par->ch_layout.nb_channels = Channels;
+    if (Order != AV_CHANNEL_ORDER_UNSPEC)
+        Par->ch_layout.u.mask = Mask;
+    Par->sample_rate = ReadInt(F);
+    Par->block_align = ReadInt(F);
+    Par->frame_size = ReadInt(F);
+    Par->initial_padding = ReadInt(F);
+    Par->trailing_padding = ReadInt(F);
+    Par->seek_preroll = ReadInt(F);
+    int SideDataCount = ReadInt(F);
+    if (SideDataCount < 0 || SideDataCount > 1024)
+        return false;
+    for (int i = 0; i < SideDataCount; i++) {
+        AVPacketSideDataType Type = static_cast<AVPacketSideDataType>(ReadInt(F));
+        std::string Data = ReadString(F);
+        uint8_t *Buffer = static_cast<uint8_t *>(av_malloc(Data.size()));
+        if (!Buffer)
+            return false;
+        memcpy(Buffer, Data.data(), Data.size());
+        if (!av_packet_side_data_add(&Par->coded_side_data, &Par->nb_coded_side_data, Type, Buffer, Data.size(), 0)) {
+            av_free(Buffer);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool LoadStreamProbe(const std::filesystem::path &ProbeFile, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts) {
+    std::string Key = GetProbeKey(SourceFile, LAVFOpts);
+    if (GetProbe(Key))
+        return true;
+
+    file_ptr_t F = OpenNormalFile(ProbeFile, false);
+    if (!F)
+        return false;
+    if (!ReadBSHeader(F, true) || !ReadCompareInt(F, StreamProbeFormatVersion))
+        return false;
+
+    auto Probe = std::make_shared<StreamProbe>();
+    Probe->FileSize = ReadInt64(F);
+    if (Probe->FileSize <= 0)
+        return false;
+    Probe->ModificationTime = ReadInt64(F);
+
+    int LAVFOptCount = ReadInt(F);
+    std::map<std::string, std::string> ProbeLAVFOptions;
+    for (int i = 0; i < LAVFOptCount; i++) {
+        std::string OptKey = ReadString(F);
+        ProbeLAVFOptions[OptKey] = ReadString(F);
+    }
+    if (LAVFOpts != ProbeLAVFOptions)
+        return false;
+
+    Probe->FormatName = ReadString(F);
+    Probe->StartTime = ReadInt64(F);
+    Probe->Duration = ReadInt64(F);
+    Probe->BitRate = ReadInt64(F);
+
+    int NumStreams = ReadInt(F);
+    if (NumStreams <= 0 || NumStreams > 0xFFFF)
+        return false;
+    for (int i = 0; i < NumStreams; i++) {
+        StreamProbe::StreamInfo Info = {};
+        Info.TimeBase = ReadRational(F);
+        Info.StartTime = ReadInt64(F);
+        Info.Duration = ReadInt64(F);
+        Info.NumFrames = ReadInt64(F);
+        Info.Disposition = ReadInt(F);
+        Info.SAR = ReadRational(F);
+        Info.AvgFrameRate = ReadRational(F);
+        Info.RFrameRate = ReadRational(F);
+        Probe->Streams.push_back(Info);
+        Probe->Streams.back().CodecPar = avcodec_parameters_alloc();
+        if (!Probe->Streams.back().CodecPar || !ReadCodecParameters(F, Probe->Streams.back().CodecPar))
+            return false;
+    }
+
+    if (ReadByte(F) != 0 || ferror(F.get()))
+        return false;
+
+    Probe->StoredPath = ProbeFile;
+    std::lock_guard<std::mutex> Lock(ProbeMutex);
+    Probes.emplace(Key, std::move(Probe));
+    return true;
+}
+
+bool StoreStreamProbe(const std::filesystem::path &ProbeFile, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts) {
+    std::shared_ptr<StreamProbe> Probe = GetProbe(GetProbeKey(SourceFile, LAVFOpts));
+    if (!Probe)
+        return false;
+
+    {
+        std::lock_guard<std::mutex> Lock(ProbeMutex);
+        if (Probe->StoredPath == ProbeFile)
+            return true;
+    }
+
+    for (const auto &Iter : Probe->Streams)
+        if (!CanWriteCodecParameters(Iter.CodecPar))
+            return false;
+
+    std::filesystem::path TempFile = GetTempFilePath(ProbeFile);
+    std::error_code ec;
+    std::filesystem::create_directories(ProbeFile.parent_path(), ec);
+
+    {
+        file_ptr_t F = OpenNormalFile(TempFile, true);
+        if (!F)
+            return false;
+        WriteBSHeader(F, true);
+        WriteInt(F, StreamProbeFormatVersion);
+        WriteInt64(F, Probe->FileSize);
+        WriteInt64(F, Probe->ModificationTime);
+
+        WriteInt(F, static_cast<int>(LAVFOpts.size()));
+        for (const auto &Iter : LAVFOpts) {
+            WriteString(F, Iter.first);
+            WriteString(F, Iter.second);
+        }
+
+        WriteString(F, Probe->FormatName);
+        WriteInt64(F, Probe->StartTime);
+        WriteInt64(F, Probe->Duration);
+        WriteInt64(F, Probe->BitRate);
+
+        WriteInt(F, static_cast<int>(Probe->Streams.size()));
+        for (const auto &Iter : Probe->Streams) {
+            WriteRational(F, Iter.TimeBase);
+            WriteInt64(F, Iter.StartTime);
+            WriteInt64(F, Iter.Duration);
+            WriteInt64(F, Iter.NumFrames);
+            WriteInt(F, Iter.Disposition);
+            WriteRational(F, Iter.SAR);
+            WriteRational(F, Iter.AvgFrameRate);
+            WriteRational(F, Iter.RFrameRate);
+            WriteCodecParameters(F, Iter.CodecPar);
+        }
+
+        // A trailing zero byte makes truncated files detectable
+        WriteByte(F, 0);
+
+        if (fflush(F.get())) {
+            F.reset();
+            std::filesystem::remove(TempFile, ec);
+            return false;
+        }
+    }
+
+    std::filesystem::rename(TempFile, ProbeFile, ec);
+    if (ec) {
+        std::filesystem::remove(TempFile, ec);
+        return false;
+    }
+
+    std::lock_guard<std::mutex> Lock(ProbeMutex);
+    Probe->StoredPath = ProbeFile;
+    return true;
+}
+
+bool GetProbedStartTime(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, int Track, double &StartTime) {
+    std::shared_ptr<StreamProbe> Probe = GetProbe(GetProbeKey(SourceFile, LAVFOpts));
+    if (!Probe || Track < 0 || Track >= static_cast<int>(Probe->Streams.size()))
+        return false;
+
+    const StreamProbe::StreamInfo &Info = Probe->Streams[Track];
+    if (Info.CodecPar->codec_type != AVMEDIA_TYPE_AUDIO || Info.StartTime == AV_NOPTS_VALUE || Info.TimeBase.den <= 0)
+        return false;
+
+    StartTime = (static_cast<double>(Info.TimeBase.num) * Info.StartTime) / Info.TimeBase.den;
+    return true;
+}
@@ -0,0 +1,46 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+
+#ifndef STREAMPROBE_H
+#define STREAMPROBE_H
+
+#include "bsshared.h"
+#include <map>
+#include <string>
+#include <filesystem>
+
+struct AVFormatContext;
+
+/* Drop-in replacement for avformat_find_stream_info(). What it finds is remembered for the rest of the process and when the same file is
+   opened again with the same options only the header is read, the remembered stream information is filled in as long as the demuxer
+   creates the same streams and the file size and modification time are unchanged. Formats that only discover their streams while reading packets are always probed. */
+[[nodiscard]] int FindStreamInfo(AVFormatContext *FormatContext, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts);
+
+/* The remembered stream information can be stored next to the index so later processes can skip probing too */
+[[nodiscard]] std::filesystem::path GetStreamProbePath(bool AbsolutePath, const std::filesystem::path &CachePath, const std::filesystem::path &Source);
+bool LoadStreamProbe(const std::filesystem::path &ProbeFile, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts);
+bool StoreStreamProbe(const std::filesystem::path &ProbeFile, const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts); // Does nothing if it was already loaded from or stored to ProbeFile
+
+/* The start time of an audio track in seconds as found when probing. Returns false if the file hasn't been probed, the start time is unknown
+   or Track isn't an audio track, video tracks start with their first decoded frame which the container doesn't reliably know. */
+[[nodiscard]] bool GetProbedStartTime(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, int Track, double &StartTime);
+
+#endif
@@ -84,8 +84,10 @@ void SetSynthFrameProperties(const std::unique_ptr<BestVideoFrame> &Src, const B
         mapSetData("DolbyVisionRPU", reinterpret_cast<const char *>(Src->DolbyVisionRPU), static_cast<int>(Src->DolbyVisionRPUSize), false);
     }
 
-    if (Src->HDR10Plus && Src->HDR10PlusSize > 0) {
-        mapSetData("HDR10Plus", reinterpret_cast<const char *>(Src->HDR10Plus), static_cast<int>(Src->HDR10PlusSize), false);
+    size_t HDR10PlusSize = 0;
+    const uint8_t *HDR10Plus = Src->GetHDR10Plus(HDR10PlusSize);
+    if (HDR10Plus && HDR10PlusSize > 0) {
+        mapSetData("HDR10Plus", reinterpret_cast<const char *>(HDR10Plus), static_cast<int>(HDR10PlusSize), false);
     }
 
     if (Src->ICCProfile && Src->ICCProfileSize > 0) {
@@ -95,4 +97,14 @@ void SetSynthFrameProperties(const std::unique_ptr<BestVideoFrame> &Src, const B
     mapSetInt("FlipVertical", VP.FlipVerical);
     mapSetInt("FlipHorizontal", VP.FlipHorizontal);
     mapSetInt("Rotation", VP.Rotation);
-}
\ No newline at end of file
+}
+
+std::string GetSharedSourceKey(std::initializer_list<std::string> Values) {
+    // Nul can't appear in paths or option values so it's a safe separator
+    std::string Key;
+    for (const auto &Iter : Values) {
+        Key += Iter;
+        Key.push_back('\0');
+    }
+    return Key;
+}
@@ -25,7 +25,10 @@
 #include "videosource.h"
 #include <functional>
 #include <cstdint>
+#include <string>
+#include <initializer_list>
 
 void SetSynthFrameProperties(const std::unique_ptr<BestVideoFrame> &Src, const BSVideoProperties &VP, bool RFF, bool TFF, const std::function<void(const char *, int64_t)> &mapSetInt, const std::function<void(const char *, double)> &mapSetFloat, const std::function<void(const char *, const char *, int, bool)> &mapSetData);
+[[nodiscard]] std::string GetSharedSourceKey(std::initializer_list<std::string> Values); // Joins all settings of a source into a key for GetSharedVideoSource()
 
 #endif
\ No newline at end of file
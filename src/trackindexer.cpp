@@ -0,0 +1,191 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#include "trackindexer.h"
+#include "streamprobe.h"
+#include <thread>
+#include <exception>
+#include <memory>
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavcodec/avcodec.h>
+}
+
+static constexpr size_t MaxQueuedPackets = 256;
+
+BSPacketQueue::BSPacketQueue(size_t MaxPackets) : MaxPackets(MaxPackets) {
+}
+
+BSPacketQueue::~BSPacketQueue() {
+    for (auto &Iter : Packets)
+        av_packet_free(&Iter);
+}
+
+void BSPacketQueue::Push(AVPacket *Packet, int64_t FilePosition) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Condition.wait(Lock, [this] { return Packets.size() < MaxPackets || Closed; });
+    if (Closed) {
+        av_packet_free(&Packet);
+        return;
+    }
+    // The position is stored in the otherwise unused pos field until the packet is popped
+    Packet->pos = FilePosition;
+    Packets.push_back(Packet);
+    Condition.notify_all();
+}
+
+void BSPacketQueue::Finish() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Finished = true;
+    Condition.notify_all();
+}
+
+void BSPacketQueue::Abort() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Aborted = true;
+    Condition.notify_all();
+}
+
+void BSPacketQueue::Close() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Closed = true;
+    for (auto &Iter : Packets)
+        av_packet_free(&Iter);
+    Packets.clear();
+    Condition.notify_all();
+}
+
+bool BSPacketQueue::IsClosed() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    return Closed;
+}
+
+bool BSPacketQueue::Pop(AVPacket *Dst) {
+    std::unique_lock<std::mutex> Lock(Mutex);
+    Condition.wait(Lock, [this] { return !Packets.empty() || Finished || Closed || Aborted; });
+    if (Aborted)
+        throw BestSourceException("Reading packets from the shared demuxer failed");
+    if (Packets.empty())
+        return false;
+    AVPacket *Packet = Packets.front();
+    Packets.pop_front();
+    Condition.notify_all();
+    Lock.unlock();
+
+    Position = Packet->pos;
+    Packet->pos = -1;
+    av_packet_move_ref(Dst, Packet);
+    av_packet_free(&Packet);
+    return true;
+}
+
+int64_t BSPacketQueue::GetPosition() const {
+    return Position;
+}
+
+void IndexTracksTogether(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, const std::vector<BSTrackIndexJob> &Jobs) {
+    AVFormatContext *FormatContext = nullptr;
+    AVDictionary *Dict = nullptr;
+    for (const auto &Iter : LAVFOpts)
+        av_dict_set(&Dict, Iter.first.c_str(), Iter.second.c_str(), 0);
+
+    if (avformat_open_input(&FormatContext, SourceFile.u8string().c_str(), nullptr, &Dict) != 0) {
+        av_dict_free(&Dict);
+        throw BestSourceException("Couldn't open '" + SourceFile.u8string() + "'");
+    }
+
+    av_dict_free(&Dict);
+    std::unique_ptr<AVFormatContext, void (*)(AVFormatContext *)> FormatContextHolder(FormatContext, [](AVFormatContext *Ctx) { avformat_close_input(&Ctx); });
+
+    if (FindStreamInfo(FormatContext, SourceFile, LAVFOpts) < 0)
+        throw BestSourceException("Couldn't find stream information");
+
+    std::map<int, std::unique_ptr<BSPacketQueue>> Queues;
+    for (const auto &Iter : Jobs) {
+        if (Iter.Track < 0 || Iter.Track >= static_cast<int>(FormatContext->nb_streams))
+            throw BestSourceException("Invalid track number " + std::to_string(Iter.Track));
+        if (Queues.count(Iter.Track))
+            throw BestSourceException("Track " + std::to_string(Iter.Track) + " can only be indexed once");
+        Queues[Iter.Track].reset(new BSPacketQueue(MaxQueuedPackets));
+    }
+
+    for (int i = 0; i < static_cast<int>(FormatContext->nb_streams); i++)
+        if (!Queues.count(i))
+            FormatContext->streams[i]->discard = AVDISCARD_ALL;
+
+    AVPacket *Packet = av_packet_alloc();
+    if (!Packet)
+        throw BestSourceException("Couldn't allocate packet");
+
+    std::vector<std::exception_ptr> Errors(Jobs.size());
+    std::vector<std::thread> Threads;
+    Threads.reserve(Jobs.size());
+    for (size_t i = 0; i < Jobs.size(); i++) {
+        BSPacketQueue *Queue = Queues[Jobs[i].Track].get();
+        Threads.emplace_back([&Jobs, &Errors, Queue, i] {
+            try {
+                Jobs[i].Open(Queue);
+            } catch (...) {
+                Errors[i] = std::current_exception();
+            }
+            Queue->Close();
+        });
+    }
+
+    bool Failed = false;
+    size_t OpenQueues = Queues.size();
+    while (OpenQueues > 0 && av_read_frame(FormatContext, Packet) >= 0) {
+        auto Iter = Queues.find(Packet->stream_index);
+        if (Iter != Queues.end() && !Iter->second->IsClosed()) {
+            AVPacket *Tmp = av_packet_alloc();
+            if (!Tmp) {
+                Failed = true;
+                break;
+            }
+            av_packet_move_ref(Tmp, Packet);
+            Iter->second->Push(Tmp, FormatContext->pb ? avio_tell(FormatContext->pb) : -1); // Formats like image2 open their own files and have no context
+        }
+        av_packet_unref(Packet);
+
+        // Stop reading early if every job is done
+        OpenQueues = 0;
+        for (const auto &QueueIter : Queues)
+            OpenQueues += !QueueIter.second->IsClosed();
+    }
+    av_packet_free(&Packet);
+
+    // A missing packet would silently leave a hole in the index so every job fails instead
+    for (auto &Iter : Queues) {
+        if (Failed)
+            Iter.second->Abort();
+        else
+            Iter.second->Finish();
+    }
+    for (auto &Iter : Threads)
+        Iter.join();
+
+    for (auto &Iter : Errors)
+        if (Iter)
+            std::rethrow_exception(Iter);
+
+    if (Failed)
+        throw BestSourceException("Couldn't allocate packet");
+}
@@ -0,0 +1,72 @@
+//  Copyright (c) 2024 Fredrik Mellbin
+//
+//  Permission is hereby granted, free of charge, to any person obtaining a copy
+//  of this software and associated documentation files (the "Software"), to deal
+//  in the Software without restriction, including without limitation the rights
+//  to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+//  copies of the Software, and to permit persons to whom the Software is
+//  furnished to do so, subject to the following conditions:
+//
+//  The above copyright notice and this permission notice shall be included in
+//  all copies or substantial portions of the Software.
+//
+//  THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+//  IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+//  FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+//  AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+//  LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+//  OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+//  THE SOFTWARE.
+
+#ifndef TRACKINDEXER_H
+#define TRACKINDEXER_H
+
+#include "bsshared.h"
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <map>
+#include <string>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <filesystem>
+
+struct AVPacket;
+
+/* Passes the packets of one track from a shared demuxer to the decoder indexing it, the demuxer waits while the queue is full */
+class BSPacketQueue {
+private:
+    std::mutex Mutex;
+    std::condition_variable Condition;
+    std::deque<AVPacket *> Packets;
+    size_t MaxPackets;
+    std::atomic<int64_t> Position{ 0 }; // File position after the most recently popped packet
+    bool Finished = false; // No more packets will be pushed
+    bool Closed = false; // Nobody is reading anymore so new packets are dropped
+    bool Aborted = false; // Demuxing failed and the track can't be indexed
+public:
+    BSPacketQueue(size_t MaxPackets);
+    ~BSPacketQueue();
+    void Push(AVPacket *Packet, int64_t FilePosition); // Takes ownership of Packet
+    void Finish();
+    void Abort();
+    void Close();
+    [[nodiscard]] bool IsClosed();
+    [[nodiscard]] bool Pop(AVPacket *Dst); // Moves the next packet into Dst, returns false once the track has ended and throws if demuxing failed
+    [[nodiscard]] int64_t GetPosition() const;
+};
+
+/* Open is called on a thread of its own and should create the source for Track with Packets passed on so it indexes from the shared demuxer,
+   when the track already has an index Packets is simply never read. Track has to be the absolute track number. */
+struct BSTrackIndexJob {
+    int Track;
+    std::function<void(BSPacketQueue *Packets)> Open;
+};
+
+/* Reads the file once and feeds the packets to all jobs at the same time instead of every track reading the whole file on its own. The first
+   exception thrown by a job is rethrown once all jobs have finished. */
+void IndexTracksTogether(const std::filesystem::path &SourceFile, const std::map<std::string, std::string> &LAVFOpts, const std::vector<BSTrackIndexJob> &Jobs);
+
+#endif
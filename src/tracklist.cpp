@@ -19,6 +19,7 @@
 //  THE SOFTWARE.
 
 #include "tracklist.h"
+#include "streamprobe.h"
 #include <cassert>
 #include <memory>
 
@@ -39,7 +40,7 @@ void BestTrackList::OpenFile(const std::filesystem::path &SourceFile, const std:
 
     av_dict_free(&Dict);
 
-    if (avformat_find_stream_info(FormatContext, nullptr) < 0) {
+    if (FindStreamInfo(FormatContext, SourceFile, LAVFOpts) < 0) {
         avformat_close_input(&FormatContext);
         FormatContext = nullptr;
         throw BestSourceException("Couldn't find stream information");
@@ -28,6 +28,7 @@
 #include <VSHelper4.h>
 #include <vector>
 #include <algorithm>
+#include <array>
 #include <memory>
 #include <limits>
 #include <string>
@@ -49,12 +50,37 @@ static void BSInit() {
 
 struct BestVideoSourceData {
     VSVideoInfo VI = {};
-    std::unique_ptr<BestVideoSource> V;
+    std::shared_ptr<BestVideoSource> V;
     int64_t FPSNum = -1;
     int64_t FPSDen = -1;
     bool RFF = false;
+    bool Concurrent = false;
+    bool Stats = false;
+    int ExportThreads = 1;
 };
 
+static void SetStatisticsProperties(VSMap *Props, const BSSourceStatistics &Stats, const VSAPI *vsapi) {
+    auto SetHistogram = [Props, vsapi](const char *Name, const BSHistogram &Histogram) {
+        std::array<int64_t, BSHistogram::NumBuckets> Buckets;
+        std::copy(Histogram.Buckets.begin(), Histogram.Buckets.end(), Buckets.begin());
+        vsapi->mapSetIntArray(Props, Name, Buckets.data(), static_cast<int>(Buckets.size()));
+    };
+
+    vsapi->mapSetInt(Props, "BSRequests", Stats.Requests, maReplace);
+    vsapi->mapSetInt(Props, "BSCacheHits", Stats.Cache.Hits, maReplace);
+    vsapi->mapSetInt(Props, "BSCacheMisses", Stats.Cache.Misses, maReplace);
+    vsapi->mapSetInt(Props, "BSCacheEvictions", Stats.Cache.Evictions, maReplace);
+    vsapi->mapSetInt(Props, "BSCacheSize", Stats.Cache.Size, maReplace);
+    vsapi->mapSetInt(Props, "BSSeeks", Stats.Seeks, maReplace);
+    vsapi->mapSetInt(Props, "BSSeekRetries", Stats.SeekRetries, maReplace);
+    vsapi->mapSetInt(Props, "BSLinearFallbacks", Stats.LinearFallbacks, maReplace);
+    vsapi->mapSetInt(Props, "BSDecodedFrames", Stats.DecodedFrames, maReplace);
+    vsapi->mapSetInt(Props, "BSBytesRead", Stats.BytesRead, maReplace);
+    SetHistogram("BSDecodedFramesHistogram", Stats.DecodedFramesPerRequest);
+    SetHistogram("BSRequestTimeHistogram", Stats.RequestMilliseconds);
+    SetHistogram("BSSeekTimeHistogram", Stats.SeekMilliseconds);
+}
+
 static const VSFrame *VS_CC BestVideoSourceGetFrame(int n, int ActivationReason, void *InstanceData, void **, VSFrameContext *FrameCtx, VSCore *Core, const VSAPI *vsapi) {
     BestVideoSourceData *D = reinterpret_cast<BestVideoSourceData *>(InstanceData);
 
@@ -97,7 +123,7 @@ static const VSFrame *VS_CC BestVideoSourceGetFrame(int n, int ActivationReason,
                 vsapi->mapSetInt(vsapi->getFramePropertiesRW(AlphaDst), "_ColorRange", 0, maAppend);
             }
 
-            if (!Src->ExportAsPlanar(DstPtrs, DstStride, AlphaDst ? vsapi->getWritePtr(AlphaDst, 0) : nullptr, AlphaStride)) {
+            if (!Src->ExportAsPlanar(DstPtrs, DstStride, AlphaDst ? vsapi->getWritePtr(AlphaDst, 0) : nullptr, AlphaStride, D->ExportThreads)) {
                 throw BestSourceException("Cannot export to planar format for frame " + std::to_string(n));
             }
 
@@ -118,6 +144,9 @@ static const VSFrame *VS_CC BestVideoSourceGetFrame(int n, int ActivationReason,
             [Props, vsapi](const char *Name, double V) { vsapi->mapSetFloat(Props, Name, V, maAppend); },
             [Props, vsapi](const char *Name, const char *V, int Size, bool Utf8) { vsapi->mapSetData(Props, Name, V, Size, Utf8 ? dtUtf8 : dtBinary, maAppend); });
 
+        if (D->Stats)
+            SetStatisticsProperties(Props, D->V->GetStatistics(), vsapi);
+
         return Dst;
     }
 
@@ -144,6 +173,15 @@ static void VS_CC CreateBestVideoSource(const VSMap *In, VSMap *Out, void *, VSC
     if (err)
         VariableFormat = -1;
     int Threads = vsapi->mapGetIntSaturated(In, "threads", 0, &err);
+    int IndexThreads = vsapi->mapGetIntSaturated(In, "indexthreads", 0, &err);
+    if (err)
+        IndexThreads = 1;
+    bool FastIndex = !!vsapi->mapGetInt(In, "fastindex", 0, &err);
+    bool SparseHash = !!vsapi->mapGetInt(In, "sparsehash", 0, &err);
+    int MaxDecoders = vsapi->mapGetIntSaturated(In, "decoders", 0, &err);
+    if (err)
+        MaxDecoders = 4;
+    int64_t IOCacheSize = std::max<int64_t>(vsapi->mapGetInt(In, "iocachesize", 0, &err), 0);
     int StartNumber = vsapi->mapGetIntSaturated(In, "start_number", 0, &err);
     if (err)
         StartNumber = -1;
@@ -182,32 +220,82 @@ static void VS_CC CreateBestVideoSource(const VSMap *In, VSMap *Out, void *, VSC
         if (D->FPSNum > 0 && D->RFF)
             throw BestSourceException("Cannot combine CFR and RFF modes");
 
-        if (ShowProgress) {
-            auto NextUpdate = std::chrono::high_resolution_clock::now();
-            int LastValue = -1;
-            D->V.reset(new BestVideoSource(Source, HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath ? CachePath : "", &Opts,
-                [vsapi, Core, &NextUpdate, &LastValue](int Track, int64_t Cur, int64_t Total) {
-                    if (NextUpdate < std::chrono::high_resolution_clock::now()) {
-                        if (Total == INT64_MAX && Cur == Total) {
-                            vsapi->logMessage(mtInformation, ("VideoSource track #" + std::to_string(Track) + " indexing complete").c_str(), Core);
-                        } else {
-                            int PValue = (Total > 0) ? static_cast<int>((static_cast<double>(Cur) / static_cast<double>(Total)) * 100) : static_cast<int>(Cur / (1024 * 1024));
-                            if (PValue != LastValue) {
-                                vsapi->logMessage(mtInformation, ("VideoSource track #" + std::to_string(Track) + " index progress " + std::to_string(PValue) + ((Total > 0) ? "%" : "MB")).c_str(), Core);
-                                LastValue = PValue;
-                                NextUpdate = std::chrono::high_resolution_clock::now() + std::chrono::seconds(1);
+        // Everything the source is configured with has to be part of the key when it's shared
+        int SeekPreRoll = vsapi->mapGetIntSaturated(In, "seekpreroll", 0, &err);
+        if (err)
+            SeekPreRoll = -1;
+        int DecoderPolicy = vsapi->mapGetIntSaturated(In, "decoderpolicy", 0, &err);
+        if (err)
+            DecoderPolicy = -1;
+        int64_t IdleTimeout = vsapi->mapGetInt(In, "idletimeout", 0, &err);
+        if (err)
+            IdleTimeout = -1;
+        int64_t Prefetch = vsapi->mapGetInt(In, "prefetch", 0, &err);
+        if (err)
+            Prefetch = -1;
+        int64_t CacheSize = vsapi->mapGetInt(In, "cachesize", 0, &err);
+        if (err)
+            CacheSize = -1;
+        bool CachePlanar = !!vsapi->mapGetInt(In, "cacheplanar", 0, &err);
+        D->Concurrent = !!vsapi->mapGetInt(In, "concurrent", 0, &err);
+        bool Shared = !!vsapi->mapGetInt(In, "shared", 0, &err);
+        D->Stats = !!vsapi->mapGetInt(In, "stats", 0, &err);
+
+        auto Create = [&]() {
+            std::unique_ptr<BestVideoSource> V;
+            if (ShowProgress) {
+                auto NextUpdate = std::chrono::high_resolution_clock::now();
+                int LastValue = -1;
+                V.reset(new BestVideoSource(Source, HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath ? CachePath : "", &Opts,
+                    [vsapi, Core, &NextUpdate, &LastValue](int Track, int64_t Cur, int64_t Total) {
+                        if (NextUpdate < std::chrono::high_resolution_clock::now()) {
+                            if (Total == INT64_MAX && Cur == Total) {
+                                vsapi->logMessage(mtInformation, ("VideoSource track #" + std::to_string(Track) + " indexing complete").c_str(), Core);
+                            } else {
+                                int PValue = (Total > 0) ? static_cast<int>((static_cast<double>(Cur) / static_cast<double>(Total)) * 100) : static_cast<int>(Cur / (1024 * 1024));
+                                if (PValue != LastValue) {
+                                    vsapi->logMessage(mtInformation, ("VideoSource track #" + std::to_string(Track) + " index progress " + std::to_string(PValue) + ((Total > 0) ? "%" : "MB")).c_str(), Core);
+                                    LastValue = PValue;
+                                    NextUpdate = std::chrono::high_resolution_clock::now() + std::chrono::seconds(1);
+                                }
                             }
                         }
-                    }
-                    return true;
-                }));
+                        return true;
+                    }, IndexThreads, FastIndex, SparseHash, MaxDecoders, static_cast<size_t>(IOCacheSize) * 1024 * 1024));
+
+            } else {
+                V.reset(new BestVideoSource(Source, HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath ? CachePath : "", &Opts, nullptr, IndexThreads, FastIndex, SparseHash, MaxDecoders, static_cast<size_t>(IOCacheSize) * 1024 * 1024));
+            }
 
+            V->SelectFormatSet(VariableFormat);
+            if (SeekPreRoll >= 0)
+                V->SetSeekPreRoll(SeekPreRoll);
+            if (DecoderPolicy >= 0)
+                V->SetDecoderPolicy(static_cast<BestDecoderPolicy>(DecoderPolicy));
+            if (IdleTimeout >= 0)
+                V->SetIdleDecoderTimeout(IdleTimeout);
+            if (Prefetch >= 0)
+                V->SetPrefetch(Prefetch);
+            if (D->Concurrent)
+                V->SetConcurrentMode(true);
+            if (CacheSize >= 0)
+                V->SetMaxCacheSize(CacheSize * 1024 * 1024);
+            V->SetCachePlanar(CachePlanar);
+            return V.release();
+        };
+
+        if (Shared) {
+            std::string OptsKey;
+            for (const auto &Iter : Opts)
+                OptsKey += Iter.first + "=" + Iter.second + ";";
+            std::string Key = GetSharedSourceKey({ Source.u8string(), std::to_string(Track), std::to_string(ViewID), HWDevice ? HWDevice : "", std::to_string(ExtraHWFrames), std::to_string(Threads),
+                std::to_string(FastIndex), std::to_string(SparseHash), std::to_string(MaxDecoders), std::to_string(IOCacheSize), std::to_string(CacheMode), CachePath ? CachePath : "", OptsKey,
+                std::to_string(VariableFormat), std::to_string(SeekPreRoll), std::to_string(DecoderPolicy), std::to_string(IdleTimeout), std::to_string(CacheSize), std::to_string(CachePlanar) });
+            D->V = GetSharedVideoSource(Key, Create);
         } else {
-            D->V.reset(new BestVideoSource(Source, HWDevice ? HWDevice : "", ExtraHWFrames, Track, ViewID, Threads, CacheMode, CachePath ? CachePath : "", &Opts));
+            D->V.reset(Create());
         }
 
-        D->V->SelectFormatSet(VariableFormat);
-
         const BSVideoProperties &VP = D->V->GetVideoProperties();
         if ((VP.VF.ColorFamily == 0 && VariableFormat != -1) || !vsapi->queryVideoFormat(&D->VI.format, VP.VF.ColorFamily, VP.VF.Float, VP.VF.Bits, VP.VF.SubSamplingW, VP.VF.SubSamplingH, Core))
             throw BestSourceException("Unsupported video format from decoder (probably less than 8 bit or palette)");
@@ -231,9 +319,9 @@ static void VS_CC CreateBestVideoSource(const VSMap *In, VSMap *Out, void *, VSC
             D->VI.numFrames = vsh::int64ToIntS(VP.NumRFFFrames);
         }
 
-        int SeekPreRoll = vsapi->mapGetIntSaturated(In, "seekpreroll", 0, &err);
+        int ExportThreads = vsapi->mapGetIntSaturated(In, "exportthreads", 0, &err);
         if (!err)
-            D->V->SetSeekPreRoll(SeekPreRoll);
+            D->ExportThreads = std::max(ExportThreads, 1);
 
         if (Timecodes)
             D->V->WriteTimecodes(CreateProbablyUTF8Path(Timecodes));
@@ -243,17 +331,15 @@ static void VS_CC CreateBestVideoSource(const VSMap *In, VSMap *Out, void *, VSC
         return;
     }
 
-    int64_t CacheSize = vsapi->mapGetInt(In, "cachesize", 0, &err);
-    if (!err && CacheSize >= 0)
-        D->V->SetMaxCacheSize(CacheSize * 1024 * 1024);
-
-    vsapi->createVideoFilter(Out, "VideoSource", &D->VI, BestVideoSourceGetFrame, BestVideoSourceFree, fmUnordered, nullptr, 0, D, Core);
+    vsapi->createVideoFilter(Out, "VideoSource", &D->VI, BestVideoSourceGetFrame, BestVideoSourceFree, D->Concurrent ? fmParallel : fmUnordered, nullptr, 0, D, Core);
 }
 
 struct BestAudioSourceData {
     VSAudioInfo AI = {};
     bool Is8Bit = false;
     std::unique_ptr<BestAudioSource> A;
+    std::unique_ptr<BestAudioSource::StreamReader> Reader; // Only created once frames are requested in order
+    int64_t NextSample = -1;
 };
 
 static const VSFrame *VS_CC BestAudioSourceGetFrame(int n, int ActivationReason, void *InstanceData, void **, VSFrameContext *FrameCtx, VSCore *Core, const VSAPI *vsapi) {
@@ -268,7 +354,17 @@ static const VSFrame *VS_CC BestAudioSourceGetFrame(int n, int ActivationReason,
         for (int Channel = 0; Channel < D->AI.format.numChannels; Channel++)
             Tmp.push_back(vsapi->getWritePtr(Dst, Channel));
         try {
-            D->A->GetPlanarAudio(Tmp.data(), n * static_cast<int64_t>(VS_AUDIO_FRAME_SAMPLES), SamplesOut);
+            int64_t Start = n * static_cast<int64_t>(VS_AUDIO_FRAME_SAMPLES);
+            if (Start == D->NextSample) {
+                if (!D->Reader)
+                    D->Reader.reset(new BestAudioSource::StreamReader(*D->A, Start));
+                D->Reader->SetPosition(Start);
+            }
+            if (D->Reader && D->Reader->GetPosition() == Start)
+                D->Reader->GetPlanarAudio(Tmp.data(), SamplesOut);
+            else
+                D->A->GetPlanarAudio(Tmp.data(), Start, SamplesOut);
+            D->NextSample = Start + SamplesOut;
         } catch (BestSourceException &e) {
             vsapi->setFilterError(("AudioSource: " + std::string(e.what())).c_str(), FrameCtx);
             vsapi->freeFrame(Dst);
@@ -307,6 +403,10 @@ static void VS_CC CreateBestAudioSource(const VSMap *In, VSMap *Out, void *, VSC
     if (err)
         AdjustDelay = -1;
     int Threads = vsapi->mapGetIntSaturated(In, "threads", 0, &err);
+    int MaxDecoders = vsapi->mapGetIntSaturated(In, "decoders", 0, &err);
+    if (err)
+        MaxDecoders = 4;
+    int64_t IOCacheSize = std::max<int64_t>(vsapi->mapGetInt(In, "iocachesize", 0, &err), 0);
     bool ShowProgress = !!vsapi->mapGetInt(In, "showprogress", 0, &err);
     int CacheMode = vsapi->mapGetIntSaturated(In, "cachemode", 0, &err);
     if (err)
@@ -341,10 +441,10 @@ static void VS_CC CreateBestAudioSource(const VSMap *In, VSMap *Out, void *, VSC
                         }
                     }
                     return true;
-                }));
+                }, MaxDecoders, static_cast<size_t>(IOCacheSize) * 1024 * 1024));
 
         } else {
-            D->A.reset(new BestAudioSource(Source, Track, AdjustDelay, Threads, CacheMode, CachePath ? CachePath : "", &Opts, DrcScale));
+            D->A.reset(new BestAudioSource(Source, Track, AdjustDelay, Threads, CacheMode, CachePath ? CachePath : "", &Opts, DrcScale, nullptr, MaxDecoders, static_cast<size_t>(IOCacheSize) * 1024 * 1024));
         }
 
         D->A->SelectFormatSet(0);
@@ -433,6 +533,16 @@ static void VS_CC SetDebugOutput(const VSMap *In, VSMap *, void *, VSCore *, con
     SetBSDebugOutput(!!vsapi->mapGetInt(In, "enable", 0, nullptr));
 }
 
+static void VS_CC SetThreadBudget(const VSMap *In, VSMap *, void *, VSCore *, const VSAPI *vsapi) {
+    BSInit();
+    SetDecoderThreadBudget(vsapi->mapGetIntSaturated(In, "threads", 0, nullptr));
+}
+
+static void VS_CC SetCacheBudget(const VSMap *In, VSMap *, void *, VSCore *, const VSAPI *vsapi) {
+    BSInit();
+    SetFrameCacheBudget(static_cast<size_t>(std::max<int64_t>(vsapi->mapGetInt(In, "size", 0, nullptr), 0)) * 1024 * 1024);
+}
+
 static void VS_CC SetLogLevel(const VSMap *In, VSMap *Out, void *, VSCore *, const VSAPI *vsapi) {
     BSInit();
     int err;
@@ -444,10 +554,12 @@ static void VS_CC SetLogLevel(const VSMap *In, VSMap *Out, void *, VSCore *, con
 
 VS_EXTERNAL_API(void) VapourSynthPluginInit2(VSPlugin *plugin, const VSPLUGINAPI *vspapi) {
     vspapi->configPlugin("com.vapoursynth.bestsource", "bs", "Best Source 2", VS_MAKE_VERSION(BEST_SOURCE_VERSION_MAJOR, BEST_SOURCE_VERSION_MINOR), VS_MAKE_VERSION(VAPOURSYNTH_API_MAJOR, 0), 0, plugin);
-    vspapi->registerFunction("VideoSource", "source:data;track:int:opt;variableformat:int:opt;fpsnum:int:opt;fpsden:int:opt;rff:int:opt;threads:int:opt;seekpreroll:int:opt;enable_drefs:int:opt;use_absolute_path:int:opt;cachemode:int:opt;cachepath:data:opt;cachesize:int:opt;hwdevice:data:opt;extrahwframes:int:opt;timecodes:data:opt;start_number:int:opt;viewid:int:opt;showprogress:int:opt;", "clip:vnode;", CreateBestVideoSource, nullptr, plugin);
-    vspapi->registerFunction("AudioSource", "source:data;track:int:opt;adjustdelay:int:opt;threads:int:opt;enable_drefs:int:opt;use_absolute_path:int:opt;drc_scale:float:opt;cachemode:int:opt;cachepath:data:opt;cachesize:int:opt;showprogress:int:opt;", "clip:anode;", CreateBestAudioSource, nullptr, plugin);
+    vspapi->registerFunction("VideoSource", "source:data;track:int:opt;variableformat:int:opt;fpsnum:int:opt;fpsden:int:opt;rff:int:opt;threads:int:opt;seekpreroll:int:opt;enable_drefs:int:opt;use_absolute_path:int:opt;cachemode:int:opt;cachepath:data:opt;cachesize:int:opt;hwdevice:data:opt;extrahwframes:int:opt;timecodes:data:opt;start_number:int:opt;viewid:int:opt;indexthreads:int:opt;fastindex:int:opt;prefetch:int:opt;concurrent:int:opt;decoders:int:opt;iocachesize:int:opt;cacheplanar:int:opt;decoderpolicy:int:opt;idletimeout:int:opt;exportthreads:int:opt;sparsehash:int:opt;shared:int:opt;stats:int:opt;showprogress:int:opt;", "clip:vnode;", CreateBestVideoSource, nullptr, plugin);
+    vspapi->registerFunction("AudioSource", "source:data;track:int:opt;adjustdelay:int:opt;threads:int:opt;enable_drefs:int:opt;use_absolute_path:int:opt;drc_scale:float:opt;cachemode:int:opt;cachepath:data:opt;cachesize:int:opt;decoders:int:opt;iocachesize:int:opt;showprogress:int:opt;", "clip:anode;", CreateBestAudioSource, nullptr, plugin);
     vspapi->registerFunction("TrackInfo", "source:data;enable_drefs:int:opt;use_absolute_path:int:opt;", "mediatype:int;mediatypestr:data;codec:int;codecstr:data;disposition:int;dispositionstr:data;", GetTrackInfo, nullptr, plugin);
     vspapi->registerFunction("Metadata", "source:data;track:int:opt;enable_drefs:int:opt;use_absolute_path:int:opt;", "any", GetMetadata, nullptr, plugin);
     vspapi->registerFunction("SetDebugOutput", "enable:int;", "", SetDebugOutput, nullptr, plugin);
+    vspapi->registerFunction("SetThreadBudget", "threads:int;", "", SetThreadBudget, nullptr, plugin);
+    vspapi->registerFunction("SetCacheBudget", "size:int;", "", SetCacheBudget, nullptr, plugin);
     vspapi->registerFunction("SetFFmpegLogLevel", "level:int;", "level:int;", SetLogLevel, nullptr, plugin);
 }
@@ -19,13 +19,29 @@
 //  THE SOFTWARE.
 
 #include "videosource.h"
+#include "trackindexer.h"
+#include "streamprobe.h"
+#include "blockcache.h"
+#include "framepool.h"
 #include "version.h"
+#include "exportkernels.h"
 #include <algorithm>
 #include <thread>
+#include <future>
+#include <functional>
+#include <deque>
+#include <queue>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <cassert>
 #include <iterator>
 #include <charconv>
 
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
 #include "../libp2p/p2p_api.h"
 
 #include <xxhash.h>
@@ -75,7 +91,46 @@ static int IsRealPlanar(const AVPixFmtDescriptor *Desc) {
     return (MaxPlane + 1) == Desc->nb_components;
 }
 
+// Luma in the first plane and chroma interleaved as UV pairs in the second
+static bool IsSemiPlanar(const AVPixFmtDescriptor *Desc, int BytesPerSample) {
+    if (Desc->nb_components != 3 || !!(Desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_FLOAT)) || (BytesPerSample != 1 && BytesPerSample != 2))
+        return false;
+    const AVComponentDescriptor *C = Desc->comp;
+    return C[0].plane == 0 && C[0].step == BytesPerSample && C[0].offset == 0 &&
+        C[1].plane == 1 && C[1].step == 2 * BytesPerSample && C[1].offset == 0 &&
+        C[2].plane == 1 && C[2].step == 2 * BytesPerSample && C[2].offset == BytesPerSample &&
+        C[0].shift == C[1].shift && C[1].shift == C[2].shift && (BytesPerSample == 2 || C[0].shift == 0);
+}
+
+// 8 bit RGB with all components in a single plane of 3 or 4 byte pixels, such as RGB24 and BGRA
+static bool IsPackedRGB8(const AVPixFmtDescriptor *Desc) {
+    if ((Desc->nb_components != 3 && Desc->nb_components != 4) || !(Desc->flags & AV_PIX_FMT_FLAG_RGB) || !!(Desc->flags & (AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_FLOAT)))
+        return false;
+    int Step = Desc->comp[0].step;
+    if (Step != 3 && Step != 4)
+        return false;
+    for (int i = 0; i < Desc->nb_components; i++) {
+        const AVComponentDescriptor &C = Desc->comp[i];
+        if (C.plane != 0 || C.step != Step || C.depth != 8 || C.shift != 0)
+            return false;
+    }
+    return true;
+}
+
+// 8 bit 4:2:2 with Y, U and V packed in pairs of pixels, such as YUY2 and UYVY
+static bool IsPackedYUV4228(const AVPixFmtDescriptor *Desc) {
+    if (Desc->nb_components != 3 || !!(Desc->flags & (AV_PIX_FMT_FLAG_RGB | AV_PIX_FMT_FLAG_PAL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_FLOAT)) || Desc->log2_chroma_w != 1 || Desc->log2_chroma_h != 0)
+        return false;
+    const AVComponentDescriptor *C = Desc->comp;
+    for (int i = 0; i < 3; i++)
+        if (C[i].plane != 0 || C[i].depth != 8 || C[i].shift != 0)
+            return false;
+    return C[0].step == 2 && C[1].step == 4 && C[2].step == 4 && C[0].offset < 2;
+}
+
 bool LWVideoDecoder::ReadPacket() {
+    if (PacketSource)
+        return PacketSource->Pop(Packet);
     while (av_read_frame(FormatContext, Packet) >= 0) {
         if (Packet->stream_index == TrackNumber)
             return true;
@@ -84,22 +139,10 @@ bool LWVideoDecoder::ReadPacket() {
     return false;
 }
 
-bool LWVideoDecoder::DecodeNextFrame(bool SkipOutput) {
-    if (!DecodeFrame) {
-        DecodeFrame = av_frame_alloc();
-        if (!DecodeFrame)
-            throw BestSourceException("Couldn't allocate frame");
-    }
-
+bool LWVideoDecoder::ReceiveFrame(AVFrame *Frame) {
     while (true) {
-        int Ret = avcodec_receive_frame(CodecContext, HWMode ? HWFrame : DecodeFrame);
+        int Ret = avcodec_receive_frame(CodecContext, Frame);
         if (Ret == 0) {
-            if (HWMode) {
-                if (!SkipOutput) {
-                    av_hwframe_transfer_data(DecodeFrame, HWFrame, 0);
-                    av_frame_copy_props(DecodeFrame, HWFrame);
-                }
-            }
             return true;
         } else if (Ret == AVERROR(EAGAIN) || Ret == AVERROR_INPUT_CHANGED) { // AVERROR_INPUT_CHANGED is only used for two things inside FFmpeg and the other one can't happen, therefore we don't need to care about whether or not variable format is allowed
             if (ReadPacket()) {
@@ -116,8 +159,114 @@ bool LWVideoDecoder::DecodeNextFrame(bool SkipOutput) {
     return false;
 }
 
-void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts) {
+void LWVideoDecoder::StartDownload(AVFrame *Dst, const AVFrame *Src) {
+    if (!DownloadThread.joinable()) {
+        ReservedThreads += AcquireDecoderThreads(1);
+        DownloadThread = std::thread(&LWVideoDecoder::DownloadLoop, this);
+    }
+    std::lock_guard<std::mutex> Lock(DownloadMutex);
+    assert(!DownloadSrc);
+    DownloadDst = Dst;
+    DownloadSrc = Src;
+    DownloadCondition.notify_all();
+}
+
+int LWVideoDecoder::WaitForDownload() {
+    std::unique_lock<std::mutex> Lock(DownloadMutex);
+    DownloadCondition.wait(Lock, [this] { return !DownloadSrc; });
+    return DownloadResult;
+}
+
+void LWVideoDecoder::DownloadLoop() {
+    std::unique_lock<std::mutex> Lock(DownloadMutex);
+    while (true) {
+        DownloadCondition.wait(Lock, [this] { return DownloadSrc || DownloadExit; });
+        if (!DownloadSrc)
+            return;
+        AVFrame *Dst = DownloadDst;
+        const AVFrame *Src = DownloadSrc;
+        Lock.unlock();
+        int Result = BSFramePool::TransferData(FramePool, Dst, Src);
+        Lock.lock();
+        DownloadResult = Result;
+        DownloadSrc = nullptr;
+        DownloadCondition.notify_all();
+    }
+}
+
+void LWVideoDecoder::DiscardNextHWFrame() {
+    if (NextDownloading)
+        WaitForDownload();
+    NextDownloading = false;
+    av_frame_unref(NextDecodeFrame);
+    av_frame_unref(NextHWFrame);
+    HasNextHWFrame = false;
+}
+
+bool LWVideoDecoder::DecodeNextFrame(bool SkipOutput) {
+    if (!DecodeFrame) {
+        DecodeFrame = av_frame_alloc();
+        if (!DecodeFrame)
+            throw BestSourceException("Couldn't allocate frame");
+    }
+
+    if (!HWMode)
+        return ReceiveFrame(DecodeFrame);
+
+    // Surfaces are only downloaded when the frame is output, the download of frame N runs on the download thread while
+    // frame N+1 is decoded and when output is wanted the download of N+1 is started as soon as N is done
+    bool Downloading = false;
+
+    if (HasNextHWFrame) {
+        std::swap(HWFrame, NextHWFrame);
+        HasNextHWFrame = false;
+        if (NextDownloading) {
+            std::swap(DecodeFrame, NextDecodeFrame);
+            NextDownloading = false;
+            Downloading = true;
+        }
+    } else if (!ReceiveFrame(HWFrame)) {
+        return false;
+    }
+
+    if (!SkipOutput && !Downloading) {
+        if (AsyncDownload) {
+            StartDownload(DecodeFrame, HWFrame);
+            Downloading = true;
+        } else {
+            BSFramePool::TransferData(FramePool, DecodeFrame, HWFrame);
+            av_frame_copy_props(DecodeFrame, HWFrame);
+        }
+    }
+
+    // Skipping usually continues so there's no point in decoding ahead without a download to overlap with
+    if (Downloading) {
+        HasNextHWFrame = ReceiveFrame(NextHWFrame);
+        WaitForDownload();
+        if (SkipOutput)
+            av_frame_unref(DecodeFrame);
+        else
+            av_frame_copy_props(DecodeFrame, HWFrame);
+    }
+
+    av_frame_unref(HWFrame);
+
+    if (!SkipOutput && HasNextHWFrame) {
+        if (!NextDecodeFrame) {
+            NextDecodeFrame = av_frame_alloc();
+            if (!NextDecodeFrame)
+                throw BestSourceException("Couldn't allocate frame");
+        }
+        StartDownload(NextDecodeFrame, NextHWFrame);
+        NextDownloading = true;
+    }
+
+    return true;
+}
+
+void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts, BSBlockCache *BlockCache, BSFramePool *FramePool, int LowRes) {
     TrackNumber = Track;
+    this->FramePool = FramePool;
 
     AVHWDeviceType Type = AV_HWDEVICE_TYPE_NONE;
     if (!HWDeviceName.empty()) {
@@ -132,6 +281,17 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
     for (const auto &Iter : LAVFOpts)
         av_dict_set(&Dict, Iter.first.c_str(), Iter.second.c_str(), 0);
 
+    if (BlockCache) {
+        FormatContext = avformat_alloc_context();
+        CustomIO = BlockCache->CreateIOContext();
+        if (!FormatContext || !CustomIO) {
+            av_dict_free(&Dict);
+            throw BestSourceException("Couldn't allocate IO context");
+        }
+        FormatContext->pb = CustomIO;
+        FormatContext->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
     if (avformat_open_input(&FormatContext, SourceFile.u8string().c_str(), nullptr, &Dict) != 0) {
         av_dict_free(&Dict);
         throw BestSourceException("Couldn't open '" + SourceFile.u8string() + "'");
@@ -139,7 +299,7 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
 
     av_dict_free(&Dict);
 
-    if (avformat_find_stream_info(FormatContext, nullptr) < 0) {
+    if (FindStreamInfo(FormatContext, SourceFile, LAVFOpts) < 0) {
         avformat_close_input(&FormatContext);
         FormatContext = nullptr;
         throw BestSourceException("Couldn't find stream information");
@@ -215,7 +375,8 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
         else
             Threads = std::min(HardwareConcurrency, 2);
     }
-    CodecContext->thread_count = Threads;
+    ReservedThreads = AcquireDecoderThreads(Threads);
+    CodecContext->thread_count = ReservedThreads;
 
     // Read icc profiles
     CodecContext->flags2 |= AV_CODEC_FLAG2_ICC_PROFILES;
@@ -229,6 +390,12 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
         CodecContext->has_b_frames = 15; // the maximum possible value for h264
     }
 
+    if (LowRes > 0)
+        CodecContext->lowres = std::min(LowRes, static_cast<int>(Codec->max_lowres));
+
+    if (FramePool)
+        FramePool->Attach(CodecContext);
+
     if (HWMode) {
         CodecContext->extra_hw_frames = ExtraHWFrames;
         CodecContext->pix_fmt = hw_pix_fmt;
@@ -236,8 +403,13 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
             throw BestSourceException("Failed to create specified HW device");
         CodecContext->hw_device_ctx = av_buffer_ref(HWDeviceContext);
 
+        // These hwcontexts lock the device or use their own queues for transfers so a download doesn't interfere with decoding
+        AsyncDownload = (Type == AV_HWDEVICE_TYPE_CUDA || Type == AV_HWDEVICE_TYPE_D3D11VA || Type == AV_HWDEVICE_TYPE_D3D12VA || Type == AV_HWDEVICE_TYPE_VAAPI ||
+            Type == AV_HWDEVICE_TYPE_VIDEOTOOLBOX || Type == AV_HWDEVICE_TYPE_VULKAN);
+
         HWFrame = av_frame_alloc();
-        if (!HWFrame)
+        NextHWFrame = av_frame_alloc();
+        if (!HWFrame || !NextHWFrame)
             throw BestSourceException("Couldn't allocate frame");
     }
 
@@ -275,10 +447,10 @@ void LWVideoDecoder::OpenFile(const std::filesystem::path &SourceFile, const std
     }
 }
 
-LWVideoDecoder::LWVideoDecoder(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts) {
+LWVideoDecoder::LWVideoDecoder(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts, BSBlockCache *BlockCache, BSFramePool *FramePool, int LowRes) {
     try {
         Packet = av_packet_alloc();
-        OpenFile(SourceFile, HWDeviceName, ExtraHWFrames, Track, ViewID, Threads, LAVFOpts);
+        OpenFile(SourceFile, HWDeviceName, ExtraHWFrames, Track, ViewID, Threads, LAVFOpts, BlockCache, FramePool, LowRes);
     } catch (...) {
         Free();
         throw;
@@ -286,12 +458,25 @@ LWVideoDecoder::LWVideoDecoder(const std::filesystem::path &SourceFile, const st
 }
 
 void LWVideoDecoder::Free() {
+    if (DownloadThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> Lock(DownloadMutex);
+            DownloadExit = true;
+            DownloadCondition.notify_all();
+        }
+        DownloadThread.join();
+    }
     av_packet_free(&Packet);
     av_frame_free(&DecodeFrame);
+    av_frame_free(&NextDecodeFrame);
     av_frame_free(&HWFrame);
+    av_frame_free(&NextHWFrame);
     avcodec_free_context(&CodecContext);
     avformat_close_input(&FormatContext);
+    BSBlockCache::FreeIOContext(&CustomIO);
     av_buffer_unref(&HWDeviceContext);
+    ReleaseDecoderThreads(ReservedThreads);
+    ReservedThreads = 0;
 }
 
 LWVideoDecoder::~LWVideoDecoder() {
@@ -303,9 +488,23 @@ int64_t LWVideoDecoder::GetSourceSize() const {
 }
 
 int64_t LWVideoDecoder::GetSourcePostion() const {
+    if (PacketSource)
+        return PacketSource->GetPosition();
     return avio_tell(FormatContext->pb);
 }
 
+int64_t LWVideoDecoder::TakeBytesRead() {
+    if (PacketSource || !FormatContext->pb)
+        return 0;
+    int64_t Result = FormatContext->pb->bytes_read - ReportedBytesRead;
+    ReportedBytesRead = FormatContext->pb->bytes_read;
+    return Result;
+}
+
+int64_t LWVideoDecoder::GetStartPTS() const {
+    return FormatContext->streams[TrackNumber]->start_time;
+}
+
 int LWVideoDecoder::GetTrack() const {
     return TrackNumber;
 }
@@ -445,6 +644,15 @@ AVFrame *LWVideoDecoder::GetNextFrame() {
     return nullptr;
 }
 
+bool LWVideoDecoder::ReadPacketInfo(int64_t &PTS, int &Flags) {
+    if (!ReadPacket())
+        return false;
+    PTS = Packet->pts;
+    Flags = Packet->flags;
+    av_packet_unref(Packet);
+    return true;
+}
+
 bool LWVideoDecoder::SkipFrames(int64_t Count) {
     while (Count-- > 0) {
         if (DecodeSuccess) {
@@ -468,6 +676,8 @@ bool LWVideoDecoder::Seek(int64_t PTS) {
     if (!Seeked && CodecContext->codec_id == AV_CODEC_ID_H264)
         SkipFrames(1);
     Seeked = true;
+    if (HWMode)
+        DiscardNextHWFrame();
     avcodec_flush_buffers(CodecContext);
     CurrentFrame = INT64_MIN;
     // Mild variable reuse, if seek fails then there's no point to decode more either
@@ -475,10 +685,23 @@ bool LWVideoDecoder::Seek(int64_t PTS) {
     return DecodeSuccess;
 }
 
+void LWVideoDecoder::SetPacketSource(BSPacketQueue *Packets) {
+    PacketSource = Packets;
+}
+
+void LWVideoDecoder::SetKeyFramesOnly() {
+    CodecContext->skip_frame = AVDISCARD_NONKEY;
+}
+
 bool LWVideoDecoder::HasSeeked() const {
     return Seeked;
 }
 
+bool LWVideoDecoder::IsIntraOnly() const {
+    const AVCodecDescriptor *Desc = avcodec_descriptor_get(CodecContext->codec_id);
+    return Desc && (Desc->props & AV_CODEC_PROP_INTRA_ONLY);
+}
+
 void BSVideoFormat::Set(const AVPixFmtDescriptor *Desc) {
     Alpha = HasAlpha(Desc);
     Float = GetSampleTypeIsFloat(Desc);
@@ -553,11 +776,13 @@ BestVideoFrame::BestVideoFrame(AVFrame *F) {
         DolbyVisionRPUSize = DolbyVisionRPUSideData->size;
     }
 
-    AVFrameSideData *HDR10PlusSideData = av_frame_get_side_data(Frame, AV_FRAME_DATA_DYNAMIC_HDR_PLUS);
+    // Part of the public fields so it's serialized up front, frames without HDR10+ metadata don't need an allocation
+    const AVFrameSideData *HDR10PlusSideData = av_frame_get_side_data(Frame, AV_FRAME_DATA_DYNAMIC_HDR_PLUS);
     if (HDR10PlusSideData) {
         int ret = av_dynamic_hdr_plus_to_t35(reinterpret_cast<const AVDynamicHDRPlus *>(HDR10PlusSideData->data), &HDR10Plus, &HDR10PlusSize);
         if (ret < 0) {
             // report error here "HDR10+ dynamic metadata could not be serialized."
+            HDR10PlusSize = 0;
         }
     }
 
@@ -577,6 +802,11 @@ const AVFrame *BestVideoFrame::GetAVFrame() const {
     return Frame;
 };
 
+const uint8_t *BestVideoFrame::GetHDR10Plus(size_t &Size) const {
+    Size = HDR10PlusSize;
+    return HDR10Plus;
+}
+
 void BestVideoFrame::MergeField(bool Top, const BestVideoFrame *AFieldSrc) {
     const AVFrame *FieldSrc = AFieldSrc->GetAVFrame();
     if (Frame->format != FieldSrc->format || Frame->width != FieldSrc->width || Frame->height != FieldSrc->height)
@@ -602,6 +832,7 @@ void BestVideoFrame::MergeField(bool Top, const BestVideoFrame *AFieldSrc) {
         if (Plane == 1 || Plane == 2)
             PlaneHeight >>= Desc->log2_chroma_h;
 
+        // Whole rows are copied so memcpy is already as fast as it gets, there's nothing for a separate kernel to do
         for (int h = Top ? 0 : 1; h < PlaneHeight; h += 2) {
             memcpy(DstData, SrcData, MinLineSize);
             DstData += 2 * DstLineSize;
@@ -641,31 +872,185 @@ static const std::map<AVPixelFormat, p2p_packing> FormatMap = {
     { AV_PIX_FMT_XV36, p2p_y412_le },
 };
 
-bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t *const Stride, uint8_t *AlphaDst, ptrdiff_t AlphaStride) const {
+static int GetBytesPerSample(const BSVideoFormat &VF) {
+    if (VF.Bits <= 8)
+        return 1;
+    else if (VF.Bits <= 16)
+        return 2;
+    else if (VF.Bits <= 32)
+        return 4;
+    else if (VF.Bits <= 64)
+        return 8;
+    return 0;
+}
+
+// Frames from hosts and decoders usually have the same padded stride in which case the whole plane is a single copy
+static void CopyPlane(uint8_t *Dst, ptrdiff_t DstStride, const uint8_t *Src, ptrdiff_t SrcStride, size_t RowBytes, int Height) {
+    if (Height <= 0)
+        return;
+    if (DstStride == SrcStride && DstStride > 0) {
+        memcpy(Dst, Src, (Height - 1) * DstStride + RowBytes);
+    } else {
+        for (int h = 0; h < Height; h++) {
+            memcpy(Dst, Src, RowBytes);
+            Src += SrcStride;
+            Dst += DstStride;
+        }
+    }
+}
+
+BestBorrowedPlanes::BestBorrowedPlanes(const AVFrame *F) {
+    Frame = av_frame_clone(F);
+    if (!Frame)
+        throw BestSourceException("Couldn't reference frame");
+}
+
+BestBorrowedPlanes::~BestBorrowedPlanes() {
+    av_frame_free(&Frame);
+}
+
+BestBorrowedPlanes *BestVideoFrame::BorrowPlanes() const {
+    if (VF.ColorFamily == 0 || !Frame->buf[0])
+        return nullptr;
+
+    auto Desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(Frame->format));
+    int BytesPerSample = GetBytesPerSample(VF);
+    if (!IsRealPlanar(Desc) || !BytesPerSample)
+        return nullptr;
+
+    std::unique_ptr<BestBorrowedPlanes> Result(new BestBorrowedPlanes(Frame));
+    int NumBasePlanes = (VF.ColorFamily == 1 ? 1 : 3);
+    for (int Plane = 0; Plane < NumBasePlanes; Plane++) {
+        int SrcPlane = Desc->comp[Plane].plane;
+        Result->Data[Plane] = Frame->data[SrcPlane];
+        Result->Stride[Plane] = Frame->linesize[SrcPlane];
+        Result->RowBytes[Plane] = BytesPerSample * (Plane > 0 ? (SSModWidth >> Desc->log2_chroma_w) : SSModWidth);
+        Result->Height[Plane] = (Plane > 0 ? (SSModHeight >> Desc->log2_chroma_h) : SSModHeight);
+    }
+    Result->NumPlanes = NumBasePlanes;
+
+    if (VF.Alpha) {
+        Result->Data[NumBasePlanes] = Frame->data[3];
+        Result->Stride[NumBasePlanes] = Frame->linesize[3];
+        Result->RowBytes[NumBasePlanes] = BytesPerSample * SSModWidth;
+        Result->Height[NumBasePlanes] = SSModHeight;
+        Result->NumPlanes++;
+    }
+
+    return Result.release();
+}
+
+namespace {
+    // Runs the row bands of large frame exports, the threads are started on first use and kept for the lifetime of the process
+    class ExportWorkerPool {
+    private:
+        std::mutex Mutex;
+        std::condition_variable Condition;
+        std::deque<std::packaged_task<bool()>> Tasks;
+        size_t NumWorkers = 0;
+
+        void WorkerLoop() {
+            while (true) {
+                std::packaged_task<bool()> Task;
+                {
+                    std::unique_lock<std::mutex> Lock(Mutex);
+                    Condition.wait(Lock, [this] { return !Tasks.empty(); });
+                    Task = std::move(Tasks.front());
+                    Tasks.pop_front();
+                }
+                Task();
+            }
+        }
+    public:
+        static constexpr size_t MaxWorkers = 16;
+
+        static ExportWorkerPool &Get() {
+            // Intentionally leaked so no thread ever has to be joined while a library is being unloaded
+            static ExportWorkerPool *Pool = new ExportWorkerPool();
+            return *Pool;
+        }
+
+        // The first function is run on the calling thread and the rest in the pool, exceptions count as failure
+        bool Run(std::vector<std::function<bool()>> &Functions) {
+            std::vector<std::future<bool>> Results;
+            {
+                std::lock_guard<std::mutex> Lock(Mutex);
+                for (size_t i = 1; i < Functions.size(); i++) {
+                    Tasks.emplace_back(Functions[i]);
+                    Results.push_back(Tasks.back().get_future());
+                }
+
+                for (; NumWorkers < std::min(Functions.size() - 1, MaxWorkers); NumWorkers++)
+                    std::thread(&ExportWorkerPool::WorkerLoop, this).detach();
+            }
+            Condition.notify_all();
+
+            // All bands have to finish before returning since they write into the caller's buffers
+            bool Success = false;
+            try {
+                Success = Functions[0]();
+            } catch (...) {
+            }
+
+            for (auto &Iter : Results) {
+                try {
+                    Success = Iter.get() && Success;
+                } catch (...) {
+                    Success = false;
+                }
+            }
+            return Success;
+        }
+    };
+}
+
+// Splitting smaller frames doesn't make up for the synchronization overhead
+static constexpr int64_t ParallelExportMinPixels = 3840 * 2160 / 2;
+static constexpr int ParallelExportMinRows = 64;
+
+bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts, const ptrdiff_t *const Stride, uint8_t *AlphaDst, ptrdiff_t AlphaStride, int Threads) const {
     if (VF.ColorFamily == 0)
         return false;
 
-    uint8_t *Dsts[3] = { Dsts1[0], Dsts1[1], Dsts1[2] };
+    int NumBands = 1;
+    if (Threads > 1 && static_cast<int64_t>(SSModWidth) * SSModHeight >= ParallelExportMinPixels)
+        NumBands = std::min<int>({ Threads, static_cast<int>(ExportWorkerPool::MaxWorkers) + 1, SSModHeight / ParallelExportMinRows });
+
+    if (NumBands <= 1)
+        return ExportRows(Dsts, Stride, AlphaDst, AlphaStride, 0, SSModHeight);
+
+    // Band boundaries have to fall on whole chroma rows
+    int RowAlignment = 1 << VF.SubSamplingH;
+    int BandHeight = ((SSModHeight / NumBands + RowAlignment - 1) / RowAlignment) * RowAlignment;
+
+    std::vector<std::function<bool()>> Functions;
+    for (int Top = 0; Top < SSModHeight; Top += BandHeight) {
+        int Bottom = std::min(Top + BandHeight, SSModHeight);
+        Functions.push_back([=]() { return ExportRows(Dsts, Stride, AlphaDst, AlphaStride, Top, Bottom); });
+    }
+
+    return ExportWorkerPool::Get().Run(Functions);
+}
+
+bool BestVideoFrame::ExportRows(uint8_t *const *const Dsts1, const ptrdiff_t *const Stride, uint8_t *AlphaDst, ptrdiff_t AlphaStride, int Top, int Bottom) const {
+    const BSExportKernels &Kernels = GetExportKernels();
 
     if (Frame->format == AV_PIX_FMT_PAL8) {
-        const uint8_t *Src = Frame->data[0];
+        const uint8_t *Src = Frame->data[0] + Top * Frame->linesize[0];
         const uint8_t *Palette = Frame->data[1];
-        for (int y = 0; y < SSModHeight; y++) {
-            for (int x = 0; x < SSModWidth; x++) {
-                uint8_t V = Src[x];
-                // So a palette is always BGRA order? Not really documented
-                Dsts[0][x] = Palette[V * 4 + 2];
-                Dsts[1][x] = Palette[V * 4 + 1];
-                Dsts[2][x] = Palette[V * 4 + 0];
-                if (AlphaDst)
-                    AlphaDst[x] = Palette[V * 4 + 3];
-            }
+        uint8_t *Dsts[3] = { Dsts1[0] + Top * Stride[0], Dsts1[1] + Top * Stride[1], Dsts1[2] + Top * Stride[2] };
+        if (AlphaDst)
+            AlphaDst += Top * AlphaStride;
+        for (int y = Top; y < Bottom; y++) {
+            // So a palette is always BGRA order? Not really documented
+            Kernels.DepaletteRow(Src, Palette, Dsts[0], Dsts[1], Dsts[2], AlphaDst, SSModWidth);
             Src += Frame->linesize[0];
             Dsts[0] += Stride[0];
             Dsts[1] += Stride[1];
             Dsts[2] += Stride[2];
-            AlphaDst += AlphaStride;
-        }   
+            if (AlphaDst)
+                AlphaDst += AlphaStride;
+        }
         return true;
     }
 
@@ -676,61 +1061,74 @@ bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t
         return false;
 
     // Keep it simple until someone complains
-    int BytesPerSample = 0;
-
-    if (VF.Bits <= 8)
-        BytesPerSample = 1;
-    if (VF.Bits > 8 && VF.Bits <= 16)
-        BytesPerSample = 2;
-    else if (VF.Bits > 16 && VF.Bits <= 32)
-        BytesPerSample = 4;
-    else if (VF.Bits > 32 && VF.Bits <= 64)
-        BytesPerSample = 8;
+    int BytesPerSample = GetBytesPerSample(VF);
 
     if (!BytesPerSample)
         return false;
 
+    int NumBasePlanes = (VF.ColorFamily == 1 ? 1 : 3);
+
+    // The first row of the band in each destination plane
+    uint8_t *Dsts[3] = {};
+    for (int Plane = 0; Plane < NumBasePlanes; Plane++)
+        Dsts[Plane] = Dsts1[Plane] + (Plane > 0 ? (Top >> VF.SubSamplingH) : Top) * Stride[Plane];
+    if (AlphaDst)
+        AlphaDst += Top * AlphaStride;
+
     if (IsRealPlanar(Desc)) {
-        int NumBasePlanes = (VF.ColorFamily == 1 ? 1 : 3);
         for (int Plane = 0; Plane < NumBasePlanes; Plane++) {
             int PlaneW = SSModWidth;
-            int PlaneH = SSModHeight;
+            int PlaneTop = Top;
+            int PlaneBottom = Bottom;
             if (Plane > 0) {
                 PlaneW >>= Desc->log2_chroma_w;
-                PlaneH >>= Desc->log2_chroma_h;
+                PlaneTop >>= Desc->log2_chroma_h;
+                PlaneBottom >>= Desc->log2_chroma_h;
             }
             int SrcPlane = Desc->comp[Plane].plane;
-            const uint8_t *Src = Frame->data[SrcPlane];
-            uint8_t *Dst = Dsts[Plane];
-            for (int h = 0; h < PlaneH; h++) {
-                memcpy(Dst, Src, BytesPerSample * PlaneW);
-                Src += Frame->linesize[SrcPlane];
-                Dst += Stride[Plane];
-            }
+            CopyPlane(Dsts[Plane], Stride[Plane], Frame->data[SrcPlane] + PlaneTop * Frame->linesize[SrcPlane], Frame->linesize[SrcPlane], BytesPerSample * PlaneW, PlaneBottom - PlaneTop);
         }
 
-        if (VF.Alpha && AlphaDst) {
-            const uint8_t *Src = Frame->data[3];
-            uint8_t *Dst = AlphaDst;
-            for (int h = 0; h < SSModHeight; h++) {
-                memcpy(Dst, Src, BytesPerSample * SSModWidth);
-                Src += Frame->linesize[3];
-                Dst += AlphaStride;
-            }
+        if (VF.Alpha && AlphaDst)
+            CopyPlane(AlphaDst, AlphaStride, Frame->data[3] + Top * Frame->linesize[3], Frame->linesize[3], BytesPerSample * SSModWidth, Bottom - Top);
+    } else if (IsSemiPlanar(Desc, BytesPerSample)) {
+        // NV12 and P010 style formats are what hardware decoders output so they get their own fast path
+        int Shift = Desc->comp[0].shift;
+        if (Shift == 0) {
+            CopyPlane(Dsts[0], Stride[0], Frame->data[0] + Top * Frame->linesize[0], Frame->linesize[0], BytesPerSample * SSModWidth, Bottom - Top);
+        } else {
+            for (int h = Top; h < Bottom; h++)
+                Kernels.ShiftRow16(Frame->data[0] + h * Frame->linesize[0], Dsts[0] + (h - Top) * Stride[0], SSModWidth, Shift);
         }
+
+        DeinterleaveRowFunc DeinterleaveRow = (BytesPerSample == 1) ? Kernels.DeinterleaveRow8 : Kernels.DeinterleaveRow16;
+        int ChromaTop = Top >> Desc->log2_chroma_h;
+        for (int h = ChromaTop; h < (Bottom >> Desc->log2_chroma_h); h++)
+            DeinterleaveRow(Frame->data[1] + h * Frame->linesize[1], Dsts[1] + (h - ChromaTop) * Stride[1], Dsts[2] + (h - ChromaTop) * Stride[2], SSModWidth >> Desc->log2_chroma_w, Shift);
+    } else if (IsPackedRGB8(Desc)) {
+        int Offsets[4] = {};
+        for (int i = 0; i < Desc->nb_components; i++)
+            Offsets[i] = Desc->comp[i].offset;
+        uint8_t *A = (Desc->nb_components == 4 && VF.Alpha) ? AlphaDst : nullptr;
+        for (int h = Top; h < Bottom; h++)
+            Kernels.UnpackRGBRow(Frame->data[0] + h * Frame->linesize[0], Dsts[0] + (h - Top) * Stride[0], Dsts[1] + (h - Top) * Stride[1], Dsts[2] + (h - Top) * Stride[2], A ? A + (h - Top) * AlphaStride : nullptr, Offsets, Desc->comp[0].step, SSModWidth);
+    } else if (IsPackedYUV4228(Desc)) {
+        const int Offsets[3] = { Desc->comp[0].offset, Desc->comp[1].offset, Desc->comp[2].offset };
+        for (int h = Top; h < Bottom; h++)
+            Kernels.UnpackYUV422Row(Frame->data[0] + h * Frame->linesize[0], Dsts[0] + (h - Top) * Stride[0], Dsts[1] + (h - Top) * Stride[1], Dsts[2] + (h - Top) * Stride[2], Offsets, SSModWidth / 2);
     } else {
         try {
             p2p_buffer_param Buf = {};
             Buf.packing = FormatMap.at(static_cast<AVPixelFormat>(Frame->format));
-            Buf.height = SSModHeight;
+            Buf.height = Bottom - Top;
             Buf.width = SSModWidth;
 
             for (int Plane = 0; Plane < Desc->nb_components; Plane++) {
-                Buf.src[Plane] = Frame->data[Plane];
+                Buf.src[Plane] = Frame->data[Plane] + (Plane > 0 ? (Top >> Desc->log2_chroma_h) : Top) * Frame->linesize[Plane];
                 Buf.src_stride[Plane] = Frame->linesize[Plane];
             }
 
-            for (int plane = 0; plane < (VF.ColorFamily == 1 ? 1 : 3); plane++) {
+            for (int plane = 0; plane < NumBasePlanes; plane++) {
                 Buf.dst[plane] = Dsts[plane];
                 Buf.dst_stride[plane] = Stride[plane];
             }
@@ -743,35 +1141,39 @@ bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t
             p2p_unpack_frame(&Buf, 0);
         } catch (std::out_of_range &) {
             if (BytesPerSample == 2 || BytesPerSample == 4) {
-                for (int Plane = 0; Plane < (VF.ColorFamily == 1 ? 1 : 3); Plane++) {
-                    int PlaneHeight = SSModHeight;
+                for (int Plane = 0; Plane < NumBasePlanes; Plane++) {
+                    int PlaneTop = Top;
+                    int PlaneBottom = Bottom;
                     int PlaneWidth = SSModWidth;
                     if (Plane > 0) {
-                        PlaneHeight >>= VF.SubSamplingH;
+                        PlaneTop >>= VF.SubSamplingH;
+                        PlaneBottom >>= VF.SubSamplingH;
                         PlaneWidth >>= VF.SubSamplingW;
                     }
 
-                    for (int y = 0; y < PlaneHeight; y++)
-                        av_read_image_line2(Dsts[Plane] + y * Stride[Plane], const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Plane, PlaneWidth, 0, BytesPerSample);
+                    for (int y = PlaneTop; y < PlaneBottom; y++)
+                        av_read_image_line2(Dsts[Plane] + (y - PlaneTop) * Stride[Plane], const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Plane, PlaneWidth, 0, BytesPerSample);
                 }
 
                 if (VF.Alpha && AlphaDst) {
-                    for (int y = 0; y < SSModHeight; y++)
-                        av_read_image_line2(AlphaDst + y * AlphaStride, const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Desc->nb_components - 1, SSModWidth, 0, BytesPerSample);
+                    for (int y = Top; y < Bottom; y++)
+                        av_read_image_line2(AlphaDst + (y - Top) * AlphaStride, const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Desc->nb_components - 1, SSModWidth, 0, BytesPerSample);
                 }
             } else if (BytesPerSample == 1) {
                 std::vector<uint16_t> TempSpace;
                 TempSpace.resize(SSModWidth);
-                for (int Plane = 0; Plane < (VF.ColorFamily == 1 ? 1 : 3); Plane++) {
+                for (int Plane = 0; Plane < NumBasePlanes; Plane++) {
                     uint8_t *RealDst = Dsts[Plane];
-                    int PlaneHeight = SSModHeight;
+                    int PlaneTop = Top;
+                    int PlaneBottom = Bottom;
                     int PlaneWidth = SSModWidth;
                     if (Plane > 0) {
-                        PlaneHeight >>= VF.SubSamplingH;
+                        PlaneTop >>= VF.SubSamplingH;
+                        PlaneBottom >>= VF.SubSamplingH;
                         PlaneWidth >>= VF.SubSamplingW;
                     }
 
-                    for (int y = 0; y < PlaneHeight; y++) {
+                    for (int y = PlaneTop; y < PlaneBottom; y++) {
                         av_read_image_line2(TempSpace.data(), const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Plane, PlaneWidth, 0, 2);
                         for (int x = 0; x < PlaneWidth; x++)
                             RealDst[x] = static_cast<uint8_t>(TempSpace[x]);
@@ -780,7 +1182,7 @@ bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t
                 }
 
                 if (VF.Alpha && AlphaDst) {
-                    for (int y = 0; y < SSModHeight; y++) {
+                    for (int y = Top; y < Bottom; y++) {
                         av_read_image_line2(TempSpace.data(), const_cast<const uint8_t **>(Frame->data), Frame->linesize, Desc, 0, y, Desc->nb_components - 1, SSModWidth, 0, 2);
                         for (int x = 0; x < SSModWidth; x++)
                             AlphaDst[x] = static_cast<uint8_t>(TempSpace[x]);
@@ -796,7 +1198,13 @@ bool BestVideoFrame::ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t
     return true;
 }
 
-static std::array<uint8_t, HashSize> GetHash(const AVFrame *Frame) {
+// Only every nth row of each plane is hashed in sparse mode, all planes are still included
+static constexpr int SparseHashRowStep = 4;
+
+static std::array<uint8_t, HashSize> GetHash(const AVFrame *Frame, bool Sparse) {
+    // The state is fairly large so one is kept around for each thread that hashes frames
+    thread_local std::unique_ptr<XXH3_state_t, decltype(&XXH3_freeState)> State(XXH3_createState(), &XXH3_freeState);
+
     std::array<uint8_t, HashSize> Result;
     const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(Frame->format));
     int NumPlanes = 0;
@@ -812,7 +1220,7 @@ static std::array<uint8_t, HashSize> GetHash(const AVFrame *Frame) {
         NumPlanes = std::max(NumPlanes, desc->comp[i].plane + 1);
     }
 
-    XXH3_state_t *hctx = XXH3_createState();
+    XXH3_state_t *hctx = State.get();
     XXH3_64bits_reset(hctx);
 
     for (int p = 0; p < NumPlanes; p++) {
@@ -825,9 +1233,17 @@ static std::array<uint8_t, HashSize> GetHash(const AVFrame *Frame) {
         Width *= SampleSize[p];
         assert(Width <= Frame->linesize[p]);
         const uint8_t *Data = Frame->data[p];
-        for (int h = 0; h < Height; h++) {
-            XXH3_64bits_update(hctx, Data, Width);
-            Data += Frame->linesize[p];
+        if (Sparse) {
+            for (int h = 0; h < Height; h += SparseHashRowStep)
+                XXH3_64bits_update(hctx, Data + h * Frame->linesize[p], Width);
+        } else if (Width == Frame->linesize[p]) {
+            // Gives the same result as hashing row by row
+            XXH3_64bits_update(hctx, Data, static_cast<size_t>(Width) * Height);
+        } else {
+            for (int h = 0; h < Height; h++) {
+                XXH3_64bits_update(hctx, Data, Width);
+                Data += Frame->linesize[p];
+            }
         }
     }
 
@@ -835,63 +1251,177 @@ static std::array<uint8_t, HashSize> GetHash(const AVFrame *Frame) {
     static_assert(sizeof(Result) == sizeof(FinalHash));
     memcpy(Result.data(), &FinalHash, sizeof(FinalHash));
 
-    XXH3_freeState(hctx);
     return Result;
 }
 
-BestVideoSource::Cache::CacheBlock::CacheBlock(int64_t FrameNumber, AVFrame *Frame) : FrameNumber(FrameNumber), Frame(Frame) {
+static std::atomic<uint64_t> FrameCacheUseCounter(0);
+
+BestVideoSource::Cache::CacheBlock::CacheBlock(int64_t FrameNumber, AVFrame *Frame) : FrameNumber(FrameNumber), Frame(Frame), LastUse(++FrameCacheUseCounter) {
     for (int i = 0; i < 4; i++)
         if (Frame->buf[i])
             Size += Frame->buf[i]->size;
+    AddFrameCacheMemory(Size);
 }
 
 BestVideoSource::Cache::CacheBlock::~CacheBlock() {
+    RemoveFrameCacheMemory(Size);
     av_frame_free(&Frame);
 }
 
-void BestVideoSource::Cache::ApplyMaxSize() {
-    while (Size > MaxSize) {
-        Size -= Data.back().Size;
-        Data.pop_back();
+std::mutex BestVideoSource::Cache::AllCachesMutex;
+std::set<BestVideoSource::Cache *> BestVideoSource::Cache::AllCaches;
+
+BestVideoSource::Cache::Cache() {
+    SetStripes(1);
+    std::lock_guard<std::mutex> Lock(AllCachesMutex);
+    AllCaches.insert(this);
+}
+
+BestVideoSource::Cache::~Cache() {
+    std::lock_guard<std::mutex> Lock(AllCachesMutex);
+    AllCaches.erase(this);
+}
+
+BestVideoSource::Cache::CacheStripe &BestVideoSource::Cache::GetStripe(int64_t FrameNumber) {
+    return *Stripes[FrameNumber % Stripes.size()];
+}
+
+void BestVideoSource::Cache::EvictLast(CacheStripe &Stripe) {
+    Stripe.Size -= Stripe.Data.back().Size;
+    Stripe.Index.erase(Stripe.Data.back().FrameNumber);
+    Stripe.Data.pop_back();
+    Stripe.Evictions++;
+}
+
+void BestVideoSource::Cache::ApplyMaxSize(CacheStripe &Stripe) {
+    size_t StripeMaxSize = MaxSize / Stripes.size();
+    while (Stripe.Size > StripeMaxSize)
+        EvictLast(Stripe);
+}
+
+void BestVideoSource::Cache::ApplyFrameCacheBudget() {
+    if (!IsFrameCacheOverBudget())
+        return;
+
+    std::lock_guard<std::mutex> Lock(AllCachesMutex);
+    if (!IsFrameCacheOverBudget())
+        return;
+
+    // Evicting a bit below the budget means all stripes only have to be scanned every few inserts instead of for every one
+    size_t Budget = GetFrameCacheBudget();
+    if (Budget == 0)
+        return;
+    size_t Target = Budget - Budget / 32;
+
+    // The stripes ordered by their least recently used frame. The frames in a stripe are ordered by LastUse so the oldest one can
+    // only be replaced by a newer one, an entry that's out of date is simply put back with the new value.
+    // The most recently inserted frame of a stripe is always kept so the frame that was just cached can still be returned.
+    typedef std::pair<uint64_t, CacheStripe *> StripeEntry;
+    std::priority_queue<StripeEntry, std::vector<StripeEntry>, std::greater<StripeEntry>> Oldest;
+    for (Cache *Iter : AllCaches) {
+        for (auto &Stripe : Iter->Stripes) {
+            std::lock_guard<std::mutex> StripeLock(Stripe->Mutex);
+            if (Stripe->Data.size() > 1)
+                Oldest.emplace(Stripe->Data.back().LastUse, Stripe.get());
+        }
+    }
+
+    while (!Oldest.empty() && GetFrameCacheMemoryUsed() > Target) {
+        StripeEntry Entry = Oldest.top();
+        Oldest.pop();
+        CacheStripe &Stripe = *Entry.second;
+        std::lock_guard<std::mutex> StripeLock(Stripe.Mutex);
+        if (Stripe.Data.size() > 1 && Stripe.Data.back().LastUse == Entry.first)
+            EvictLast(Stripe);
+        if (Stripe.Data.size() > 1)
+            Oldest.emplace(Stripe.Data.back().LastUse, &Stripe);
     }
 }
 
+void BestVideoSource::Cache::SetStripes(size_t Count) {
+    assert(Count > 0);
+    std::lock_guard<std::mutex> Lock(AllCachesMutex);
+    Stripes.clear();
+    for (size_t i = 0; i < Count; i++)
+        Stripes.emplace_back(new CacheStripe());
+}
+
 void BestVideoSource::Cache::Clear() {
-    Data.clear();
-    Size = 0;
+    for (auto &Iter : Stripes) {
+        std::lock_guard<std::mutex> Lock(Iter->Mutex);
+        Iter->Data.clear();
+        Iter->Index.clear();
+        Iter->Size = 0;
+    }
+}
+
+void BestVideoSource::Cache::RejectSeekedFrames() {
+    RejectSeeked = true;
+    Clear();
 }
 
 void BestVideoSource::Cache::SetMaxSize(size_t Bytes) {
     MaxSize = Bytes;
-    ApplyMaxSize();
+    for (auto &Iter : Stripes) {
+        std::lock_guard<std::mutex> Lock(Iter->Mutex);
+        ApplyMaxSize(*Iter);
+    }
 }
 
-void BestVideoSource::Cache::CacheFrame(int64_t FrameNumber, AVFrame *Frame) {
+void BestVideoSource::Cache::CacheFrame(int64_t FrameNumber, AVFrame *Frame, bool Seeked) {
     assert(Frame);
     assert(FrameNumber >= 0);
-    // Don't cache the same frame twice, get rid of the oldest copy instead
-    for (auto Iter = Data.begin(); Iter != Data.end(); ++Iter) {
-        if (Iter->FrameNumber == FrameNumber) {
-            Size -= Iter->Size;
-            Data.erase(Iter);
-            break;
+    {
+        CacheStripe &Stripe = GetStripe(FrameNumber);
+        std::lock_guard<std::mutex> Lock(Stripe.Mutex);
+        if (Seeked && RejectSeeked) {
+            av_frame_free(&Frame);
+            return;
+        }
+
+        // Don't cache the same frame twice, get rid of the oldest copy instead
+        auto Iter = Stripe.Index.find(FrameNumber);
+        if (Iter != Stripe.Index.end()) {
+            Stripe.Size -= Iter->second->Size;
+            Stripe.Data.erase(Iter->second);
+            Stripe.Index.erase(Iter);
         }
-    }
 
-    Data.emplace_front(FrameNumber, Frame);
-    Size += Data.front().Size;
-    ApplyMaxSize();
+        Stripe.Data.emplace_front(FrameNumber, Frame);
+        Stripe.Index[FrameNumber] = Stripe.Data.begin();
+        Stripe.Size += Stripe.Data.front().Size;
+        ApplyMaxSize(Stripe);
+    }
+    ApplyFrameCacheBudget();
 }
 
 BestVideoFrame *BestVideoSource::Cache::GetFrame(int64_t N) {
-    for (auto Iter = Data.begin(); Iter != Data.end(); ++Iter) {
-        if (Iter->FrameNumber == N) {
-            AVFrame *F = Iter->Frame;
-            Data.splice(Data.begin(), Data, Iter);
-            return new BestVideoFrame(F);
-        }
+    CacheStripe &Stripe = GetStripe(N);
+    std::lock_guard<std::mutex> Lock(Stripe.Mutex);
+    auto Iter = Stripe.Index.find(N);
+    if (Iter == Stripe.Index.end()) {
+        Stripe.Misses++;
+        return nullptr;
     }
-    return nullptr;
+
+    Stripe.Hits++;
+    Iter->second->LastUse = ++FrameCacheUseCounter;
+    AVFrame *F = Iter->second->Frame;
+    Stripe.Data.splice(Stripe.Data.begin(), Stripe.Data, Iter->second);
+    return new BestVideoFrame(F);
+}
+
+BSCacheStatistics BestVideoSource::Cache::GetStatistics() const {
+    BSCacheStatistics Result = {};
+    for (const auto &Iter : Stripes) {
+        std::lock_guard<std::mutex> Lock(Iter->Mutex);
+        Result.Hits += Iter->Hits;
+        Result.Misses += Iter->Misses;
+        Result.Evictions += Iter->Evictions;
+        Result.Size += Iter->Size;
+        Result.Frames += Iter->Data.size();
+    }
+    return Result;
 }
 
 bool BestVideoSource::NearestCommonFrameRate(BSRational &FPS) {
@@ -914,8 +1444,8 @@ bool BestVideoSource::NearestCommonFrameRate(BSRational &FPS) {
     return false;
 }
 
-BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, const ProgressFunction &Progress)
-    : Source(SourceFile), HWDevice(HWDeviceName), ExtraHWFrames(!HWDeviceName.empty() ? ExtraHWFrames : 0), VideoTrack(Track), ViewID(ViewID), Threads(Threads) {
+BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, const ProgressFunction &Progress, int IndexThreads, bool FastIndex, bool SparseHash, int MaxDecoders, size_t IOCacheSize, BSPacketQueue *IndexPackets)
+    : Source(SourceFile), HWDevice(HWDeviceName), ExtraHWFrames(!HWDeviceName.empty() ? ExtraHWFrames : 0), VideoTrack(Track), ViewID(ViewID), Threads(Threads), IndexThreads(IndexThreads), FastIndex(FastIndex), SparseHash(SparseHash), MaxDecoders(MaxDecoders), IndexPackets(IndexPackets) {
     // Only make file path absolute if it exists to pass through special protocol paths
     std::error_code ec;
     if (std::filesystem::exists(SourceFile, ec))
@@ -933,35 +1463,98 @@ BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const
     if (ViewID < 0)
         throw BestSourceException("ViewID must be 0 or greater");
 
-    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions));
+    if (IndexThreads < 0)
+        throw BestSourceException("IndexThreads must be 0 or greater");
+
+    if (MaxDecoders < 1)
+        throw BestSourceException("MaxDecoders must be 1 or greater");
+
+    if (IOCacheSize > 0 && BSBlockCache::IsSupported(Source))
+        BlockCache = std::make_shared<BSBlockCache>(Source, LAVFOptions, IOCacheSize);
+
+    FramePool = std::make_shared<BSFramePool>();
+
+    std::filesystem::path ProbeFile;
+    if (CacheMode != bcmDisable) {
+        ProbeFile = GetStreamProbePath(IsAbsolutePathCacheMode(CacheMode), CachePath, Source);
+        LoadStreamProbe(ProbeFile, Source, LAVFOptions);
+    }
+
+    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
 
     Decoder->GetVideoProperties(VP);
     VideoTrack = Decoder->GetTrack();
     FileSize = Decoder->GetSourceSize();
+    IntraOnlyCodec = Decoder->IsIntraOnly();
+
+    if (this->IndexThreads == 0)
+        this->IndexThreads = IntraOnlyCodec ? std::max<int>(1, std::thread::hardware_concurrency()) : 1;
+
+    int64_t IndexedFileSize = -1;
+    bool IndexLoaded = (CacheMode != bcmDisable && ReadVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath, IndexedFileSize));
+
+    // Other sources and processes may have the existing index mapped and on Windows such a file can't be replaced, the index in memory
+    // is just as good so failing to write it only means the track has to be indexed again next time
+    bool IndexStored = IndexLoaded;
+
+    if (IndexLoaded && IndexedFileSize != FileSize) {
+        size_t FirstNewFrame = 0;
+        IndexLoaded = ExtendTrackIndex(Progress, FirstNewFrame);
+        if (!IndexLoaded) {
+            BSDebugPrint("The existing index doesn't match the grown file, indexing the whole track");
+            TrackIndex = {};
+        } else if (ShouldWriteIndex(CacheMode, TrackIndex.size())) {
+            IndexStored = AppendVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath, FirstNewFrame) || WriteVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath, TrackIndex.size() / 4);
+            if (!IndexStored)
+                BSDebugPrint("Failed to write index to '" + CachePath.u8string() + "' for track #" + std::to_string(VideoTrack) + ", the extended index is only kept in memory");
+        }
+    }
 
-    if (CacheMode == bcmDisable || !ReadVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath)) {
+    if (!IndexLoaded) {
         if (!IndexTrack(Progress))
             throw BestSourceException("Indexing of '" + Source.u8string() + "' track #" + std::to_string(VideoTrack) + " failed");
 
-        if (ShouldWriteIndex(CacheMode, TrackIndex.Frames.size())) {
-            if (!WriteVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath))
-                throw BestSourceException("Failed to write index to '" + CachePath.u8string() + "' for track #" + std::to_string(VideoTrack));
+        // Fast indexes are never written but the probe and seek history are still worth keeping for them
+        IndexStored = ShouldWriteIndex(CacheMode, TrackIndex.size());
+        if (IndexStored && !TrackIndex.HashKnown) {
+            // Files that are still being written can then be extended in place while other readers have the index mapped
+            IndexStored = WriteVideoTrackIndex(IsAbsolutePathCacheMode(CacheMode), CachePath, TrackIndex.size() / 4);
+            if (!IndexStored)
+                BSDebugPrint("Failed to write index to '" + CachePath.u8string() + "' for track #" + std::to_string(VideoTrack) + ", the index is only kept in memory");
         }
     }
 
-    if (TrackIndex.Frames[0].RepeatPict < 0)
+    if (CacheMode != bcmDisable && IndexStored) {
+        StoreStreamProbe(ProbeFile, Source, LAVFOptions);
+        SeekHistoryFile = GetCacheFilePath(IsAbsolutePathCacheMode(CacheMode), CachePath, Source, VideoTrack);
+        BSSeekHistory History;
+        if (ReadSeekHistory(SeekHistoryFile, true, FileSize, TrackIndex.size(), History)) {
+            BSDebugPrint("Loaded seek history with " + std::to_string(History.BadSeekLocations.size()) + " bad seek locations" + (History.LinearMode ? " and linear mode" : ""));
+            BadSeekLocations = std::move(History.BadSeekLocations);
+            LinearMode = History.LinearMode;
+        }
+    }
+
+    if (TrackIndex.GetRepeatPict(0) < 0)
         throw BestSourceException("Found an unexpected RFF quirk, please submit a bug report and attach the source file");
 ;
 
+    // Only trust the keyframe flags for codecs that can't code anything else, broken files may have every frame flagged when indexing
+    AllIntra = IntraOnlyCodec;
+    for (size_t i = 0; AllIntra && i < TrackIndex.size(); i++)
+        AllIntra = TrackIndex.IsKeyFrame(i) && TrackIndex.GetPTS(i) != AV_NOPTS_VALUE && (i == 0 || TrackIndex.GetPTS(i) > TrackIndex.GetPTS(i - 1));
+    if (AllIntra)
+        MinSeekFrame = 1;
+
     // Framerate and last frame duration guessing fun
     const auto OriginalFPS = VP.FPS;
     std::map<int64_t, size_t> DurationHistogram;
 
-    for (size_t i = 0; i < TrackIndex.Frames.size() - 1; i++)
-        if (TrackIndex.Frames[i].PTS == AV_NOPTS_VALUE || TrackIndex.Frames[i + 1].PTS == AV_NOPTS_VALUE)
+    for (size_t i = 0; i < TrackIndex.size() - 1; i++)
+        if (TrackIndex.GetPTS(i) == AV_NOPTS_VALUE || TrackIndex.GetPTS(i + 1) == AV_NOPTS_VALUE)
             ++DurationHistogram[AV_NOPTS_VALUE];
         else
-            ++DurationHistogram[TrackIndex.Frames[i + 1].PTS - TrackIndex.Frames[i].PTS];
+            ++DurationHistogram[TrackIndex.GetPTS(i + 1) - TrackIndex.GetPTS(i)];
 
     std::pair<int64_t, size_t> MostCommonDuration(1, 1);
     if (!DurationHistogram.empty())
@@ -972,14 +1565,14 @@ BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const
         LastFrameDuration = MostCommonDuration.first;
     LastFrameDuration = std::max<int64_t>(1, LastFrameDuration);
 
-    VP.Duration = (TrackIndex.Frames.back().PTS - TrackIndex.Frames.front().PTS) + LastFrameDuration;
+    VP.Duration = (TrackIndex.GetPTS(TrackIndex.size() - 1) - TrackIndex.GetPTS(0)) + LastFrameDuration;
     
     if (DurationHistogram.size() == 1 && MostCommonDuration.first > 0) {
         // It's true CFR so make sure the frame rate matches the frame durations
         av_reduce(&VP.FPS.Num, &VP.FPS.Den, VP.TimeBase.Den, MostCommonDuration.first * VP.TimeBase.Num, INT_MAX);
-    } else if (TrackIndex.Frames.size() >= 20 && DurationHistogram.size() > 1) {
+    } else if (TrackIndex.size() >= 20 && DurationHistogram.size() > 1) {
         // If the clip is long enough discard as many small duration bins as possible but less than 5% of the total number of frame durations and calculate a frame rate from that
-        size_t TotalHistogramFrames = TrackIndex.Frames.size() - 1;
+        size_t TotalHistogramFrames = TrackIndex.size() - 1;
         size_t UsedHistogramFrames = TotalHistogramFrames - DurationHistogram[AV_NOPTS_VALUE];
         DurationHistogram.erase(AV_NOPTS_VALUE);
 
@@ -1000,11 +1593,11 @@ BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const
             av_reduce(&VP.FPS.Num, &VP.FPS.Den, UsedHistogramFrames * VP.TimeBase.Den, HistDuration * VP.TimeBase.Num, INT_MAX);
             NearestCommonFrameRate(VP.FPS);
         }
-    } else if (VP.FPS.Num == 90000 && VP.FPS.Den == 1 && TrackIndex.Frames.size() >= 2) {
+    } else if (VP.FPS.Num == 90000 && VP.FPS.Den == 1 && TrackIndex.size() >= 2) {
         // This is the mpeg timebase and definitely not anywhere near the real fps so just fill in something more sane based on the duration of a single frame in the middle of the clip and hope it's good enough
         // It's a fallback to make even obviously wrong mpeg timebase files have a saner framerate
-        int64_t F1 = TrackIndex.Frames[TrackIndex.Frames.size() / 2].PTS;
-        int64_t F2 = TrackIndex.Frames[TrackIndex.Frames.size() / 2 - 1].PTS;
+        int64_t F1 = TrackIndex.GetPTS(TrackIndex.size() / 2);
+        int64_t F2 = TrackIndex.GetPTS(TrackIndex.size() / 2 - 1);
         if (F1 != AV_NOPTS_VALUE && F2 != AV_NOPTS_VALUE) {
             av_reduce(&VP.FPS.Num, &VP.FPS.Den, VP.TimeBase.Den, (F1 - F2) * VP.TimeBase.Num, INT_MAX);
             NearestCommonFrameRate(VP.FPS);
@@ -1017,7 +1610,20 @@ BestVideoSource::BestVideoSource(const std::filesystem::path &SourceFile, const
     if (DefaultFormatSet.NumFrames != DefaultFormatSet.NumRFFFrames)
         VP.FPS = OriginalFPS; // Restore the original FPS since it's generally always correct for files with RFF set
 
-    Decoders[0] = std::move(Decoder);
+    CreateLanes(false);
+    Lanes[0]->Decoders[0] = std::move(Decoder);
+    MarkDecoderUsed(*Lanes[0], 0);
+}
+
+BestVideoSource::~BestVideoSource() {
+    if (PrefetchThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> Lock(PrefetchMutex);
+            PrefetchExit = true;
+            PrefetchCondition.notify_all();
+        }
+        PrefetchThread.join();
+    }
 }
 
 int BestVideoSource::GetTrack() const {
@@ -1028,6 +1634,125 @@ void BestVideoSource::SetMaxCacheSize(size_t Bytes) {
     FrameCache.SetMaxSize(Bytes);
 }
 
+void BestVideoSource::SetCachePlanar(bool Planar) {
+    if (Planar == CachePlanar)
+        return;
+    // Frames of both layouts mixed would make fields from cached and newly decoded frames impossible to merge
+    FrameCache.Clear();
+    CachePlanar = Planar;
+}
+
+// The planar format with the same properties that ExportAsPlanar() only has to copy
+static AVPixelFormat GetPlanarFormat(const BSVideoFormat &VF) {
+    int BytesPerSample = GetBytesPerSample(VF);
+    for (const AVPixFmtDescriptor *Desc = av_pix_fmt_desc_next(nullptr); Desc; Desc = av_pix_fmt_desc_next(Desc)) {
+        if ((Desc->flags & (AV_PIX_FMT_FLAG_BE | AV_PIX_FMT_FLAG_HWACCEL | AV_PIX_FMT_FLAG_BITSTREAM | AV_PIX_FMT_FLAG_BAYER | AV_PIX_FMT_FLAG_XYZ)) || !IsRealPlanar(Desc))
+            continue;
+
+        BSVideoFormat Candidate;
+        Candidate.Set(Desc);
+        if (Candidate.ColorFamily != VF.ColorFamily || Candidate.Alpha != VF.Alpha || Candidate.Float != VF.Float || Candidate.Bits != VF.Bits || Candidate.SubSamplingW != VF.SubSamplingW || Candidate.SubSamplingH != VF.SubSamplingH)
+            continue;
+
+        bool Plain = (!VF.Alpha || (Desc->nb_components == 4 && Desc->comp[3].plane == 3));
+        for (int i = 0; i < Desc->nb_components; i++)
+            Plain = Plain && Desc->comp[i].shift == 0 && Desc->comp[i].offset == 0 && Desc->comp[i].step == BytesPerSample;
+        if (Plain)
+            return av_pix_fmt_desc_get_id(Desc);
+    }
+    return AV_PIX_FMT_NONE;
+}
+
+AVFrame *BestVideoSource::ConvertForCache(AVFrame *Frame) {
+    if (!CachePlanar)
+        return Frame;
+
+    // Planar frames are exported with a plain copy so there's nothing to gain
+    const AVPixFmtDescriptor *Desc = av_pix_fmt_desc_get(static_cast<AVPixelFormat>(Frame->format));
+    if (!Desc || IsRealPlanar(Desc))
+        return Frame;
+
+    BestVideoFrame Src(Frame);
+    AVPixelFormat Format = GetPlanarFormat(Src.VF);
+    if (Format == AV_PIX_FMT_NONE || Src.VF.ColorFamily == 0)
+        return Frame;
+
+    AVFrame *Dst = av_frame_alloc();
+    if (!Dst || !FramePool->AllocateFrame(Dst, Format, Frame->width, Frame->height) || av_frame_copy_props(Dst, Frame) < 0) {
+        av_frame_free(&Dst);
+        return Frame;
+    }
+
+    const AVPixFmtDescriptor *DstDesc = av_pix_fmt_desc_get(Format);
+    uint8_t *Dsts[3] = {};
+    ptrdiff_t DstStride[3] = {};
+    int NumBasePlanes = (Src.VF.ColorFamily == 1 ? 1 : 3);
+    for (int Plane = 0; Plane < NumBasePlanes; Plane++) {
+        int DstPlane = DstDesc->comp[Plane].plane;
+        Dsts[Plane] = Dst->data[DstPlane];
+        DstStride[Plane] = Dst->linesize[DstPlane];
+    }
+
+    if (!Src.ExportAsPlanar(Dsts, DstStride, Src.VF.Alpha ? Dst->data[3] : nullptr, Src.VF.Alpha ? Dst->linesize[3] : 0)) {
+        av_frame_free(&Dst);
+        return Frame;
+    }
+
+    av_frame_free(&Frame);
+    return Dst;
+}
+
+BSCacheStatistics BestVideoSource::GetCacheStatistics() const {
+    return FrameCache.GetStatistics();
+}
+
+BSSourceStatistics BestVideoSource::GetStatistics() const {
+    std::lock_guard<std::mutex> Lock(StatsMutex);
+    BSSourceStatistics Result = Stats;
+    Result.Cache = FrameCache.GetStatistics();
+    return Result;
+}
+
+void BestVideoSource::SetTraceCallback(const TraceFunction &Callback) {
+    TraceCallback = Callback;
+}
+
+void BestVideoSource::BeginRequest(DecoderLane &Lane, int64_t N) {
+    Lane.Trace = {};
+    Lane.Trace.Track = VideoTrack;
+    Lane.Trace.Frame = N;
+    Lane.RequestStart = std::chrono::steady_clock::now();
+}
+
+void BestVideoSource::EndRequest(DecoderLane &Lane) {
+    for (auto &Iter : Lane.Decoders)
+        if (Iter)
+            Lane.Trace.BytesRead += Iter->TakeBytesRead();
+    Lane.Trace.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Lane.RequestStart).count();
+    RecordRequest(Lane.Trace);
+}
+
+void BestVideoSource::RecordRequest(const BSRequestTrace &Trace) {
+    {
+        std::lock_guard<std::mutex> Lock(StatsMutex);
+        Stats.AddRequest(Trace);
+    }
+    if (TraceCallback)
+        TraceCallback(Trace);
+}
+
+void BestVideoSource::SetPrefetch(int64_t Frames) {
+    if (Frames < 0)
+        throw BestSourceException("Prefetch must be 0 or greater");
+
+    std::unique_lock<std::mutex> Lock(PrefetchMutex);
+    PrefetchFrames = ConcurrentMode ? 0 : Frames;
+    if (PrefetchFrames == 0)
+        StopPrefetch(Lock);
+    else if (!PrefetchThread.joinable())
+        PrefetchThread = std::thread(&BestVideoSource::PrefetchWorker, this);
+}
+
 void BestVideoSource::SetSeekPreRoll(int64_t Frames) {
     if (Frames < 0 || Frames > 40)
         throw BestSourceException("SeekPreRoll must be between 0 and 40");
@@ -1035,10 +1760,26 @@ void BestVideoSource::SetSeekPreRoll(int64_t Frames) {
 }
 
 bool BestVideoSource::IndexTrack(const ProgressFunction &Progress) {
-    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions));
+    if (FastIndex && !IndexPackets) {
+        if (IndexTrackFast(Progress))
+            return true;
+        BSDebugPrint("Fast indexing not possible, falling back to decoding the whole track");
+        TrackIndex = {};
+    }
+
+    if (IndexThreads > 1 && !IndexPackets) {
+        if (IndexTrackParallel(Progress))
+            return true;
+        BSDebugPrint("Parallel indexing not possible, falling back to indexing the whole track in order");
+        TrackIndex = {};
+    }
+
+    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
+    Decoder->SetPacketSource(IndexPackets);
 
     int64_t FileSize = Progress ? Decoder->GetSourceSize() : -1;
 
+    std::vector<FrameInfo> Frames;
     TrackIndex.LastFrameDuration = 0;
     bool HasKeyFrames = false;
     bool HasEarlyKeyFrames = false;
@@ -1049,9 +1790,9 @@ bool BestVideoSource::IndexTrack(const ProgressFunction &Progress) {
             break;
 
         HasKeyFrames = HasKeyFrames || !!(F->flags & AV_FRAME_FLAG_KEY);
-        if (TrackIndex.Frames.size() < 100)
+        if (Frames.size() < 100)
             HasEarlyKeyFrames = HasKeyFrames;
-        TrackIndex.Frames.push_back({ F->pts, F->repeat_pict, !!(F->flags & AV_FRAME_FLAG_KEY), !!(F->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST), F->format, F->width, F->height, GetHash(F) });
+        Frames.push_back({ F->pts, F->repeat_pict, !!(F->flags & AV_FRAME_FLAG_KEY), !!(F->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST), F->format, F->width, F->height, GetHash(F, SparseHash) });
         TrackIndex.LastFrameDuration = F->duration;
 
         av_frame_free(&F);
@@ -1064,73 +1805,1086 @@ bool BestVideoSource::IndexTrack(const ProgressFunction &Progress) {
     if (Progress)
         Progress(VideoTrack, INT64_MAX, INT64_MAX);
 
-    if (!TrackIndex.Frames.empty()) {
+    if (!Frames.empty()) {
         if (!HasKeyFrames) {
             BSDebugPrint("No keyframes found when indexing which indicates an incorrectly flagged or very broken file, this may or may not cause performance problems when seeking");
-            for (auto &Iter : TrackIndex.Frames)
+            for (auto &Iter : Frames)
                 Iter.KeyFrame = true;
         } else if (!HasEarlyKeyFrames) {
             BSDebugPrint("No keyframes found in the first 100 frames when indexing, this may or may not cause performance problems when seeking");
         }
     }
 
-    return !TrackIndex.Frames.empty();
-}
-
-const BSVideoProperties &BestVideoSource::GetVideoProperties() const {
-    return VP;
+    TrackIndex.Assign(Frames);
+    return !TrackIndex.empty();
 }
 
 // Short algorithm summary
-// 1. If a current decoder is close to the requested frame simply start from there
-//    Determine if a decoder is "close" based on whether or not it is already in the optimal zone based on the existing keyframes
-// 2. If a decoder isn't nearby and the seek destination is within the first 100 frames simply start with a fresh decoder to avoid the seek to start issue (technically almost always fresh)
-// 3. Seek with an existing or new decoder. Seek to the nearest keyframe at or before frame N-preroll using PTS. If no such point exists more than 100 frames after the start don't seek.
+// 1. Split the track into equally long PTS ranges and seek a separate decoder to the start of each one. Seeking always lands on a keyframe at or before the requested position.
+// 2. Every segment except the last keeps decoding past the start of the following segment until a number of frames beyond the boundary have been seen. This is the overlap.
+// 3. To stitch two segments together a string of frames starting at the first keyframe in the later segment is located in the overlap of the earlier one by matching both PTS and hashes.
+//    The location has to be unique and all remaining frames of the overlap have to be identical in both segments or the whole attempt is considered failed.
+// 4. Failure in any step means the track is indexed the normal way instead.
+
+bool BestVideoSource::IndexTrackParallel(const ProgressFunction &Progress) {
+    static constexpr size_t SeamMatchFrames = 10;
+    static constexpr size_t SeamSearchFrames = 10;
+    // Segments of intra-only tracks start exactly where the decoder seeked to so they can be a lot shorter and only need enough overlap to find the seam
+    const int64_t MinSegmentFrames = IntraOnlyCodec ? 100 : 1000;
+    const int64_t OverlapFrames = IntraOnlyCodec ? static_cast<int64_t>(SeamMatchFrames + SeamSearchFrames) : 50;
+
+    if (VP.Duration <= 0 || VP.NumFrames <= 0)
+        return false;
+
+    int Segments = static_cast<int>(std::min<int64_t>(IndexThreads, VP.NumFrames / MinSegmentFrames));
+    if (Segments < 2)
+        return false;
+
+    int64_t StartPTS;
+    {
+        std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
+        StartPTS = Decoder->GetStartPTS();
+    }
+
+    if (StartPTS == AV_NOPTS_VALUE)
+        StartPTS = 0;
+
+    std::vector<int64_t> SegmentStart;
+    for (int i = 0; i <= Segments; i++)
+        SegmentStart.push_back(StartPTS + (VP.Duration * i) / Segments);
+
+    int SegmentThreads = Threads;
+    if (SegmentThreads < 1 && HWDevice.empty())
+        SegmentThreads = std::max<int>(1, std::thread::hardware_concurrency() / Segments);
+
+    struct SegmentResult {
+        std::vector<FrameInfo> Frames;
+        int64_t LastFrameDuration = 0;
+        bool Success = false;
+    };
+
+    std::atomic_bool Abort(false);
+    std::vector<std::atomic<int64_t>> Processed(Segments);
+    for (auto &Iter : Processed)
+        Iter = 0;
+
+    auto IndexSegment = [&](int Segment) {
+        SegmentResult Result;
+        try {
+            std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, SegmentThreads, LAVFOptions, BlockCache.get(), FramePool.get()));
+            if (Segment > 0 && !Decoder->Seek(SegmentStart[Segment]))
+                return Result;
+
+            int64_t StartPosition = Decoder->GetSourcePostion();
+            bool LastSegment = (Segment == Segments - 1);
+            int64_t FramesBeyondEnd = 0;
+
+            while (!Abort) {
+                AVFrame *F = Decoder->GetNextFrame();
+                if (!F)
+                    break;
+
+                Result.Frames.push_back({ F->pts, F->repeat_pict, !!(F->flags & AV_FRAME_FLAG_KEY), !!(F->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST), F->format, F->width, F->height, GetHash(F, SparseHash) });
+                Result.LastFrameDuration = F->duration;
+
+                if (!LastSegment && F->pts != AV_NOPTS_VALUE && F->pts >= SegmentStart[Segment + 1])
+                    FramesBeyondEnd++;
+
+                av_frame_free(&F);
+                Processed[Segment] = Decoder->GetSourcePostion() - StartPosition;
+
+                if (FramesBeyondEnd >= OverlapFrames)
+                    break;
+            }
+
+            Result.Success = !Abort && !Result.Frames.empty();
+        } catch (BestSourceException &) {
+            Result.Success = false;
+        }
+        return Result;
+    };
+
+    std::vector<std::future<SegmentResult>> Workers;
+    for (int i = 0; i < Segments; i++)
+        Workers.push_back(std::async(std::launch::async, IndexSegment, i));
+
+    bool Canceled = false;
+    for (auto &Iter : Workers) {
+        while (Iter.wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+            if (Progress && !Canceled) {
+                int64_t Current = 0;
+                for (const auto &P : Processed)
+                    Current += P;
+                if (!Progress(VideoTrack, std::min(Current, FileSize), FileSize)) {
+                    Canceled = true;
+                    Abort = true;
+                }
+            }
+        }
+    }
+
+    std::vector<SegmentResult> Results;
+    for (auto &Iter : Workers)
+        Results.push_back(Iter.get());
+
+    if (Canceled)
+        throw BestSourceException("Indexing canceled by user");
+
+    for (const auto &Iter : Results)
+        if (!Iter.Success)
+            return false;
+
+    auto FramesEqual = [](const FrameInfo &A, const FrameInfo &B) {
+        return A.PTS == B.PTS && A.Hash == B.Hash;
+    };
+
+    std::vector<FrameInfo> Frames = std::move(Results[0].Frames);
+    size_t PreviousSegmentStart = 0;
+
+    for (int Segment = 1; Segment < Segments; Segment++) {
+        const std::vector<FrameInfo> &Next = Results[Segment].Frames;
+
+        size_t FirstKeyFrame = 0;
+        while (FirstKeyFrame < Next.size() && !Next[FirstKeyFrame].KeyFrame)
+            FirstKeyFrame++;
+
+        bool Stitched = false;
+        for (size_t NextStart = FirstKeyFrame; !Stitched && NextStart < std::min(FirstKeyFrame + SeamSearchFrames, Next.size()); NextStart++) {
+            size_t MatchLength = std::min(SeamMatchFrames, Next.size() - NextStart);
+            if (Frames.size() < PreviousSegmentStart + MatchLength)
+                break;
+
+            std::vector<size_t> Matches;
+            for (size_t i = PreviousSegmentStart; i <= Frames.size() - MatchLength; i++) {
+                bool Match = true;
+                for (size_t j = 0; Match && j < MatchLength; j++)
+                    Match = FramesEqual(Frames[i + j], Next[NextStart + j]);
+                if (Match)
+                    Matches.push_back(i);
+            }
+
+            if (Matches.size() != 1)
+                continue;
+
+            size_t Seam = Matches.front();
+            size_t OverlapLength = Frames.size() - Seam;
+            if (OverlapLength > Next.size() - NextStart)
+                return false;
+
+            for (size_t i = 0; i < OverlapLength; i++) {
+                if (!FramesEqual(Frames[Seam + i], Next[NextStart + i])) {
+                    BSDebugPrint("Frames in the overlap between two index segments differ", Seam + i);
+                    return false;
+                }
+            }
+
+            Frames.resize(Seam);
+            PreviousSegmentStart = Seam;
+            Frames.insert(Frames.end(), Next.begin() + NextStart, Next.end());
+            Stitched = true;
+        }
+
+        if (!Stitched) {
+            BSDebugPrint("Couldn't locate the start of index segment " + std::to_string(Segment) + " in the previous segment");
+            return false;
+        }
+    }
+
+    TrackIndex.LastFrameDuration = Results.back().LastFrameDuration;
+
+    if (Progress)
+        Progress(VideoTrack, INT64_MAX, INT64_MAX);
+
+    bool HasKeyFrames = false;
+    bool HasEarlyKeyFrames = false;
+    for (size_t i = 0; i < Frames.size(); i++) {
+        HasKeyFrames = HasKeyFrames || Frames[i].KeyFrame;
+        if (i < 100)
+            HasEarlyKeyFrames = HasKeyFrames;
+    }
+
+    if (!HasKeyFrames) {
+        BSDebugPrint("No keyframes found when indexing which indicates an incorrectly flagged or very broken file, this may or may not cause performance problems when seeking");
+        for (auto &Iter : Frames)
+            Iter.KeyFrame = true;
+    } else if (!HasEarlyKeyFrames) {
+        BSDebugPrint("No keyframes found in the first 100 frames when indexing, this may or may not cause performance problems when seeking");
+    }
+
+    TrackIndex.Assign(Frames);
+    return true;
+}
+
+bool BestVideoSource::IndexTrackFast(const ProgressFunction &Progress) {
+    static constexpr size_t VerifyFrames = 30;
+
+    std::vector<std::pair<int64_t, bool>> Packets;
+
+    {
+        std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
+        int64_t PTS;
+        int Flags;
+        while (Decoder->ReadPacketInfo(PTS, Flags)) {
+            // Packets that are dropped or otherwise special make it impossible to know which frames will be output
+            if (PTS == AV_NOPTS_VALUE || (Flags & (AV_PKT_FLAG_CORRUPT | AV_PKT_FLAG_DISCARD))) {
+                BSDebugPrint("Found a packet without a timestamp or with unusual flags when fast indexing", Packets.size());
+                return false;
+            }
+            Packets.emplace_back(PTS, !!(Flags & AV_PKT_FLAG_KEY));
+
+            if (Progress) {
+                if (!Progress(VideoTrack, Decoder->GetSourcePostion(), FileSize))
+                    throw BestSourceException("Indexing canceled by user");
+            }
+        }
+    }
+
+    if (Packets.empty())
+        return false;
+
+    std::sort(Packets.begin(), Packets.end());
+    for (size_t i = 1; i < Packets.size(); i++) {
+        if (Packets[i - 1].first == Packets[i].first) {
+            BSDebugPrint("Found duplicate packet timestamps when fast indexing", i);
+            return false;
+        }
+    }
+
+    // Decode the first few frames to get the format and to make sure that the packets actually correspond to the output frames
+    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
+    std::vector<std::pair<FrameInfo, std::array<uint8_t, HashSize>>> Decoded;
+    while (Decoded.size() < std::min(VerifyFrames, Packets.size())) {
+        AVFrame *F = Decoder->GetNextFrame();
+        if (!F)
+            break;
+        Decoded.push_back(std::make_pair(FrameInfo{ F->pts, F->repeat_pict, !!(F->flags & AV_FRAME_FLAG_KEY), !!(F->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST), F->format, F->width, F->height }, GetHash(F, SparseHash)));
+        TrackIndex.LastFrameDuration = F->duration;
+        av_frame_free(&F);
+    }
+
+    if (Decoded.size() != std::min(VerifyFrames, Packets.size()))
+        return false;
+
+    for (size_t i = 0; i < Decoded.size(); i++) {
+        if (Decoded[i].first.PTS != Packets[i].first) {
+            BSDebugPrint("Decoded frames don't match the packets when fast indexing", i);
+            return false;
+        }
+    }
+
+    // The format sets, output properties and RFF tables are only derived once from the guessed properties so
+    // anything that would make the guesses wrong needs a full index
+    const FrameInfo &First = Decoded.front().first;
+    for (size_t i = 0; i < Decoded.size(); i++) {
+        const FrameInfo &FI = Decoded[i].first;
+        if (FI.RepeatPict != 0 || FI.Format != First.Format || FI.Width != First.Width || FI.Height != First.Height) {
+            BSDebugPrint("Found repeated fields or a format change when fast indexing", i);
+            return false;
+        }
+    }
+
+    bool HasKeyFrames = false;
+    std::vector<FrameInfo> Frames;
+    Frames.reserve(Packets.size());
+    for (const auto &Iter : Packets) {
+        Frames.push_back({ Iter.first, 0, Iter.second, First.TFF, First.Format, First.Width, First.Height, {} });
+        HasKeyFrames = HasKeyFrames || Iter.second;
+    }
+
+    if (!HasKeyFrames) {
+        BSDebugPrint("No keyframes found when fast indexing which indicates an incorrectly flagged or very broken file, this may or may not cause performance problems when seeking");
+        for (auto &Iter : Frames)
+            Iter.KeyFrame = true;
+    }
+
+    for (size_t i = 0; i < Decoded.size(); i++) {
+        Frames[i] = Decoded[i].first;
+        Frames[i].Hash = Decoded[i].second;
+    }
+
+    TrackIndex.Assign(Frames);
+    TrackIndex.ReserveDictionary();
+    TrackIndex.HashKnown.reset(new std::atomic_bool[TrackIndex.size()]());
+    for (size_t i = 0; i < Decoded.size(); i++)
+        TrackIndex.HashKnown[i] = true;
+
+    if (Progress)
+        Progress(VideoTrack, INT64_MAX, INT64_MAX);
+
+    return true;
+}
+
+// Frames at the end of a file that's still being written may have been decoded from incomplete data so everything from
+// the second to last keyframe is decoded again. The first frames after it have to match the old index exactly to know
+// that the file only grew and that the seek ended up in the right place.
+
+bool BestVideoSource::ExtendTrackIndex(const ProgressFunction &Progress, size_t &FirstNewFrame) {
+    static constexpr size_t VerifyFrames = 10;
+    static constexpr size_t MaxSearchFrames = 1000;
+
+    int64_t LastKeyFrame = -1;
+    int64_t ResumeFrame = -1;
+    for (int64_t i = TrackIndex.GetPreviousKeyFrame(TrackIndex.size() - 1); i >= 0 && ResumeFrame < 0; i = TrackIndex.GetPreviousKeyFrame(i - 1)) {
+        if (TrackIndex.GetPTS(i) != AV_NOPTS_VALUE) {
+            if (LastKeyFrame < 0)
+                LastKeyFrame = i;
+            else
+                ResumeFrame = i;
+        }
+    }
+
+    if (ResumeFrame < 0)
+        return false;
+
+    std::unique_ptr<LWVideoDecoder> Decoder(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
+    if (!Decoder->Seek(TrackIndex.GetPTS(ResumeFrame)))
+        return false;
+
+    std::vector<FrameInfo> NewFrames;
+    int64_t LastFrameDuration = TrackIndex.LastFrameDuration;
+    size_t SearchedFrames = 0;
+
+    while (true) {
+        AVFrame *F = Decoder->GetNextFrame();
+        if (!F)
+            break;
+
+        FrameInfo FI = { F->pts, F->repeat_pict, !!(F->flags & AV_FRAME_FLAG_KEY), !!(F->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST), F->format, F->width, F->height, GetHash(F, SparseHash) };
+        LastFrameDuration = F->duration;
+        av_frame_free(&F);
+
+        if (NewFrames.empty() && (FI.PTS != TrackIndex.GetPTS(ResumeFrame) || FI.Hash != TrackIndex.GetHash(ResumeFrame))) {
+            if (++SearchedFrames >= MaxSearchFrames)
+                return false;
+            continue;
+        }
+
+        int64_t N = ResumeFrame + NewFrames.size();
+        if (NewFrames.size() < VerifyFrames && N < LastKeyFrame && (FI.PTS != TrackIndex.GetPTS(N) || FI.Hash != TrackIndex.GetHash(N))) {
+            BSDebugPrint("Frame doesn't match the existing index when extending it", N);
+            return false;
+        }
+
+        NewFrames.push_back(FI);
+
+        if (Progress) {
+            if (!Progress(VideoTrack, Decoder->GetSourcePostion(), FileSize))
+                throw BestSourceException("Indexing canceled by user");
+        }
+    }
+
+    if (Progress)
+        Progress(VideoTrack, INT64_MAX, INT64_MAX);
+
+    // A file that grew but now has fewer frames is something else entirely
+    if (ResumeFrame + NewFrames.size() < TrackIndex.size())
+        return false;
+
+    // The frames decoded again usually match the loaded ones exactly, anything else means the existing part of the index changes
+    auto SameFrame = [](const FrameInfo &A, const FrameInfo &B) {
+        return A.PTS == B.PTS && A.RepeatPict == B.RepeatPict && A.KeyFrame == B.KeyFrame && A.TFF == B.TFF && A.Format == B.Format && A.Width == B.Width && A.Height == B.Height && A.Hash == B.Hash;
+    };
+
+    size_t FirstChangedFrame = ResumeFrame;
+    while (FirstChangedFrame < TrackIndex.size() && SameFrame(TrackIndex[FirstChangedFrame], NewFrames[FirstChangedFrame - ResumeFrame]))
+        FirstChangedFrame++;
+
+    std::vector<FrameInfo> Frames;
+    Frames.reserve(ResumeFrame + NewFrames.size());
+    for (int64_t i = 0; i < ResumeFrame; i++)
+        Frames.push_back(TrackIndex[i]);
+    Frames.insert(Frames.end(), NewFrames.begin(), NewFrames.end());
+
+    BSDebugPrint("Extended index with " + std::to_string(Frames.size() - TrackIndex.size()) + " new frames", ResumeFrame);
+
+    // The property ids of all frames refer to the dictionary so a different one changes everything
+    std::vector<VideoTrackIndex::FrameProperties> OldDictionary = TrackIndex.GetDictionary();
+    TrackIndex.Assign(Frames, true);
+    TrackIndex.LastFrameDuration = LastFrameDuration;
+    FirstNewFrame = (TrackIndex.GetDictionary() == OldDictionary) ? FirstChangedFrame : 0;
+    return true;
+}
+
+// Hashes of fast indexed frames are only written once and published by setting HashKnown afterwards so no lock is needed when reading them
+
+bool BestVideoSource::CompareFrame(int64_t N, const std::array<uint8_t, HashSize> &Hash, int64_t PTS) const {
+    if (!TrackIndex.HashKnown || TrackIndex.HashKnown[N])
+        return TrackIndex.GetHash(N) == Hash;
+    else
+        return TrackIndex.GetPTS(N) == PTS;
+}
+
+void BestVideoSource::UpdateFrameInfo(int64_t N, const AVFrame *Frame, const std::array<uint8_t, HashSize> &Hash) {
+    if (!TrackIndex.HashKnown || TrackIndex.HashKnown[N])
+        return;
+    std::lock_guard<std::mutex> Lock(IndexMutex);
+    if (!TrackIndex.HashKnown[N]) {
+        // Only the properties of the first decoded frames are known after fast indexing, the rest are guesses based on them.
+        // The format sets, output properties and RFF tables are derived from the guesses so they have to follow any correction.
+        const FrameInfo Guess = TrackIndex[N];
+        bool WrongGuess = (Frame->format != Guess.Format || Frame->width != Guess.Width || Frame->height != Guess.Height || Frame->repeat_pict != Guess.RepeatPict);
+        TrackIndex.SetProperties(N, { Frame->width, Frame->height, static_cast<int16_t>(Frame->format), static_cast<int16_t>(Frame->repeat_pict), !!(Frame->flags & AV_FRAME_FLAG_TOP_FIELD_FIRST) });
+        TrackIndex.SetHash(N, Hash);
+        if (WrongGuess) {
+            BSDebugPrint("Decoded frame has a different format or repeated fields than guessed when fast indexing, updating the output properties", N);
+            UpdateFormatSets();
+        }
+        TrackIndex.HashKnown[N] = true;
+    }
+}
+
+const BSVideoProperties &BestVideoSource::GetVideoProperties() const {
+    return VP;
+}
+
+// Short algorithm summary
+// 1. If a current decoder is close to the requested frame simply start from there
+//    Determine if a decoder is "close" based on whether or not it is already in the optimal zone based on the existing keyframes
+// 2. If a decoder isn't nearby and the seek destination is within the first 100 frames simply start with a fresh decoder to avoid the seek to start issue (technically almost always fresh)
+// 3. Seek with an existing or new decoder. Seek to the nearest keyframe at or before frame N-preroll using PTS. If no such point exists more than 100 frames after the start don't seek.
 //    After seeking match the hash of the decoded frame. For duplicate hashes match a string of up to 10 frame hashes.
 // 4. If the frame is determined to not exist, be beyond the target frame to decode or simply in a string of frames that aren't uniquely identifiable by hashes mark the keyframe as unusable and retry seeking to
 //    at least 100 frames earlier.
 // 5. If linear decoding after seeking fails handle it the same way as #4 and flag it as a bad seek point and retry from at least 100 frames earlier.
+// 6. All-intra tracks seek directly to frame N with no preroll and no 100 frame limit. The first decoded frame is identified by its PTS alone since those are unique.
+
+int64_t BestVideoSource::GetTrackFrameNumber(int64_t N) const {
+    // Adjust frame number if an output format is chosen
+    if (VariableFormat >= 0 && FormatSets.size() > 1) {
+        const auto &ActiveSet = FormatSets[VariableFormat];
+        int64_t UsableFrames = 0;
+        int64_t SourceN = N;
+        for (size_t i = 0; i < TrackIndex.size(); i++) {
+            const FrameInfo Iter = TrackIndex[i];
+            if (Iter.Format != ActiveSet.Format || Iter.Width != ActiveSet.Width || Iter.Height != ActiveSet.Height) {
+                N++;
+            } else {
+                if (UsableFrames++ == SourceN)
+                    break;
+            }
+        }
+    }
+    return N;
+}
+
+BestVideoFrame *BestVideoSource::GetFrame(int64_t N, bool Linear) {
+    if (N < 0 || N >= VP.NumFrames)
+        return nullptr;
+    return GetTrackFrame(GetTrackFrameNumber(N), Linear);
+}
+
+BestVideoFrame *BestVideoSource::GetTrackFrame(int64_t N, bool Linear) {
+    if (PrefetchFrames > 0) {
+        int64_t Previous = LastRequestedFrame.exchange(N);
+        if (N == Previous + 1)
+            SequentialRequests++;
+        else if (N != Previous)
+            SequentialRequests = 0;
+    }
+
+    auto Start = std::chrono::steady_clock::now();
+    std::unique_ptr<BestVideoFrame> F(FrameCache.GetFrame(N));
+    if (!F && PrefetchFrames > 0 && WaitForPrefetch(N))
+        F.reset(FrameCache.GetFrame(N));
+    if (F) {
+        BSRequestTrace Trace = {};
+        Trace.Track = VideoTrack;
+        Trace.Frame = N;
+        Trace.CacheHit = true;
+        Trace.Seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+        RecordRequest(Trace);
+    } else {
+        size_t LaneIndex = AcquireLane(N);
+        DecoderLane &Lane = *Lanes[LaneIndex];
+        BeginRequest(Lane, N);
+        Lane.RequestStart = Start;
+        try {
+            // Another thread may have decoded the frame while waiting for a lane
+            if (ConcurrentMode)
+                F.reset(FrameCache.GetFrame(N));
+            Lane.Trace.CacheHit = !!F;
+            if (!F)
+                F.reset(Linear ? GetFrameLinearInternal(Lane, N) : GetFrameInternal(Lane, N));
+        } catch (...) {
+            ReleaseLane(LaneIndex);
+            throw;
+        }
+        EndRequest(Lane);
+        ReleaseLane(LaneIndex);
+    }
+
+    if (F && PrefetchFrames > 0 && SequentialRequests >= 2)
+        UpdatePrefetch(N);
+
+    return F.release();
+}
+
+BestVideoFrame *BestVideoSource::DecodeRangeFrame(DecoderLane &Lane, int64_t N) {
+    int Index = -1;
+    for (int i = 0; i < static_cast<int>(Lane.Decoders.size()); i++) {
+        if (Lane.Decoders[i] && Lane.Decoders[i]->GetFrameNumber() <= N && (Index < 0 || Lane.Decoders[Index]->GetFrameNumber() < Lane.Decoders[i]->GetFrameNumber()))
+            Index = i;
+    }
+
+    if (Index >= 0 && (Lane.Decoders[Index]->GetFrameNumber() == N || CanDecodeLinearly(Lane.Decoders[Index]->GetFrameNumber(), N, GetSeekFrame(N)))) {
+        std::unique_ptr<LWVideoDecoder> &Decoder = Lane.Decoders[Index];
+        MarkDecoderUsed(Lane, Index);
+
+        // Usually nothing to skip, only frames of other format sets or a gap shorter than seeking would cost
+        int64_t OldPosition = Decoder->GetFrameNumber();
+        Decoder->SkipFrames(N - OldPosition);
+
+        AVFrame *Frame = Decoder->HasMoreFrames() ? Decoder->GetNextFrame() : nullptr;
+        std::array<uint8_t, HashSize> Hash = {};
+        if (Frame)
+            Hash = GetHash(Frame, SparseHash);
+        Lane.Trace.DecodedFrames += N - OldPosition + 1;
+
+        if (Frame && CompareFrame(N, Hash, Frame->pts)) {
+            UpdateFrameInfo(N, Frame, Hash);
+            BestVideoFrame *Result = new BestVideoFrame(Frame);
+            av_frame_free(&Frame);
+            return Result;
+        }
+
+        av_frame_free(&Frame);
+        BSDebugPrint("Decoded frame does not match hash when decoding a range, retrying the normal way", N);
+        CloseDecoder(Lane, Decoder);
+    }
+
+    std::unique_ptr<BestVideoFrame> F(FrameCache.GetFrame(N));
+    Lane.Trace.CacheHit = !!F;
+    if (!F)
+        F.reset(GetFrameInternal(Lane, N));
+    return F.release();
+}
+
+bool BestVideoSource::GetFrames(int64_t First, int64_t Last, const FrameRangeCallback &Callback) {
+    static constexpr size_t QueueDepth = 2;
+
+    if (First < 0 || Last >= VP.NumFrames || First > Last)
+        return false;
+
+    auto NextTrackFrameNumber = [this](int64_t N) {
+        N++;
+        if (VariableFormat >= 0 && FormatSets.size() > 1) {
+            const auto &ActiveSet = FormatSets[VariableFormat];
+            for (; N < static_cast<int64_t>(TrackIndex.size()); N++) {
+                const FrameInfo Iter = TrackIndex[N];
+                if (Iter.Format == ActiveSet.Format && Iter.Width == ActiveSet.Width && Iter.Height == ActiveSet.Height)
+                    break;
+            }
+        }
+        return N;
+    };
+
+    int64_t FirstTrackFrame = GetTrackFrameNumber(First);
+
+    // Prefetching would only decode the same frames a second time so it's stopped until the range is done
+    {
+        std::unique_lock<std::mutex> Lock(PrefetchMutex);
+        ActiveRanges++;
+        StopPrefetch(Lock);
+    }
+
+    std::mutex QueueMutex;
+    std::condition_variable QueueCondition;
+    std::deque<std::pair<int64_t, BestVideoFrame *>> Queue;
+    std::atomic_bool Stop(false);
+    bool Done = false;
+    std::exception_ptr Error;
+
+    // A lane is only held while a frame is decoded, never while waiting for the queue or while Callback runs, so Callback and other threads
+    // can request frames from this source in between. The lane decoding the range ends up positioned right after the frame so it's
+    // normally picked again for the next one, if another request moved its decoders the frame is sought to the normal way.
+    std::thread DecodeThread([&]() {
+        try {
+            int64_t TrackN = FirstTrackFrame;
+            for (int64_t N = First; N <= Last && !Stop; N++, TrackN = NextTrackFrameNumber(TrackN)) {
+                size_t LaneIndex = AcquireLane(TrackN, true);
+                BestVideoFrame *F;
+                try {
+                    BeginRequest(*Lanes[LaneIndex], TrackN);
+                    F = DecodeRangeFrame(*Lanes[LaneIndex], TrackN);
+                    EndRequest(*Lanes[LaneIndex]);
+                } catch (...) {
+                    ReleaseLane(LaneIndex);
+                    throw;
+                }
+                ReleaseLane(LaneIndex);
+                std::unique_lock<std::mutex> Lock(QueueMutex);
+                QueueCondition.wait(Lock, [&] { return Stop || Queue.size() < QueueDepth; });
+                if (Stop) {
+                    delete F;
+                    break;
+                }
+                Queue.emplace_back(N, F);
+                QueueCondition.notify_all();
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> Lock(QueueMutex);
+            Error = std::current_exception();
+        }
+        std::lock_guard<std::mutex> Lock(QueueMutex);
+        Done = true;
+        QueueCondition.notify_all();
+    });
+
+    auto Finish = [&]() {
+        {
+            std::lock_guard<std::mutex> Lock(QueueMutex);
+            Stop = true;
+            QueueCondition.notify_all();
+        }
+        DecodeThread.join();
+        for (auto &Iter : Queue)
+            delete Iter.second;
+        Queue.clear();
+        std::lock_guard<std::mutex> Lock(PrefetchMutex);
+        ActiveRanges--;
+    };
+
+    bool Complete = true;
+    try {
+        while (true) {
+            std::unique_lock<std::mutex> Lock(QueueMutex);
+            QueueCondition.wait(Lock, [&] { return Done || !Queue.empty(); });
+            if (Queue.empty())
+                break;
+            auto Item = Queue.front();
+            Queue.pop_front();
+            QueueCondition.notify_all();
+            Lock.unlock();
+
+            if (!Callback(Item.first, Item.second)) {
+                Complete = false;
+                break;
+            }
+        }
+    } catch (...) {
+        Finish();
+        throw;
+    }
+
+    Finish();
+    if (Error)
+        std::rethrow_exception(Error);
+    return Complete;
+}
+
+BestVideoFrame *BestVideoSource::DecodeKeyFrame(int64_t N, int LowRes) {
+    std::lock_guard<std::mutex> Lock(ScrubMutex);
+
+    if (!ScrubDecoder || ScrubLowRes != LowRes) {
+        ScrubDecoder.reset();
+        // Every request decodes a single frame so frame threading would only add delay, HW decoding doesn't support lowres
+        ScrubDecoder.reset(new LWVideoDecoder(Source, "", 0, VideoTrack, ViewID, 1, LAVFOptions, BlockCache.get(), FramePool.get(), LowRes));
+        ScrubDecoder->SetKeyFramesOnly();
+        ScrubLowRes = LowRes;
+        ScrubLastKeyFrame = -1;
+    }
+
+    // Non-key packets are only demuxed so continuing is cheaper than seeking when no other keyframe is in between
+    int64_t PTS = TrackIndex.GetPTS(N);
+    bool Continue = (ScrubLastKeyFrame >= 0 && N > ScrubLastKeyFrame && TrackIndex.GetPreviousKeyFrame(N - 1) == ScrubLastKeyFrame);
+    ScrubLastKeyFrame = -1;
+    if (!Continue && !ScrubDecoder->Seek(PTS)) {
+        ScrubDecoder.reset();
+        return nullptr;
+    }
+
+    while (AVFrame *F = ScrubDecoder->GetNextFrame()) {
+        int64_t FramePTS = F->pts;
+        if (FramePTS == PTS) {
+            BestVideoFrame *Result = new BestVideoFrame(F);
+            av_frame_free(&F);
+            ScrubLastKeyFrame = N;
+            return Result;
+        }
+        av_frame_free(&F);
+        if (FramePTS == AV_NOPTS_VALUE || FramePTS > PTS)
+            break;
+    }
+
+    ScrubDecoder.reset();
+    return nullptr;
+}
+
+BestVideoFrame *BestVideoSource::GetNearestKeyFrame(int64_t N, int LowRes, int64_t *KeyFrame) {
+    if (N < 0 || N >= VP.NumFrames)
+        return nullptr;
+
+    N = std::max<int64_t>(TrackIndex.GetPreviousKeyFrame(GetTrackFrameNumber(N)), 0);
+    if (KeyFrame)
+        *KeyFrame = N;
+
+    // An already decoded frame is as good as it gets
+    if (LowRes <= 0) {
+        std::unique_ptr<BestVideoFrame> F(FrameCache.GetFrame(N));
+        if (F)
+            return F.release();
+    }
+
+    if (TrackIndex.IsKeyFrame(N) && TrackIndex.GetPTS(N) != AV_NOPTS_VALUE && !LinearMode) {
+        std::unique_ptr<BestVideoFrame> F(DecodeKeyFrame(N, std::max(LowRes, 0)));
+        if (F)
+            return F.release();
+        BSDebugPrint("Keyframe scrubbing failed, decoding the frame normally", N);
+    }
+
+    return GetTrackFrame(N, false);
+}
+
+void BestVideoSource::CreateLanes(bool Concurrent) {
+    std::vector<std::unique_ptr<LWVideoDecoder>> Existing;
+    for (auto &Lane : Lanes)
+        for (auto &Iter : Lane->Decoders)
+            if (Iter)
+                Existing.push_back(std::move(Iter));
+
+    Lanes.clear();
+    size_t NumLanes = Concurrent ? MaxDecoders : 1;
+    size_t DecodersPerLane = MaxDecoders / NumLanes;
+    for (size_t i = 0; i < NumLanes; i++) {
+        Lanes.emplace_back(new DecoderLane());
+        Lanes.back()->Decoders.resize(DecodersPerLane);
+        Lanes.back()->DecoderLastUse.resize(DecodersPerLane);
+        Lanes.back()->DecoderLastUseTime.resize(DecodersPerLane);
+    }
+
+    for (size_t i = 0; i < Existing.size(); i++) {
+        DecoderLane &Lane = *Lanes[i % NumLanes];
+        Lane.Decoders[i / NumLanes] = std::move(Existing[i]);
+        MarkDecoderUsed(Lane, i / NumLanes);
+        Lane.Position = std::max(Lane.Position, Lane.Decoders[i / NumLanes]->GetFrameNumber());
+    }
+}
+
+void BestVideoSource::MarkDecoderUsed(DecoderLane &Lane, size_t Index) {
+    Lane.DecoderLastUse[Index] = Lane.DecoderSequenceNum++;
+    Lane.DecoderLastUseTime[Index] = std::chrono::steady_clock::now();
+}
+
+void BestVideoSource::CloseDecoder(DecoderLane &Lane, std::unique_ptr<LWVideoDecoder> &Decoder) {
+    Lane.Trace.BytesRead += Decoder->TakeBytesRead();
+    Decoder.reset();
+}
+
+void BestVideoSource::DropIdleDecoders(DecoderLane &Lane) {
+    if (IdleDecoderTimeout.count() <= 0)
+        return;
+
+    auto Now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < Lane.Decoders.size(); i++) {
+        if (Lane.Decoders[i] && Now - Lane.DecoderLastUseTime[i] > IdleDecoderTimeout) {
+            BSDebugPrint("Closing idle decoder", -1, Lane.Decoders[i]->GetFrameNumber());
+            Lane.Decoders[i].reset();
+        }
+    }
+}
+
+bool BestVideoSource::CanDecodeLinearly(int64_t Position, int64_t N, int64_t SeekFrame) const {
+    if (Position < 0 || Position > N)
+        return false;
+    if (SeekFrame < MinSeekFrame || Position >= SeekFrame)
+        return true;
+    if (DecoderPolicy != bdpShortestDistance)
+        return false;
+    // Both ways decode everything from the keyframe at SeekFrame to N so only the frames before it are weighed against the seek,
+    // until something has been measured a seek still has to decode at least PreRoll frames before N so a decoder that's only
+    // slightly behind the seek point is about as fast and has no risk of failing
+    double LinearTime = EstimateLinearTime(Position, SeekFrame - 1, N);
+    double SeekTime = SeekLatency;
+    if (LinearTime > 0 && SeekTime > 0)
+        return LinearTime <= SeekTime;
+    return SeekFrame - Position <= PreRoll;
+}
 
-BestVideoFrame *BestVideoSource::GetFrame(int64_t N, bool Linear) {
-    if (N < 0 || N >= VP.NumFrames)
-        return nullptr;
+double BestVideoSource::EstimateLinearTime(int64_t First, int64_t Last, int64_t N) const {
+    // Frames before the preroll are only skipped which is cheaper than outputting them, until skipping has been measured it's
+    // assumed to cost as much
+    double FrameTime = FrameDecodeTime;
+    double SkipTime = SkipDecodeTime;
+    if (SkipTime <= 0)
+        SkipTime = FrameTime;
+    int64_t Skipped = std::max<int64_t>(std::min(Last + 1, N - PreRoll) - First, 0);
+    int64_t Output = std::max<int64_t>(Last + 1 - std::max(First, N - PreRoll), 0);
+    return Skipped * SkipTime + Output * FrameTime;
+}
 
-    // Adjust frame number if an output format is chosen
-    if (VariableFormat >= 0 && FormatSets.size() > 1) {
-        const auto &ActiveSet = FormatSets[VariableFormat];
-        int64_t UsableFrames = 0;
-        int64_t SourceN = N;
-        for (const auto &Iter : TrackIndex.Frames) {
-            if (Iter.Format != ActiveSet.Format || Iter.Width != ActiveSet.Width || Iter.Height != ActiveSet.Height) {
-                N++;
-            } else {
-                if (UsableFrames++ == SourceN)
+void BestVideoSource::UpdateCostEstimate(std::atomic<double> &Estimate, double Sample) {
+    double Current = Estimate;
+    Estimate = (Current > 0) ? Current + (Sample - Current) / 8 : Sample;
+}
+
+size_t BestVideoSource::GetReplaceableDecoder(const DecoderLane &Lane, int64_t N) const {
+    int EmptySlot = -1;
+    int LeastRecentlyUsed = 0;
+    int Finished = -1;
+    int Behind = -1;
+    for (int i = 0; i < static_cast<int>(Lane.Decoders.size()); i++) {
+        if (!Lane.Decoders[i]) {
+            EmptySlot = i;
+            continue;
+        }
+        if (Lane.DecoderLastUse[i] < Lane.DecoderLastUse[LeastRecentlyUsed])
+            LeastRecentlyUsed = i;
+        if (!Lane.Decoders[i]->HasMoreFrames())
+            Finished = i;
+        else if (Lane.Decoders[i]->GetFrameNumber() <= N && (Behind < 0 || Lane.Decoders[Behind]->GetFrameNumber() < Lane.Decoders[i]->GetFrameNumber()))
+            Behind = i;
+    }
+
+    if (EmptySlot >= 0)
+        return EmptySlot;
+
+    // Decoders that have reached the end are useless and the closest decoder before N will only cover the frames before the new position
+    if (DecoderPolicy == bdpShortestDistance) {
+        if (Finished >= 0)
+            return Finished;
+        if (Behind >= 0)
+            return Behind;
+    }
+
+    return LeastRecentlyUsed;
+}
+
+size_t BestVideoSource::AcquireLane(int64_t N, bool Range) {
+    std::unique_lock<std::mutex> Lock(LaneMutex);
+
+    if (Lanes.size() == 1 || LinearMode) {
+        // Free decoders in idle lanes since they can never be used again in linear mode
+        if (LinearMode) {
+            for (size_t i = 1; i < Lanes.size(); i++) {
+                if (!Lanes[i]->Busy) {
+                    for (auto &Iter : Lanes[i]->Decoders)
+                        Iter.reset();
+                    Lanes[i]->Position = -1;
+                }
+            }
+        }
+        LaneCondition.wait(Lock, [this] { return !Lanes[0]->Busy; });
+        Lanes[0]->Busy = true;
+        Lanes[0]->Range = Range;
+        Lanes[0]->Position = N + 1;
+        Lanes[0]->LastUse = LaneSequenceNum++;
+        return 0;
+    }
+
+    // Same basic reasoning as in GetFrameInternal(), a lane positioned in the zone where linear decoding is preferred is always waited for
+    // if busy, otherwise the least recently used idle lane is picked to seek with. Lanes decoding a range frame are never waited for since
+    // the range continues with them as soon as the frame is done.
+    int64_t SeekFrame = GetSeekFrame(N);
+
+    while (true) {
+        int Index = -1;
+        for (int i = 0; i < static_cast<int>(Lanes.size()); i++) {
+            int64_t Position = Lanes[i]->Position;
+            if (!Lanes[i]->Range && CanDecodeLinearly(Position, N, SeekFrame) && (Index < 0 || Lanes[Index]->Position < Position))
+                Index = i;
+        }
+
+        if (Index >= 0 && Lanes[Index]->Busy) {
+            LaneCondition.wait(Lock);
+            continue;
+        }
+
+        if (Index < 0) {
+            for (int i = 0; i < static_cast<int>(Lanes.size()); i++)
+                if (!Lanes[i]->Busy && (Index < 0 || Lanes[i]->LastUse < Lanes[Index]->LastUse))
+                    Index = i;
+        }
+
+        if (Index < 0) {
+            LaneCondition.wait(Lock);
+            continue;
+        }
+
+        Lanes[Index]->Busy = true;
+        Lanes[Index]->Range = Range;
+        Lanes[Index]->Position = N + 1;
+        Lanes[Index]->LastUse = LaneSequenceNum++;
+        return Index;
+    }
+}
+
+void BestVideoSource::ReleaseLane(size_t Index) {
+    std::lock_guard<std::mutex> Lock(LaneMutex);
+    Lanes[Index]->Busy = false;
+    Lanes[Index]->Range = false;
+
+    // Idle lanes can't be acquired by other threads while the lock is held so it's safe to clean them up here too
+    for (auto &Lane : Lanes) {
+        if (Lane->Busy)
+            continue;
+        DropIdleDecoders(*Lane);
+        Lane->Position = -1;
+        for (const auto &Iter : Lane->Decoders)
+            if (Iter)
+                Lane->Position = std::max(Lane->Position, Iter->GetFrameNumber());
+    }
+
+    LaneCondition.notify_all();
+}
+
+void BestVideoSource::SetDecoderPolicy(BestDecoderPolicy Policy) {
+    if (Policy != bdpLeastRecentlyUsed && Policy != bdpShortestDistance)
+        throw BestSourceException("Invalid decoder policy");
+    DecoderPolicy = Policy;
+}
+
+void BestVideoSource::SetIdleDecoderTimeout(int64_t Milliseconds) {
+    IdleDecoderTimeout = std::chrono::milliseconds(std::max<int64_t>(Milliseconds, 0));
+}
+
+void BestVideoSource::SetConcurrentMode(bool Concurrent) {
+    if (Concurrent == ConcurrentMode)
+        return;
+
+    if (Concurrent) {
+        std::unique_lock<std::mutex> Lock(PrefetchMutex);
+        StopPrefetch(Lock);
+        PrefetchFrames = 0;
+    }
+
+    // Lazy initialization isn't thread-safe so do it now
+    if (RFFState == RFFStateEnum::Uninitialized)
+        InitializeRFF();
+
+    CreateLanes(Concurrent);
+    FrameCache.SetStripes(Concurrent ? 16 : 1);
+    ConcurrentMode = Concurrent;
+}
+
+void BestVideoSource::PrefetchWorker() {
+    std::unique_lock<std::mutex> Lock(PrefetchMutex);
+    while (!PrefetchExit) {
+        if (!PrefetchDecoder || PrefetchPosition > PrefetchTarget) {
+            PrefetchCondition.wait(Lock);
+            continue;
+        }
+
+        int64_t FrameNumber = PrefetchPosition;
+        PrefetchBusy = true;
+        Lock.unlock();
+
+        AVFrame *Frame = PrefetchDecoder->GetNextFrame();
+        bool Success = Frame && CompareFrame(FrameNumber, GetHash(Frame, SparseHash), Frame->pts);
+        if (Success)
+            FrameCache.CacheFrame(FrameNumber, ConvertForCache(Frame), PrefetchDecoder->HasSeeked());
+        else
+            av_frame_free(&Frame);
+        Success = Success && PrefetchDecoder->HasMoreFrames();
+
+        Lock.lock();
+        PrefetchBusy = false;
+        if (Success) {
+            PrefetchPosition = FrameNumber + 1;
+        } else {
+            BSDebugPrint("Prefetching stopped", PrefetchTarget, FrameNumber);
+            PrefetchDecoder.reset();
+        }
+        PrefetchCondition.notify_all();
+    }
+}
+
+void BestVideoSource::UpdatePrefetch(int64_t N) {
+    {
+        std::lock_guard<std::mutex> Lock(PrefetchMutex);
+        if (ActiveRanges > 0)
+            return;
+        if (PrefetchDecoder && PrefetchPosition > N && PrefetchPosition <= N + PrefetchFrames + 1) {
+            PrefetchTarget = N + PrefetchFrames;
+            PrefetchCondition.notify_all();
+            return;
+        }
+    }
+
+    // Take over the decoder that produced the requested frame and put the previous prefetch decoder back in the pool since it may still be useful.
+    // The decoders of a lane may only be touched while holding it since a range may be decoded with it while its callback requests frames.
+    size_t LaneIndex = AcquireLane(N);
+    DecoderLane &Lane = *Lanes[LaneIndex];
+    try {
+        std::unique_lock<std::mutex> Lock(PrefetchMutex);
+        for (size_t i = 0; i < Lane.Decoders.size(); i++) {
+            if (Lane.Decoders[i] && Lane.Decoders[i]->GetFrameNumber() == N + 1 && Lane.Decoders[i]->HasMoreFrames()) {
+                PrefetchCondition.wait(Lock, [this] { return !PrefetchBusy; });
+                if (ActiveRanges > 0)
                     break;
+                std::swap(PrefetchDecoder, Lane.Decoders[i]);
+                MarkDecoderUsed(Lane, i);
+                PrefetchPosition = N + 1;
+                PrefetchTarget = N + PrefetchFrames;
+                PrefetchCondition.notify_all();
+                break;
             }
         }
+    } catch (...) {
+        ReleaseLane(LaneIndex);
+        throw;
     }
+    ReleaseLane(LaneIndex);
+}
 
-    std::unique_ptr<BestVideoFrame> F(FrameCache.GetFrame(N));
-    if (!F)
-        F.reset(Linear ? GetFrameLinearInternal(N) : GetFrameInternal(N));
+void BestVideoSource::StopPrefetch(std::unique_lock<std::mutex> &Lock) {
+    PrefetchTarget = -1;
+    PrefetchCondition.wait(Lock, [this] { return !PrefetchBusy; });
+    PrefetchDecoder.reset();
+}
 
-    return F.release();
+bool BestVideoSource::WaitForPrefetch(int64_t N) {
+    std::unique_lock<std::mutex> Lock(PrefetchMutex);
+    if (!PrefetchDecoder || PrefetchPosition > N || PrefetchTarget < N)
+        return false;
+    PrefetchCondition.wait(Lock, [this, N] { return !PrefetchDecoder || PrefetchPosition > N; });
+    return true;
 }
 
-void BestVideoSource::SetLinearMode() {
-    assert(!LinearMode);
-    if (!LinearMode) {
+void BestVideoSource::SetLinearMode(DecoderLane &Lane) {
+    // In concurrent mode several threads may reach this point at the same time, the decoders of other lanes are freed when they're acquired in linear mode.
+    // Until then other lanes may still be decoding with seeked decoders so their frames are kept out of the cache instead of only clearing it once.
+    if (!LinearMode.exchange(true)) {
         BSDebugPrint("Linear mode is now forced");
-        LinearMode = true;
-        FrameCache.Clear();
-        for (size_t i = 0; i < MaxVideoSources; i++)
-            Decoders[i].reset();
+        Lane.Trace.LinearFallback = true;
+        {
+            std::unique_lock<std::mutex> Lock(PrefetchMutex);
+            StopPrefetch(Lock);
+        }
+        FrameCache.RejectSeekedFrames();
+        StoreSeekHistory();
+    }
+    for (size_t i = 0; i < Lane.Decoders.size(); i++)
+        if (Lane.Decoders[i])
+            CloseDecoder(Lane, Lane.Decoders[i]);
+}
+
+void BestVideoSource::AddBadSeekLocation(int64_t N) {
+    {
+        std::lock_guard<std::mutex> Lock(BadSeekMutex);
+        if (!BadSeekLocations.insert(N).second)
+            return;
+    }
+    StoreSeekHistory();
+}
+
+void BestVideoSource::StoreSeekHistory() {
+    if (SeekHistoryFile.empty())
+        return;
+    BSSeekHistory History;
+    {
+        std::lock_guard<std::mutex> Lock(BadSeekMutex);
+        History.BadSeekLocations = BadSeekLocations;
     }
+    History.LinearMode = LinearMode;
+    if (!WriteSeekHistory(SeekHistoryFile, true, FileSize, TrackIndex.size(), History))
+        BSDebugPrint("Failed to store the seek history");
 }
 
-int64_t BestVideoSource::GetSeekFrame(int64_t N) {
-    for (int64_t i = N - PreRoll; i >= 100; i--) {
-        if (TrackIndex.Frames[i].KeyFrame && TrackIndex.Frames[i].PTS != AV_NOPTS_VALUE && !BadSeekLocations.count(i))
+int64_t BestVideoSource::GetSeekFrame(int64_t N) const {
+    std::lock_guard<std::mutex> Lock(BadSeekMutex);
+    // Every frame of an all-intra track is a valid seek point so there's no need to start decoding earlier
+    for (int64_t i = TrackIndex.GetPreviousKeyFrame(AllIntra ? N : N - PreRoll); i >= MinSeekFrame; i = TrackIndex.GetPreviousKeyFrame(i - 1)) {
+        if (TrackIndex.GetPTS(i) != AV_NOPTS_VALUE && !BadSeekLocations.count(i))
             return i;
     }
 
@@ -1141,7 +2895,11 @@ namespace {
     class FrameHolder {
     private:
         std::vector<std::pair<AVFrame *, std::array<uint8_t, HashSize>>> Data;
+        bool SparseHash;
     public:
+        FrameHolder(bool SparseHash) : SparseHash(SparseHash) {
+        }
+
         void clear() {
             for (auto &iter : Data)
                 av_frame_free(&iter.first);
@@ -1149,7 +2907,7 @@ namespace {
         }
 
         void push_back(AVFrame *F) {
-            Data.push_back(std::make_pair(F, GetHash(F)));
+            Data.push_back(std::make_pair(F, GetHash(F, SparseHash)));
         }
 
         size_t size() {
@@ -1167,8 +2925,12 @@ namespace {
             return Tmp;
         }
 
-        [[nodiscard]] bool CompareHash(size_t Index, const std::array<uint8_t, HashSize> &Other) {
-            return Data[Index].second == Other;
+        [[nodiscard]] const std::array<uint8_t, HashSize> &GetFrameHash(size_t Index) const {
+            return Data[Index].second;
+        }
+
+        [[nodiscard]] int64_t GetPTS(size_t Index) const {
+            return Data[Index].first->pts;
         }
 
         ~FrameHolder() {
@@ -1177,33 +2939,34 @@ namespace {
     };
 }
 
-BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std::unique_ptr<LWVideoDecoder> &Decoder, size_t Depth) {
-    if (!Decoder->Seek(TrackIndex.Frames[SeekFrame].PTS)) {
+BestVideoFrame *BestVideoSource::SeekAndDecode(DecoderLane &Lane, int64_t N, int64_t SeekFrame, std::unique_ptr<LWVideoDecoder> &Decoder, size_t Depth) {
+    Lane.Trace.Seeks++;
+    if (!Decoder->Seek(TrackIndex.GetPTS(SeekFrame))) {
         BSDebugPrint("Unseekable file", N);
-        SetLinearMode();
-        return GetFrameLinearInternal(N);
+        SetLinearMode(Lane);
+        return GetFrameLinearInternal(Lane, N);
     }
 
-    FrameHolder MatchFrames;
+    FrameHolder MatchFrames(SparseHash);
 
     while (true) {
         AVFrame *F = Decoder->GetNextFrame();
         if (!F && MatchFrames.empty()) {
-            BadSeekLocations.insert(SeekFrame);
+            AddBadSeekLocation(SeekFrame);
             BSDebugPrint("No frame could be decoded after seeking, added as bad seek location", N, SeekFrame);
             if (Depth < RetrySeekAttempts) {
                 int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                 BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
-                if (SeekFrameNext < 100) { // #2 again
-                    Decoder.reset();
-                    return GetFrameLinearInternal(N);
+                if (SeekFrameNext < MinSeekFrame) { // #2 again
+                    CloseDecoder(Lane, Decoder);
+                    return GetFrameLinearInternal(Lane, N);
                 } else {
-                    return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
+                    return SeekAndDecode(Lane, N, SeekFrameNext, Decoder, Depth + 1);
                 }
             } else {
                 BSDebugPrint("Maximum number of seek attempts made, setting linear mode", N, SeekFrame);
-                SetLinearMode();
-                return GetFrameLinearInternal(N);
+                SetLinearMode(Lane);
+                return GetFrameLinearInternal(Lane, N);
             }
         }
 
@@ -1211,20 +2974,27 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
 
         if (F) {
             MatchFrames.push_back(F);
+            Lane.Trace.DecodedFrames++;
 
-            for (size_t i = 0; i <= TrackIndex.Frames.size() - MatchFrames.size(); i++) {
-                bool HashMatch = true;
-                for (size_t j = 0; j < MatchFrames.size(); j++)
-                    HashMatch = HashMatch && MatchFrames.CompareHash(j, TrackIndex.Frames[i + j].Hash);
-                if (HashMatch)
-                    Matches.insert(i);
+            if (AllIntra && MatchFrames.size() == 1 && F->pts == TrackIndex.GetPTS(SeekFrame)) {
+                // The PTS is unique so the seek landed exactly where requested and only that frame has to be compared
+                if (CompareFrame(SeekFrame, MatchFrames.GetFrameHash(0), F->pts))
+                    Matches.insert(SeekFrame);
+            } else {
+                for (size_t i = 0; i <= TrackIndex.size() - MatchFrames.size(); i++) {
+                    bool HashMatch = true;
+                    for (size_t j = 0; j < MatchFrames.size(); j++)
+                        HashMatch = HashMatch && CompareFrame(i + j, MatchFrames.GetFrameHash(j), MatchFrames.GetPTS(j));
+                    if (HashMatch)
+                        Matches.insert(i);
+                }
             }
         } else if (!F) {
             bool HashMatch = true;
             for (size_t j = 0; j < MatchFrames.size(); j++)
-                HashMatch = HashMatch && MatchFrames.CompareHash(j, TrackIndex.Frames[TrackIndex.Frames.size() - MatchFrames.size() + j].Hash);
+                HashMatch = HashMatch && CompareFrame(TrackIndex.size() - MatchFrames.size() + j, MatchFrames.GetFrameHash(j), MatchFrames.GetPTS(j));
             if (HashMatch)
-                Matches.insert(TrackIndex.Frames.size() - MatchFrames.size());
+                Matches.insert(TrackIndex.size() - MatchFrames.size());
         }
 
         // #3 Seek failure?, fall back to linear
@@ -1248,22 +3018,22 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
 
         if (!SuitableCandidate || UndeterminableLocation) {
             BSDebugPrint("No destination frame number could be determined after seeking, added as bad seek location", N, SeekFrame);
-            BadSeekLocations.insert(SeekFrame);
+            AddBadSeekLocation(SeekFrame);
             MatchFrames.clear();
             if (Depth < RetrySeekAttempts) {
                 int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                 BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
-                if (SeekFrameNext < 100) { // #2 again
-                    Decoder.reset();
-                    return GetFrameLinearInternal(N);
+                if (SeekFrameNext < MinSeekFrame) { // #2 again
+                    CloseDecoder(Lane, Decoder);
+                    return GetFrameLinearInternal(Lane, N);
                 } else {
-                    return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
+                    return SeekAndDecode(Lane, N, SeekFrameNext, Decoder, Depth + 1);
                 }
             } else {
                 BSDebugPrint("Maximum number of seek attempts made, setting linear mode", N, SeekFrame);
                 // Fall back to linear decoding permanently since we failed to seek to any even remotably suitable frame in 3 attempts
-                SetLinearMode();
-                return GetFrameLinearInternal(N);
+                SetLinearMode(Lane);
+                return GetFrameLinearInternal(Lane, N);
             }
         }
 
@@ -1271,7 +3041,7 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
             int64_t MatchedN = *Matches.begin();
 
 #ifndef NDEBUG
-            if (MatchedN < 100)
+            if (MatchedN < MinSeekFrame)
                 BSDebugPrint("Seek destination determined to be within 100 frames of start, this was unexpected", N, MatchedN);
 #endif
 
@@ -1281,12 +3051,14 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
             BestVideoFrame *RetFrame = nullptr;
             for (size_t FramesIdx = 0; FramesIdx < MatchFrames.size(); FramesIdx++) {
                 int64_t FrameNumber = MatchedN + FramesIdx;
+                UpdateFrameInfo(FrameNumber, MatchFrames.GetFrame(FramesIdx), MatchFrames.GetFrameHash(FramesIdx));
 
                 if (FrameNumber >= N - PreRoll) {
+                    AVFrame *Frame = ConvertForCache(MatchFrames.GetFrame(FramesIdx, true));
                     if (FrameNumber == N)
-                        RetFrame = new BestVideoFrame(MatchFrames.GetFrame(FramesIdx));
+                        RetFrame = new BestVideoFrame(Frame);
 
-                    FrameCache.CacheFrame(FrameNumber, MatchFrames.GetFrame(FramesIdx, true));
+                    FrameCache.CacheFrame(FrameNumber, Frame, true);
                 }
             }
 
@@ -1295,7 +3067,7 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
 
             // Now that we have done everything we can and aren't holding on to the frame to output let the linear function do the rest
             MatchFrames.clear();
-            return GetFrameLinearInternal(N, SeekFrame);
+            return GetFrameLinearInternal(Lane, N, SeekFrame);
         }
 
         assert(Matches.size() > 1);
@@ -1308,98 +3080,110 @@ BestVideoFrame *BestVideoSource::SeekAndDecode(int64_t N, int64_t SeekFrame, std
     return nullptr;
 }
 
-BestVideoFrame *BestVideoSource::GetFrameInternal(int64_t N) {
+BestVideoFrame *BestVideoSource::GetFrameInternal(DecoderLane &Lane, int64_t N) {
     if (LinearMode)
-        return GetFrameLinearInternal(N);
+        return GetFrameLinearInternal(Lane, N);
 
     // #2 If the seek limit is less than 100 frames away from the start see #2 and do linear decoding
     int64_t SeekFrame = GetSeekFrame(N);
 
-    if (SeekFrame < 100)
-        return GetFrameLinearInternal(N);
+    if (SeekFrame < MinSeekFrame)
+        return GetFrameLinearInternal(Lane, N);
 
     // # 1 A suitable linear decoder exists and seeking is out of the question
-    for (int i = 0; i < MaxVideoSources; i++) {
-        if (Decoders[i] && Decoders[i]->GetFrameNumber() <= N && Decoders[i]->GetFrameNumber() >= SeekFrame)
-            return GetFrameLinearInternal(N);
+    for (int i = 0; i < static_cast<int>(Lane.Decoders.size()); i++) {
+        if (Lane.Decoders[i] && CanDecodeLinearly(Lane.Decoders[i]->GetFrameNumber(), N, SeekFrame))
+            return GetFrameLinearInternal(Lane, N);
     }
 
+    // Seeks that keep failing can make decoding from the start with a new decoder cheaper
+    if (CanDecodeLinearly(0, N, SeekFrame))
+        return GetFrameLinearInternal(Lane, N);
+
     // #3 Preparations here
 
     // Grab/create a new decoder to use for seeking, the position is irrelevant
-    int EmptySlot = -1;
-    int LeastRecentlyUsed = 0;
-    for (int i = 0; i < MaxVideoSources; i++) {
-        if (!Decoders[i])
-            EmptySlot = i;
-        if (Decoders[i] && DecoderLastUse[i] < DecoderLastUse[LeastRecentlyUsed])
-            LeastRecentlyUsed = i;
-    }
+    size_t Index = GetReplaceableDecoder(Lane, N);
+    if (!Lane.Decoders[Index])
+        Lane.Decoders[Index].reset(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
 
-    int Index = (EmptySlot >= 0) ? EmptySlot : LeastRecentlyUsed;
-    if (!Decoders[Index])
-        Decoders[Index].reset(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions));
-
-    DecoderLastUse[Index] = DecoderSequenceNum++;
+    MarkDecoderUsed(Lane, Index);
 
     // #3 Actual seeking dance of death starts here
-    return SeekAndDecode(N, SeekFrame, Decoders[Index]);
+    auto Start = std::chrono::steady_clock::now();
+    BestVideoFrame *Frame = SeekAndDecode(Lane, N, SeekFrame, Lane.Decoders[Index]);
+
+    double Elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+    Lane.Trace.SeekSeconds = Elapsed;
+
+    // Whatever isn't explained by decoding from SeekFrame to N is the cost of seeking, including failed attempts
+    double LinearTime = EstimateLinearTime(SeekFrame, N, N);
+    if (Frame && LinearTime > 0 && !LinearMode) {
+        UpdateCostEstimate(SeekLatency, std::max(Elapsed - LinearTime, 0.0));
+    }
+
+    return Frame;
 }
 
-BestVideoFrame *BestVideoSource::GetFrameLinearInternal(int64_t N, int64_t SeekFrame, size_t Depth, bool ForceUnseeked) {
+BestVideoFrame *BestVideoSource::GetFrameLinearInternal(DecoderLane &Lane, int64_t N, int64_t SeekFrame, size_t Depth, bool ForceUnseeked) {
     // Check for a suitable existing decoder
     int Index = -1;
-    int EmptySlot = -1;
-    int LeastRecentlyUsed = 0;
-    for (int i = 0; i < MaxVideoSources; i++) {
-        if (Decoders[i] && (!ForceUnseeked || !Decoders[i]->HasSeeked()) && Decoders[i]->GetFrameNumber() <= N && (Index < 0 || Decoders[Index]->GetFrameNumber() < Decoders[i]->GetFrameNumber()))
+    for (int i = 0; i < static_cast<int>(Lane.Decoders.size()); i++) {
+        if (Lane.Decoders[i] && (!ForceUnseeked || !Lane.Decoders[i]->HasSeeked()) && Lane.Decoders[i]->GetFrameNumber() <= N && (Index < 0 || Lane.Decoders[Index]->GetFrameNumber() < Lane.Decoders[i]->GetFrameNumber()))
             Index = i;
-        if (!Decoders[i])
-            EmptySlot = i;
-        if (Decoders[i] && DecoderLastUse[i] < DecoderLastUse[LeastRecentlyUsed])
-            LeastRecentlyUsed = i;
     }
 
-    // If an empty slot exists simply spawn a new decoder there or reuse the least recently used decoder slot if no free ones exist
+    // If an empty slot exists simply spawn a new decoder there or replace a decoder according to the policy if no free ones exist
     if (Index < 0) {
-        Index = (EmptySlot >= 0) ? EmptySlot : LeastRecentlyUsed;
-        Decoders[Index].reset(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions));
+        Index = static_cast<int>(GetReplaceableDecoder(Lane, N));
+        if (Lane.Decoders[Index])
+            CloseDecoder(Lane, Lane.Decoders[Index]);
+        Lane.Decoders[Index].reset(new LWVideoDecoder(Source, HWDevice, ExtraHWFrames, VideoTrack, ViewID, Threads, LAVFOptions, BlockCache.get(), FramePool.get()));
     }
 
-    std::unique_ptr<LWVideoDecoder> &Decoder = Decoders[Index];
-    DecoderLastUse[Index] = DecoderSequenceNum++;
+    std::unique_ptr<LWVideoDecoder> &Decoder = Lane.Decoders[Index];
+    MarkDecoderUsed(Lane, Index);
 
     BestVideoFrame *RetFrame = nullptr;
+    // Output and skipped frames are timed separately since skipping avoids the download, hashing and caching
+    std::chrono::steady_clock::duration OutputDuration{};
+    int64_t OutputFrames = 0;
 
     while (Decoder && Decoder->GetFrameNumber() <= N && Decoder->HasMoreFrames()) {
         int64_t FrameNumber = Decoder->GetFrameNumber();
         if (FrameNumber >= N - PreRoll) {
+            auto Start = std::chrono::steady_clock::now();
             AVFrame *Frame = Decoder->GetNextFrame();
+            Lane.Trace.DecodedFrames++;
 
             // This is the most central sanity check. It primarily exists to catch the case
             // when a decoder has successfully seeked and had its location identified but
             // still returns frames out of order. Possibly open gop related but hard to tell.
 
-            if (!Frame || TrackIndex.Frames[FrameNumber].Hash != GetHash(Frame)) {
+            std::array<uint8_t, HashSize> Hash = {};
+            if (Frame)
+                Hash = GetHash(Frame, SparseHash);
+
+            if (!Frame || !CompareFrame(FrameNumber, Hash, Frame->pts)) {
                 av_frame_free(&Frame);
 
                 if (Decoder->HasSeeked()) {
                     BSDebugPrint("Decoded frame does not match hash in GetFrameLinearInternal() or no frame produced at all, added as bad seek location", N, FrameNumber);
                     assert(SeekFrame >= 0);
-                    BadSeekLocations.insert(SeekFrame);
+                    AddBadSeekLocation(SeekFrame);
                     if (Depth < RetrySeekAttempts) {
                         int64_t SeekFrameNext = GetSeekFrame(SeekFrame - 100);
                         BSDebugPrint("Retrying seeking with", N, SeekFrameNext);
-                        if (SeekFrameNext < 100) { // #2 again
-                            Decoder.reset();
-                            return GetFrameLinearInternal(N);
+                        if (SeekFrameNext < MinSeekFrame) { // #2 again
+                            CloseDecoder(Lane, Decoder);
+                            return GetFrameLinearInternal(Lane, N);
                         } else {
-                            return SeekAndDecode(N, SeekFrameNext, Decoder, Depth + 1);
+                            return SeekAndDecode(Lane, N, SeekFrameNext, Decoder, Depth + 1);
                         }
                     } else {
                         BSDebugPrint("Maximum number of seek attempts made, setting linear mode", N, SeekFrame);
-                        SetLinearMode();
-                        return GetFrameLinearInternal(N, -1, 0, true);
+                        SetLinearMode(Lane);
+                        return GetFrameLinearInternal(Lane, N, -1, 0, true);
                     }
                 } else {
                     BSDebugPrint("Linear decoding returned a bad frame, this should be impossible so I'll just return nothing now. Try deleting the index and using threads=1 if you haven't already done so.", N, SeekFrame);
@@ -1407,18 +3191,32 @@ BestVideoFrame *BestVideoSource::GetFrameLinearInternal(int64_t N, int64_t SeekF
                 }
             }
 
+            UpdateFrameInfo(FrameNumber, Frame, Hash);
+            Frame = ConvertForCache(Frame);
+
             if (FrameNumber == N)
                 RetFrame = new BestVideoFrame(Frame);
 
-            FrameCache.CacheFrame(FrameNumber, Frame);
+            FrameCache.CacheFrame(FrameNumber, Frame, Decoder->HasSeeked());
+            OutputDuration += std::chrono::steady_clock::now() - Start;
+            OutputFrames++;
         } else if (FrameNumber < N) {
-            Decoder->SkipFrames(N - PreRoll - FrameNumber);
+            auto Start = std::chrono::steady_clock::now();
+            int64_t Skipped = N - PreRoll - FrameNumber;
+            Decoder->SkipFrames(Skipped);
+            Lane.Trace.DecodedFrames += Skipped;
+            // Skipping reaches the end of the track early if frames are missing, a broken measurement is worse than none
+            if (Decoder->GetFrameNumber() == FrameNumber + Skipped)
+                UpdateCostEstimate(SkipDecodeTime, std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count() / Skipped);
         }
 
         if (!Decoder->HasMoreFrames())
-            Decoder.reset();
+            CloseDecoder(Lane, Decoder);
     }
 
+    if (RetFrame && OutputFrames > 0)
+        UpdateCostEstimate(FrameDecodeTime, std::chrono::duration<double>(OutputDuration).count() / OutputFrames);
+
     return RetFrame;
 }
 
@@ -1429,11 +3227,10 @@ bool BestVideoSource::InitializeRFF() {
     int64_t DestFieldBottom = 0;
     RFFFields.resize(VP.NumRFFFrames);
 
-    int64_t N = 0;
-    for (auto &Iter : TrackIndex.Frames) {
-        int RepeatFields = Iter.RepeatPict + 2;
+    for (int64_t N = 0; N < static_cast<int64_t>(TrackIndex.size()); N++) {
+        int RepeatFields = TrackIndex.GetRepeatPict(N) + 2;
 
-        bool DestTop = Iter.TFF;
+        bool DestTop = TrackIndex.IsTFF(N);
         for (int i = 0; i < RepeatFields; i++) {
             if (DestTop) {
                 assert(DestFieldTop <= DestFieldBottom);
@@ -1444,7 +3241,6 @@ bool BestVideoSource::InitializeRFF() {
             }
             DestTop = !DestTop;
         }
-        N++;
     }
 
     if (DestFieldTop > DestFieldBottom) {
@@ -1458,12 +3254,14 @@ bool BestVideoSource::InitializeRFF() {
     assert(DestFieldTop == DestFieldBottom);
     assert(DestFieldTop == VP.NumRFFFrames);
 
+    RFFState = RFFStateEnum::Ready;
     return true;
 }
 
 void BestVideoSource::InitializeFormatSets() {
     std::map<std::tuple<int, int, int>, std::tuple<int64_t, int64_t, int64_t, bool>> SeenSets;
-    for (const auto &Iter : TrackIndex.Frames) {
+    for (size_t i = 0; i < TrackIndex.size(); i++) {
+        const FrameInfo Iter = TrackIndex[i];
         auto V = std::make_tuple(Iter.Format, Iter.Width, Iter.Height);
         if (SeenSets.insert(std::make_pair(V, std::make_tuple(0, 0, Iter.PTS, Iter.TFF))).second)
             FormatSets.push_back(FormatSet{ {}, Iter.Format, Iter.Width, Iter.Height });
@@ -1482,7 +3280,7 @@ void BestVideoSource::InitializeFormatSets() {
     }
 
     DefaultFormatSet = FormatSets[0];
-    DefaultFormatSet.NumFrames = TrackIndex.Frames.size();
+    DefaultFormatSet.NumFrames = TrackIndex.size();
     DefaultFormatSet.NumRFFFrames = 0;
 
     for (auto &Iter : FormatSets) {
@@ -1505,6 +3303,26 @@ void BestVideoSource::InitializeFormatSets() {
         DefaultFormatSet.VF = {};
 }
 
+void BestVideoSource::UpdateFormatSets() {
+    // New format sets can show up before the selected one so it's looked up again by its format
+    FormatSet Selected = (VariableFormat >= 0) ? FormatSets[VariableFormat] : FormatSet{};
+    FormatSets.clear();
+    InitializeFormatSets();
+
+    int Index = -1;
+    if (VariableFormat >= 0) {
+        for (size_t i = 0; i < FormatSets.size(); i++) {
+            if (FormatSets[i].Format == Selected.Format && FormatSets[i].Width == Selected.Width && FormatSets[i].Height == Selected.Height)
+                Index = static_cast<int>(i);
+        }
+    }
+    SelectFormatSet(Index);
+
+    // Same as in SetConcurrentMode(), lazy initialization isn't thread-safe
+    if (ConcurrentMode && RFFState == RFFStateEnum::Uninitialized)
+        InitializeRFF();
+}
+
 BestVideoFrame *BestVideoSource::GetFrameWithRFF(int64_t N, bool Linear) {
     if (RFFState == RFFStateEnum::Uninitialized)
         InitializeRFF();
@@ -1536,14 +3354,23 @@ BestVideoFrame *BestVideoSource::GetFrameWithRFF(int64_t N, bool Linear) {
 
 BestVideoFrame *BestVideoSource::GetFrameByTime(double Time, bool Linear) {
     int64_t PTS = static_cast<int64_t>(((Time * VP.TimeBase.Den) / VP.TimeBase.Num) + .001);
-    FrameInfo F{ PTS };
 
-    auto Pos = std::lower_bound(TrackIndex.Frames.begin(), TrackIndex.Frames.end(), F, [](const FrameInfo &FI1, const FrameInfo &FI2) { return FI1.PTS < FI2.PTS; });
+    // Binary search for the first frame with a PTS not less than the requested one
+    size_t Frame = 0;
+    size_t Count = TrackIndex.size();
+    while (Count > 0) {
+        size_t Step = Count / 2;
+        if (TrackIndex.GetPTS(Frame + Step) < PTS) {
+            Frame += Step + 1;
+            Count -= Step + 1;
+        } else {
+            Count = Step;
+        }
+    }
 
-    if (Pos == TrackIndex.Frames.end())
-        return GetFrame(TrackIndex.Frames.size() - 1, Linear);
-    size_t Frame = std::distance(TrackIndex.Frames.begin(), Pos);
-    if (Pos == TrackIndex.Frames.begin() || std::abs(Pos->PTS - PTS) <= std::abs((Pos - 1)->PTS - PTS))
+    if (Frame == TrackIndex.size())
+        return GetFrame(TrackIndex.size() - 1, Linear);
+    if (Frame == 0 || std::abs(TrackIndex.GetPTS(Frame) - PTS) <= std::abs(TrackIndex.GetPTS(Frame - 1) - PTS))
         return GetFrame(Frame, Linear);
     return GetFrame(Frame - 1);
 }
@@ -1581,177 +3408,377 @@ void BestVideoSource::SelectFormatSet(int Index) {
 ////////////////////////////////////////
 // Index read/write
 
-typedef std::array<uint8_t, sizeof(int64_t) + sizeof(int) + sizeof(int) + sizeof(int) + sizeof(int) + sizeof(uint8_t)> VideoCompArray;
+static int HighestSetBit(uint64_t Value) {
+#ifdef _MSC_VER
+    unsigned long Index;
+    _BitScanReverse64(&Index, Value);
+    return static_cast<int>(Index);
+#else
+    return 63 - __builtin_clzll(Value);
+#endif
+}
+
+bool BestVideoSource::VideoTrackIndex::FrameProperties::operator==(const FrameProperties &Other) const {
+    return Width == Other.Width && Height == Other.Height && Format == Other.Format && RepeatPict == Other.RepeatPict && TFF == Other.TFF;
+}
 
-static VideoCompArray GetVideoCompArray(int64_t PTS, int RepeatPict, int Format, int Width, int Height, bool KeyFrame, bool TFF) {
-    VideoCompArray Result;
-    memcpy(Result.data(), &PTS, sizeof(PTS));
-    memcpy(Result.data() + sizeof(PTS), &RepeatPict, sizeof(RepeatPict));
-    memcpy(Result.data() + sizeof(PTS) + sizeof(RepeatPict), &Format, sizeof(Format));
-    memcpy(Result.data() + sizeof(PTS) + sizeof(RepeatPict) + sizeof(Format), &Width, sizeof(Width));
-    memcpy(Result.data() + sizeof(PTS) + sizeof(RepeatPict) + sizeof(Format) + sizeof(Width), &Height, sizeof(Height));
-    uint8_t Flags = static_cast<uint8_t>(KeyFrame) | (static_cast<uint8_t>(TFF) << 1);
-    memcpy(Result.data() + sizeof(PTS) + sizeof(RepeatPict) + sizeof(Format) + sizeof(Width) + sizeof(Height), &Flags, sizeof(Flags));
+void BestVideoSource::VideoTrackIndex::Assign(const std::vector<FrameInfo> &Frames, bool KeepDictionary) {
+    Mapping.reset();
+    if (!KeepDictionary)
+        Dictionary.clear();
+
+    OwnedPTS.resize(Frames.size());
+    OwnedHashes.resize(Frames.size());
+    OwnedPropertyIds.resize(Frames.size());
+    OwnedKeyFrames.assign((Frames.size() + 63) / 64, 0);
+
+    for (size_t i = 0; i < Frames.size(); i++) {
+        const FrameInfo &FI = Frames[i];
+        FrameProperties Properties = { FI.Width, FI.Height, static_cast<int16_t>(FI.Format), static_cast<int16_t>(FI.RepeatPict), FI.TFF };
+
+        // Searched from the back since the properties of consecutive frames are almost always the same
+        size_t Id = Dictionary.size();
+        for (size_t j = Dictionary.size(); j > 0; j--) {
+            if (Dictionary[j - 1] == Properties) {
+                Id = j - 1;
+                break;
+            }
+        }
 
-    static_assert(sizeof(PTS) + sizeof(RepeatPict) + sizeof(Format) + sizeof(Width) + sizeof(Height) + sizeof(Flags) == sizeof(VideoCompArray));
+        if (Id == Dictionary.size()) {
+            if (Dictionary.size() > UINT16_MAX)
+                throw BestSourceException("Too many different frame formats in track");
+            Dictionary.push_back(Properties);
+        }
 
-    return Result;
+        OwnedPTS[i] = FI.PTS;
+        OwnedHashes[i] = FI.Hash;
+        OwnedPropertyIds[i] = static_cast<uint16_t>(Id);
+        if (FI.KeyFrame)
+            OwnedKeyFrames[i / 64] |= UINT64_C(1) << (i % 64);
+    }
+
+    PTS = OwnedPTS.data();
+    Hashes = OwnedHashes.data();
+    PropertyIds = OwnedPropertyIds.data();
+    KeyFrames = OwnedKeyFrames.data();
+    NumFrames = Frames.size();
 }
 
-bool BestVideoSource::WriteVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath) {
-    file_ptr_t F = OpenCacheFile(AbsolutePath, CachePath, Source, VideoTrack, true);
-    if (!F)
+bool BestVideoSource::VideoTrackIndex::Map(std::unique_ptr<BSMappedFile> File, const IndexFileLayout &Layout, size_t Count, std::vector<FrameProperties> &&FileDictionary) {
+    if (!File || Layout.EndOffset < 0 || File->GetSize() != static_cast<size_t>(Layout.EndOffset) || Count > static_cast<size_t>(Layout.Capacity))
         return false;
-    WriteBSHeader(F, true);
-    WriteInt64(F, FileSize);
-    WriteInt(F, VideoTrack);
-    WriteInt(F, ViewID);
-    WriteString(F, HWDevice);
-    WriteInt(F, ExtraHWFrames);
 
-    WriteInt(F, static_cast<int>(LAVFOptions.size()));
-    for (const auto &Iter : LAVFOptions) {
-        WriteString(F, Iter.first);
-        WriteString(F, Iter.second);
+    const uint8_t *Data = File->GetData();
+    const uint16_t *MappedPropertyIds = reinterpret_cast<const uint16_t *>(Data + Layout.PropertyIdOffset);
+    for (size_t i = 0; i < Count; i++)
+        if (MappedPropertyIds[i] >= FileDictionary.size())
+            return false;
+
+    OwnedPTS = {};
+    OwnedHashes = {};
+    OwnedPropertyIds = {};
+    OwnedKeyFrames = {};
+    Dictionary = std::move(FileDictionary);
+    Mapping = std::move(File);
+    PTS = reinterpret_cast<const int64_t *>(Data + Layout.PTSOffset);
+    Hashes = reinterpret_cast<const std::array<uint8_t, HashSize> *>(Data + Layout.HashOffset);
+    PropertyIds = MappedPropertyIds;
+    KeyFrames = reinterpret_cast<const uint64_t *>(Data + Layout.KeyFrameOffset);
+    NumFrames = Count;
+    return true;
+}
+
+static bool WriteColumn(file_ptr_t &F, int64_t Offset, size_t ElementSize, const void *Data, size_t First, size_t Count, size_t Capacity, bool ZeroFill) {
+    static const uint8_t Zeroes[4096] = {};
+    if (!SeekFile(F, Offset + First * ElementSize))
+        return false;
+    if (fwrite(static_cast<const uint8_t *>(Data) + First * ElementSize, 1, (Count - First) * ElementSize, F.get()) != (Count - First) * ElementSize)
+        return false;
+    if (!ZeroFill)
+        return true;
+    for (size_t Remaining = (Capacity - Count) * ElementSize; Remaining > 0;) {
+        size_t Bytes = std::min(Remaining, sizeof(Zeroes));
+        if (fwrite(Zeroes, 1, Bytes, F.get()) != Bytes)
+            return false;
+        Remaining -= Bytes;
     }
+    return true;
+}
 
-    WriteInt64(F, TrackIndex.Frames.size());
-    WriteInt64(F, TrackIndex.LastFrameDuration);
+bool BestVideoSource::VideoTrackIndex::WriteColumns(file_ptr_t &F, const IndexFileLayout &Layout, size_t FirstFrame, bool ZeroFill) const {
+    size_t Capacity = static_cast<size_t>(Layout.Capacity);
+    if (NumFrames > Capacity || FirstFrame > NumFrames)
+        return false;
+    return WriteColumn(F, Layout.PTSOffset, sizeof(*PTS), PTS, FirstFrame, NumFrames, Capacity, ZeroFill) &&
+        WriteColumn(F, Layout.HashOffset, sizeof(*Hashes), Hashes, FirstFrame, NumFrames, Capacity, ZeroFill) &&
+        WriteColumn(F, Layout.PropertyIdOffset, sizeof(*PropertyIds), PropertyIds, FirstFrame, NumFrames, Capacity, ZeroFill) &&
+        WriteColumn(F, Layout.KeyFrameOffset, sizeof(*KeyFrames), KeyFrames, FirstFrame / 64, (NumFrames + 63) / 64, (Capacity + 63) / 64, ZeroFill);
+}
+
+void BestVideoSource::VideoTrackIndex::SetHash(size_t N, const std::array<uint8_t, HashSize> &Hash) {
+    assert(!Mapping);
+    OwnedHashes[N] = Hash;
+}
 
-    std::map<VideoCompArray, uint8_t> Dict;
+void BestVideoSource::VideoTrackIndex::ReserveDictionary() {
+    Dictionary.reserve(static_cast<size_t>(UINT16_MAX) + 1);
+}
 
-    int64_t PTSPredictor = 0;
-    if (TrackIndex.Frames.size() > 1 && TrackIndex.Frames[0].PTS != AV_NOPTS_VALUE && TrackIndex.Frames[1].PTS != AV_NOPTS_VALUE)
-        PTSPredictor = TrackIndex.Frames[1].PTS - 2 * (TrackIndex.Frames[1].PTS - TrackIndex.Frames[0].PTS);
-    int64_t LastPTSValue = PTSPredictor;
+void BestVideoSource::VideoTrackIndex::SetProperties(size_t N, const FrameProperties &Properties) {
+    assert(!Mapping);
+    assert(Dictionary.capacity() > UINT16_MAX);
+    if (Dictionary[OwnedPropertyIds[N]] == Properties)
+        return;
 
-    for (const auto &Iter : TrackIndex.Frames) {
-        int64_t PTS = Iter.PTS;
-        if (PTS != AV_NOPTS_VALUE) {
-            int64_t OrigPTS = PTS;
-            PTS = PTS - LastPTSValue;
-            LastPTSValue = OrigPTS;
+    size_t Id = Dictionary.size();
+    for (size_t j = Dictionary.size(); j > 0; j--) {
+        if (Dictionary[j - 1] == Properties) {
+            Id = j - 1;
+            break;
         }
+    }
 
-        Dict.insert(std::make_pair(GetVideoCompArray(PTS, Iter.RepeatPict, Iter.Format, Iter.Width, Iter.Height, Iter.KeyFrame, Iter.TFF), 0));
+    if (Id == Dictionary.size()) {
+        // Keeping the guessed properties is better than failing to decode
+        if (Dictionary.size() > UINT16_MAX)
+            return;
+        Dictionary.push_back(Properties);
     }
 
-    // Only bother with a dictionary if it's not too big
-    // Most files have less than 64 entries and a surprisingly large number of files only 2-4 unique entries
-    if (Dict.size() <= 0xFF) {
-        uint8_t PV = 0;
-        for (auto &Iter : Dict)
-            Iter.second = PV++;
+    OwnedPropertyIds[N] = static_cast<uint16_t>(Id);
+}
 
-        WriteInt(F, static_cast<int>(Dict.size()));
-        WriteInt64(F, PTSPredictor);
+size_t BestVideoSource::VideoTrackIndex::size() const {
+    return NumFrames;
+}
 
-        for (const auto &Iter : Dict)
-            fwrite(Iter.first.data(), 1, Iter.first.size(), F.get());
+bool BestVideoSource::VideoTrackIndex::empty() const {
+    return NumFrames == 0;
+}
 
-        LastPTSValue = PTSPredictor;
-        for (const auto &Iter : TrackIndex.Frames) {
-            int64_t PTS = Iter.PTS;
-            if (PTS != AV_NOPTS_VALUE) {
-                int64_t OrigPTS = PTS;
-                PTS = PTS - LastPTSValue;
-                LastPTSValue = OrigPTS;
-            }
+const std::vector<BestVideoSource::VideoTrackIndex::FrameProperties> &BestVideoSource::VideoTrackIndex::GetDictionary() const {
+    return Dictionary;
+}
+
+BestVideoSource::FrameInfo BestVideoSource::VideoTrackIndex::operator[](size_t N) const {
+    const FrameProperties &P = Dictionary[PropertyIds[N]];
+    return { PTS[N], P.RepeatPict, IsKeyFrame(N), P.TFF, P.Format, P.Width, P.Height, Hashes[N] };
+}
+
+int64_t BestVideoSource::VideoTrackIndex::GetPTS(size_t N) const {
+    return PTS[N];
+}
+
+bool BestVideoSource::VideoTrackIndex::IsKeyFrame(size_t N) const {
+    return !!(KeyFrames[N / 64] & (UINT64_C(1) << (N % 64)));
+}
+
+int64_t BestVideoSource::VideoTrackIndex::GetPreviousKeyFrame(int64_t N) const {
+    N = std::min<int64_t>(N, static_cast<int64_t>(NumFrames) - 1);
+    if (N < 0)
+        return -1;
+
+    int64_t Word = N / 64;
+    uint64_t Bits = KeyFrames[Word] & (~UINT64_C(0) >> (63 - N % 64));
+    while (!Bits) {
+        if (--Word < 0)
+            return -1;
+        Bits = KeyFrames[Word];
+    }
+    return Word * 64 + HighestSetBit(Bits);
+}
+
+bool BestVideoSource::VideoTrackIndex::IsTFF(size_t N) const {
+    return Dictionary[PropertyIds[N]].TFF;
+}
+
+int BestVideoSource::VideoTrackIndex::GetRepeatPict(size_t N) const {
+    return Dictionary[PropertyIds[N]].RepeatPict;
+}
+
+const std::array<uint8_t, HashSize> &BestVideoSource::VideoTrackIndex::GetHash(size_t N) const {
+    return Hashes[N];
+}
+
+// Index format 4 stores the frame properties dictionary in the header followed by each column of the index with room for
+// Capacity frames so it can be mapped and used in place without any parsing and extended without moving anything
+static constexpr int VideoIndexFormatVersion = 4;
+
+static int64_t AlignIndexOffset(int64_t Offset) {
+    constexpr int64_t Alignment = 32;
+    return (Offset + Alignment - 1) & ~(Alignment - 1);
+}
+
+void BestVideoSource::IndexFileLayout::SetColumnOffsets(int64_t ColumnStart) {
+    PTSOffset = AlignIndexOffset(ColumnStart);
+    HashOffset = AlignIndexOffset(PTSOffset + Capacity * sizeof(int64_t));
+    PropertyIdOffset = AlignIndexOffset(HashOffset + Capacity * HashSize);
+    KeyFrameOffset = AlignIndexOffset(PropertyIdOffset + Capacity * sizeof(uint16_t));
+    EndOffset = KeyFrameOffset + ((Capacity + 63) / 64) * sizeof(uint64_t);
+}
+
+bool BestVideoSource::WriteVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, size_t ExtraCapacity) {
+    // Write to a temporary file and then replace the index since other processes may have the old one mapped
+    std::filesystem::path CacheFile = GetCacheFilePath(AbsolutePath, CachePath, Source, VideoTrack);
+    std::filesystem::path TempFile = GetTempFilePath(CacheFile);
+    std::error_code ec;
+    std::filesystem::create_directories(CacheFile.parent_path(), ec);
+
+    IndexFileLayout Layout;
 
-            WriteByte(F, Dict[GetVideoCompArray(PTS, Iter.RepeatPict, Iter.Format, Iter.Width, Iter.Height, Iter.KeyFrame, Iter.TFF)]);
-            fwrite(Iter.Hash.data(), 1, Iter.Hash.size(), F.get());
+    {
+        file_ptr_t F = OpenNormalFile(TempFile, true);
+        if (!F)
+            return false;
+        WriteBSHeader(F, true);
+        WriteInt(F, VideoIndexFormatVersion);
+        Layout.FileSizeOffset = ftell(F.get());
+        WriteInt64(F, FileSize);
+        WriteInt(F, VideoTrack);
+        WriteInt(F, ViewID);
+        WriteString(F, HWDevice);
+        WriteInt(F, ExtraHWFrames);
+        WriteInt(F, SparseHash);
+
+        WriteInt(F, static_cast<int>(LAVFOptions.size()));
+        for (const auto &Iter : LAVFOptions) {
+            WriteString(F, Iter.first);
+            WriteString(F, Iter.second);
         }
-    } else {
-        WriteInt(F, 0);
 
-        for (const auto &Iter : TrackIndex.Frames) {
-            fwrite(Iter.Hash.data(), 1, Iter.Hash.size(), F.get());
-            WriteInt64(F, Iter.PTS);
-            WriteInt(F, Iter.RepeatPict);
-            WriteInt(F, Iter.Format);
+        Layout.NumFramesOffset = ftell(F.get());
+        WriteInt64(F, TrackIndex.size());
+        WriteInt64(F, TrackIndex.LastFrameDuration);
+        Layout.NumFrames = TrackIndex.size();
+        Layout.Capacity = TrackIndex.size() + ExtraCapacity;
+        WriteInt64(F, Layout.Capacity);
+
+        const auto &Dictionary = TrackIndex.GetDictionary();
+        Layout.DictionarySize = Dictionary.size();
+        WriteInt(F, static_cast<int>(Dictionary.size()));
+        for (const auto &Iter : Dictionary) {
             WriteInt(F, Iter.Width);
             WriteInt(F, Iter.Height);
-            WriteByte(F, static_cast<uint8_t>(Iter.KeyFrame) | (static_cast<uint8_t>(Iter.TFF) << 1));
+            WriteInt(F, Iter.Format);
+            WriteInt(F, Iter.RepeatPict);
+            WriteInt(F, Iter.TFF);
+        }
+
+        Layout.SetColumnOffsets(ftell(F.get()));
+
+        if (!TrackIndex.WriteColumns(F, Layout, 0, true) || fflush(F.get())) {
+            F.reset();
+            std::filesystem::remove(TempFile, ec);
+            return false;
         }
     }
 
+    std::filesystem::rename(TempFile, CacheFile, ec);
+    if (ec) {
+        std::filesystem::remove(TempFile, ec);
+        return false;
+    }
+
+    IndexLayout = Layout;
     return true;
 }
 
-bool BestVideoSource::ReadVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath) {
-    file_ptr_t F = OpenCacheFile(AbsolutePath, CachePath, Source, VideoTrack, false);
-    if (!F)
-        return false;
-    if (!ReadBSHeader(F, true))
+bool BestVideoSource::ReadVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, int64_t &IndexedFileSize) {
+    std::filesystem::path CacheFile = GetCacheFilePath(AbsolutePath, CachePath, Source, VideoTrack);
+    IndexFileLayout Layout;
+    int64_t NumFrames;
+    int64_t LastFrameDuration;
+    std::vector<VideoTrackIndex::FrameProperties> Dictionary;
+
+    {
+        file_ptr_t F = OpenNormalFile(CacheFile, false);
+        if (!F)
+            return false;
+        if (!ReadBSHeader(F, true))
+            return false;
+        if (!ReadCompareInt(F, VideoIndexFormatVersion))
+            return false;
+        Layout.FileSizeOffset = ftell(F.get());
+        IndexedFileSize = ReadInt64(F);
+        if (IndexedFileSize != FileSize && (IndexedFileSize < 0 || FileSize < 0 || IndexedFileSize > FileSize))
+            return false;
+        if (!ReadCompareInt(F, VideoTrack))
+            return false;
+        if (!ReadCompareInt(F, ViewID))
+            return false;
+        if (!ReadCompareString(F, HWDevice))
+            return false;
+        if (!ReadCompareInt(F, ExtraHWFrames))
+            return false;
+        if (!ReadCompareInt(F, SparseHash))
+            return false;
+
+        int LAVFOptCount = ReadInt(F);
+        std::map<std::string, std::string> IndexLAVFOptions;
+        for (int i = 0; i < LAVFOptCount; i++) {
+            std::string Key = ReadString(F);
+            IndexLAVFOptions[Key] = ReadString(F);
+        }
+        if (LAVFOptions != IndexLAVFOptions)
+            return false;
+        Layout.NumFramesOffset = ftell(F.get());
+        NumFrames = ReadInt64(F);
+        LastFrameDuration = ReadInt64(F);
+        Layout.Capacity = ReadInt64(F);
+        if (NumFrames <= 0 || Layout.Capacity < NumFrames)
+            return false;
+        Layout.NumFrames = static_cast<size_t>(NumFrames);
+
+        int DictSize = ReadInt(F);
+        if (DictSize <= 0 || DictSize > UINT16_MAX + 1)
+            return false;
+        Dictionary.reserve(DictSize);
+        for (int i = 0; i < DictSize; i++) {
+            VideoTrackIndex::FrameProperties Properties = {};
+            Properties.Width = ReadInt(F);
+            Properties.Height = ReadInt(F);
+            Properties.Format = static_cast<int16_t>(ReadInt(F));
+            Properties.RepeatPict = static_cast<int16_t>(ReadInt(F));
+            Properties.TFF = !!ReadInt(F);
+            Dictionary.push_back(Properties);
+        }
+        Layout.DictionarySize = Dictionary.size();
+
+        Layout.SetColumnOffsets(ftell(F.get()));
+    }
+
+    if (!TrackIndex.Map(BSMappedFile::Open(CacheFile), Layout, NumFrames, std::move(Dictionary)))
         return false;
-    if (!ReadCompareInt64(F, FileSize))
+    TrackIndex.LastFrameDuration = LastFrameDuration;
+    IndexLayout = Layout;
+    return true;
+}
+
+bool BestVideoSource::AppendVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, size_t FirstNewFrame) {
+    // Changes to frames already in the file, new frame formats or running out of reserved space means the whole file has to be written again.
+    // Only the reserved space, which nothing reads, and the header fields that are only read when opening it are written in place.
+    if (IndexLayout.EndOffset < 0 || FirstNewFrame < IndexLayout.NumFrames || TrackIndex.GetDictionary().size() != IndexLayout.DictionarySize || TrackIndex.size() > static_cast<size_t>(IndexLayout.Capacity))
         return false;
-    if (!ReadCompareInt(F, VideoTrack))
+
+    file_ptr_t F = OpenUpdateFile(GetCacheFilePath(AbsolutePath, CachePath, Source, VideoTrack));
+    if (!F)
         return false;
-    if (!ReadCompareInt(F, ViewID))
+
+    // The file size is updated last so an interrupted update is detected as a mismatch with the source file size. The reserved
+    // space was zero filled when the file was created so only the new frames are written.
+    if (!TrackIndex.WriteColumns(F, IndexLayout, FirstNewFrame, false))
         return false;
-    if (!ReadCompareString(F, HWDevice))
+    if (!SeekFile(F, IndexLayout.NumFramesOffset))
         return false;
-    if (!ReadCompareInt(F, ExtraHWFrames))
+    WriteInt64(F, TrackIndex.size());
+    WriteInt64(F, TrackIndex.LastFrameDuration);
+    if (fflush(F.get()) || !SeekFile(F, IndexLayout.FileSizeOffset))
         return false;
-
-    int LAVFOptCount = ReadInt(F);
-    std::map<std::string, std::string> IndexLAVFOptions;
-    for (int i = 0; i < LAVFOptCount; i++) {
-        std::string Key = ReadString(F);
-        IndexLAVFOptions[Key] = ReadString(F);
-    }
-    if (LAVFOptions != IndexLAVFOptions)
+    WriteInt64(F, FileSize);
+    if (fflush(F.get()))
         return false;
-    int64_t NumFrames = ReadInt64(F);
-    TrackIndex.LastFrameDuration = ReadInt64(F);
-    TrackIndex.Frames.reserve(NumFrames);
-
-    int DictSize = ReadInt(F);
-
-    if (DictSize > 0) {
-        int64_t LastPTSValue = ReadInt64(F);
-        std::map<uint8_t, FrameInfo> Dict;
-        for (int i = 0; i < DictSize; i++) {
-            FrameInfo FI = {};
-            FI.PTS = ReadInt64(F);
-            FI.RepeatPict = ReadInt(F);
-            FI.Format = ReadInt(F);
-            FI.Width = ReadInt(F);
-            FI.Height = ReadInt(F);
-            uint8_t Flags = ReadByte(F);
-            FI.KeyFrame = !!(Flags & 1);
-            FI.TFF = !!(Flags & 2);
-            Dict[i] = FI;
-        }
-
-        for (int i = 0; i < NumFrames; i++) {
-            FrameInfo FI = Dict.at(ReadByte(F));
-            if (FI.PTS != AV_NOPTS_VALUE) {
-                FI.PTS += LastPTSValue;
-                LastPTSValue = FI.PTS;
-            }
-            if (fread(FI.Hash.data(), 1, FI.Hash.size(), F.get()) != FI.Hash.size())
-                return false;
-            TrackIndex.Frames.push_back(FI);
-        }
-    } else {
-        for (int i = 0; i < NumFrames; i++) {
-            FrameInfo FI = {};
-            if (fread(FI.Hash.data(), 1, FI.Hash.size(), F.get()) != FI.Hash.size())
-                return false;
-            FI.PTS = ReadInt64(F);
-            FI.RepeatPict = ReadInt(F);
-            FI.Format = ReadInt(F);
-            FI.Width = ReadInt(F);
-            FI.Height = ReadInt(F);
-            uint8_t Flags = ReadByte(F);
-            FI.KeyFrame = !!(Flags & 1);
-            FI.TFF = !!(Flags & 2);
-            TrackIndex.Frames.push_back(FI);
-        }
-    }
-
+    IndexLayout.NumFrames = TrackIndex.size();
     return true;
 }
 
@@ -1763,18 +3790,18 @@ bool BestVideoSource::GetFrameIsTFF(int64_t N, bool RFF) {
         InitializeRFF();
 
     if (!RFF || RFFState == RFFStateEnum::Unused) {
-        return TrackIndex.Frames[N].TFF;
+        return TrackIndex.IsTFF(N);
     } else {
         if (RFFFields[N].first == RFFFields[N].second)
-            return TrackIndex.Frames[RFFFields[N].first].TFF;
+            return TrackIndex.IsTFF(RFFFields[N].first);
         else
             return (RFFFields[N].first < RFFFields[N].second);
     }
 }
 
 void BestVideoSource::WriteTimecodes(const std::filesystem::path &TimecodeFile) const {
-    for (const auto &Iter : TrackIndex.Frames)
-        if (Iter.PTS == AV_NOPTS_VALUE)
+    for (size_t i = 0; i < TrackIndex.size(); i++)
+        if (TrackIndex.GetPTS(i) == AV_NOPTS_VALUE)
             throw BestSourceException("Cannot write valid timecode file, track contains frames with unknown timestamp");
 
     file_ptr_t F(OpenNormalFile(TimecodeFile, true));
@@ -1782,8 +3809,8 @@ void BestVideoSource::WriteTimecodes(const std::filesystem::path &TimecodeFile)
         throw BestSourceException("Couldn't open timecode file for writing");
 
     fprintf(F.get(), "# timecode format v2\n");
-    for (const auto &Iter : TrackIndex.Frames) {
-        double timestamp = (Iter.PTS * VP.TimeBase.Num) / (double)VP.TimeBase.Den;
+    for (size_t i = 0; i < TrackIndex.size(); i++) {
+        double timestamp = (TrackIndex.GetPTS(i) * VP.TimeBase.Num) / (double)VP.TimeBase.Den;
 #ifdef __cpp_lib_to_chars
         char buffer[100];
         auto res = std::to_chars(buffer, buffer + sizeof(buffer), timestamp, std::chars_format::fixed, 2);
@@ -1794,10 +3821,76 @@ void BestVideoSource::WriteTimecodes(const std::filesystem::path &TimecodeFile)
     }
 }
 
-const BestVideoSource::FrameInfo &BestVideoSource::GetFrameInfo(int64_t N) const {
-    return TrackIndex.Frames[N];
+BestVideoSource::FrameInfo BestVideoSource::GetFrameInfo(int64_t N) const {
+    return TrackIndex[N];
 }
 
 bool BestVideoSource::GetLinearDecodingState() const {
     return LinearMode;
-}
\ No newline at end of file
+}
+
+bool BestVideoSource::IsAllIntra() const {
+    return AllIntra;
+}
+
+bool BestVideoSource::GetFastIndexState() const {
+    return !!TrackIndex.HashKnown;
+}
+
+static std::mutex SharedVideoSourceMutex;
+static std::map<std::string, std::shared_future<std::weak_ptr<BestVideoSource>>> SharedVideoSources;
+
+std::shared_ptr<BestVideoSource> GetSharedVideoSource(const std::string &Key, const std::function<BestVideoSource *()> &Create) {
+    while (true) {
+        std::promise<std::weak_ptr<BestVideoSource>> Promise;
+        std::shared_future<std::weak_ptr<BestVideoSource>> Future;
+        bool Creator = false;
+
+        {
+            // Only held for the lookup so creating one source doesn't block opening any other
+            std::lock_guard<std::mutex> Lock(SharedVideoSourceMutex);
+
+            for (auto Iter = SharedVideoSources.begin(); Iter != SharedVideoSources.end();) {
+                if (Iter->second.wait_for(std::chrono::seconds(0)) == std::future_status::ready && Iter->second.get().expired())
+                    Iter = SharedVideoSources.erase(Iter);
+                else
+                    ++Iter;
+            }
+
+            auto Iter = SharedVideoSources.find(Key);
+            if (Iter != SharedVideoSources.end()) {
+                Future = Iter->second;
+            } else {
+                // A placeholder so other threads opening the same source wait for this one instead of indexing it again
+                Future = Promise.get_future().share();
+                SharedVideoSources[Key] = Future;
+                Creator = true;
+            }
+        }
+
+        if (Creator) {
+            std::shared_ptr<BestVideoSource> Result;
+            try {
+                Result.reset(Create());
+                Result->SetConcurrentMode(true);
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> Lock(SharedVideoSourceMutex);
+                    SharedVideoSources.erase(Key);
+                }
+                Promise.set_exception(std::current_exception());
+                throw;
+            }
+            Promise.set_value(Result);
+            return Result;
+        }
+
+        // Rethrows if creating it failed
+        std::shared_ptr<BestVideoSource> Result = Future.get().lock();
+        if (Result) {
+            BSDebugPrint("Reusing shared video source");
+            return Result;
+        }
+        // The last user released it in the meantime so it has to be created again
+    }
+}
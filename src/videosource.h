@@ -24,19 +24,30 @@
 #include "bsshared.h"
 #include <cstdint>
 #include <list>
+#include <unordered_map>
 #include <string>
 #include <map>
 #include <set>
 #include <vector>
 #include <array>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <condition_variable>
 
 struct AVFormatContext;
 struct AVCodecContext;
 struct AVBufferRef;
 struct AVFrame;
 struct AVPacket;
+struct AVIOContext;
 struct AVPixFmtDescriptor;
+class BSPacketQueue;
+class BSBlockCache;
+class BSFramePool;
 
 struct BSVideoFormat {
     int ColorFamily; /* Unknown = 0, Gray = 1, RGB = 2, YUV = 3 */
@@ -113,6 +124,21 @@ private:
     AVBufferRef *HWDeviceContext = nullptr;
     AVFrame *DecodeFrame = nullptr;
     AVFrame *HWFrame = nullptr;
+    AVFrame *NextHWFrame = nullptr; // The frame after HWFrame when it has already been received from the decoder
+    AVFrame *NextDecodeFrame = nullptr; // Download destination of NextHWFrame
+    bool NextDownloading = false; // NextHWFrame is being downloaded to NextDecodeFrame
+    bool HasNextHWFrame = false;
+
+    // Surfaces are downloaded on one thread per decoder while decoding continues, only for device types where downloading a surface at the same
+    // time as the decoder submits work to the device is known to be safe. Other device types download on the decoding thread.
+    bool AsyncDownload = false;
+    std::thread DownloadThread; // Started the first time a download is needed and counted against the decoder thread budget
+    std::mutex DownloadMutex;
+    std::condition_variable DownloadCondition;
+    AVFrame *DownloadDst = nullptr;
+    const AVFrame *DownloadSrc = nullptr; // Set from when a download is handed over until it has finished
+    int DownloadResult = 0;
+    bool DownloadExit = false;
     int64_t CurrentFrame = 0;
     int TrackNumber = -1;
     bool HWMode = false;
@@ -120,38 +146,73 @@ private:
     AVPacket *Packet = nullptr;
     bool Seeked = false;
     bool IsLayered = false;
+    int ReservedThreads = 0; // Drawn from the decoder thread budget
+    BSPacketQueue *PacketSource = nullptr;
+    AVIOContext *CustomIO = nullptr; // Reads through the block cache of the source when set
+    BSFramePool *FramePool = nullptr;
+    int64_t ReportedBytesRead = 0;
     std::vector<LWVideoProperties::ViewIDInfo> ViewIDs;
 
-    void OpenFile(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts);
+    void OpenFile(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts, BSBlockCache *BlockCache, BSFramePool *FramePool, int LowRes);
     bool ReadPacket();
+    bool ReceiveFrame(AVFrame *Frame);
+    void DiscardNextHWFrame();
+    void StartDownload(AVFrame *Dst, const AVFrame *Src);
+    int WaitForDownload();
+    void DownloadLoop();
     bool DecodeNextFrame(bool SkipOutput = false);
     void Free();
 public:
-    LWVideoDecoder(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts); // Positive track numbers are absolute. Negative track numbers mean nth audio track to simplify things.
+    LWVideoDecoder(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, const std::map<std::string, std::string> &LAVFOpts, BSBlockCache *BlockCache = nullptr, BSFramePool *FramePool = nullptr, int LowRes = 0); // FramePool provides the frame buffers if set. LowRes decodes at 1/2^LowRes of the resolution if the codec supports it. Positive track numbers are absolute. Negative track numbers mean nth audio track to simplify things.
     ~LWVideoDecoder();
     [[nodiscard]] int64_t GetSourceSize() const;
     [[nodiscard]] int64_t GetSourcePostion() const;
+    [[nodiscard]] int64_t TakeBytesRead(); // The number of bytes read from the file since the last call
+    [[nodiscard]] int64_t GetStartPTS() const; // The container start time of the track, may be AV_NOPTS_VALUE
     [[nodiscard]] int GetTrack() const; // Useful when opening nth video track to get the actual number
     [[nodiscard]] int64_t GetFrameNumber() const; // The frame you will get when calling GetNextFrame()
     void SetFrameNumber(int64_t N); // Use after seeking to update internal frame number
     void GetVideoProperties(LWVideoProperties &VP); // Gets file level video properties, note that format and resolution information can only be retrieved by decoding a frame with GetNextFrame() and examining it 
     [[nodiscard]] AVFrame *GetNextFrame();
+    [[nodiscard]] bool ReadPacketInfo(int64_t &PTS, int &Flags); // Demuxes the next packet of the track without decoding it, don't mix with GetNextFrame() and SkipFrames()
     bool SkipFrames(int64_t Count);
     [[nodiscard]] bool HasMoreFrames() const;
     [[nodiscard]] bool Seek(int64_t PTS); // Note that the current frame number isn't updated and if seeking fails the decoder is in an undefined state
+    void SetPacketSource(BSPacketQueue *Packets); // Takes the packets from a shared demuxer instead of reading the file, only for decoding the whole track in order
+    void SetKeyFramesOnly(); // Makes the decoder skip everything except keyframes, the frame number is meaningless afterwards
     [[nodiscard]] bool HasSeeked() const;
+    [[nodiscard]] bool IsIntraOnly() const; // True if the codec can only code every frame independently, such as image formats, ProRes, DNxHD and MJPEG
 };
 
 
+// Read only access to the planes of a decoded frame without copying them, the plane buffers are kept alive by a reference
+// to the decoded frame until the object is destroyed
+class BestBorrowedPlanes {
+private:
+    AVFrame *Frame;
+public:
+    BestBorrowedPlanes(const AVFrame *Frame);
+    ~BestBorrowedPlanes();
+
+    int NumPlanes = 0; /* 1 or 3 base planes and one more if there's alpha */
+    const uint8_t *Data[4] = {}; /* Planes in the same order as ExportAsPlanar() with alpha last */
+    ptrdiff_t Stride[4] = {};
+    int RowBytes[4] = {};
+    int Height[4] = {};
+};
+
 class BestVideoFrame {
 private:
     AVFrame *Frame;
+    bool ExportRows(uint8_t *const *const Dsts, const ptrdiff_t *const Stride, uint8_t *AlphaDst, ptrdiff_t AlphaStride, int Top, int Bottom) const; // Exports the luma rows Top to Bottom, both must be multiples of the vertical subsampling
 public:
     BestVideoFrame(AVFrame *Frame);
     ~BestVideoFrame();
     [[nodiscard]] const AVFrame *GetAVFrame() const;
     void MergeField(bool Top, const BestVideoFrame *FieldSrc); // Useful for RFF and other such things where fields from multiple decoded frames need to be combined, retains original frame's properties
-    bool ExportAsPlanar(uint8_t *const *const Dsts1, const ptrdiff_t *const Stride, uint8_t *AlphaDst = nullptr, ptrdiff_t AlphaStride = 0) const;
+    bool ExportAsPlanar(uint8_t *const *const Dsts, const ptrdiff_t *const Stride, uint8_t *AlphaDst = nullptr, ptrdiff_t AlphaStride = 0, int Threads = 1) const; // Threads > 1 splits large frames into row bands that are converted in parallel
+    [[nodiscard]] BestBorrowedPlanes *BorrowPlanes() const; // Only possible when the decoded frame already has the planar layout ExportAsPlanar() would produce, returns nullptr otherwise
+    [[nodiscard]] const uint8_t *GetHDR10Plus(size_t &Size) const; // The HDR10+ metadata serialized as T.35, same as the HDR10Plus and HDR10PlusSize fields. Returns nullptr if the frame has none
 
     BSVideoFormat VF;
     int Width;
@@ -194,7 +255,7 @@ public:
     uint8_t *DolbyVisionRPU = nullptr;
     size_t DolbyVisionRPUSize = 0;
 
-    /* HDR10Plus */
+    /* HDR10Plus, only allocated for frames that have it */
     uint8_t *HDR10Plus = nullptr;
     size_t HDR10PlusSize = 0;
 
@@ -205,6 +266,8 @@ public:
 
 class BestVideoSource {
 public:
+    typedef std::function<bool(int64_t N, BestVideoFrame *Frame)> FrameRangeCallback; // Takes ownership of Frame which is nullptr if it couldn't be decoded, return false to stop
+
     struct FormatSet {
         BSVideoFormat VF = {};
         int Format = 0;
@@ -232,13 +295,73 @@ public:
 
 
 private:
-    struct VideoTrackIndex {
+    // File offsets of the fields that change when an index is extended and of the frame columns
+    struct IndexFileLayout {
+        int64_t FileSizeOffset = -1;
+        int64_t NumFramesOffset = -1;
+        int64_t Capacity = 0;
+        size_t NumFrames = 0; // The number of frames in the file, everything at or after it is unused reserved space
+        size_t DictionarySize = 0;
+        int64_t PTSOffset = -1;
+        int64_t HashOffset = -1;
+        int64_t PropertyIdOffset = -1;
+        int64_t KeyFrameOffset = -1;
+        int64_t EndOffset = -1;
+
+        void SetColumnOffsets(int64_t ColumnStart); // Places the columns after the header based on Capacity
+    };
+
+    // The frames are stored as separate columns where the rarely changing properties are replaced by an id into a small dictionary
+    // and keyframes are a bitmap. The columns are either owned or point straight into a memory mapped index file.
+    class VideoTrackIndex {
+    public:
+        struct FrameProperties {
+            int32_t Width;
+            int32_t Height;
+            int16_t Format;
+            int16_t RepeatPict;
+            bool TFF;
+
+            bool operator==(const FrameProperties &Other) const;
+        };
+    private:
+        std::vector<FrameProperties> Dictionary;
+        std::vector<int64_t> OwnedPTS;
+        std::vector<std::array<uint8_t, HashSize>> OwnedHashes;
+        std::vector<uint16_t> OwnedPropertyIds;
+        std::vector<uint64_t> OwnedKeyFrames;
+        std::unique_ptr<BSMappedFile> Mapping;
+        const int64_t *PTS = nullptr;
+        const std::array<uint8_t, HashSize> *Hashes = nullptr;
+        const uint16_t *PropertyIds = nullptr;
+        const uint64_t *KeyFrames = nullptr;
+        size_t NumFrames = 0;
+    public:
         int64_t LastFrameDuration = 0; // fixme, is LastFrameDuration actually applied?
-        std::vector<FrameInfo> Frames;
+        std::unique_ptr<std::atomic_bool[]> HashKnown; // Only used by fast indexing, null means all frame hashes are known
+
+        void Assign(const std::vector<FrameInfo> &Frames, bool KeepDictionary = false); // KeepDictionary preserves the ids of the existing dictionary entries so an index file can be updated in place
+        [[nodiscard]] bool Map(std::unique_ptr<BSMappedFile> File, const IndexFileLayout &Layout, size_t Count, std::vector<FrameProperties> &&FileDictionary); // Fails if the columns don't fit the file exactly
+        [[nodiscard]] bool WriteColumns(file_ptr_t &F, const IndexFileLayout &Layout, size_t FirstFrame, bool ZeroFill) const; // Writes all frames from FirstFrame, ZeroFill also writes the reserved space after them which is only needed when creating the file
+        void SetHash(size_t N, const std::array<uint8_t, HashSize> &Hash); // Only possible for owned columns
+        void ReserveDictionary(); // Makes room for every possible id so SetProperties() never moves the existing entries while other threads read them
+        void SetProperties(size_t N, const FrameProperties &Properties); // Only possible for owned columns after ReserveDictionary()
+        [[nodiscard]] size_t size() const;
+        [[nodiscard]] bool empty() const;
+        [[nodiscard]] const std::vector<FrameProperties> &GetDictionary() const;
+        [[nodiscard]] FrameInfo operator[](size_t N) const;
+        [[nodiscard]] int64_t GetPTS(size_t N) const;
+        [[nodiscard]] bool IsKeyFrame(size_t N) const;
+        [[nodiscard]] int64_t GetPreviousKeyFrame(int64_t N) const; // Returns the closest keyframe at or before N or -1 if there is none
+        [[nodiscard]] bool IsTFF(size_t N) const;
+        [[nodiscard]] int GetRepeatPict(size_t N) const;
+        [[nodiscard]] const std::array<uint8_t, HashSize> &GetHash(size_t N) const;
     };
 
-    bool WriteVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath);
-    bool ReadVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath);
+    IndexFileLayout IndexLayout;
+    bool WriteVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, size_t ExtraCapacity = 0); // ExtraCapacity reserves room for frames to be appended in place later
+    bool ReadVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, int64_t &IndexedFileSize); // Also accepts indexes of a smaller file size so they can be extended
+    bool AppendVideoTrackIndex(bool AbsolutePath, const std::filesystem::path &CachePath, size_t FirstNewFrame); // Writes the frames from FirstNewFrame in place, only possible when they're all in the reserved space after the frames already in the file since other processes may have it mapped
 
     class Cache {
     private:
@@ -247,19 +370,45 @@ private:
             int64_t FrameNumber;
             AVFrame *Frame;
             size_t Size = 0;
+            uint64_t LastUse; // Ordered across all caches in the process so the process wide budget can evict the globally oldest frame
             CacheBlock(int64_t FrameNumber, AVFrame *Frame);
             ~CacheBlock();
         };
 
-        size_t Size = 0;
+        // Frames are spread over the stripes by frame number and each stripe has its own lock and share of the max size
+        struct CacheStripe {
+            std::mutex Mutex;
+            size_t Size = 0;
+            uint64_t Hits = 0;
+            uint64_t Misses = 0;
+            uint64_t Evictions = 0;
+            std::list<CacheBlock> Data;
+            std::unordered_map<int64_t, std::list<CacheBlock>::iterator> Index;
+        };
+
         size_t MaxSize = 1024 * 1024 * 1024;
-        std::list<CacheBlock> Data;
-        void ApplyMaxSize();
+        std::atomic_bool RejectSeeked{ false }; // Checked under the stripe lock so nothing inserted after RejectSeekedFrames() clears a stripe survives
+        std::vector<std::unique_ptr<CacheStripe>> Stripes;
+        [[nodiscard]] CacheStripe &GetStripe(int64_t FrameNumber);
+        void ApplyMaxSize(CacheStripe &Stripe);
+        static void EvictLast(CacheStripe &Stripe);
+
+        // All caches in the process, the mutex is also held while the stripes of a cache are replaced
+        static std::mutex AllCachesMutex;
+        static std::set<Cache *> AllCaches;
+        static void ApplyFrameCacheBudget(); // Evicts the least recently used frames of all caches until the process is a bit below the budget, call without holding a stripe lock
     public:
+        Cache();
+        ~Cache();
+        Cache(const Cache &) = delete;
+        Cache &operator=(const Cache &) = delete;
+        void SetStripes(size_t Count); // Also clears the cache, can't be called while other threads access the cache
         void Clear();
         void SetMaxSize(size_t Bytes);
-        void CacheFrame(int64_t FrameNumber, AVFrame *Frame); // Takes ownership of Frame
+        void RejectSeekedFrames(); // Clears the cache and drops the frames of decoders that have seeked from then on
+        void CacheFrame(int64_t FrameNumber, AVFrame *Frame, bool Seeked); // Takes ownership of Frame, Seeked is if the decoder it came from has seeked
         [[nodiscard]] BestVideoFrame *GetFrame(int64_t N);
+        [[nodiscard]] BSCacheStatistics GetStatistics() const;
     };
 
     VideoTrackIndex TrackIndex;
@@ -274,8 +423,9 @@ private:
     std::vector<FormatSet> FormatSets;
     FormatSet DefaultFormatSet;
 
-    static constexpr int MaxVideoSources = 4;
     std::map<std::string, std::string> LAVFOptions;
+    std::shared_ptr<BSBlockCache> BlockCache; // Shared by all decoders of the source, declared before them so it outlives them
+    std::shared_ptr<BSFramePool> FramePool; // Same as above
     BSVideoProperties VP = {};
     std::filesystem::path Source;
     std::string HWDevice;
@@ -284,27 +434,130 @@ private:
     int VariableFormat = -1;
     int ViewID;
     int Threads;
-    bool LinearMode = false;
-    uint64_t DecoderSequenceNum = 0;
-    uint64_t DecoderLastUse[MaxVideoSources] = {};
-    std::unique_ptr<LWVideoDecoder> Decoders[MaxVideoSources];
+    int IndexThreads;
+    bool FastIndex;
+    bool SparseHash;
+    int MaxDecoders;
+    BestDecoderPolicy DecoderPolicy = bdpLeastRecentlyUsed;
+    std::chrono::milliseconds IdleDecoderTimeout{ 0 };
+    std::atomic_bool LinearMode{ false };
+    bool ConcurrentMode = false;
+    bool CachePlanar = false;
+    bool IntraOnlyCodec = false;
+    bool AllIntra = false; // Every frame is a keyframe with a unique PTS so seeking goes straight to the requested frame and is verified by PTS
+    int64_t MinSeekFrame = 100; // Frames closer to the start than this are reached by decoding from the start instead of seeking
+
+    // A lane is a group of decoders that's only used by one thread at a time, in concurrent mode every decoder has its own lane
+    struct DecoderLane {
+        uint64_t DecoderSequenceNum = 0;
+        std::vector<uint64_t> DecoderLastUse;
+        std::vector<std::chrono::steady_clock::time_point> DecoderLastUseTime;
+        std::vector<std::unique_ptr<LWVideoDecoder>> Decoders;
+        /* Protected by LaneMutex */
+        bool Busy = false;
+        int64_t Position = -1; // The furthest decoder position, or the next frame after the requested one while busy
+        bool Range = false; // Held by GetFrames() for a frame of a range, other requests never wait for it since the range continues with it
+        uint64_t LastUse = 0;
+        /* The request currently holding the lane */
+        BSRequestTrace Trace = {};
+        std::chrono::steady_clock::time_point RequestStart;
+    };
+
+    std::vector<std::unique_ptr<DecoderLane>> Lanes;
+    std::mutex LaneMutex;
+    std::condition_variable LaneCondition;
+    uint64_t LaneSequenceNum = 0;
+    [[nodiscard]] size_t AcquireLane(int64_t N, bool Range = false);
+    void ReleaseLane(size_t Index);
+    void CreateLanes(bool Concurrent);
+    void DropIdleDecoders(DecoderLane &Lane);
+    void MarkDecoderUsed(DecoderLane &Lane, size_t Index);
+    void CloseDecoder(DecoderLane &Lane, std::unique_ptr<LWVideoDecoder> &Decoder); // Counts what the decoder read for the current request before closing it
+    [[nodiscard]] bool CanDecodeLinearly(int64_t Position, int64_t N, int64_t SeekFrame) const; // True if continuing from Position is expected to be cheaper than seeking to SeekFrame, the costs are only weighed with bdpShortestDistance
+    [[nodiscard]] double EstimateLinearTime(int64_t First, int64_t Last, int64_t N) const; // The expected time to decode the frames First to Last when N is requested, 0 if unknown
+    [[nodiscard]] size_t GetReplaceableDecoder(const DecoderLane &Lane, int64_t N) const;
+    /* Moving averages in seconds, 0 until measured. Only used with bdpShortestDistance */
+    std::atomic<double> FrameDecodeTime{ 0 }; // Per output frame when decoding linearly, includes hashing and caching
+    std::atomic<double> SkipDecodeTime{ 0 }; // Per frame skipped before the preroll when decoding linearly
+    std::atomic<double> SeekLatency{ 0 }; // The extra time spent by a seek compared to decoding the same frames linearly
+    static void UpdateCostEstimate(std::atomic<double> &Estimate, double Sample);
     int64_t PreRoll = 20;
     int64_t FileSize = -1;
     static constexpr size_t RetrySeekAttempts = 10;
     std::set<int64_t> BadSeekLocations;
-    void SetLinearMode();
-    [[nodiscard]] int64_t GetSeekFrame(int64_t N);
-    [[nodiscard]] BestVideoFrame *SeekAndDecode(int64_t N, int64_t SeekFrame, std::unique_ptr<LWVideoDecoder> &Decoder, size_t Depth = 0);
-    [[nodiscard]] BestVideoFrame *GetFrameInternal(int64_t N);
-    [[nodiscard]] BestVideoFrame *GetFrameLinearInternal(int64_t N, int64_t SeekFrame = -1, size_t Depth = 0, bool ForceUnseeked = false);
+    mutable std::mutex BadSeekMutex;
+    std::mutex IndexMutex; // Serializes updates of fast indexed frames
+    void AddBadSeekLocation(int64_t N);
+    std::filesystem::path SeekHistoryFile; // The index file the seek history is stored next to, empty if it isn't stored
+    void StoreSeekHistory();
+
+    /* Runtime statistics, merged in as requests finish */
+    BSSourceStatistics Stats = {};
+    mutable std::mutex StatsMutex;
+    TraceFunction TraceCallback;
+    void BeginRequest(DecoderLane &Lane, int64_t N);
+    void EndRequest(DecoderLane &Lane);
+    void RecordRequest(const BSRequestTrace &Trace);
+
+    /* Prefetching, PrefetchDecoder is only touched by the prefetch thread while PrefetchBusy is set. Decoders are only moved between the
+       prefetch thread and a lane while holding both the lane and PrefetchMutex, always acquired in that order */
+    int64_t PrefetchFrames = 0;
+    std::atomic<int64_t> LastRequestedFrame{ -1 };
+    std::atomic_int SequentialRequests{ 0 };
+    std::thread PrefetchThread;
+    std::mutex PrefetchMutex;
+    std::condition_variable PrefetchCondition;
+    std::unique_ptr<LWVideoDecoder> PrefetchDecoder;
+    int64_t PrefetchPosition = -1; // The next frame the prefetch thread will decode
+    int64_t PrefetchTarget = -1; // The last frame to prefetch
+    bool PrefetchBusy = false;
+    bool PrefetchExit = false;
+    int ActiveRanges = 0; // Prefetching is suspended while GetFrames() decodes a range
+    void PrefetchWorker();
+    void UpdatePrefetch(int64_t N);
+    void StopPrefetch(std::unique_lock<std::mutex> &Lock);
+    [[nodiscard]] bool WaitForPrefetch(int64_t N);
+
+    /* Keyframe scrubbing, uses a decoder of its own so the pool never has frames skipped */
+    std::mutex ScrubMutex;
+    std::unique_ptr<LWVideoDecoder> ScrubDecoder;
+    int ScrubLowRes = 0;
+    int64_t ScrubLastKeyFrame = -1; // The keyframe ScrubDecoder returned last, -1 if it has to seek
+    [[nodiscard]] BestVideoFrame *DecodeKeyFrame(int64_t N, int LowRes);
+
+    void SetLinearMode(DecoderLane &Lane);
+    [[nodiscard]] int64_t GetSeekFrame(int64_t N) const;
+    [[nodiscard]] BestVideoFrame *SeekAndDecode(DecoderLane &Lane, int64_t N, int64_t SeekFrame, std::unique_ptr<LWVideoDecoder> &Decoder, size_t Depth = 0);
+    [[nodiscard]] BestVideoFrame *GetFrameInternal(DecoderLane &Lane, int64_t N);
+    [[nodiscard]] BestVideoFrame *GetFrameLinearInternal(DecoderLane &Lane, int64_t N, int64_t SeekFrame = -1, size_t Depth = 0, bool ForceUnseeked = false);
+    [[nodiscard]] int64_t GetTrackFrameNumber(int64_t N) const; // Maps output frame numbers to track frame numbers when a format set is selected
+    [[nodiscard]] BestVideoFrame *GetTrackFrame(int64_t N, bool Linear);
+    [[nodiscard]] AVFrame *ConvertForCache(AVFrame *Frame); // Takes ownership of Frame and returns it converted to planar if CachePlanar is set and it isn't already
+    [[nodiscard]] BestVideoFrame *DecodeRangeFrame(DecoderLane &Lane, int64_t N); // Continues with a decoder positioned at or shortly before track frame N without caching the frame, otherwise falls back to GetFrameInternal() which caches as usual
+    BSPacketQueue *IndexPackets = nullptr; // Only set during construction
     [[nodiscard]] bool IndexTrack(const ProgressFunction &Progress = nullptr);
+    [[nodiscard]] bool IndexTrackParallel(const ProgressFunction &Progress); // Returns false if the track can't be split into segments or the segments don't line up, the caller should fall back to IndexTrack() in that case
+    [[nodiscard]] bool IndexTrackFast(const ProgressFunction &Progress); // Only demuxes the track, returns false if the packets can't be trusted to map to frames one to one
+    [[nodiscard]] bool ExtendTrackIndex(const ProgressFunction &Progress, size_t &FirstNewFrame); // Continues indexing a file that has grown since it was indexed, returns false if the existing index doesn't match the file. FirstNewFrame is set to the first frame that differs from the loaded index
+    [[nodiscard]] bool CompareFrame(int64_t N, const std::array<uint8_t, HashSize> &Hash, int64_t PTS) const; // Compares the hash if known, otherwise the PTS
+    void UpdateFrameInfo(int64_t N, const AVFrame *Frame, const std::array<uint8_t, HashSize> &Hash); // Fills in the hash and properties of fast indexed frames once a frame is known to be decoded
     bool InitializeRFF();
     bool NearestCommonFrameRate(BSRational &FPS);
     void InitializeFormatSets();
+    void UpdateFormatSets(); // Derives the format sets and output properties again after fast indexed frames turned out to differ from the guesses, IndexMutex has to be held
 public:
-    BestVideoSource(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, const ProgressFunction &Progress = nullptr);
+    BestVideoSource(const std::filesystem::path &SourceFile, const std::string &HWDeviceName, int ExtraHWFrames, int Track, int ViewID, int Threads, int CacheMode, const std::filesystem::path &CachePath, const std::map<std::string, std::string> *LAVFOpts, const ProgressFunction &Progress = nullptr, int IndexThreads = 1, bool FastIndex = false, bool SparseHash = false, int MaxDecoders = 4, size_t IOCacheSize = 0, BSPacketQueue *IndexPackets = nullptr); /* New arguments are only ever added at the end so existing callers keep working. IndexThreads is the number of segments decoded in parallel when indexing, 1 means the whole track is decoded in order and 0 picks the number of cores for intra-only codecs and 1 for everything else. FastIndex only demuxes the track and fills in hashes as frames are decoded, such an index is never written to disk. It falls back to a full index if the first decoded frames have repeated fields or change format, later frames are assumed to match them and the format sets and video properties are updated whenever a decoded frame proves otherwise. IndexPackets makes indexing read from a shared demuxer, see IndexTracksTogether(), and overrides IndexThreads and FastIndex. SparseHash only hashes a subset of the rows of each frame which makes indexing of high resolution tracks faster. MaxDecoders is the number of decoders kept open for seeking, 4 is a good default. IOCacheSize is the size in bytes of a block cache all decoders read the file through, mostly useful for network sources, 0 reads the file directly */
+    ~BestVideoSource();
     [[nodiscard]] int GetTrack() const; // Useful when opening nth video track to get the actual number
     void SetMaxCacheSize(size_t Bytes); /* Default max size is 1GB */
+    void SetCachePlanar(bool Planar); /* Converts packed, paletted and semi-planar frames to the planar layout ExportAsPlanar() produces before they're cached and returned so repeated requests only copy them. The cache size counts the converted frames. Clears the cache and must not be called while frames are being requested */
+    void SetPrefetch(int64_t Frames); /* The number of frames to decode ahead on a separate thread when frames are requested in order, 0 disables prefetching which is the default. Has no effect in concurrent mode */
+    void SetConcurrentMode(bool Concurrent); /* Allows GetFrame(), GetFrameWithRFF() and GetFrameByTime() to be called from several threads at the same time with every decoder in the pool seeking and decoding independently. Must not be called while frames are being requested */
+    [[nodiscard]] BSCacheStatistics GetCacheStatistics() const;
+    [[nodiscard]] BSSourceStatistics GetStatistics() const; /* Counters and histograms for all frame requests so far, frames decoded by prefetching and keyframe scrubbing aren't included */
+    void SetTraceCallback(const TraceFunction &Callback); /* Called with a summary of every frame request once it's done on the thread that decoded it, nullptr disables it. Must not be called while frames are being requested */
+    void SetDecoderPolicy(BestDecoderPolicy Policy); /* Changes how existing decoders are picked for reuse and replacement, the default is bdpLeastRecentlyUsed */
+    void SetIdleDecoderTimeout(int64_t Milliseconds); /* Decoders that haven't been used for this long are closed to free their threads and hardware surfaces, checked after every decoded frame request. 0 keeps them open forever which is the default */
     void SetSeekPreRoll(int64_t Frames); /* The number of frames to cache before the position being fast forwarded to */
     [[nodiscard]] const BSVideoProperties &GetVideoProperties() const;
     [[nodiscard]] const std::vector<FormatSet> &GetFormatSets() const; /* Get a listing of all the number of formats  */
@@ -312,10 +565,20 @@ public:
     [[nodiscard]] BestVideoFrame *GetFrame(int64_t N, bool Linear = false);
     [[nodiscard]] BestVideoFrame *GetFrameWithRFF(int64_t N, bool Linear = false);
     [[nodiscard]] BestVideoFrame *GetFrameByTime(double Time, bool Linear = false); /* Time is in seconds */
+    bool GetFrames(int64_t First, int64_t Last, const FrameRangeCallback &Callback); /* Passes the frames First to Last to Callback in order on the calling thread while the following frames are decoded on another thread. Frames decoded in order aren't put in the cache so this is the fastest way to process a long range once, only frames that have to be sought to, such as the first one, go through the cache. No decoder is held while Callback runs so it and other threads may request frames from this source. Prefetching is suspended until the range is done. Returns false if the range is invalid or Callback stopped it early */
+    [[nodiscard]] BestVideoFrame *GetNearestKeyFrame(int64_t N, int LowRes = 0, int64_t *KeyFrame = nullptr); /* Returns the closest keyframe at or before N for previews and thumbnails, decoded by a separate decoder that skips all other frames. LowRes reduces the resolution by 2^LowRes for codecs that support it so always check the frame dimensions. KeyFrame is set to the track frame number returned */
     [[nodiscard]] bool GetFrameIsTFF(int64_t N, bool RFF = false);
     void WriteTimecodes(const std::filesystem::path &TimecodeFile) const;
-    [[nodiscard]] const FrameInfo &GetFrameInfo(int64_t N) const;
+    [[nodiscard]] FrameInfo GetFrameInfo(int64_t N) const;
     [[nodiscard]] bool GetLinearDecodingState() const;
+    [[nodiscard]] bool GetFastIndexState() const; /* True if the index was created by only demuxing the track and not all frame information is known */
+    [[nodiscard]] bool IsAllIntra() const; /* True if every frame can be decoded on its own, such as in image sequences and ProRes files. Sources like this work best in concurrent mode since any decoder can seek to any frame without decoding others */
 };
 
+/* Returns the source previously created with the same key if it's still in use and otherwise creates it. Sharing a source means sharing its
+   index, decoders and cache. The key has to include everything the source is created and configured with, Create should do both.
+   Shared sources are always put in concurrent mode since several users may request frames at the same time. Threads opening the same key
+   while it's being created wait for it and get the same exception if creating it fails, other keys can be opened at the same time. */
+[[nodiscard]] std::shared_ptr<BestVideoSource> GetSharedVideoSource(const std::string &Key, const std::function<BestVideoSource *()> &Create);
+
 #endif